@@ -96,6 +96,9 @@
 /* Have PTHREAD_PRIO_INHERIT. */
 #cmakedefine HAVE_PTHREAD_PRIO_INHERIT 1
 
+/* Define to 1 if you have the `recvmmsg' function. */
+#cmakedefine HAVE_RECVMMSG 1
+
 /* Define to 1 if you have the `select' function. */
 #cmakedefine HAVE_SELECT 1
 
@@ -108,6 +111,9 @@
 /* Define to 1 if you have the `setrlimit' function. */
 #cmakedefine HAVE_SETRLIMIT 1
 
+/* Define to 1 if you have the `sendmmsg' function. */
+#cmakedefine HAVE_SENDMMSG 1
+
 /* Define to 1 if you have the `socket' function. */
 #cmakedefine HAVE_SOCKET 1
 
@@ -126,6 +132,9 @@
 /* Define to 1 if you have the <string.h> header file. */
 #cmakedefine HAVE_STRING_H 1
 
+/* Define to 1 if you have the <sys/epoll.h> header file. */
+#cmakedefine HAVE_SYS_EPOLL_H 1
+
 /* Define to 1 if you have the <sys/ioctl.h> header file. */
 #cmakedefine HAVE_SYS_IOCTL_H 1
 
@@ -239,6 +248,14 @@
 /* Define if use system shared lib. */
 #cmakedefine USE_SYSTEM_SHARED_LIB 1
 
+/* Define to the name of the only AEAD method built in. */
+#cmakedefine FIXED_CIPHER_NAME "@FIXED_CIPHER_NAME@"
+
+/* Define to the index of the only AEAD method built in. */
+#ifdef FIXED_CIPHER_NAME
+#define FIXED_CIPHER @FIXED_CIPHER@
+#endif
+
 /* Version number of package */
 #define VERSION "@PROJECT_VERSION@"
 
@@ -53,7 +53,9 @@ check_include_files(pcre.h HAVE_PCRE_H)
 check_include_files(pcre/pcre.h HAVE_PCRE_PCRE_H)
 check_symbol_exists(PTHREAD_PRIO_INHERIT pthread.h HAVE_PTHREAD_PRIO_INHERIT)
 
+check_function_exists(recvmmsg HAVE_RECVMMSG)
 check_function_exists(select HAVE_SELECT)
+check_function_exists(sendmmsg HAVE_SENDMMSG)
 check_function_exists(setresuid HAVE_SETRESUID)
 check_function_exists(setreuid HAVE_SETREUID)
 check_function_exists(setrlimit HAVE_SETRLIMIT)
@@ -66,6 +68,7 @@ check_function_exists(strerror HAVE_STRERROR)
 
 check_include_files(strings.h HAVE_STRINGS_H)
 check_include_files(string.h HAVE_STRING_H)
+check_include_files(sys/epoll.h HAVE_SYS_EPOLL_H)
 check_include_files(sys/ioctl.h HAVE_SYS_IOCTL_H)
 check_include_files(sys/select.h HAVE_SYS_SELECT_H)
 check_include_files(sys/socket.h HAVE_SYS_SOCKET_H)
@@ -193,3 +196,15 @@ endif ()
 if (NOT HAVE_WORKING_VFORK)
     set(vfork fork)
 endif ()
+
+# A single AEAD method build, the index follows aead.c
+if (WITH_CIPHER)
+    set(FIXED_CIPHER_METHODS aes-128-gcm aes-192-gcm aes-256-gcm
+            chacha20-ietf-poly1305 xchacha20-ietf-poly1305)
+    list(FIND FIXED_CIPHER_METHODS "${WITH_CIPHER}" FIXED_CIPHER)
+    if (FIXED_CIPHER EQUAL -1)
+        message(FATAL_ERROR "bad value ${WITH_CIPHER} for WITH_CIPHER, expected an AEAD method")
+    endif ()
+    set(FIXED_CIPHER_NAME "${WITH_CIPHER}")
+    message(STATUS "Building for ${WITH_CIPHER} only")
+endif ()
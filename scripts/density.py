@@ -0,0 +1,248 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+#
+# density.py - Measure the memory and fds an idle relayed connection costs
+#
+# Opens N SOCKS5 connections through ss-local -> ss-server on loopback to a
+# sink, sends one byte on each so ss-server has decrypted the request and
+# connected out, then leaves them idle and reports RSS and fds per
+# connection for each process, broken down by the `mem` control command.
+#
+# Linux only. Connections are spread over 127.0.0.0/8 addresses so every
+# hop stays within the ephemeral port range, and over shards of
+# ss-local/ss-server pairs for more than --shard-size connections. 1M
+# connections need `ulimit -n` (and fs.nr_open) above 1M.
+#
+#   scripts/density.py --bin src/ -n 100000 -m aes-256-gcm
+
+import argparse
+import json
+import os
+import resource
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+PER_ADDRESS = 10000     # connections per source or target address
+SERVER_ADDRS = 10       # listen addresses per ss-server, MAX_REMOTE_NUM
+
+parser = argparse.ArgumentParser(description='idle connection density')
+parser.add_argument('-n', '--connections', type=int, default=10000)
+parser.add_argument('-m', '--method', type=str, default='aes-256-gcm')
+parser.add_argument('-k', '--password', type=str, default='density')
+parser.add_argument('--bin', type=str, default='')
+parser.add_argument('--port', type=int, default=18400)
+parser.add_argument('--shard-size', type=int, default=150000)
+parser.add_argument('--settle', type=float, default=2.0)
+parser.add_argument('--sink', type=int, default=None, help=argparse.SUPPRESS)
+
+config = parser.parse_args()
+
+
+def sink(port):
+    # Accepts and holds every connection, the payload is left unread
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.bind(('0.0.0.0', port))
+    s.listen(4096)
+    held = []
+    while True:
+        conn, _ = s.accept()
+        held.append(conn)
+
+
+def loopback(net, i):
+    i += 1
+    return '127.%d.%d.%d' % (net, (i >> 8) & 0xff, i & 0xff)
+
+
+def raise_nofile(need):
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if hard != resource.RLIM_INFINITY and hard < need:
+        try:
+            resource.setrlimit(resource.RLIMIT_NOFILE, (need, need))
+            return
+        except (ValueError, OSError):
+            sys.exit('need %d fds per process, hard limit is %d' % (need, hard))
+    resource.setrlimit(resource.RLIMIT_NOFILE, (max(soft, need), hard))
+
+
+def proc_stat(pid):
+    rss = 0
+    with open('/proc/%d/status' % pid) as f:
+        for line in f:
+            if line.startswith('VmRSS:'):
+                rss = int(line.split()[1]) * 1024
+    return rss, len(os.listdir('/proc/%d/fd' % pid))
+
+
+def kernel_tcp_mem():
+    with open('/proc/net/sockstat') as f:
+        for line in f:
+            if line.startswith('TCP:'):
+                fields = line.split()
+                return int(fields[fields.index('mem') + 1]) * \
+                    resource.getpagesize()
+    return 0
+
+
+def control(path, cmd):
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+    s.bind(path + '.cli')
+    s.settimeout(5)
+    try:
+        s.sendto(cmd.encode(), path)
+        reply = b''
+        while True:
+            data = s.recv(8192)
+            reply += data
+            if len(data) < 8192:
+                break
+        return json.loads(reply.decode())
+    finally:
+        s.close()
+        os.unlink(path + '.cli')
+
+
+def socks5_connect(local_port, source, target, port):
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.settimeout(10)
+    if hasattr(socket, 'IP_BIND_ADDRESS_NO_PORT'):
+        s.setsockopt(socket.SOL_IP, socket.IP_BIND_ADDRESS_NO_PORT, 1)
+    s.bind((source, 0))
+    s.connect(('127.0.0.1', local_port))
+    s.sendall(b'\x05\x01\x00')
+    if s.recv(2) != b'\x05\x00':
+        raise IOError('socks5 method rejected')
+    s.sendall(b'\x05\x01\x00\x01' + socket.inet_aton(target) +
+              struct.pack('>H', port))
+    reply = s.recv(10)
+    if len(reply) < 2 or reply[1:2] != b'\x00':
+        raise IOError('socks5 connect rejected')
+    # ss-local only connects out once there is payload to send
+    s.sendall(b'x')
+    return s
+
+
+def report(name, pid, base, ctl, conns):
+    rss, fds = proc_stat(pid)
+    mem = control(ctl, 'mem') if ctl else None
+    rss -= base[0]
+    fds -= base[1]
+    print('%-10s rss/conn %8.0f B   fds/conn %5.2f' %
+          (name, rss / conns, fds / conns))
+    if mem and mem['connections']:
+        n = mem['connections']
+        parts = [(k, mem[k]) for k in
+                 ('state', 'watchers', 'buffers', 'ciphers')]
+        for k, v in parts:
+            print('%-10s   %-8s %8.0f B' % ('', k, v / n))
+        other = rss - sum(v for _, v in parts)
+        print('%-10s   %-8s %8.0f B   (allocator, mbed TLS state, libev)' %
+              ('', 'other', other / n))
+    return rss, fds
+
+
+if config.sink is not None:
+    signal.signal(signal.SIGTERM, lambda *_: os._exit(0))
+    sink(config.sink)
+
+total = config.connections
+shards = (total + config.shard_size - 1) // config.shard_size
+sink_port = config.port - 1
+
+raise_nofile(total + 1024)
+
+workdir = tempfile.mkdtemp(prefix='ss-density-')
+procs = []
+pairs = []
+
+try:
+    procs.append(('sink', subprocess.Popen(
+        [sys.executable, os.path.abspath(__file__), '--sink', str(sink_port)],
+        close_fds=True)))
+
+    for shard in range(shards):
+        server_port = config.port + 2 * shard
+        local_port = server_port + 1
+        addrs = [loopback(10 + shard, i) for i in range(SERVER_ADDRS)]
+        common = ['-k', config.password, '-m', config.method, '-t', '86400']
+        server_ctl = os.path.join(workdir, 'server%d.ctl' % shard)
+        local_ctl = os.path.join(workdir, 'local%d.ctl' % shard)
+
+        server_args = ['%sss-server' % config.bin, '-p', str(server_port),
+                       '--control-address', server_ctl] + common
+        local_args = ['%sss-local' % config.bin, '-p', str(server_port),
+                      '-l', str(local_port), '--control-address', local_ctl] + common
+        for addr in addrs:
+            server_args += ['-s', addr]
+            local_args += ['-s', addr]
+
+        server = subprocess.Popen(server_args, close_fds=True,
+                                  stdout=subprocess.DEVNULL,
+                                  stderr=subprocess.DEVNULL)
+        local = subprocess.Popen(local_args, close_fds=True,
+                                 stdout=subprocess.DEVNULL,
+                                 stderr=subprocess.DEVNULL)
+        procs += [('server%d' % shard, server), ('local%d' % shard, local)]
+        pairs.append((shard, local_port, server, server_ctl, local, local_ctl))
+
+    time.sleep(1)
+    for name, p in procs:
+        if p.poll() is not None:
+            sys.exit('%s exited with %d' % (name, p.returncode))
+
+    base = dict((p.pid, proc_stat(p.pid)) for _, p in procs)
+    base_kernel = kernel_tcp_mem()
+
+    held = []
+    start = time.time()
+    for i in range(total):
+        shard = pairs[i // config.shard_size]
+        held.append(socks5_connect(shard[1],
+                                   loopback(20, i // PER_ADDRESS),
+                                   loopback(30, i // PER_ADDRESS),
+                                   sink_port))
+        if (i + 1) % 10000 == 0:
+            print('opened %d connections' % (i + 1), file=sys.stderr)
+    elapsed = time.time() - start
+
+    # Wait for every ss-server to have connected out
+    deadline = time.time() + 60
+    for shard, _, _, server_ctl, _, _ in pairs:
+        want = min(config.shard_size, total - shard * config.shard_size)
+        while control(server_ctl, 'mem')['remotes'] < want:
+            if time.time() > deadline:
+                sys.exit('ss-server shard %d did not connect everything' % shard)
+            time.sleep(0.1)
+    time.sleep(config.settle)
+
+    print('connections %d  method %s  shards %d  opened in %.1f s' %
+          (total, config.method, shards, elapsed))
+
+    local_rss = server_rss = 0
+    for shard, _, server, server_ctl, local, local_ctl in pairs:
+        conns = min(config.shard_size, total - shard * config.shard_size)
+        local_rss += report('ss-local', local.pid, base[local.pid],
+                            local_ctl, conns)[0]
+        server_rss += report('ss-server', server.pid, base[server.pid],
+                             server_ctl, conns)[0]
+
+    kernel = kernel_tcp_mem() - base_kernel
+    print('kernel     tcp mem/conn %8.0f B   (4 sockets per connection)' %
+          (kernel / total))
+    print('total      %8.0f B/conn   %.0f connections/GB' %
+          ((local_rss + server_rss + kernel) / total,
+           total * 2 ** 30 / max(1, local_rss + server_rss + kernel)))
+finally:
+    for name, p in procs:
+        if p.poll() is None:
+            p.terminate()
+            p.wait()
+    for f in os.listdir(workdir):
+        os.unlink(os.path.join(workdir, f))
+    os.rmdir(workdir)
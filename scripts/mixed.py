@@ -0,0 +1,235 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+#
+# mixed.py - Measure interactive latency next to bulk transfers
+#
+# Runs a local ss-local -> ss-server pair twice, once as is and once with
+# --priority-classes, or the options given with --compare. Each run has --bulk connections downloading from a
+# sink as fast as they can, and --probes connections sending a small
+# request every --interval and waiting for the echo, the way a terminal
+# or a DNS-over-TCP client does. Reports the round trips of the probes
+# and the bulk throughput of both runs, along with the CPU the two relays
+# used while the probes ran.
+#
+# The bulk readers and the sink run in processes of their own, so the
+# probes are only delayed by the relay. With --perf, `perf stat` also
+# counts the dTLB loads and misses of ss-server while the probes run.
+#
+#   scripts/mixed.py --bin src/ -m aes-256-gcm --bulk 32
+#   scripts/mixed.py --args='--edge-triggered' --duration 30
+#   scripts/mixed.py --bulk 0 --interval 0.001 --compare='--busy-poll 50'
+#   scripts/mixed.py --bulk 256 --compare='--huge-pages 64' --perf
+
+import argparse
+import asyncio
+import multiprocessing
+import os
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+CHUNK = 65536
+
+parser = argparse.ArgumentParser(description='interactive latency under bulk load')
+parser.add_argument('-m', '--method', type=str, default='aes-256-gcm')
+parser.add_argument('-k', '--password', type=str, default='mixed')
+parser.add_argument('--bin', type=str, default='')
+parser.add_argument('--port', type=int, default=18600)
+parser.add_argument('--bulk', type=int, default=32)
+parser.add_argument('--probes', type=int, default=4)
+parser.add_argument('--size', type=int, default=64,
+                    help='probe request size')
+parser.add_argument('--interval', type=float, default=0.02)
+parser.add_argument('--duration', type=float, default=10.0)
+parser.add_argument('--args', type=str, default='',
+                    help='extra arguments for both ss-local and ss-server')
+parser.add_argument('--compare', type=str, default='--priority-classes',
+                    help='arguments of the second run')
+parser.add_argument('--perf', action='store_true',
+                    help='count dTLB misses of ss-server with perf stat')
+
+config = parser.parse_args()
+
+sink_port = config.port - 1
+server_port = config.port
+local_port = config.port + 1
+
+
+async def sink_client(reader, writer):
+    try:
+        kind = await reader.readexactly(1)
+        if kind == b'B':
+            data = b'x' * CHUNK
+            while True:
+                writer.write(data)
+                await writer.drain()
+        else:
+            while True:
+                data = await reader.read(4096)
+                if not data:
+                    break
+                writer.write(data)
+    except (OSError, asyncio.IncompleteReadError):
+        pass
+    finally:
+        writer.close()
+
+
+async def serve():
+    server = await asyncio.start_server(sink_client, '127.0.0.1', sink_port,
+                                        backlog=1024)
+    await server.serve_forever()
+
+
+def sink():
+    asyncio.run(serve())
+
+
+async def socks5(kind):
+    reader, writer = await asyncio.open_connection('127.0.0.1', local_port)
+    writer.write(b'\x05\x01\x00')
+    if await reader.readexactly(2) != b'\x05\x00':
+        raise IOError('socks5 method rejected')
+    writer.write(b'\x05\x01\x00\x01' + socket.inet_aton('127.0.0.1') +
+                 struct.pack('>H', sink_port))
+    reply = await reader.readexactly(10)
+    if reply[1] != 0:
+        raise IOError('socks5 connect rejected')
+    writer.write(kind)
+    return reader, writer
+
+
+async def download(received):
+    reader, writer = await socks5(b'B')
+    while True:
+        data = await reader.read(CHUNK)
+        if not data:
+            break
+        received.value += len(data)
+
+
+async def downloads(received):
+    await asyncio.gather(*[download(received) for _ in range(config.bulk)],
+                         return_exceptions=True)
+
+
+def bulk(received):
+    asyncio.run(downloads(received))
+
+
+async def probe(rtts, deadline):
+    reader, writer = await socks5(b'P')
+    request = b'p' * config.size
+    while time.time() < deadline:
+        start = time.time()
+        writer.write(request)
+        await reader.readexactly(len(request))
+        rtts.append((time.time() - start) * 1000)
+        await asyncio.sleep(config.interval)
+    writer.close()
+
+
+async def probes(rtts, deadline):
+    await asyncio.gather(*[probe(rtts, deadline) for _ in range(config.probes)])
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def cpu_time(pid):
+    with open('/proc/%d/stat' % pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+
+def perf_start(pid):
+    return subprocess.Popen(['perf', 'stat', '-x', ',', '-e',
+                             'dTLB-loads,dTLB-load-misses', '-p', str(pid)],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                            universal_newlines=True)
+
+
+def perf_stop(perf):
+    # Miss rate of the dTLB loads, None when not counted
+    perf.send_signal(signal.SIGINT)
+    counts = {}
+    for line in perf.communicate()[1].splitlines():
+        fields = line.split(',')
+        if len(fields) > 2 and fields[0].isdigit():
+            counts[fields[2]] = int(fields[0])
+    loads = counts.get('dTLB-loads')
+    misses = counts.get('dTLB-load-misses')
+    if not loads or misses is None:
+        return None
+    return misses / loads * 100
+
+
+def run(extra):
+    common = ['-k', config.password, '-m', config.method, '-t', '600'] + extra
+    procs = [
+        subprocess.Popen(['%sss-server' % config.bin, '-s', '127.0.0.1',
+                          '-p', str(server_port)] + common,
+                         stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL),
+        subprocess.Popen(['%sss-local' % config.bin, '-s', '127.0.0.1',
+                          '-p', str(server_port), '-l', str(local_port)] + common,
+                         stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL),
+    ]
+    received = multiprocessing.Value('q', 0, lock=False)
+    loader = None
+    try:
+        time.sleep(1)
+        for p in procs:
+            if p.poll() is not None:
+                sys.exit('%s exited with %d' % (p.args[0], p.returncode))
+
+        loader = multiprocessing.Process(target=bulk, args=(received,))
+        loader.start()
+        # Let the bulk flows ramp up and settle in their class first
+        time.sleep(2)
+
+        rtts = []
+        start = received.value
+        cpu = sum(cpu_time(p.pid) for p in procs)
+        perf = perf_start(procs[0].pid) if config.perf else None
+        began = time.time()
+        deadline = began + config.duration
+        asyncio.run(probes(rtts, deadline))
+        elapsed = time.time() - began
+        rate = (received.value - start) / elapsed / 2 ** 20
+        cpu = (sum(cpu_time(p.pid) for p in procs) - cpu) / elapsed * 100
+        dtlb = perf_stop(perf) if perf is not None else None
+        return rtts, rate, cpu, dtlb
+    finally:
+        if loader is not None:
+            loader.terminate()
+            loader.join()
+        for p in procs:
+            if p.poll() is None:
+                p.terminate()
+                p.wait()
+
+
+server = multiprocessing.Process(target=sink, daemon=True)
+server.start()
+time.sleep(0.5)
+
+print('bulk %d  probes %d x %d B every %.0f ms  method %s' %
+      (config.bulk, config.probes, config.size, config.interval * 1000,
+       config.method))
+extra = config.args.split()
+for name, args in (('default', extra),
+                   (config.compare.lstrip('-'), extra + config.compare.split())):
+    rtts, rate, cpu, dtlb = run(args)
+    if not rtts:
+        sys.exit('%s: no probe completed' % name)
+    print('%-17s probe rtt ms p50 %6.2f p90 %6.2f p99 %6.2f max %7.2f   bulk %7.1f MB/s   cpu %3.0f%%%s' %
+          (name, percentile(rtts, 0.5), percentile(rtts, 0.9),
+           percentile(rtts, 0.99), max(rtts), rate, cpu,
+           '   dTLB miss %.3f%%' % dtlb if dtlb is not None else ''))
+
+server.terminate()
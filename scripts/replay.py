@@ -0,0 +1,304 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+#
+# replay.py - Replay a --flow-log capture through ss-local and ss-server
+#
+# Every flow in the log is started at its original offset, relayed through
+# a local ss-local -> ss-server pair to a sink, and both ends reproduce the
+# recorded reads: the side that sent a read waits the recorded gap and
+# writes the same number of bytes, the other side reads them. Reads past
+# the per-flow cap are spread evenly over the rest of the flow. UDP
+# sessions go through SOCKS5 UDP ASSOCIATE, each recorded read being one
+# datagram.
+#
+# The sink only sees loopback addresses, so every destination class is
+# mapped to 127.0.0.1, "localhost" or ::1.
+#
+#   scripts/replay.py --bin src/ -m aes-256-gcm flows.json
+#   scripts/replay.py --speed 10 --limit 5000 flows.json
+
+import argparse
+import asyncio
+import json
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+UP, DOWN = 0, 1
+
+parser = argparse.ArgumentParser(description='replay a flow log')
+parser.add_argument('log', type=str)
+parser.add_argument('-m', '--method', type=str, default='aes-256-gcm')
+parser.add_argument('-k', '--password', type=str, default='replay')
+parser.add_argument('--bin', type=str, default='')
+parser.add_argument('--port', type=int, default=18500)
+parser.add_argument('--speed', type=float, default=1.0,
+                    help='time compression, 10 replays ten times faster')
+parser.add_argument('--limit', type=int, default=0,
+                    help='replay only the first N flows')
+parser.add_argument('--ipv6', action='store_true',
+                    help='send ipv6 destinations to ::1')
+parser.add_argument('--timeout', type=float, default=30.0)
+
+config = parser.parse_args()
+
+sink_port = config.port - 1
+server_port = config.port
+local_port = config.port + 1
+
+
+def load(path):
+    flows = []
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if line:
+                flows.append(json.loads(line))
+    flows.sort(key=lambda flow: flow['t'])
+    if config.limit > 0:
+        flows = flows[:config.limit]
+    if flows:
+        t0 = flows[0]['t']
+        for flow in flows:
+            flow['t'] -= t0
+    return flows
+
+
+def socks5_addr(flow):
+    if flow['dest'] == 'domain':
+        name = b'localhost'
+        return b'\x03' + bytes([len(name)]) + name
+    if flow['dest'] == 'ipv6' and config.ipv6:
+        return b'\x04' + socket.inet_pton(socket.AF_INET6, '::1')
+    return b'\x01' + socket.inet_aton('127.0.0.1')
+
+
+def rest_chunks(flow, direction):
+    rest = flow['rest']
+    total, reads = rest[2 * direction], rest[2 * direction + 1]
+    if reads == 0:
+        return []
+    size = max(1, total // reads)
+    chunks = [size] * (reads - 1)
+    chunks.append(max(1, total - size * (reads - 1)))
+    return chunks
+
+
+def rest_gap(flow):
+    # What the capped event list does not cover of the recorded duration
+    covered = sum(e[1] for e in flow['events']) / 1e6
+    reads = flow['rest'][1] + flow['rest'][3]
+    if reads == 0:
+        return 0
+    return max(0, flow['dur'] - covered) / reads
+
+
+async def pause(us):
+    if us > 0:
+        await asyncio.sleep(us / 1e6 / config.speed)
+
+
+async def play(reader, writer, flow, side):
+    # side is the direction this end writes
+    for direction, gap, size in flow['events']:
+        if direction == side:
+            await pause(gap)
+            writer.write(b'x' * size)
+            await writer.drain()
+        else:
+            await reader.readexactly(size)
+
+    async def send_rest():
+        gap = rest_gap(flow) * 1e6
+        for size in rest_chunks(flow, side):
+            await pause(gap)
+            writer.write(b'x' * size)
+            await writer.drain()
+
+    async def recv_rest():
+        total = sum(rest_chunks(flow, 1 - side))
+        if total:
+            await reader.readexactly(total)
+
+    await asyncio.gather(send_rest(), recv_rest())
+
+
+class Sink(asyncio.DatagramProtocol):
+
+    def __init__(self, flows):
+        self.flows = flows
+        self.udp = None
+
+    async def tcp(self, reader, writer):
+        try:
+            flow = self.flows[struct.unpack('>Q', await reader.readexactly(8))[0]]
+            await play(reader, writer, flow, DOWN)
+            await reader.read()
+        except (OSError, asyncio.IncompleteReadError):
+            pass
+        finally:
+            writer.close()
+
+    async def answer(self, flow, index, addr):
+        # Send the downstream datagrams that followed upstream read `index`
+        for direction, gap, size in flow['events'][index + 1:]:
+            if direction == UP:
+                break
+            await pause(gap)
+            self.udp.sendto(b'x' * max(size, 1), addr)
+
+    def datagram_received(self, data, addr):
+        if len(data) < 12:
+            return
+        flow_id, index = struct.unpack('>QI', data[:12])
+        if flow_id < len(self.flows):
+            asyncio.ensure_future(self.answer(self.flows[flow_id], index, addr))
+
+    def connection_made(self, transport):
+        self.udp = transport
+
+
+async def socks5(cmd, addr):
+    reader, writer = await asyncio.open_connection('127.0.0.1', local_port)
+    writer.write(b'\x05\x01\x00')
+    if await reader.readexactly(2) != b'\x05\x00':
+        raise IOError('socks5 method rejected')
+    writer.write(b'\x05' + bytes([cmd]) + b'\x00' + addr)
+    reply = await reader.readexactly(4)
+    if reply[1] != 0:
+        raise IOError('socks5 request rejected')
+    atyp = reply[3]
+    if atyp == 1:
+        bound = socket.inet_ntoa(await reader.readexactly(4))
+    elif atyp == 4:
+        bound = socket.inet_ntop(socket.AF_INET6, await reader.readexactly(16))
+    else:
+        bound = (await reader.readexactly((await reader.readexactly(1))[0])).decode()
+    port = struct.unpack('>H', await reader.readexactly(2))[0]
+    return reader, writer, (bound, port)
+
+
+async def replay_tcp(flow_id, flow):
+    addr = socks5_addr(flow) + struct.pack('>H', sink_port)
+    reader, writer, _ = await socks5(1, addr)
+    try:
+        writer.write(struct.pack('>Q', flow_id))
+        await play(reader, writer, flow, UP)
+    finally:
+        writer.close()
+
+
+class Client(asyncio.DatagramProtocol):
+
+    def __init__(self):
+        self.received = asyncio.Queue()
+
+    def datagram_received(self, data, addr):
+        self.received.put_nowait(data)
+
+
+async def replay_udp(flow_id, flow):
+    loop = asyncio.get_event_loop()
+    header = b'\x00\x00\x00' + socks5_addr(flow) + struct.pack('>H', sink_port)
+    _, control, relay = await socks5(3, b'\x01\x00\x00\x00\x00\x00\x00')
+    transport, client = await loop.create_datagram_endpoint(
+        Client, remote_addr=('127.0.0.1', relay[1]))
+    try:
+        for index, (direction, gap, size) in enumerate(flow['events']):
+            if direction == UP:
+                await pause(gap)
+                payload = struct.pack('>QI', flow_id, index)
+                transport.sendto(header + payload + b'x' * max(0, size - 12))
+            else:
+                # Datagrams may be lost, a late one is not waited for forever
+                try:
+                    await asyncio.wait_for(client.received.get(), 2.0)
+                except asyncio.TimeoutError:
+                    pass
+    finally:
+        transport.close()
+        control.close()
+
+
+async def run(flow_id, flow, start, results):
+    await asyncio.sleep(max(0, start + flow['t'] / config.speed - time.time()))
+    began = time.time()
+    try:
+        replay = replay_tcp if flow['proto'] == 'tcp' else replay_udp
+        await asyncio.wait_for(replay(flow_id, flow),
+                               config.timeout + flow['dur'] / config.speed)
+        results.append((flow['proto'], time.time() - began, flow['dur']))
+    except (OSError, IOError, asyncio.TimeoutError,
+            asyncio.IncompleteReadError):
+        results.append((flow['proto'], None, flow['dur']))
+
+
+def percentile(values, p):
+    if not values:
+        return 0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def report(results, elapsed):
+    print('replayed %d flows in %.1f s' % (len(results), elapsed))
+    for proto in ('tcp', 'udp'):
+        flows = [r for r in results if r[0] == proto]
+        if not flows:
+            continue
+        done = [r for r in flows if r[1] is not None]
+        # Time added by the relay on top of the recorded pacing
+        extra = [max(0, d - dur / config.speed) * 1000 for _, d, dur in done]
+        print('%s  flows %d  failed %d  extra ms p50 %.1f p90 %.1f p99 %.1f max %.1f' %
+              (proto, len(flows), len(flows) - len(done),
+               percentile(extra, 0.5), percentile(extra, 0.9),
+               percentile(extra, 0.99), max(extra) if extra else 0))
+
+
+async def main(flows):
+    loop = asyncio.get_event_loop()
+    sink = Sink(flows)
+    tcp_sink = await asyncio.start_server(sink.tcp, '127.0.0.1', sink_port,
+                                          backlog=4096)
+    if config.ipv6:
+        await asyncio.start_server(sink.tcp, '::1', sink_port, backlog=4096)
+    await loop.create_datagram_endpoint(lambda: sink,
+                                        local_addr=('127.0.0.1', sink_port))
+
+    results = []
+    start = time.time() + 0.5
+    await asyncio.gather(*[run(i, flow, start, results)
+                           for i, flow in enumerate(flows)])
+    tcp_sink.close()
+    report(results, time.time() - start)
+
+
+flows = load(config.log)
+if not flows:
+    sys.exit('no flows in %s' % config.log)
+
+common = ['-k', config.password, '-m', config.method, '-u', '-t', '600']
+procs = [
+    subprocess.Popen(['%sss-server' % config.bin, '-s', '127.0.0.1',
+                      '-p', str(server_port)] + common,
+                     stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL),
+    subprocess.Popen(['%sss-local' % config.bin, '-s', '127.0.0.1',
+                      '-p', str(server_port), '-l', str(local_port)] + common,
+                     stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL),
+]
+
+try:
+    time.sleep(1)
+    for p in procs:
+        if p.poll() is not None:
+            sys.exit('%s exited with %d' % (p.args[0], p.returncode))
+    signal.signal(signal.SIGINT, lambda *_: sys.exit(1))
+    asyncio.get_event_loop().run_until_complete(main(flows))
+finally:
+    for p in procs:
+        if p.poll() is None:
+            p.terminate()
+            p.wait()
@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+#
+# udp-pps.py - Measure the datagram rate of the ss-server UDP relay
+#
+# Runs ss-server twice, once with --udp-batch 1 (one recvfrom/sendto per
+# datagram) and once with the default batch, and reports how many
+# datagrams per second make it through both ways. Every client blasts
+# small datagrams into an ss-tunnel of its own, ss-server relays them to
+# an echo sink of its own and the echoes come back the same way. The
+# tunnels and clients are spread over processes so ss-server is the
+# bottleneck given enough cores; the CPU time ss-server spends per echoed
+# datagram is reported as well, which holds on small machines too.
+#
+# With --netns (root, Linux) ss-server and the sinks run in a network
+# namespace behind a veth pair, so datagrams cross a real interface.
+#
+#   scripts/udp-pps.py --bin src/ -m aes-256-gcm --clients 4
+#   sudo scripts/udp-pps.py --bin src/ --netns
+
+import argparse
+import multiprocessing
+import os
+import socket
+import subprocess
+import sys
+import time
+
+NETNS = 'ss-pps'
+VETH = ('ss-pps0', 'ss-pps1')
+HOST_ADDR = '10.201.0.1'
+NETNS_ADDR = '10.201.0.2'
+
+parser = argparse.ArgumentParser(description='ss-server udp datagram rate')
+parser.add_argument('-m', '--method', type=str, default='aes-256-gcm')
+parser.add_argument('-k', '--password', type=str, default='pps')
+parser.add_argument('--bin', type=str, default='')
+parser.add_argument('--port', type=int, default=18800)
+parser.add_argument('--clients', type=int, default=4)
+parser.add_argument('--size', type=int, default=64)
+parser.add_argument('--duration', type=float, default=10.0)
+parser.add_argument('--netns', action='store_true',
+                    help='run ss-server behind a veth pair in a namespace')
+parser.add_argument('--args', type=str, default='',
+                    help='extra arguments for ss-server')
+parser.add_argument('--sink-port', type=int, default=None,
+                    help=argparse.SUPPRESS)
+
+config = parser.parse_args()
+
+server_port = config.port
+tunnel_port = config.port + 1
+sink_port = config.port + 100
+
+server_addr = NETNS_ADDR if config.netns else '127.0.0.1'
+
+
+def netns(cmd):
+    return ['ip', 'netns', 'exec', NETNS] + cmd if config.netns else cmd
+
+
+def setup_netns():
+    for cmd in (['ip', 'netns', 'add', NETNS],
+                ['ip', 'link', 'add', VETH[0], 'type', 'veth',
+                 'peer', 'name', VETH[1]],
+                ['ip', 'link', 'set', VETH[1], 'netns', NETNS],
+                ['ip', 'addr', 'add', HOST_ADDR + '/24', 'dev', VETH[0]],
+                ['ip', 'link', 'set', VETH[0], 'up'],
+                netns(['ip', 'addr', 'add', NETNS_ADDR + '/24', 'dev', VETH[1]]),
+                netns(['ip', 'link', 'set', VETH[1], 'up']),
+                netns(['ip', 'link', 'set', 'lo', 'up'])):
+        subprocess.check_call(cmd)
+
+
+def teardown_netns():
+    subprocess.call(['ip', 'link', 'del', VETH[0]], stderr=subprocess.DEVNULL)
+    subprocess.call(['ip', 'netns', 'del', NETNS], stderr=subprocess.DEVNULL)
+
+
+def sink(port):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.bind(('127.0.0.1', port))
+    while True:
+        data, addr = s.recvfrom(65536)
+        try:
+            s.sendto(data, addr)
+        except OSError:
+            pass
+
+
+def client(port, deadline, counts, index):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.connect(('127.0.0.1', port))
+    s.setblocking(False)
+    payload = b'x' * config.size
+    sent = received = 0
+    while time.time() < deadline:
+        for _ in range(32):
+            try:
+                s.send(payload)
+                sent += 1
+            except OSError:
+                break
+        while True:
+            try:
+                s.recv(65536)
+                received += 1
+            except OSError:
+                break
+    counts[2 * index] = sent
+    counts[2 * index + 1] = received
+
+
+def cpu_time(pid):
+    with open('/proc/%d/stat' % pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+
+def run(extra):
+    common = ['-k', config.password, '-m', config.method, '-t', '600', '-U']
+    procs = [subprocess.Popen(
+        netns(['%sss-server' % config.bin, '-s', server_addr,
+               '-p', str(server_port)] + common + extra),
+        stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)]
+    for i in range(config.clients):
+        procs.append(subprocess.Popen(
+            netns([sys.executable, os.path.abspath(__file__), '--sink-port',
+                   str(sink_port + i)]),
+            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL))
+        procs.append(subprocess.Popen(
+            ['%sss-tunnel' % config.bin, '-s', server_addr,
+             '-p', str(server_port), '-l', str(tunnel_port + i),
+             '-L', '127.0.0.1:%d' % (sink_port + i)] + common,
+            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL))
+
+    try:
+        time.sleep(1)
+        for p in procs:
+            if p.poll() is not None:
+                sys.exit('%s exited with %d' % (p.args[0], p.returncode))
+
+        counts = multiprocessing.Array('q', 2 * config.clients, lock=False)
+        cpu = cpu_time(procs[0].pid)
+        deadline = time.time() + config.duration
+        clients = [multiprocessing.Process(
+            target=client, args=(tunnel_port + i, deadline, counts, i))
+            for i in range(config.clients)]
+        for c in clients:
+            c.start()
+        for c in clients:
+            c.join()
+        cpu = cpu_time(procs[0].pid) - cpu
+        sent = sum(counts[0::2])
+        received = sum(counts[1::2])
+        return (sent / config.duration, received / config.duration,
+                cpu * 1e6 / max(1, received))
+    finally:
+        for p in procs:
+            if p.poll() is None:
+                p.terminate()
+                p.wait()
+
+
+if config.sink_port is not None:
+    sink(config.sink_port)
+
+if config.netns:
+    teardown_netns()
+    setup_netns()
+
+try:
+    print('clients %d  size %d B  method %s%s' %
+          (config.clients, config.size, config.method,
+           '  over veth' if config.netns else ''))
+    extra = config.args.split()
+    for name, args in (('recvfrom/sendto', extra + ['--udp-batch', '1']),
+                       ('recvmmsg/sendmmsg', extra)):
+        sent, received, cost = run(args)
+        print('%-18s sent %9.0f pps   echoed %9.0f pps   ss-server %5.2f us/datagram' %
+              (name, sent, received, cost))
+finally:
+    if config.netns:
+        teardown_netns()
@@ -36,6 +36,7 @@
 #include "netutils.h"
 #include "utils.h"
 #include "cache.h"
+#include "jconf.h"
 #include "acl.h"
 
 static struct ip_set white_list_ipv4;
@@ -53,6 +54,20 @@ static struct ip_set outbound_block_list_ipv4;
 static struct ip_set outbound_block_list_ipv6;
 static struct cork_dllist outbound_block_list_rules;
 
+// The [upstream:<name>] and [profile:<name>] lists
+typedef struct named_list {
+    char *name;
+    struct ip_set ipv4;
+    struct ip_set ipv6;
+    struct cork_dllist rules;
+} named_list_t;
+
+static named_list_t upstream_lists[MAX_UPSTREAM_NUM];
+static int upstream_list_num = 0;
+
+static named_list_t profile_lists[MAX_SOCKPROF_NUM];
+static int profile_list_num = 0;
+
 static void
 parse_addr_cidr(const char *str, char *host, int *cidr)
 {
@@ -97,6 +112,29 @@ trimwhitespace(char *str)
     return str;
 }
 
+static named_list_t *
+get_named_list(named_list_t *lists, int *num, int max,
+               const char *kind, const char *name)
+{
+    int i;
+    for (i = 0; i < *num; i++)
+        if (strcmp(lists[i].name, name) == 0)
+            return &lists[i];
+
+    if (*num >= max) {
+        LOGE("Too many %s lists, discarding [%s:%s]", kind, kind, name);
+        return NULL;
+    }
+
+    named_list_t *list = &lists[(*num)++];
+    list->name = strdup(name);
+    ipset_init(&list->ipv4);
+    ipset_init(&list->ipv6);
+    cork_dllist_init(&list->rules);
+
+    return list;
+}
+
 int
 init_acl(const char *path)
 {
@@ -121,6 +159,7 @@ init_acl(const char *path)
     struct ip_set *list_ipv4  = &black_list_ipv4;
     struct ip_set *list_ipv6  = &black_list_ipv6;
     struct cork_dllist *rules = &black_list_rules;
+    int discard               = 0;  // in a section with no list left for it
 
     FILE *f = fopen(path, "r");
     if (f == NULL) {
@@ -169,18 +208,47 @@ init_acl(const char *path)
                 list_ipv4 = &outbound_block_list_ipv4;
                 list_ipv6 = &outbound_block_list_ipv6;
                 rules     = &outbound_block_list_rules;
+                discard   = 0;
                 continue;
             } else if (strcmp(line, "[black_list]") == 0
                        || strcmp(line, "[bypass_list]") == 0) {
                 list_ipv4 = &black_list_ipv4;
                 list_ipv6 = &black_list_ipv6;
                 rules     = &black_list_rules;
+                discard   = 0;
                 continue;
             } else if (strcmp(line, "[white_list]") == 0
                        || strcmp(line, "[proxy_list]") == 0) {
                 list_ipv4 = &white_list_ipv4;
                 list_ipv6 = &white_list_ipv6;
                 rules     = &white_list_rules;
+                discard   = 0;
+                continue;
+            } else if (strncmp(line, "[upstream:", 10) == 0
+                       && line[strlen(line) - 1] == ']') {
+                line[strlen(line) - 1] = '\0';
+                named_list_t *list = get_named_list(upstream_lists, &upstream_list_num,
+                                                    MAX_UPSTREAM_NUM, "upstream",
+                                                    trimwhitespace(line + 10));
+                if (list != NULL) {
+                    list_ipv4 = &list->ipv4;
+                    list_ipv6 = &list->ipv6;
+                    rules     = &list->rules;
+                }
+                discard = list == NULL;
+                continue;
+            } else if (strncmp(line, "[profile:", 9) == 0
+                       && line[strlen(line) - 1] == ']') {
+                line[strlen(line) - 1] = '\0';
+                named_list_t *list = get_named_list(profile_lists, &profile_list_num,
+                                                    MAX_SOCKPROF_NUM, "profile",
+                                                    trimwhitespace(line + 9));
+                if (list != NULL) {
+                    list_ipv4 = &list->ipv4;
+                    list_ipv6 = &list->ipv6;
+                    rules     = &list->rules;
+                }
+                discard = list == NULL;
                 continue;
             } else if (strcmp(line, "[reject_all]") == 0
                        || strcmp(line, "[bypass_all]") == 0) {
@@ -192,6 +260,10 @@ init_acl(const char *path)
                 continue;
             }
 
+            if (discard) {
+                continue;
+            }
+
             char host[MAX_HOSTNAME_LEN];
             int cidr;
             parse_addr_cidr(line, host, &cidr);
@@ -235,6 +307,18 @@ free_rules(struct cork_dllist *rules)
     }
 }
 
+static void
+free_named_lists(named_list_t *lists, int num)
+{
+    int i;
+    for (i = 0; i < num; i++) {
+        ipset_done(&lists[i].ipv4);
+        ipset_done(&lists[i].ipv6);
+        free_rules(&lists[i].rules);
+        ss_free(lists[i].name);
+    }
+}
+
 void
 free_acl(void)
 {
@@ -245,6 +329,11 @@ free_acl(void)
 
     free_rules(&black_list_rules);
     free_rules(&white_list_rules);
+
+    free_named_lists(upstream_lists, upstream_list_num);
+    upstream_list_num = 0;
+    free_named_lists(profile_lists, profile_list_num);
+    profile_list_num = 0;
 }
 
 int
@@ -353,3 +442,83 @@ outbound_block_match_host(const char *host)
 
     return ret;
 }
+
+int
+get_upstream_num(void)
+{
+    return upstream_list_num;
+}
+
+const char *
+get_upstream_name(int index)
+{
+    if (index < 0 || index >= upstream_list_num)
+        return NULL;
+    return upstream_lists[index].name;
+}
+
+static int
+match_named_list(named_list_t *lists, int num, const char *host)
+{
+    struct cork_ip addr;
+    int i;
+
+    if (num == 0)
+        return -1;
+
+    int err = cork_ip_init(&addr, host);
+
+    if (err) {
+        int host_len = strlen(host);
+        for (i = 0; i < num; i++)
+            if (lookup_rule(&lists[i].rules, host, host_len) != NULL)
+                return i;
+        return -1;
+    }
+
+    for (i = 0; i < num; i++) {
+        if (addr.version == 4) {
+            if (ipset_contains_ipv4(&lists[i].ipv4, &(addr.ip.v4)))
+                return i;
+        } else if (addr.version == 6) {
+            if (ipset_contains_ipv6(&lists[i].ipv6, &(addr.ip.v6)))
+                return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Return -1, if not match.
+ * Return the index of the first matching [upstream:<name>] list otherwise.
+ */
+int
+acl_match_upstream(const char *host)
+{
+    return match_named_list(upstream_lists, upstream_list_num, host);
+}
+
+int
+get_profile_num(void)
+{
+    return profile_list_num;
+}
+
+const char *
+get_profile_name(int index)
+{
+    if (index < 0 || index >= profile_list_num)
+        return NULL;
+    return profile_lists[index].name;
+}
+
+/*
+ * Return -1, if not match.
+ * Return the index of the first matching [profile:<name>] list otherwise.
+ */
+int
+acl_match_profile(const char *host)
+{
+    return match_named_list(profile_lists, profile_list_num, host);
+}
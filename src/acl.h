@@ -37,4 +37,12 @@ int get_acl_mode(void);
 
 int outbound_block_match_host(const char *host);
 
+int acl_match_upstream(const char *host);
+int get_upstream_num(void);
+const char *get_upstream_name(int index);
+
+int acl_match_profile(const char *host);
+int get_profile_num(void);
+const char *get_profile_name(int index);
+
 #endif // _ACL_H
@@ -55,6 +55,20 @@
 #define XCHACHA20POLY1305IETF   4
 #endif
 
+/*
+ * A build configured --with-cipher knows its method up front, so the
+ * switches below fold into the one primitive and the chunk loops call it
+ * directly.
+ */
+#ifdef FIXED_CIPHER
+#if FIXED_CIPHER < AES128GCM || FIXED_CIPHER >= AEAD_CIPHER_NUM
+#error "FIXED_CIPHER is not an AEAD method this libsodium supports"
+#endif
+#define AEAD_METHOD(cipher)     FIXED_CIPHER
+#else
+#define AEAD_METHOD(cipher)     ((cipher)->method)
+#endif
+
 #define CHUNK_SIZE_LEN          2
 #define CHUNK_SIZE_MASK         0x3FFF
 
@@ -165,7 +179,7 @@ aead_cipher_encrypt(cipher_ctx_t *cipher_ctx,
     size_t nlen = cipher_ctx->cipher->nonce_len;
     size_t tlen = cipher_ctx->cipher->tag_len;
 
-    switch (cipher_ctx->cipher->method) {
+    switch (AEAD_METHOD(cipher_ctx->cipher)) {
     case AES256GCM: // Only AES-256-GCM is supported by libsodium.
         if (cipher_ctx->aes256gcm_ctx != NULL) { // Use it if availble
             err = crypto_aead_aes256gcm_encrypt_afternm(c, &long_clen, m, mlen,
@@ -214,7 +228,7 @@ aead_cipher_decrypt(cipher_ctx_t *cipher_ctx,
     size_t nlen = cipher_ctx->cipher->nonce_len;
     size_t tlen = cipher_ctx->cipher->tag_len;
 
-    switch (cipher_ctx->cipher->method) {
+    switch (AEAD_METHOD(cipher_ctx->cipher)) {
     case AES256GCM: // Only AES-256-GCM is supported by libsodium.
         if (cipher_ctx->aes256gcm_ctx != NULL) { // Use it if availble
             err = crypto_aead_aes256gcm_decrypt_afternm(p, &long_plen, NULL, m, mlen,
@@ -258,7 +272,7 @@ aead_cipher_decrypt(cipher_ctx_t *cipher_ctx,
  * get basic cipher info structure
  * it's a wrapper offered by crypto library
  */
-const cipher_kt_t *
+static const cipher_kt_t *
 aead_get_cipher_type(int method)
 {
     if (method < AES128GCM || method >= AEAD_CIPHER_NUM) {
@@ -282,7 +296,7 @@ aead_get_cipher_type(int method)
 }
 
 static void
-aead_cipher_ctx_set_key(cipher_ctx_t *cipher_ctx, int enc)
+aead_derive_subkey(cipher_t *cipher, const uint8_t *salt, uint8_t *skey)
 {
     const digest_type_t *md = mbedtls_md_info_from_string("SHA1");
     if (md == NULL) {
@@ -290,18 +304,25 @@ aead_cipher_ctx_set_key(cipher_ctx_t *cipher_ctx, int enc)
     }
 
     int err = crypto_hkdf(md,
-                          cipher_ctx->salt, cipher_ctx->cipher->key_len,
-                          cipher_ctx->cipher->key, cipher_ctx->cipher->key_len,
+                          salt, cipher->key_len,
+                          cipher->key, cipher->key_len,
                           (uint8_t *)SUBKEY_INFO, strlen(SUBKEY_INFO),
-                          cipher_ctx->skey, cipher_ctx->cipher->key_len);
+                          skey, cipher->key_len);
     if (err) {
         FATAL("Unable to generate subkey");
     }
+}
 
+/*
+ * Set up the cipher for the subkey in the context
+ */
+static void
+aead_cipher_ctx_expand_key(cipher_ctx_t *cipher_ctx, int enc)
+{
     memset(cipher_ctx->nonce, 0, cipher_ctx->cipher->nonce_len);
 
     /* cipher that don't use mbed TLS, just return */
-    if (cipher_ctx->cipher->method >= CHACHA20POLY1305IETF) {
+    if (AEAD_METHOD(cipher_ctx->cipher) >= CHACHA20POLY1305IETF) {
         return;
     }
     if (cipher_ctx->aes256gcm_ctx != NULL) {
@@ -320,6 +341,13 @@ aead_cipher_ctx_set_key(cipher_ctx_t *cipher_ctx, int enc)
     }
 }
 
+static void
+aead_cipher_ctx_set_key(cipher_ctx_t *cipher_ctx, int enc)
+{
+    aead_derive_subkey(cipher_ctx->cipher, cipher_ctx->salt, cipher_ctx->skey);
+    aead_cipher_ctx_expand_key(cipher_ctx, enc);
+}
+
 static void
 aead_cipher_ctx_init(cipher_ctx_t *cipher_ctx, int method, int enc)
 {
@@ -360,15 +388,114 @@ aead_cipher_ctx_init(cipher_ctx_t *cipher_ctx, int method, int enc)
 #endif
 }
 
+/*
+ * Salts and subkeys of encrypt contexts made ahead of time, while the
+ * loop is idle, see keypool.c.
+ */
+typedef struct aead_key {
+    aes256gcm_ctx state;            // the expanded subkey, with libsodium's AES-256-GCM
+    uint8_t salt[MAX_KEY_LENGTH];
+    uint8_t skey[MAX_KEY_LENGTH];
+} aead_key_t;
+
+static aead_key_t *key_pool;
+static cipher_t *key_pool_cipher;
+static int key_pool_size;
+static int key_pool_num;
+
+int
+aead_key_pool_init(cipher_t *cipher, int size)
+{
+    if (size <= 0) {
+        return -1;
+    }
+
+    key_pool = ss_aligned_malloc(size * sizeof(aead_key_t));
+    sodium_memzero(key_pool, size * sizeof(aead_key_t));
+    key_pool_cipher = cipher;
+    key_pool_size   = size;
+    key_pool_num    = 0;
+
+    return 0;
+}
+
+void
+aead_key_pool_free(void)
+{
+    if (key_pool == NULL) {
+        return;
+    }
+
+    sodium_memzero(key_pool, key_pool_size * sizeof(aead_key_t));
+    ss_aligned_free(key_pool);
+    key_pool_cipher = NULL;
+    key_pool_size   = 0;
+    key_pool_num    = 0;
+}
+
+/*
+ * Make up to n more keys, returns how many are still missing
+ */
+int
+aead_key_pool_fill(int n)
+{
+    cipher_t *cipher = key_pool_cipher;
+
+    for (; n > 0 && key_pool_num < key_pool_size; n--) {
+        aead_key_t *key = &key_pool[key_pool_num];
+
+        rand_bytes(key->salt, cipher->key_len);
+        aead_derive_subkey(cipher, key->salt, key->skey);
+
+        if (AEAD_METHOD(cipher) == AES256GCM && crypto_aead_aes256gcm_is_available()
+            && crypto_aead_aes256gcm_beforenm(&key->state, key->skey) != 0) {
+            FATAL("Cannot set libsodium cipher key");
+        }
+
+        key_pool_num++;
+    }
+
+    return key_pool_size - key_pool_num;
+}
+
+/*
+ * Key a new encrypt context from the pool, returns 0 when it is empty
+ */
+static int
+aead_cipher_ctx_pool_key(cipher_ctx_t *cipher_ctx)
+{
+    if (key_pool_num == 0 || key_pool_cipher != cipher_ctx->cipher) {
+        return 0;
+    }
+
+    aead_key_t *key = &key_pool[--key_pool_num];
+    size_t key_len  = cipher_ctx->cipher->key_len;
+
+    memcpy(cipher_ctx->salt, key->salt, key_len);
+    memcpy(cipher_ctx->skey, key->skey, key_len);
+
+    if (cipher_ctx->aes256gcm_ctx != NULL) {
+        memcpy(cipher_ctx->aes256gcm_ctx, &key->state, sizeof(aes256gcm_ctx));
+    } else {
+        // mbed TLS contexts hold pointers of their own, their key schedule is set here
+        aead_cipher_ctx_expand_key(cipher_ctx, 1);
+    }
+
+    sodium_memzero(key, sizeof(aead_key_t));
+    cipher_ctx->keyed = 1;
+
+    return 1;
+}
+
 void
 aead_ctx_init(cipher_t *cipher, cipher_ctx_t *cipher_ctx, int enc)
 {
     sodium_memzero(cipher_ctx, sizeof(cipher_ctx_t));
     cipher_ctx->cipher = cipher;
 
-    aead_cipher_ctx_init(cipher_ctx, cipher->method, enc);
+    aead_cipher_ctx_init(cipher_ctx, AEAD_METHOD(cipher), enc);
 
-    if (enc) {
+    if (enc && !aead_cipher_ctx_pool_key(cipher_ctx)) {
         rand_bytes(cipher_ctx->salt, cipher->key_len);
     }
 }
@@ -382,7 +509,7 @@ aead_ctx_release(cipher_ctx_t *cipher_ctx)
         cipher_ctx->chunk = NULL;
     }
 
-    if (cipher_ctx->cipher->method >= CHACHA20POLY1305IETF) {
+    if (AEAD_METHOD(cipher_ctx->cipher) >= CHACHA20POLY1305IETF) {
         return;
     }
 
@@ -415,7 +542,9 @@ aead_encrypt_all(buffer_t *plaintext, cipher_t *cipher, size_t capacity)
 
     ppbloom_add((void *)cipher_ctx.salt, salt_len);
 
-    aead_cipher_ctx_set_key(&cipher_ctx, 1);
+    if (!cipher_ctx.keyed) {
+        aead_cipher_ctx_set_key(&cipher_ctx, 1);
+    }
 
     size_t clen = ciphertext->len;
     err = aead_cipher_encrypt(&cipher_ctx,
@@ -557,7 +686,9 @@ aead_encrypt(buffer_t *plaintext, cipher_ctx_t *cipher_ctx, size_t capacity)
 
     if (!cipher_ctx->init) {
         memcpy(ciphertext->data, cipher_ctx->salt, salt_len);
-        aead_cipher_ctx_set_key(cipher_ctx, 1);
+        if (!cipher_ctx->keyed) {
+            aead_cipher_ctx_set_key(cipher_ctx, 1);
+        }
         cipher_ctx->init = 1;
 
         ppbloom_add((void *)cipher_ctx->salt, salt_len);
@@ -710,7 +841,7 @@ aead_decrypt(buffer_t *ciphertext, cipher_ctx_t *cipher_ctx, size_t capacity)
     return CRYPTO_OK;
 }
 
-cipher_t *
+static cipher_t *
 aead_key_init(int method, const char *pass, const char *key)
 {
     if (method < AES128GCM || method >= AEAD_CIPHER_NUM) {
@@ -757,6 +888,10 @@ aead_key_init(int method, const char *pass, const char *key)
 cipher_t *
 aead_init(const char *pass, const char *key, const char *method)
 {
+#ifdef FIXED_CIPHER
+    // crypto_init has checked the name already
+    return aead_key_init(FIXED_CIPHER, pass, key);
+#else
     int m = AES128GCM;
     if (method != NULL) {
         /* check method validity */
@@ -770,4 +905,5 @@ aead_init(const char *pass, const char *key, const char *method)
         }
     }
     return aead_key_init(m, pass, key);
+#endif
 }
@@ -44,4 +44,8 @@ void aead_ctx_release(cipher_ctx_t *);
 
 cipher_t *aead_init(const char *pass, const char *key, const char *method);
 
+int aead_key_pool_init(cipher_t *cipher, int size);
+int aead_key_pool_fill(int n);
+void aead_key_pool_free(void);
+
 #endif // _AEAD_H
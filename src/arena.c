@@ -0,0 +1,183 @@
+/*
+ * arena.c - Huge page arena
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#endif
+
+#include "utils.h"
+#include "arena.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Keeps objects from sharing cache lines
+#define ARENA_ALIGN    64
+
+int huge_pages = 0;
+arena_pool_t arena_buffers = { ARENA_BUF_SIZE, NULL };
+
+static char *region;
+static size_t region_size;
+static size_t region_used;
+
+// The mapping as munmap wants it, larger than the region when aligned
+static void *mapping;
+static size_t mapping_size;
+
+/*
+ * Map the region, huge_pages is cleared when that fails so the callers
+ * checking it use malloc from then on.
+ */
+int
+arena_init(void)
+{
+#ifdef __MINGW32__
+    LOGE("huge pages are not supported on this platform");
+    huge_pages = 0;
+    return -1;
+#else
+    if (huge_pages <= 0) {
+        huge_pages = 0;
+        return -1;
+    }
+
+    region_size = ((size_t)huge_pages * 1024 * 1024 + HUGE_PAGE_SIZE - 1)
+                  & ~(size_t)(HUGE_PAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+    mapping = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mapping != MAP_FAILED) {
+        region       = mapping;
+        mapping_size = region_size;
+        LOGI("arena of " SIZE_FMT " MB on hugetlbfs pages", region_size >> 20);
+        return 0;
+    }
+#endif
+
+    // No reserved huge pages, map an aligned region for THP instead
+    mapping_size = region_size + HUGE_PAGE_SIZE;
+    mapping      = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        ERROR("arena_mmap");
+        mapping    = NULL;
+        huge_pages = 0;
+        return -1;
+    }
+    region = (char *)(((uintptr_t)mapping + HUGE_PAGE_SIZE - 1)
+                      & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+
+#ifdef MADV_HUGEPAGE
+    if (madvise(region, region_size, MADV_HUGEPAGE) == 0) {
+        LOGI("arena of " SIZE_FMT " MB on transparent huge pages", region_size >> 20);
+        return 0;
+    }
+#endif
+
+    LOGI("huge pages unavailable, arena of " SIZE_FMT " MB on normal pages",
+         region_size >> 20);
+    return 0;
+#endif
+}
+
+/*
+ * Only at exit, after everything taken from the arena is given back.
+ */
+void
+arena_free(void)
+{
+#ifndef __MINGW32__
+    if (mapping != NULL) {
+        munmap(mapping, mapping_size);
+    }
+#endif
+    mapping             = NULL;
+    region              = NULL;
+    region_used         = 0;
+    huge_pages          = 0;
+    arena_buffers.free  = NULL;
+}
+
+/*
+ * Zeroed memory for good, NULL once the region is used up.
+ */
+void *
+arena_alloc(size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (region == NULL || region_size - region_used < size) {
+        return NULL;
+    }
+
+    void *ptr = region + region_used;
+    region_used += size;
+    return ptr;
+}
+
+int
+arena_owns(const void *ptr)
+{
+    return region != NULL && (const char *)ptr >= region
+           && (const char *)ptr < region + region_size;
+}
+
+void *
+arena_get(arena_pool_t *pool)
+{
+    void *ptr = pool->free;
+
+    if (ptr != NULL) {
+        pool->free = *(void **)ptr;
+        return ptr;
+    }
+
+    ptr = arena_alloc(pool->size);
+    if (ptr == NULL) {
+        ptr = ss_malloc(pool->size);
+    }
+
+    return ptr;
+}
+
+void
+arena_put(arena_pool_t *pool, void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    if (!arena_owns(ptr)) {
+        free(ptr);
+        return;
+    }
+
+    *(void **)ptr = pool->free;
+    pool->free    = ptr;
+}
@@ -0,0 +1,66 @@
+/*
+ * arena.h - Define the huge page arena
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/*
+ * With huge_pages set to a number of megabytes, one region of that size
+ * is mapped with 2 MB pages: explicit hugetlbfs pages when the system has
+ * some reserved (vm.nr_hugepages), else transparent huge pages through
+ * MADV_HUGEPAGE. The replay filter, the relay buffers and the connection
+ * structures are carved from it, so the hot working set is covered by a
+ * few TLB entries instead of thousands.
+ *
+ * Everything falls back to malloc: when no region could be mapped, when
+ * it is used up, and for buffers that grow past ARENA_BUF_SIZE.
+ */
+
+// Relay buffers of SOCKET_BUF_SIZE plus the AEAD framing of one chunk
+#define ARENA_BUF_SIZE (17 * 1024)
+
+/*
+ * Objects of one size. Freed ones are kept on a list for reuse, never
+ * handed back to the region.
+ */
+typedef struct arena_pool {
+    size_t size;
+    void *free;
+} arena_pool_t;
+
+#define ARENA_POOL(type) { sizeof(type), NULL }
+
+extern int huge_pages;
+extern arena_pool_t arena_buffers;
+
+int arena_init(void);
+void arena_free(void);
+
+void *arena_alloc(size_t size);
+int arena_owns(const void *ptr);
+
+void *arena_get(arena_pool_t *pool);
+void arena_put(arena_pool_t *pool, void *ptr);
+
+#endif // _ARENA_H
@@ -0,0 +1,886 @@
+/*
+ * bench.c - Microbenchmarks for the data structures on the relay paths,
+ *           and for the resolver against an in-process stub DNS server
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef HAVE_LIBEV_EV_H
+#include <libev/ev.h>
+#else
+#include <ev.h>
+#endif
+
+#include "utils.h"
+#include "cache.h"
+#include "crypto.h"
+#include "ppbloom.h"
+#include "acl.h"
+#include "resolv.h"
+#include "dnscache.h"
+
+#define BENCH_ITERATIONS    1000000
+#define BENCH_UDP_SESSIONS  512         // MAX_UDP_CONN_NUM in udprelay.c
+#define BENCH_DOMAIN_RULES  10000       // about twice the size of gfwlist.acl
+#define BENCH_CIDR_RULES    8000        // about the size of chn.acl
+#define BENCH_SALT_LEN      32
+#define BENCH_POOL_SIZE     65536       // pregenerated inputs, a power of two
+#define BENCH_HOST_LEN      64
+
+#define BENCH_DNS_LOOKUPS       20000
+#define BENCH_DNS_CONCURRENCY   2000
+#define BENCH_DNS_HOSTS         5000
+#define BENCH_DNS_LATENCY       20      // ms, mean of a uniform 0.5x - 1.5x spread
+#define BENCH_DNS_TTL           300
+#define BENCH_DNS_PACKET_SIZE   512
+#define BENCH_DNS_SERVERS       8
+
+// Same layout as hash_key() in udprelay.c
+#define BENCH_KEY_LEN       (sizeof(int) + sizeof(struct sockaddr_storage))
+
+static uint64_t iterations = BENCH_ITERATIONS;
+static int udp_sessions    = BENCH_UDP_SESSIONS;
+static int domain_rules    = BENCH_DOMAIN_RULES;
+static int cidr_rules      = BENCH_CIDR_RULES;
+
+static int dns_lookups     = BENCH_DNS_LOOKUPS;
+static int dns_concurrency = BENCH_DNS_CONCURRENCY;
+static int dns_hosts       = BENCH_DNS_HOSTS;
+static double dns_latency[BENCH_DNS_SERVERS];
+static double dns_loss[BENCH_DNS_SERVERS];
+static int dns_servers     = 1;
+static double dns_nxdomain = 0;
+static int dns_ttl         = BENCH_DNS_TTL;
+static char *dns_cache     = NULL;
+
+int verbose = 0;
+
+static char **filters;
+static int filter_num;
+
+static int perf_fd = -1;
+static struct timespec start_ts;
+static uint64_t prng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t
+prng(void)
+{
+    // xorshift64*, deterministic so runs on two branches see the same inputs
+    prng_state ^= prng_state >> 12;
+    prng_state ^= prng_state << 25;
+    prng_state ^= prng_state >> 27;
+    return prng_state * 2685821657736338717ULL;
+}
+
+static int
+selected(const char *group)
+{
+    if (filter_num == 0) {
+        return 1;
+    }
+
+    for (int i = 0; i < filter_num; i++)
+        if (strncmp(group, filters[i], strlen(filters[i])) == 0)
+            return 1;
+
+    return 0;
+}
+
+static void
+perf_open(void)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+
+    // Fails without a PMU or with a strict perf_event_paranoid, misses are then omitted
+    perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+/*
+ * Bytes currently allocated from the heap, or -1 if the libc cannot tell.
+ */
+static long
+heap_used(void)
+{
+#ifdef __GLIBC__
+    struct mallinfo mi = mallinfo();
+    return (long)(unsigned int)mi.uordblks + (long)(unsigned int)mi.hblkhd;
+#else
+    return -1;
+#endif
+}
+
+static void
+bench_start(void)
+{
+#ifdef __linux__
+    if (perf_fd != -1) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &start_ts);
+}
+
+/*
+ * One line per benchmark: name, iterations, ns/op, cache misses/op and
+ * the heap footprint in bytes. Columns that are not measured print "-".
+ */
+static void
+bench_stop(const char *name, uint64_t ops, long before, long after)
+{
+    struct timespec end_ts;
+    long long misses = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &end_ts);
+#ifdef __linux__
+    if (perf_fd != -1) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = -1;
+        }
+    }
+#endif
+
+    double ns = (end_ts.tv_sec - start_ts.tv_sec) * 1e9
+                + (end_ts.tv_nsec - start_ts.tv_nsec);
+
+    printf("%-32s %10" PRIu64 " %12.1f", name, ops, ns / ops);
+    if (misses >= 0) {
+        printf(" %10.2f", (double)misses / ops);
+    } else {
+        printf(" %10s", "-");
+    }
+    if (before >= 0 && after >= 0) {
+        printf(" %12ld\n", after - before);
+    } else {
+        printf(" %12s\n", "-");
+    }
+    fflush(stdout);
+}
+
+static void
+cache_key(char *key, uint64_t i)
+{
+    int af = AF_INET;
+    struct sockaddr_storage storage;
+    struct sockaddr_in *addr = (struct sockaddr_in *)&storage;
+
+    memset(&storage, 0, sizeof(storage));
+    addr->sin_family      = AF_INET;
+    addr->sin_addr.s_addr = htonl(0x0a000000 + (uint32_t)(i / 50000));
+    addr->sin_port        = htons(1024 + i % 50000);
+
+    memcpy(key, &af, sizeof(int));
+    memcpy(key + sizeof(int), &storage, sizeof(storage));
+}
+
+static void
+bench_cache(void)
+{
+    struct cache *cache;
+    char key[BENCH_KEY_LEN];
+    void *data;
+    uint64_t i, next;
+
+    long before = heap_used();
+    bench_start();
+    cache_create(&cache, udp_sessions, NULL);
+    for (next = 0; next < udp_sessions; next++) {
+        cache_key(key, next);
+        cache_insert(cache, key, BENCH_KEY_LEN, NULL);
+    }
+    bench_stop("cache_fill", udp_sessions, before, heap_used());
+
+    // A full cache evicts one session per insert, like a busy UDP relay
+    bench_start();
+    for (i = 0; i < iterations; i++, next++) {
+        cache_key(key, next);
+        cache_insert(cache, key, BENCH_KEY_LEN, NULL);
+    }
+    bench_stop("cache_insert", iterations, -1, -1);
+
+    // The cache keeps udp_sessions - 1 entries, the most recent ones
+    uint64_t resident = HASH_COUNT(cache->entries);
+    bench_start();
+    for (i = 0; i < iterations; i++) {
+        cache_key(key, next - 1 - prng() % resident);
+        cache_lookup(cache, key, BENCH_KEY_LEN, &data);
+    }
+    bench_stop("cache_lookup_hit", iterations, -1, -1);
+
+    bench_start();
+    for (i = 0; i < iterations; i++) {
+        cache_key(key, next + prng() % resident);
+        cache_lookup(cache, key, BENCH_KEY_LEN, &data);
+    }
+    bench_stop("cache_lookup_miss", iterations, -1, -1);
+
+    // The periodic sweep, with nothing old enough to expire
+    uint64_t sweeps = iterations / udp_sessions + 1;
+    bench_start();
+    for (i = 0; i < sweeps; i++)
+        cache_clear(cache, 3600);
+    bench_stop("cache_clear", sweeps, -1, -1);
+
+    cache_delete(cache, 0);
+}
+
+static void
+bench_ppbloom(void)
+{
+    uint8_t *seen   = ss_malloc(BENCH_POOL_SIZE * BENCH_SALT_LEN);
+    uint8_t *unseen = ss_malloc(BENCH_POOL_SIZE * BENCH_SALT_LEN);
+    uint64_t i;
+
+    for (i = 0; i < BENCH_POOL_SIZE * BENCH_SALT_LEN / 8; i++) {
+        uint64_t a = prng(), b = prng();
+        memcpy(seen + i * 8, &a, 8);
+        memcpy(unseen + i * 8, &b, 8);
+    }
+
+    long before = heap_used();
+    bench_start();
+    ppbloom_init(BF_NUM_ENTRIES_FOR_SERVER, BF_ERROR_RATE_FOR_SERVER);
+    bench_stop("ppbloom_init", 1, before, heap_used());
+
+    bench_start();
+    for (i = 0; i < iterations; i++)
+        ppbloom_add(seen + (i & (BENCH_POOL_SIZE - 1)) * BENCH_SALT_LEN, BENCH_SALT_LEN);
+    bench_stop("ppbloom_add", iterations, -1, -1);
+
+    bench_start();
+    for (i = 0; i < iterations; i++)
+        ppbloom_check(seen + (i & (BENCH_POOL_SIZE - 1)) * BENCH_SALT_LEN, BENCH_SALT_LEN);
+    bench_stop("ppbloom_check_hit", iterations, -1, -1);
+
+    bench_start();
+    for (i = 0; i < iterations; i++)
+        ppbloom_check(unseen + (i & (BENCH_POOL_SIZE - 1)) * BENCH_SALT_LEN, BENCH_SALT_LEN);
+    bench_stop("ppbloom_check_miss", iterations, -1, -1);
+
+    ppbloom_free();
+    ss_free(seen);
+    ss_free(unseen);
+}
+
+static uint32_t
+cidr_base(int i)
+{
+    // One network per /16 starting at 1.0.0.0, prefixes from /16 to /24
+    return 0x01000000 + ((uint32_t)i << 16);
+}
+
+static void
+write_rules(FILE *f, const char *label)
+{
+    char ip[INET_ADDRSTRLEN];
+
+    for (int i = 0; i < domain_rules; i++)
+        fprintf(f, "(^|\\.)%s%d\\.com$\n", label, i);
+
+    for (int i = 0; i < cidr_rules; i++) {
+        struct in_addr addr = { .s_addr = htonl(cidr_base(i)) };
+        inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+        fprintf(f, "%s/%d\n", ip, 16 + i % 9);
+    }
+}
+
+static char *
+make_acl(void)
+{
+    char *path = strdup("/tmp/ss-bench-XXXXXX");
+    int fd     = mkstemp(path);
+    if (fd == -1) {
+        ERROR("mkstemp");
+        ss_free(path);
+        return NULL;
+    }
+
+    // Shaped like gfwlist.acl, plus a server-side block list of the same size
+    FILE *f = fdopen(fd, "w");
+    fprintf(f, "[bypass_all]\n[proxy_list]\n");
+    write_rules(f, "proxy");
+    fprintf(f, "[outbound_block_list]\n");
+    write_rules(f, "block");
+    fclose(f);
+
+    return path;
+}
+
+static char *
+make_hosts(const char *fmt, int range)
+{
+    char *hosts = ss_malloc(BENCH_POOL_SIZE * BENCH_HOST_LEN);
+
+    for (int i = 0; i < BENCH_POOL_SIZE; i++)
+        snprintf(hosts + i * BENCH_HOST_LEN, BENCH_HOST_LEN, fmt, (int)(prng() % range));
+
+    return hosts;
+}
+
+static char *
+make_ips(int hit)
+{
+    char *hosts = ss_malloc(BENCH_POOL_SIZE * BENCH_HOST_LEN);
+
+    for (int i = 0; i < BENCH_POOL_SIZE; i++) {
+        // The first address of a listed network, or one in 224.0.0.0/3
+        uint32_t ip = hit ? cidr_base(prng() % cidr_rules) + 1
+                      : 0xe0000000 + (uint32_t)(prng() % 0x20000000);
+        struct in_addr addr = { .s_addr = htonl(ip) };
+        inet_ntop(AF_INET, &addr, hosts + i * BENCH_HOST_LEN, BENCH_HOST_LEN);
+    }
+
+    return hosts;
+}
+
+static void
+bench_match(const char *name, int (*match)(const char *), const char *hosts,
+            uint64_t ops)
+{
+    bench_start();
+    for (uint64_t i = 0; i < ops; i++)
+        match(hosts + (i & (BENCH_POOL_SIZE - 1)) * BENCH_HOST_LEN);
+    bench_stop(name, ops, -1, -1);
+}
+
+static void
+bench_acl(void)
+{
+    char *path = make_acl();
+    if (path == NULL) {
+        return;
+    }
+
+    long before = heap_used();
+    bench_start();
+    init_acl(path);
+    bench_stop("acl_init", 1, before, heap_used());
+
+    unlink(path);
+    ss_free(path);
+
+    char *proxy_hosts = make_hosts("www.proxy%d.com", domain_rules);
+    char *block_hosts = make_hosts("www.block%d.com", domain_rules);
+    char *miss_hosts  = make_hosts("www.example%d.org", domain_rules);
+    char *hit_ips     = make_ips(1);
+    char *miss_ips    = make_ips(0);
+
+    // Domain rules are regexes tried one by one, so run fewer of them
+    uint64_t domain_ops = iterations / 1000 + 1;
+
+    bench_match("acl_match_domain_hit", acl_match_host, proxy_hosts, domain_ops);
+    bench_match("acl_match_domain_miss", acl_match_host, miss_hosts, domain_ops);
+    bench_match("acl_match_ip_hit", acl_match_host, hit_ips, iterations);
+    bench_match("acl_match_ip_miss", acl_match_host, miss_ips, iterations);
+
+    bench_match("outbound_block_domain_hit", outbound_block_match_host,
+                block_hosts, domain_ops);
+    bench_match("outbound_block_domain_miss", outbound_block_match_host,
+                miss_hosts, domain_ops);
+    bench_match("outbound_block_ip_hit", outbound_block_match_host,
+                hit_ips, iterations);
+    bench_match("outbound_block_ip_miss", outbound_block_match_host,
+                miss_ips, iterations);
+
+    free_acl();
+    ss_free(proxy_hosts);
+    ss_free(block_hosts);
+    ss_free(miss_hosts);
+    ss_free(hit_ips);
+    ss_free(miss_ips);
+}
+
+/*
+ * Stub DNS servers on loopback UDP sockets, served from the same event
+ * loop as the resolver. Names whose first label starts with "nx" get
+ * NXDOMAIN, every other A or AAAA question gets one record derived from
+ * the name. Server i drops queries with probability dns_loss[i] and
+ * answers after a delay around dns_latency[i].
+ */
+typedef struct stub {
+    ev_io io;
+    int fd;
+    double latency;
+    double loss;
+    uint64_t queries;
+    uint64_t dropped;
+} stub_t;
+
+typedef struct stub_reply {
+    ev_timer watcher;
+    stub_t *stub;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    size_t len;
+    uint8_t data[BENCH_DNS_PACKET_SIZE];
+} stub_reply_t;
+
+static stub_t stubs[BENCH_DNS_SERVERS];
+
+typedef struct lookup {
+    ev_tstamp start;
+    int nx;
+} lookup_t;
+
+static struct {
+    ev_idle refill;
+    double *latencies;
+    int started;
+    int finished;
+    int inflight;
+    int failed;
+    int nxdomain;
+} lookups;
+
+static void
+stub_send(stub_reply_t *reply)
+{
+    if (sendto(reply->stub->fd, reply->data, reply->len, 0,
+               (struct sockaddr *)&reply->addr, reply->addr_len) == -1) {
+        ERROR("stub_send");
+    }
+}
+
+static void
+stub_delay_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    stub_reply_t *reply = (stub_reply_t *)watcher;
+
+    stub_send(reply);
+    ss_free(reply);
+}
+
+static void
+stub_recv_cb(EV_P_ ev_io *w, int revents)
+{
+    stub_t *stub        = (stub_t *)w;
+    stub_reply_t *reply = ss_malloc(sizeof(stub_reply_t));
+    uint8_t *data       = reply->data;
+
+    reply->stub     = stub;
+    reply->addr_len = sizeof(reply->addr);
+    ssize_t r = recvfrom(stub->fd, data, BENCH_DNS_PACKET_SIZE, 0,
+                         (struct sockaddr *)&reply->addr, &reply->addr_len);
+    if (r < 12) {
+        ss_free(reply);
+        return;
+    }
+    stub->queries++;
+
+    if (prng() % 1000000 < stub->loss * 1000000) {
+        stub->dropped++;
+        ss_free(reply);
+        return;
+    }
+
+    // Skip the question name, hashing it for the answer
+    size_t off = 12;
+    uint32_t h = 2166136261u;
+    int nx     = r > 15 && data[off] >= 2 && data[off + 1] == 'n' && data[off + 2] == 'x';
+    while (off < r && data[off] != 0) {
+        h    = (h ^ data[off]) * 16777619u;
+        off += data[off] + 1;
+    }
+    if (off + 5 > r || off + 5 + 12 + 16 > BENCH_DNS_PACKET_SIZE) {
+        ss_free(reply);
+        return;
+    }
+    off += 5;
+
+    int qtype = load16_be(data + off - 4);
+    int rdlen = qtype == 1 ? 4 : qtype == 28 ? 16 : 0;
+    if (nx) {
+        rdlen = 0;
+    }
+
+    data[2] = 0x81;                         // QR, RD
+    data[3] = 0x80 | (nx ? 3 : 0);          // RA, NXDOMAIN
+    memset(data + 4, 0, 8);
+    data[5] = 1;                            // one question
+    data[7] = rdlen ? 1 : 0;                // one answer
+
+    if (rdlen) {
+        uint8_t *rr = data + off;
+        rr[0] = 0xc0;                       // name, pointer to the question
+        rr[1] = 12;
+        rr[2] = 0;
+        rr[3] = qtype;
+        rr[4] = 0;
+        rr[5] = 1;                          // IN
+        rr[6] = dns_ttl >> 24;
+        rr[7] = dns_ttl >> 16;
+        rr[8] = dns_ttl >> 8;
+        rr[9] = dns_ttl;
+        rr[10] = 0;
+        rr[11] = rdlen;
+        memset(rr + 12, 0, rdlen);
+        rr[12] = qtype == 1 ? 10 : 0xfd;    // 10.0.0.0/8 or fd00::/8
+        memcpy(rr + 12 + rdlen - 3, &h, 3);
+        off += 12 + rdlen;
+    }
+    reply->len = off;
+
+    if (stub->latency <= 0) {
+        stub_send(reply);
+        ss_free(reply);
+        return;
+    }
+
+    double delay = stub->latency / 1000.0 * (0.5 + (prng() % 1000000) / 1000000.0);
+    ev_timer_init(&reply->watcher, stub_delay_cb, delay, 0);
+    ev_timer_start(EV_A_ & reply->watcher);
+}
+
+static int
+stub_start(struct ev_loop *loop, stub_t *stub)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    stub->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (stub->fd == -1
+        || bind(stub->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+        || getsockname(stub->fd, (struct sockaddr *)&addr, &addr_len) == -1) {
+        ERROR("stub_start");
+        return -1;
+    }
+    fcntl(stub->fd, F_SETFL, fcntl(stub->fd, F_GETFL, 0) | O_NONBLOCK);
+
+    // A burst of lookups must not overflow the stub itself
+    int rcvbuf = 1 << 22;
+    setsockopt(stub->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    ev_io_init(&stub->io, stub_recv_cb, stub->fd, EV_READ);
+    ev_io_start(loop, &stub->io);
+
+    return ntohs(addr.sin_port);
+}
+
+static void
+lookup_cb(struct sockaddr *addr, void *data)
+{
+    lookup_t *lookup = (lookup_t *)data;
+
+    lookups.latencies[lookups.finished++] = ev_time() - lookup->start;
+    if (addr == NULL) {
+        if (lookup->nx) {
+            lookups.nxdomain++;
+        } else {
+            lookups.failed++;
+        }
+    }
+}
+
+static void
+lookup_free_cb(void *data)
+{
+    ss_free(data);
+    lookups.inflight--;
+    ev_idle_start(EV_DEFAULT, &lookups.refill);
+}
+
+/*
+ * New lookups are started from an idle watcher rather than from the
+ * resolver callback, c-ares answers cached names synchronously.
+ */
+static void
+lookup_refill_cb(EV_P_ ev_idle *w, int revents)
+{
+    char host[BENCH_HOST_LEN];
+
+    ev_idle_stop(EV_A_ w);
+
+    if (lookups.finished == dns_lookups) {
+        ev_break(EV_A_ EVBREAK_ALL);
+        return;
+    }
+
+    while (lookups.inflight < dns_concurrency && lookups.started < dns_lookups) {
+        int i            = prng() % dns_hosts;
+        lookup_t *lookup = ss_malloc(sizeof(lookup_t));
+        lookup->nx    = i < dns_hosts * dns_nxdomain;
+        lookup->start = ev_time();
+        snprintf(host, sizeof(host), "%s%d.bench.test", lookup->nx ? "nx" : "h", i);
+
+        lookups.started++;
+        lookups.inflight++;
+        resolv_start(host, htons(443), lookup_cb, lookup_free_cb, lookup);
+    }
+}
+
+static int
+latency_cmp(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return da < db ? -1 : da > db ? 1 : 0;
+}
+
+static void
+bench_resolv(void)
+{
+    struct ev_loop *loop = EV_DEFAULT;
+    char nameservers[BENCH_DNS_SERVERS * 24] = "";
+    uint64_t queries = 0, dropped = 0;
+    int i;
+
+    printf("# resolv lookups=%d concurrency=%d hosts=%d nxdomain=%.3f ttl=%d\n",
+           dns_lookups, dns_concurrency, dns_hosts, dns_nxdomain, dns_ttl);
+
+    if (dns_cache != NULL && dnscache_init(dns_cache, 0) == -1) {
+        return;
+    }
+
+    for (i = 0; i < dns_servers; i++) {
+        stub_t *stub = &stubs[i];
+        memset(stub, 0, sizeof(stub_t));
+        stub->latency = dns_latency[i];
+        stub->loss    = dns_loss[i];
+
+        int port = stub_start(loop, stub);
+        if (port == -1) {
+            return;
+        }
+        snprintf(nameservers + strlen(nameservers), 24, "%s127.0.0.1:%d",
+                 i ? "," : "", port);
+        printf("# resolv server %d latency=%.1fms loss=%.3f\n",
+               i, stub->latency, stub->loss);
+    }
+
+    memset(&lookups, 0, sizeof(lookups));
+    lookups.latencies = ss_malloc(dns_lookups * sizeof(double));
+    ev_idle_init(&lookups.refill, lookup_refill_cb);
+    ev_idle_start(loop, &lookups.refill);
+
+    long before = heap_used();
+    bench_start();
+    resolv_init(loop, nameservers, 0);
+    ev_run(loop, 0);
+    bench_stop("resolv_lookup", dns_lookups, before, heap_used());
+    resolv_shutdown(loop);
+    dnscache_free();
+
+    for (i = 0; i < dns_servers; i++) {
+        ev_io_stop(loop, &stubs[i].io);
+        close(stubs[i].fd);
+        queries += stubs[i].queries;
+        dropped += stubs[i].dropped;
+    }
+
+    qsort(lookups.latencies, dns_lookups, sizeof(double), latency_cmp);
+    double *l = lookups.latencies;
+    int n     = dns_lookups;
+    printf("# resolv latency ms: p50 %.2f p90 %.2f p99 %.2f p999 %.2f max %.2f\n",
+           l[n / 2] * 1e3, l[n * 9 / 10] * 1e3, l[n * 99 / 100] * 1e3,
+           l[n * 999 / 1000] * 1e3, l[n - 1] * 1e3);
+    printf("# resolv queries/lookup %.2f, dropped %" PRIu64 ", timeouts %d,"
+           " nxdomain %d\n", (double)queries / n, dropped,
+           lookups.failed, lookups.nxdomain);
+    for (i = 0; i < dns_servers; i++)
+        printf("# resolv server %d queries %" PRIu64 " dropped %" PRIu64 "\n",
+               i, stubs[i].queries, stubs[i].dropped);
+    fflush(stdout);
+
+    ss_free(lookups.latencies);
+}
+
+/*
+ * Per-server values, "200,20" for two servers; the last one repeats.
+ */
+static void
+parse_servers(double *values, const char *arg)
+{
+    char *list = strdup(arg), *saveptr = NULL;
+    int n      = 0;
+
+    for (char *v = strtok_r(list, ",", &saveptr);
+         v != NULL && n < BENCH_DNS_SERVERS; v = strtok_r(NULL, ",", &saveptr))
+        values[n++] = atof(v);
+    ss_free(list);
+
+    for (int i = n; i < BENCH_DNS_SERVERS; i++)
+        values[i] = n ? values[n - 1] : 0;
+    if (n > dns_servers) {
+        dns_servers = n;
+    }
+}
+
+static void
+bench_usage(void)
+{
+    printf("usage: ss-bench [-n <iterations>] [-u <udp_sessions>]\n"
+           "                [-d <domain_rules>] [-c <cidr_rules>]\n"
+           "                [-q <lookups>] [-j <concurrency>] [-H <hosts>]\n"
+           "                [-L <latency_ms>] [-p <loss>] [-x <nxdomain>]\n"
+           "                [-T <ttl>] [-C <dns_cache>] [<group>...]\n"
+           "\n"
+           "  groups: cache, ppbloom, acl, resolv (default: all)\n"
+           "\n"
+           "  Output columns: name, iterations, ns/op, cache misses/op and\n"
+           "  heap bytes allocated. Unavailable columns print \"-\".\n"
+           "\n"
+           "  resolv runs <lookups> resolv_start() calls, <concurrency> at a\n"
+           "  time, over <hosts> names against a stub DNS server on loopback\n"
+           "  that drops a <loss> fraction of queries, answers a <nxdomain>\n"
+           "  fraction of names with NXDOMAIN and the rest with <ttl>.\n"
+           "  <latency_ms> and <loss> take a comma separated value per\n"
+           "  server, \"-L 200,20\" runs a slow and a fast nameserver.\n"
+           "  With -C the lookups go through the shared cache file of\n"
+           "  ss-server --dns-cache, a second run shows a warm cache.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    int c;
+
+    USE_TTY();
+
+    for (c = 0; c < BENCH_DNS_SERVERS; c++)
+        dns_latency[c] = BENCH_DNS_LATENCY;
+
+    while ((c = getopt(argc, argv, "n:u:d:c:q:j:H:L:p:x:T:C:h")) != -1) {
+        switch (c) {
+        case 'n':
+            iterations = strtoull(optarg, NULL, 10);
+            break;
+        case 'u':
+            udp_sessions = atoi(optarg);
+            break;
+        case 'd':
+            domain_rules = atoi(optarg);
+            break;
+        case 'c':
+            cidr_rules = atoi(optarg);
+            break;
+        case 'q':
+            dns_lookups = atoi(optarg);
+            break;
+        case 'j':
+            dns_concurrency = atoi(optarg);
+            break;
+        case 'H':
+            dns_hosts = atoi(optarg);
+            break;
+        case 'L':
+            parse_servers(dns_latency, optarg);
+            break;
+        case 'p':
+            parse_servers(dns_loss, optarg);
+            break;
+        case 'x':
+            dns_nxdomain = atof(optarg);
+            break;
+        case 'T':
+            dns_ttl = atoi(optarg);
+            break;
+        case 'C':
+            dns_cache = optarg;
+            break;
+        case 'h':
+            bench_usage();
+            exit(EXIT_SUCCESS);
+        default:
+            bench_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (iterations == 0 || udp_sessions < 2 || domain_rules < 1
+        || cidr_rules < 1 || cidr_rules > 0xdf00
+        || dns_lookups < 1 || dns_concurrency < 1 || dns_hosts < 1
+        || dns_nxdomain < 0 || dns_nxdomain > 1
+        || dns_ttl < 0) {
+        bench_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    for (c = 0; c < dns_servers; c++)
+        if (dns_loss[c] < 0 || dns_loss[c] > 1) {
+            bench_usage();
+            exit(EXIT_FAILURE);
+        }
+
+    filters    = argv + optind;
+    filter_num = argc - optind;
+
+    perf_open();
+
+    printf("# ss-bench %s iterations=%" PRIu64 " udp_sessions=%d"
+           " domain_rules=%d cidr_rules=%d\n",
+           VERSION, iterations, udp_sessions, domain_rules, cidr_rules);
+    printf("# %-30s %10s %12s %10s %12s\n",
+           "name", "iters", "ns/op", "misses/op", "bytes");
+
+    if (selected("cache")) {
+        bench_cache();
+    }
+    if (selected("ppbloom")) {
+        bench_ppbloom();
+    }
+    if (selected("acl")) {
+        bench_acl();
+    }
+    if (selected("resolv")) {
+        bench_resolv();
+    }
+
+    return 0;
+}
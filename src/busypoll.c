@@ -0,0 +1,129 @@
+/*
+ * busypoll.c - Busy-poll low-latency mode
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "utils.h"
+#include "busypoll.h"
+
+int busy_poll = 0;
+
+static ev_prepare prepare_watcher;
+static ev_idle spin_watcher;
+static ev_tstamp last_active;
+static ev_tstamp budget;
+
+// Set when the spin watcher ran, i.e. the last iteration had nothing else
+static int spun;
+
+static void
+spin_cb(EV_P_ ev_idle *w, int revents)
+{
+    spun = 1;
+
+    // Spin without holding the CPU from whatever else is runnable
+    sched_yield();
+}
+
+/*
+ * An active idle watcher makes libev poll with a zero timeout. At the
+ * lowest priority it is only invoked by iterations without any other
+ * pending watcher, so an iteration where it did not run had work.
+ */
+static void
+prepare_cb(EV_P_ ev_prepare *w, int revents)
+{
+    ev_tstamp now = ev_now(EV_A);
+
+    if (!ev_is_active(&spin_watcher)) {
+        // Woken up from a blocking poll
+        last_active = now;
+        ev_idle_start(EV_A_ & spin_watcher);
+    } else if (!spun) {
+        last_active = now;
+    } else if (now - last_active > budget) {
+        ev_idle_stop(EV_A_ & spin_watcher);
+    }
+
+    spun = 0;
+}
+
+void
+busy_poll_socket(int fd)
+{
+#ifdef SO_BUSY_POLL
+    static int warned = 0;
+    int usec = busy_poll;
+
+    // Raising it over net.core.busy_read takes CAP_NET_ADMIN
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == -1
+        && !warned) {
+        warned = 1;
+        LOGE("SO_BUSY_POLL: %s, only the event loop busy-polls", strerror(errno));
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &opt, sizeof(opt));
+#endif
+#endif
+}
+
+int
+busy_poll_init(struct ev_loop *loop)
+{
+    if (busy_poll <= 0) {
+        busy_poll = 0;
+        return -1;
+    }
+
+    budget      = busy_poll / 1e6;
+    last_active = ev_now(loop);
+    spun        = 0;
+
+    ev_idle_init(&spin_watcher, spin_cb);
+    ev_set_priority(&spin_watcher, EV_MINPRI);
+    ev_prepare_init(&prepare_watcher, prepare_cb);
+    ev_prepare_start(loop, &prepare_watcher);
+
+    return 0;
+}
+
+void
+busy_poll_free(struct ev_loop *loop)
+{
+    if (!ev_is_active(&prepare_watcher)) {
+        return;
+    }
+
+    ev_prepare_stop(loop, &prepare_watcher);
+    if (ev_is_active(&spin_watcher)) {
+        ev_idle_stop(loop, &spin_watcher);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * busypoll.h - Define the busy-poll low-latency mode
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BUSYPOLL_H
+#define _BUSYPOLL_H
+
+#ifdef HAVE_LIBEV_EV_H
+#include <libev/ev.h>
+#else
+#include <ev.h>
+#endif
+
+/*
+ * With busy_poll set to a number of microseconds, listener and relay
+ * sockets get SO_BUSY_POLL (and SO_PREFER_BUSY_POLL where known), so the
+ * kernel polls the device queue instead of waiting for an interrupt, and
+ * the event loop keeps polling without blocking for that long after the
+ * last iteration that had something to do. Only then does it go back to
+ * sleeping in the backend.
+ *
+ * This trades a CPU spinning during the budget for the wakeup latency of
+ * the loop; it only pays off with cores to spare.
+ */
+
+extern int busy_poll;
+
+int busy_poll_init(struct ev_loop *loop);
+void busy_poll_free(struct ev_loop *loop);
+
+void busy_poll_socket(int fd);
+
+#define BUSY_POLL(fd)                           \
+    do {                                        \
+        if (busy_poll)                          \
+            busy_poll_socket(fd);               \
+    } while (0)
+
+#endif // _BUSYPOLL_H
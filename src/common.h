@@ -43,6 +43,25 @@ int init_udprelay(const char *server_host, const char *server_port,
 
 void free_udprelay(void);
 
+#ifdef MODULE_REMOTE
+int init_udprelay_fd(int serverfd, const char *server_port,
+                     int mtu, crypto_t *crypto, int timeout, const char *iface);
+
+extern int udp_batch;
+#endif
+
+#define UOT_HOST "ss.udp-over-tcp.arpa" // request header of a stream of datagrams
+
+#ifdef MODULE_REMOTE
+int uot_accept(struct ev_loop *loop, int fd, cipher_ctx_t *e_ctx, cipher_ctx_t *d_ctx,
+               const char *data, size_t len);
+#elif defined(MODULE_LOCAL) && !defined(MODULE_TUNNEL) && !defined(MODULE_REDIR)
+extern int udp_over_tcp;
+#endif
+#ifdef MODULE_LOCAL
+extern int mtu_discovery;
+#endif
+
 #ifdef __ANDROID__
 int protect_socket(int fd);
 int send_traffic_stat(uint64_t tx, uint64_t rx);
@@ -71,6 +90,23 @@ enum {
     GETOPT_VAL_MANAGER_ADDRESS,
     GETOPT_VAL_EXECUTABLE,
     GETOPT_VAL_WORKDIR,
+    GETOPT_VAL_LOOP_STAT,
+    GETOPT_VAL_CONTROL_ADDRESS,
+    GETOPT_VAL_TRACE_SAMPLE,
+    GETOPT_VAL_TRACE_THRESHOLD,
+    GETOPT_VAL_DEST_STATS,
+    GETOPT_VAL_FLOW_LOG,
+    GETOPT_VAL_EDGE_TRIGGERED,
+    GETOPT_VAL_PRIORITY_CLASSES,
+    GETOPT_VAL_UDP_BATCH,
+    GETOPT_VAL_BUSY_POLL,
+    GETOPT_VAL_UDP_OVER_TCP,
+    GETOPT_VAL_HUGE_PAGES,
+    GETOPT_VAL_DNS_CACHE,
+    GETOPT_VAL_KEY_POOL,
+    GETOPT_VAL_LISTEN_FD,
+    GETOPT_VAL_RANK_ADDRESSES,
+    GETOPT_VAL_MTU_DISCOVERY,
 };
 
 #endif // _COMMON_H
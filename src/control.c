@@ -0,0 +1,364 @@
+/*
+ * control.c - Local control socket for runtime introspection
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef __MINGW32__
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "netutils.h"
+#include "jconf.h"
+#include "utils.h"
+#include "winsock.h"
+#include "control.h"
+
+#define CONTROL_RETRY_INTERVAL 0.01
+#define CONTROL_REPLY_TIMEOUT  5
+
+struct control_reply {
+    ev_timer watcher;
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char *buf;
+    size_t len;
+    size_t capacity;
+    size_t idx;
+    ev_tstamp deadline;
+};
+
+typedef struct control_cmd {
+    const char *action;
+    control_cmd_cb cb;
+} control_cmd_t;
+
+static ev_io control_watcher;
+static char *control_path;
+static int control_cmd_num;
+static control_cmd_t control_cmds[MAX_CONTROL_CMD_NUM];
+static control_reply_t *pending_reply;
+
+int
+control_register(const char *action, control_cmd_cb cb)
+{
+    int i;
+    for (i = 0; i < control_cmd_num; i++)
+        if (strcmp(control_cmds[i].action, action) == 0) {
+            control_cmds[i].cb = cb;
+            return 0;
+        }
+
+    if (control_cmd_num >= MAX_CONTROL_CMD_NUM) {
+        LOGE("too many control commands");
+        return -1;
+    }
+
+    control_cmds[control_cmd_num].action = action;
+    control_cmds[control_cmd_num].cb     = cb;
+    control_cmd_num++;
+
+    return 0;
+}
+
+void
+control_reply(control_reply_t *reply, const char *fmt, ...)
+{
+    char line[1024];
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    if (len < 0) {
+        return;
+    }
+    if (len >= sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+
+    if (reply->len + len > reply->capacity) {
+        reply->capacity = reply->capacity * 2 + len;
+        reply->buf      = ss_realloc(reply->buf, reply->capacity);
+    }
+    memcpy(reply->buf + reply->len, line, len);
+    reply->len += len;
+}
+
+static void
+free_reply(EV_P_ control_reply_t *reply)
+{
+    ev_timer_stop(EV_A_ & reply->watcher);
+    if (pending_reply == reply) {
+        pending_reply = NULL;
+    }
+    ss_free(reply->buf);
+    ss_free(reply);
+}
+
+/*
+ * Send as much of the reply as the peer accepts. Every datagram but the
+ * last is exactly CONTROL_BUF_SIZE long, so the last one may be empty.
+ * Returns 0 if the peer's queue is full and the rest has to wait.
+ */
+static int
+send_reply(control_reply_t *reply)
+{
+    while (1) {
+        size_t n = reply->len - reply->idx;
+        if (n > CONTROL_BUF_SIZE) {
+            n = CONTROL_BUF_SIZE;
+        }
+
+        if (sendto(reply->fd, reply->buf + reply->idx, n, 0,
+                   (struct sockaddr *)&reply->addr, reply->addr_len) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                return 0;
+            }
+            ERROR("control_sendto");
+            return 1;
+        }
+
+        reply->idx += n;
+        if (n < CONTROL_BUF_SIZE) {
+            return 1;
+        }
+    }
+}
+
+static void
+control_retry_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    control_reply_t *reply = (control_reply_t *)watcher;
+
+    if (send_reply(reply)) {
+        free_reply(EV_A_ reply);
+    } else if (ev_now(EV_A) > reply->deadline) {
+        LOGE("control client stopped reading, reply dropped");
+        free_reply(EV_A_ reply);
+    }
+}
+
+static void
+control_recv_cb(EV_P_ ev_io *w, int revents)
+{
+    control_reply_t *reply = ss_malloc(sizeof(control_reply_t));
+    char buf[512];
+
+    memset(reply, 0, sizeof(control_reply_t));
+    reply->fd       = w->fd;
+    reply->addr_len = sizeof(reply->addr);
+
+    ssize_t r = recvfrom(w->fd, buf, sizeof(buf) - 1, 0,
+                         (struct sockaddr *)&reply->addr, &reply->addr_len);
+    if (r == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            ERROR("control_recvfrom");
+        }
+        ss_free(reply);
+        return;
+    }
+    buf[r] = '\0';
+
+    char *action = buf;
+    while (isspace((unsigned char)*action))
+        action++;
+
+    char *data = action;
+    while (*data != '\0' && *data != ':' && !isspace((unsigned char)*data))
+        data++;
+    if (*data != '\0') {
+        *data++ = '\0';
+    }
+    while (*data == ':' || isspace((unsigned char)*data))
+        data++;
+
+    int i;
+    for (i = 0; i < control_cmd_num; i++)
+        if (strcmp(control_cmds[i].action, action) == 0)
+            break;
+
+    if (i < control_cmd_num) {
+        control_cmds[i].cb(data, reply);
+    } else if (strcmp(action, "ping") == 0) {
+        control_reply(reply, "pong");
+    } else {
+        control_reply(reply, "unknown command: %s", action);
+    }
+
+    if (send_reply(reply)) {
+        ss_free(reply->buf);
+        ss_free(reply);
+        return;
+    }
+
+    // Only one slow reader at a time, a newer request wins
+    if (pending_reply != NULL) {
+        free_reply(EV_A_ pending_reply);
+    }
+
+    pending_reply   = reply;
+    reply->deadline = ev_now(EV_A) + CONTROL_REPLY_TIMEOUT;
+    ev_timer_init(&reply->watcher, control_retry_cb,
+                  CONTROL_RETRY_INTERVAL, CONTROL_RETRY_INTERVAL);
+    ev_timer_start(EV_A_ & reply->watcher);
+}
+
+static int
+bind_control_socket(const char *host, const char *port)
+{
+    struct addrinfo hints;
+    struct addrinfo *result, *rp;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+
+    int s = getaddrinfo(host, port, &hints, &result);
+    if (s != 0) {
+        LOGE("getaddrinfo: %s", gai_strerror(s));
+        return -1;
+    }
+
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        if (bind(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+            break;
+        }
+
+        ERROR("bind");
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(result);
+
+    return fd;
+}
+
+int
+control_init(struct ev_loop *loop, const char *address)
+{
+    ss_addr_t ip_addr = { .host = NULL, .port = NULL };
+    int fd            = -1;
+
+    parse_addr(address, &ip_addr);
+
+    if (ip_addr.host == NULL || ip_addr.port == NULL) {
+#ifndef __MINGW32__
+        struct sockaddr_un svaddr;
+
+        fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (fd == -1) {
+            ERROR("socket");
+            goto CLEANUP;
+        }
+
+        if (remove(address) == -1 && errno != ENOENT) {
+            ERROR("remove");
+            close(fd);
+            fd = -1;
+            goto CLEANUP;
+        }
+
+        memset(&svaddr, 0, sizeof(struct sockaddr_un));
+        svaddr.sun_family = AF_UNIX;
+        strncpy(svaddr.sun_path, address, sizeof(svaddr.sun_path) - 1);
+
+        if (bind(fd, (struct sockaddr *)&svaddr, sizeof(struct sockaddr_un)) == -1) {
+            ERROR("bind");
+            close(fd);
+            fd = -1;
+            goto CLEANUP;
+        }
+
+        control_path = strdup(address);
+#else
+        LOGE("control socket requires host:port on this platform");
+        goto CLEANUP;
+#endif
+    } else {
+        fd = bind_control_socket(ip_addr.host, ip_addr.port);
+    }
+
+CLEANUP:
+    free_addr(&ip_addr);
+
+    if (fd == -1) {
+        LOGE("failed to open the control socket at %s", address);
+        return -1;
+    }
+
+#ifdef __MINGW32__
+    setnonblocking(fd);
+#else
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+#endif
+    ev_io_init(&control_watcher, control_recv_cb, fd, EV_READ);
+    ev_io_start(loop, &control_watcher);
+
+    LOGI("control socket listening at %s", address);
+
+    return 0;
+}
+
+void
+control_free(struct ev_loop *loop)
+{
+    if (!ev_is_active(&control_watcher)) {
+        return;
+    }
+
+    if (pending_reply != NULL) {
+        free_reply(EV_A_ pending_reply);
+    }
+
+    ev_io_stop(loop, &control_watcher);
+    close(control_watcher.fd);
+
+    if (control_path != NULL) {
+        unlink(control_path);
+        ss_free(control_path);
+    }
+}
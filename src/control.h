@@ -0,0 +1,57 @@
+/*
+ * control.h - Define the local control socket interface
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CONTROL_H
+#define _CONTROL_H
+
+#ifdef HAVE_LIBEV_EV_H
+#include <libev/ev.h>
+#else
+#include <ev.h>
+#endif
+
+#include <stddef.h>
+
+#define MAX_CONTROL_CMD_NUM 8
+#define CONTROL_BUF_SIZE    8192
+
+typedef struct control_reply control_reply_t;
+
+/*
+ * Command handlers receive the text after "<action>:" (may be empty) and
+ * answer with any number of control_reply() calls.
+ */
+typedef void (*control_cmd_cb)(const char *data, control_reply_t *reply);
+
+int control_init(struct ev_loop *loop, const char *address);
+void control_free(struct ev_loop *loop);
+
+int control_register(const char *action, control_cmd_cb cb);
+
+/*
+ * Replies are buffered and sent in datagrams of CONTROL_BUF_SIZE bytes
+ * once the handler returns, retrying while the client's queue is full.
+ * A client reads until it gets a datagram shorter than CONTROL_BUF_SIZE.
+ */
+void control_reply(control_reply_t *reply, const char *fmt, ...);
+
+#endif // _CONTROL_H
@@ -36,9 +36,12 @@
 #include <mbedtls/version.h>
 #include <mbedtls/md5.h>
 
+#include "arena.h"
 #include "base64.h"
 #include "crypto.h"
+#ifndef FIXED_CIPHER
 #include "stream.h"
+#endif
 #include "aead.h"
 #include "utils.h"
 #include "ppbloom.h"
@@ -47,7 +50,13 @@ int
 balloc(buffer_t *ptr, size_t capacity)
 {
     sodium_memzero(ptr, sizeof(buffer_t));
-    ptr->data     = ss_malloc(capacity);
+    if (huge_pages && capacity > ARENA_BUF_SIZE / 2 && capacity <= ARENA_BUF_SIZE) {
+        // A relay buffer, from the huge page arena
+        capacity = ARENA_BUF_SIZE;
+        ptr->data = arena_get(&arena_buffers);
+    } else {
+        ptr->data = ss_malloc(capacity);
+    }
     ptr->capacity = capacity;
     return capacity;
 }
@@ -59,7 +68,15 @@ brealloc(buffer_t *ptr, size_t len, size_t capacity)
         return -1;
     size_t real_capacity = max(len, capacity);
     if (ptr->capacity < real_capacity) {
-        ptr->data     = ss_realloc(ptr->data, real_capacity);
+        if (arena_owns(ptr->data)) {
+            // Grown out of the arena
+            char *data = ss_malloc(real_capacity);
+            memcpy(data, ptr->data, ptr->capacity);
+            arena_put(&arena_buffers, ptr->data);
+            ptr->data = data;
+        } else {
+            ptr->data = ss_realloc(ptr->data, real_capacity);
+        }
         ptr->capacity = real_capacity;
     }
     return real_capacity;
@@ -74,7 +91,8 @@ bfree(buffer_t *ptr)
     ptr->len      = 0;
     ptr->capacity = 0;
     if (ptr->data != NULL) {
-        ss_free(ptr->data);
+        arena_put(&arena_buffers, ptr->data);
+        ptr->data = NULL;
     }
 }
 
@@ -88,6 +106,25 @@ bprepend(buffer_t *dst, buffer_t *src, size_t capacity)
     return dst->len;
 }
 
+/*
+ * Heap bytes held by a cipher context. The state mbed TLS allocates
+ * behind evp->cipher_ctx is opaque and not counted.
+ */
+size_t
+crypto_ctx_mem(const cipher_ctx_t *ctx)
+{
+    size_t size = sizeof(cipher_ctx_t);
+
+    if (ctx->evp != NULL)
+        size += sizeof(cipher_evp_t);
+    if (ctx->aes256gcm_ctx != NULL)
+        size += sizeof(aes256gcm_ctx);
+    if (ctx->chunk != NULL)
+        size += sizeof(buffer_t) + ctx->chunk->capacity;
+
+    return size;
+}
+
 int
 rand_bytes(void *output, int len)
 {
@@ -150,6 +187,14 @@ crypto_init(const char *password, const char *key, const char *method)
 #endif
 
     if (method != NULL) {
+#ifdef FIXED_CIPHER
+        // Built for one method, the stream ciphers are left out
+        if (strcmp(method, FIXED_CIPHER_NAME) != 0) {
+            LOGE("invalid cipher name: %s, this build supports %s only",
+                 method, FIXED_CIPHER_NAME);
+            return NULL;
+        }
+#else
         for (i = 0; i < STREAM_CIPHER_NUM; i++)
             if (strcmp(method, supported_stream_ciphers[i]) == 0) {
                 m = i;
@@ -173,6 +218,7 @@ crypto_init(const char *password, const char *key, const char *method)
             memcpy(crypto, &tmp, sizeof(crypto_t));
             return crypto;
         }
+#endif
 
         for (i = 0; i < AEAD_CIPHER_NUM; i++)
             if (strcmp(method, supported_aead_ciphers[i]) == 0) {
@@ -202,6 +248,28 @@ crypto_init(const char *password, const char *key, const char *method)
     return NULL;
 }
 
+/*
+ * Only for a crypto_t nothing uses anymore, the replay filter stays.
+ */
+void
+crypto_free(crypto_t *crypto)
+{
+    if (crypto == NULL) {
+        return;
+    }
+
+    cipher_t *cipher = crypto->cipher;
+    if (cipher != NULL) {
+        // Made up by the key init of the libsodium ciphers, not mbed TLS's
+        if (cipher->info != NULL && cipher->info->base == NULL) {
+            ss_free(cipher->info);
+        }
+        sodium_memzero(cipher, sizeof(cipher_t));
+        ss_free(cipher);
+    }
+    ss_free(crypto);
+}
+
 int
 crypto_derive_key(const char *pass, uint8_t *key, size_t key_len)
 {
@@ -68,6 +68,12 @@ typedef mbedtls_md_info_t digest_type_t;
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 #define max(a, b) (((a) > (b)) ? (a) : (b))
 
+#ifdef FIXED_CIPHER_NAME
+#define DEFAULT_METHOD FIXED_CIPHER_NAME
+#else
+#define DEFAULT_METHOD "chacha20-ietf-poly1305"
+#endif
+
 #define SUBKEY_INFO "ss-subkey"
 #define IV_INFO "ss-iv"
 
@@ -106,6 +112,7 @@ typedef struct {
 
 typedef struct {
     uint32_t init;
+    uint32_t keyed;                 // subkey set up ahead, from the AEAD key pool
     uint64_t counter;
     cipher_evp_t *evp;
     aes256gcm_ctx *aes256gcm_ctx;
@@ -132,9 +139,11 @@ int balloc(buffer_t *, size_t);
 int brealloc(buffer_t *, size_t, size_t);
 int bprepend(buffer_t *, buffer_t *, size_t);
 void bfree(buffer_t *);
+size_t crypto_ctx_mem(const cipher_ctx_t *);
 int rand_bytes(void *, int);
 
 crypto_t *crypto_init(const char *, const char *, const char *);
+void crypto_free(crypto_t *);
 unsigned char *crypto_md5(const unsigned char *, size_t, unsigned char *);
 
 int crypto_derive_key(const char *, uint8_t *, size_t);
@@ -0,0 +1,420 @@
+/*
+ * dnscache.c - Shared DNS answer cache
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef __MINGW32__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "utils.h"
+#include "control.h"
+#include "dnscache.h"
+
+#define DNSCACHE_MAGIC   0x53534443     // "SSDC"
+#define DNSCACHE_VERSION 2
+
+typedef struct dnscache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t buckets;
+    uint32_t bucket_size;
+} dnscache_header_t;
+
+/*
+ * The sequence number is in the low half of seq, odd while a writer holds
+ * the bucket. The high half has the time the writer took it, so a bucket
+ * left odd by a writer killed halfway can be taken over later.
+ */
+#define SEQ_TAKEN(seq) ((uint32_t)((seq) >> 32))
+#define SEQ_LOCK(seq, now) (((uint64_t)(uint32_t)(now) << 32) \
+                            | (((uint32_t)(seq) + 1) | 1))
+#define SEQ_UNLOCK(seq) ((uint64_t)(uint32_t)((seq) + 1))
+
+typedef struct dnscache_bucket {
+    uint64_t seq;
+    uint32_t hash;
+    int64_t expires;                // wall clock seconds, 0 when empty
+    uint8_t name_len;
+    uint8_t v4_num;
+    uint8_t v6_num;
+    char name[DNSCACHE_NAME_LEN];
+    struct in_addr v4[DNSCACHE_ADDRS];
+    struct in6_addr v6[DNSCACHE_ADDRS];
+} dnscache_bucket_t;
+
+#define DNSCACHE_SIZE (sizeof(dnscache_header_t) \
+                       + DNSCACHE_BUCKETS * sizeof(dnscache_bucket_t))
+
+static dnscache_header_t *header;
+static dnscache_bucket_t *buckets;
+
+// Of this process only
+static uint64_t hits;
+static uint64_t misses;
+static uint64_t stores;
+static uint64_t busy;
+static uint64_t reclaims;
+
+static uint32_t
+dnscache_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+
+    return h;
+}
+
+/*
+ * Lower case copy of the name, 0 if it does not fit
+ */
+static size_t
+dnscache_name(char *dst, const char *name)
+{
+    size_t len = strlen(name);
+
+    if (len == 0 || len > DNSCACHE_NAME_LEN) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < len; i++)
+        dst[i] = tolower((unsigned char)name[i]);
+
+    return len;
+}
+
+static dnscache_bucket_t *
+dnscache_set(uint32_t hash)
+{
+    return buckets + (hash & (DNSCACHE_BUCKETS - 1) & ~(DNSCACHE_WAYS - 1));
+}
+
+#ifndef __MINGW32__
+static int
+dnscache_map(int fd, int create)
+{
+    void *map;
+
+    if (create && ftruncate(fd, DNSCACHE_SIZE) == -1) {
+        ERROR("dnscache_ftruncate");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)DNSCACHE_SIZE) {
+        return -1;
+    }
+
+    map = mmap(NULL, DNSCACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        ERROR("dnscache_mmap");
+        return -1;
+    }
+
+    header  = map;
+    buckets = (dnscache_bucket_t *)(header + 1);
+
+    if (create) {
+        // The file is zeroed, empty buckets have expired long ago
+        header->buckets     = DNSCACHE_BUCKETS;
+        header->bucket_size = sizeof(dnscache_bucket_t);
+        header->version     = DNSCACHE_VERSION;
+        header->magic       = DNSCACHE_MAGIC;
+    } else if (header->magic != DNSCACHE_MAGIC
+               || header->version != DNSCACHE_VERSION
+               || header->buckets != DNSCACHE_BUCKETS
+               || header->bucket_size != sizeof(dnscache_bucket_t)) {
+        munmap(map, DNSCACHE_SIZE);
+        header  = NULL;
+        buckets = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Built under a temporary name and linked into place, so nobody maps a
+ * half initialized file. Whoever loses the race attaches to the winner's.
+ */
+static int
+dnscache_create(const char *path)
+{
+    size_t tmp_len = strlen(path) + 24;
+    char *tmp      = ss_malloc(tmp_len);
+    int fd, err;
+
+    snprintf(tmp, tmp_len, "%s.%d", path, (int)getpid());
+
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        ERROR("dnscache_open");
+        ss_free(tmp);
+        return -1;
+    }
+
+    err = dnscache_map(fd, 1);
+    close(fd);
+
+    if (err == 0 && link(tmp, path) == -1) {
+        err = errno == EEXIST ? 1 : -1;
+        munmap(header, DNSCACHE_SIZE);
+        header  = NULL;
+        buckets = NULL;
+    }
+
+    unlink(tmp);
+    ss_free(tmp);
+
+    return err;
+}
+
+static int
+dnscache_attach(const char *path)
+{
+    int fd = open(path, O_RDWR);
+    int err;
+
+    if (fd == -1) {
+        return errno == ENOENT ? 1 : -1;
+    }
+
+    err = dnscache_map(fd, 0);
+    close(fd);
+
+    if (err == -1) {
+        LOGE("%s is not a DNS cache of this version", path);
+    }
+
+    return err;
+}
+#endif
+
+int
+dnscache_init(const char *path, int fresh)
+{
+#ifdef __MINGW32__
+    LOGE("the shared DNS cache is not supported on this platform");
+    return -1;
+#else
+    int err = 1;
+
+    if (fresh && unlink(path) == -1 && errno != ENOENT) {
+        ERROR("dnscache_unlink");
+        return -1;
+    }
+
+    // Either may find the other got there first
+    for (int i = 0; i < 2 && err == 1; i++) {
+        err = dnscache_attach(path);
+        if (err == 1) {
+            err = dnscache_create(path);
+        }
+    }
+
+    if (err != 0) {
+        LOGE("failed to open the DNS cache %s", path);
+        return -1;
+    }
+
+    return 0;
+#endif
+}
+
+void
+dnscache_free(void)
+{
+#ifndef __MINGW32__
+    if (header != NULL) {
+        munmap(header, DNSCACHE_SIZE);
+    }
+#endif
+    header  = NULL;
+    buckets = NULL;
+}
+
+/*
+ * A consistent copy of the bucket, or 0 when a writer got in the way
+ */
+static int
+bucket_read(dnscache_bucket_t *bucket, dnscache_bucket_t *copy)
+{
+    uint64_t seq = __atomic_load_n(&bucket->seq, __ATOMIC_ACQUIRE);
+
+    if (seq & 1) {
+        return 0;
+    }
+
+    memcpy(copy, bucket, sizeof(dnscache_bucket_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&bucket->seq, __ATOMIC_RELAXED) == seq;
+}
+
+int
+dnscache_lookup(const char *name, dnscache_answer_t *answer)
+{
+    char key[DNSCACHE_NAME_LEN];
+    dnscache_bucket_t copy;
+    size_t len;
+
+    if (buckets == NULL || (len = dnscache_name(key, name)) == 0) {
+        return 0;
+    }
+
+    uint32_t hash             = dnscache_hash(key, len);
+    dnscache_bucket_t *bucket = dnscache_set(hash);
+    int64_t now               = time(NULL);
+
+    for (int i = 0; i < DNSCACHE_WAYS; i++, bucket++) {
+        if (__atomic_load_n(&bucket->hash, __ATOMIC_RELAXED) != hash
+            || !bucket_read(bucket, &copy)) {
+            continue;
+        }
+        if (copy.hash != hash || copy.name_len != len || copy.expires <= now
+            || memcmp(copy.name, key, len) != 0) {
+            continue;
+        }
+
+        answer->v4_num = copy.v4_num;
+        answer->v6_num = copy.v6_num;
+        memcpy(answer->v4, copy.v4, sizeof(answer->v4));
+        memcpy(answer->v6, copy.v6, sizeof(answer->v6));
+        hits++;
+        return 1;
+    }
+
+    misses++;
+    return 0;
+}
+
+/*
+ * The bucket holding the name, else an expired one, else the one
+ * expiring first. Only a hint, the bucket may change before it is taken.
+ */
+static dnscache_bucket_t *
+bucket_victim(dnscache_bucket_t *set, uint32_t hash, int64_t now)
+{
+    dnscache_bucket_t *victim = NULL;
+    int64_t oldest            = 0;
+
+    for (int i = 0; i < DNSCACHE_WAYS; i++) {
+        dnscache_bucket_t *bucket = set + i;
+        int64_t expires           = __atomic_load_n(&bucket->expires, __ATOMIC_RELAXED);
+
+        if (__atomic_load_n(&bucket->hash, __ATOMIC_RELAXED) == hash) {
+            return bucket;
+        }
+        if (expires <= now) {
+            expires = 0;
+        }
+        if (victim == NULL || expires < oldest) {
+            victim = bucket;
+            oldest = expires;
+        }
+    }
+
+    return victim;
+}
+
+void
+dnscache_store(const char *name, const dnscache_answer_t *answer)
+{
+    char key[DNSCACHE_NAME_LEN];
+    size_t len;
+
+    if (buckets == NULL || (len = dnscache_name(key, name)) == 0) {
+        return;
+    }
+
+    uint32_t hash             = dnscache_hash(key, len);
+    int64_t now               = time(NULL);
+    dnscache_bucket_t *bucket = bucket_victim(dnscache_set(hash), hash, now);
+    uint64_t seq              = __atomic_load_n(&bucket->seq, __ATOMIC_RELAXED);
+    int reclaim               = 0;
+
+    // Another process is writing it, its answer is as good as ours. Unless
+    // it has been at it for longer than the answers live, then it is gone.
+    if (seq & 1) {
+        if ((uint32_t)now - SEQ_TAKEN(seq) <= DNSCACHE_TTL) {
+            busy++;
+            return;
+        }
+        reclaim = 1;
+    }
+
+    uint64_t locked = SEQ_LOCK(seq, now);
+    if (!__atomic_compare_exchange_n(&bucket->seq, &seq, locked, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        busy++;
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    reclaims += reclaim;
+
+    int v4_num = answer->v4_num < DNSCACHE_ADDRS ? answer->v4_num : DNSCACHE_ADDRS;
+    int v6_num = answer->v6_num < DNSCACHE_ADDRS ? answer->v6_num : DNSCACHE_ADDRS;
+
+    __atomic_store_n(&bucket->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&bucket->expires, now + DNSCACHE_TTL, __ATOMIC_RELAXED);
+    bucket->name_len = len;
+    bucket->v4_num   = v4_num;
+    bucket->v6_num   = v6_num;
+    memcpy(bucket->name, key, len);
+    memcpy(bucket->v4, answer->v4, v4_num * sizeof(struct in_addr));
+    memcpy(bucket->v6, answer->v6, v6_num * sizeof(struct in6_addr));
+
+    __atomic_store_n(&bucket->seq, SEQ_UNLOCK(locked), __ATOMIC_RELEASE);
+    stores++;
+}
+
+void
+dnscache_stats(const char *data, control_reply_t *reply)
+{
+    int64_t now = time(NULL);
+    int used    = 0;
+
+    for (int i = 0; buckets != NULL && i < DNSCACHE_BUCKETS; i++)
+        if (__atomic_load_n(&buckets[i].expires, __ATOMIC_RELAXED) > now)
+            used++;
+
+    control_reply(reply, "{\"buckets\":%d,\"used\":%d,\"hits\":%" PRIu64
+                  ",\"misses\":%" PRIu64 ",\"stores\":%" PRIu64
+                  ",\"busy\":%" PRIu64 ",\"reclaims\":%" PRIu64 "}\n",
+                  buckets != NULL ? DNSCACHE_BUCKETS : 0, used,
+                  hits, misses, stores, busy, reclaims);
+}
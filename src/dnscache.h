@@ -0,0 +1,72 @@
+/*
+ * dnscache.h - Define the shared DNS answer cache
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DNSCACHE_H
+#define _DNSCACHE_H
+
+#include <stdint.h>
+
+#ifndef __MINGW32__
+#include <netinet/in.h>
+#endif
+
+/*
+ * Answers of the resolver kept in a file mapped by every ss-server that
+ * ss-manager starts, so a name looked up on one port is known to all of
+ * them. Buckets are guarded by a sequence number each, odd while a writer
+ * holds it: readers never wait, they retry through the resolver instead,
+ * and a writer finding the bucket taken just skips the store. A bucket
+ * held for longer than DNSCACHE_TTL was left by a writer that died, the
+ * next writer takes it over.
+ */
+
+#define DNSCACHE_BUCKETS  16384     // a power of two
+#define DNSCACHE_WAYS     4         // buckets a name may go to
+#define DNSCACHE_NAME_LEN 128       // longer names are not cached
+#define DNSCACHE_ADDRS    4         // addresses kept per family
+#define DNSCACHE_TTL      60        // seconds
+
+struct control_reply;
+
+typedef struct dnscache_answer {
+    int v4_num;
+    int v6_num;
+    struct in_addr v4[DNSCACHE_ADDRS];
+    struct in6_addr v6[DNSCACHE_ADDRS];
+} dnscache_answer_t;
+
+/*
+ * Map the cache at path, creating it if it does not exist yet. With
+ * fresh set, as ss-manager does at startup, an old file is replaced.
+ */
+int dnscache_init(const char *path, int fresh);
+void dnscache_free(void);
+
+/*
+ * Returns 1 and fills answer for a name cached and not expired
+ */
+int dnscache_lookup(const char *name, dnscache_answer_t *answer);
+void dnscache_store(const char *name, const dnscache_answer_t *answer);
+
+void dnscache_stats(const char *data, struct control_reply *reply);
+
+#endif // _DNSCACHE_H
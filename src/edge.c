@@ -0,0 +1,361 @@
+/*
+ * edge.c - Edge-triggered readiness for relayed sockets
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "utils.h"
+#include "edge.h"
+
+int edge_triggered = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define EDGE_EVENTS 256
+#define EDGE_MASK   (EV_READ | EV_WRITE)
+
+typedef struct edge_fd {
+    ev_io *watchers[2];             // read and write, NULL when not added
+    int ready;                      // directions seen ready since the last EAGAIN
+    int active;                     // directions whose watcher is started
+    int listed;                     // in the ready list
+} edge_fd_t;
+
+static int epoll_fd = -1;
+static struct ev_loop *edge_loop;
+static ev_io epoll_watcher;
+static ev_check feed_watcher;
+static ev_idle spin_watcher;
+
+// Indexed by fd, like the fd table of libev
+static edge_fd_t *fds;
+static int fds_num;
+
+// Fds that were ready in a started direction at some point, checked again
+// before feeding
+static int *ready_list;
+static int ready_num;
+static int ready_capacity;
+
+static inline edge_fd_t *
+edge_get(int fd)
+{
+    if (fd < 0 || fd >= fds_num || fds[fd].watchers[0] == NULL) {
+        return NULL;
+    }
+
+    return &fds[fd];
+}
+
+static void
+edge_list(int fd)
+{
+    edge_fd_t *e = &fds[fd];
+
+    if (e->listed) {
+        return;
+    }
+
+    if (ready_num == ready_capacity) {
+        ready_capacity = ready_capacity ? ready_capacity * 2 : 64;
+        ready_list     = ss_realloc(ready_list, ready_capacity * sizeof(int));
+    }
+
+    ready_list[ready_num++] = fd;
+    e->listed               = 1;
+
+    // Keep the loop from blocking while there is work left
+    ev_idle_start(edge_loop, &spin_watcher);
+}
+
+/*
+ * Invoke the started watchers of every ready socket in this iteration,
+ * dropping sockets that went idle since they were listed.
+ */
+static void
+edge_feed(EV_P)
+{
+    int n = 0;
+
+    for (int i = 0; i < ready_num; i++) {
+        int fd       = ready_list[i];
+        edge_fd_t *e = &fds[fd];
+        int revents  = e->ready & e->active;
+
+        if (e->watchers[0] == NULL || revents == 0) {
+            e->listed = 0;
+            continue;
+        }
+
+        ready_list[n++] = fd;
+        if (revents & EV_READ)
+            ev_feed_event(EV_A_ e->watchers[0], EV_READ);
+        if (revents & EV_WRITE)
+            ev_feed_event(EV_A_ e->watchers[1], EV_WRITE);
+    }
+
+    ready_num = n;
+
+    if (ready_num == 0) {
+        ev_idle_stop(EV_A_ & spin_watcher);
+    }
+}
+
+static void
+epoll_cb(EV_P_ ev_io *w, int revents)
+{
+    struct epoll_event events[EDGE_EVENTS];
+
+    int n = epoll_wait(epoll_fd, events, EDGE_EVENTS, 0);
+    if (n == -1) {
+        if (errno != EINTR)
+            ERROR("epoll_wait");
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        edge_fd_t *e = edge_get(events[i].data.fd);
+        uint32_t ev  = events[i].events;
+
+        if (e == NULL) {
+            continue;
+        }
+
+        // Errors and hangups are reported to both sides, as libev does
+        if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            e->ready |= EV_READ;
+        if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            e->ready |= EV_WRITE;
+
+        if (e->ready & e->active) {
+            edge_list(events[i].data.fd);
+        }
+    }
+
+    edge_feed(EV_A);
+}
+
+static void
+feed_cb(EV_P_ ev_check *w, int revents)
+{
+    if (ready_num > 0) {
+        edge_feed(EV_A);
+    }
+}
+
+static void
+spin_cb(EV_P_ ev_idle *w, int revents)
+{
+}
+
+int
+edge_init(struct ev_loop *loop)
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        ERROR("epoll_create1");
+        return -1;
+    }
+
+    edge_loop = loop;
+
+    ev_io_init(&epoll_watcher, epoll_cb, epoll_fd, EV_READ);
+    ev_io_start(loop, &epoll_watcher);
+    ev_check_init(&feed_watcher, feed_cb);
+    ev_check_start(loop, &feed_watcher);
+    ev_idle_init(&spin_watcher, spin_cb);
+
+    return 0;
+}
+
+void
+edge_free(struct ev_loop *loop)
+{
+    if (epoll_fd == -1) {
+        return;
+    }
+
+    ev_io_stop(loop, &epoll_watcher);
+    ev_check_stop(loop, &feed_watcher);
+    ev_idle_stop(loop, &spin_watcher);
+    close(epoll_fd);
+    epoll_fd = -1;
+
+    ss_free(fds);
+    ss_free(ready_list);
+    fds_num        = 0;
+    ready_num      = 0;
+    ready_capacity = 0;
+}
+
+void
+edge_add(int fd, ev_io *read_watcher, ev_io *write_watcher)
+{
+    struct epoll_event ev;
+
+    if (epoll_fd == -1) {
+        return;
+    }
+
+    if (fd >= fds_num) {
+        int num = fds_num ? fds_num : 1024;
+        while (num <= fd)
+            num *= 2;
+        fds = ss_realloc(fds, num * sizeof(edge_fd_t));
+        memset(fds + fds_num, 0, (num - fds_num) * sizeof(edge_fd_t));
+        fds_num = num;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events  = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        // Left to libev
+        ERROR("epoll_ctl");
+        return;
+    }
+
+    // A reused fd may still be in the ready list, edge_feed drops it
+    fds[fd].watchers[0] = read_watcher;
+    fds[fd].watchers[1] = write_watcher;
+    fds[fd].ready       = 0;
+    fds[fd].active      = 0;
+}
+
+/*
+ * Also for a socket that lives on under plain libev watchers. Must come
+ * before close(2): the fd can't be named afterwards, and the registration
+ * stays for as long as another process holds a copy of the socket.
+ */
+void
+edge_del(int fd)
+{
+    edge_fd_t *e = edge_get(fd);
+
+    if (e == NULL) {
+        return;
+    }
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        ERROR("epoll_ctl");
+    }
+
+    e->watchers[0] = NULL;
+    e->watchers[1] = NULL;
+    e->ready       = 0;
+    e->active      = 0;
+}
+
+void
+edge_io_start(EV_P_ ev_io *w)
+{
+    edge_fd_t *e = edge_get(w->fd);
+
+    if (e == NULL) {
+        ev_io_start(EV_A_ w);
+        return;
+    }
+
+    e->active |= w->events & EDGE_MASK;
+    if (e->ready & e->active) {
+        edge_list(w->fd);
+    }
+}
+
+void
+edge_io_stop(EV_P_ ev_io *w)
+{
+    edge_fd_t *e = edge_get(w->fd);
+
+    if (e == NULL) {
+        ev_io_stop(EV_A_ w);
+        return;
+    }
+
+    e->active &= ~(w->events & EDGE_MASK);
+    // A fed event must not reach a watcher that is stopped, or freed
+    ev_clear_pending(EV_A_ w);
+}
+
+void
+edge_io_again(ev_io *w)
+{
+    edge_fd_t *e = edge_get(w->fd);
+
+    if (e != NULL) {
+        e->ready &= ~(w->events & EDGE_MASK);
+    }
+}
+
+#else
+
+int
+edge_init(struct ev_loop *loop)
+{
+    LOGE("edge-triggered mode needs epoll, using libev readiness");
+    return -1;
+}
+
+void
+edge_free(struct ev_loop *loop)
+{
+}
+
+void
+edge_add(int fd, ev_io *read_watcher, ev_io *write_watcher)
+{
+}
+
+void
+edge_del(int fd)
+{
+}
+
+void
+edge_io_start(EV_P_ ev_io *w)
+{
+    ev_io_start(EV_A_ w);
+}
+
+void
+edge_io_stop(EV_P_ ev_io *w)
+{
+    ev_io_stop(EV_A_ w);
+}
+
+void
+edge_io_again(ev_io *w)
+{
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * edge.h - Define the edge-triggered readiness interface for relayed sockets
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _EDGE_H
+#define _EDGE_H
+
+#ifdef HAVE_LIBEV_EV_H
+#include <libev/ev.h>
+#else
+#include <ev.h>
+#endif
+
+/*
+ * With epoll, relayed sockets are registered edge-triggered for reading
+ * and writing once, in an epoll set of our own that libev watches as a
+ * single fd. Starting and stopping their watchers then only flips bits
+ * in user space instead of costing an epoll_ctl(2) each time a send
+ * blocks or drains.
+ *
+ * A socket stays ready in a direction until an operation on it returns
+ * EAGAIN or a short write, which has to be reported with edge_io_again().
+ * The watcher of a ready direction keeps being invoked every loop
+ * iteration while started, just like a level-triggered libev watcher.
+ *
+ * Sockets not added, and every socket without epoll or before
+ * edge_init(), go through plain ev_io_start() and ev_io_stop().
+ */
+
+extern int edge_triggered;
+
+int edge_init(struct ev_loop *loop);
+void edge_free(struct ev_loop *loop);
+
+void edge_add(int fd, ev_io *read_watcher, ev_io *write_watcher);
+void edge_del(int fd);
+
+void edge_io_start(EV_P_ ev_io *w);
+void edge_io_stop(EV_P_ ev_io *w);
+void edge_io_again(ev_io *w);
+
+#endif // _EDGE_H
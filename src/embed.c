@@ -0,0 +1,498 @@
+/*
+ * embed.c - Streams for applications linking the library
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef __MINGW32__
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+#include <libcork/ds.h>
+
+#ifdef HAVE_LIBEV_EV_H
+#include <libev/ev.h>
+#else
+#include <ev.h>
+#endif
+
+#ifdef __MINGW32__
+#include "winsock.h"
+#endif
+
+#include "netutils.h"
+#include "utils.h"
+#include "crypto.h"
+#include "jconf.h"
+#include "common.h"
+#include "shadowsocks.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef EPROTO
+#define EPROTO EINVAL
+#endif
+
+/*
+ * Everything ss-local keeps in globals, one set per context: any number
+ * of contexts live side by side, on one loop or on a loop per thread.
+ * Only the replay filter of the salts is shared by the whole process,
+ * ppbloom.c locks it in the library.
+ */
+struct ss_ctx {
+    struct ev_loop *loop;
+    crypto_t *crypto;
+    struct sockaddr_storage addr;
+    int timeout;
+    int mptcp;
+    struct cork_dllist streams;
+};
+
+struct ss_stream {
+    ss_ctx_t *ctx;
+    int fd;
+    int connected;
+    int in_cb;                  // inside a callback, freed once it returns
+    int closed;
+    ev_io recv_io;
+    ev_io send_io;
+    ev_timer watcher;
+    cipher_ctx_t e_ctx;
+    cipher_ctx_t d_ctx;
+    buffer_t buf;               // from the server, decrypted in place
+    buffer_t pending;           // encrypted, idx is what went out already
+    buffer_t out;               // scratch for the encryption
+    ss_stream_cb_t cb;
+    void *data;
+    struct cork_dllist_item entries;
+};
+
+#ifndef __MINGW32__
+static int
+setnonblocking(int fd)
+{
+    int flags;
+    if (-1 == (flags = fcntl(fd, F_GETFL, 0))) {
+        flags = 0;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+#endif
+
+ss_ctx_t *
+ss_ctx_new(struct ev_loop *loop, const profile_t *profile)
+{
+    char port[8];
+
+    if (profile->remote_host == NULL || profile->method == NULL
+        || profile->password == NULL) {
+        LOGE("ss_ctx_new: remote_host, method and password are required");
+        return NULL;
+    }
+
+    crypto_t *crypto = crypto_init(profile->password, NULL, profile->method);
+    if (crypto == NULL) {
+        LOGE("ss_ctx_new: failed to init ciphers");
+        return NULL;
+    }
+
+    ss_ctx_t *ctx = ss_malloc(sizeof(ss_ctx_t));
+    memset(ctx, 0, sizeof(ss_ctx_t));
+
+    // Blocking, as documented in shadowsocks.h
+    snprintf(port, sizeof(port), "%d", profile->remote_port);
+    if (get_sockaddr(profile->remote_host, port, &ctx->addr, 1, 0) == -1) {
+        LOGE("ss_ctx_new: failed to resolve %s", profile->remote_host);
+        crypto_free(crypto);
+        ss_free(ctx);
+        return NULL;
+    }
+
+    ctx->loop    = loop != NULL ? loop : EV_DEFAULT;
+    ctx->crypto  = crypto;
+    ctx->timeout = profile->timeout > 0 ? profile->timeout : 60;
+    ctx->mptcp   = profile->mptcp;
+    cork_dllist_init(&ctx->streams);
+
+    return ctx;
+}
+
+static void
+stream_free(ss_stream_t *stream)
+{
+    ss_ctx_t *ctx = stream->ctx;
+
+    ev_io_stop(ctx->loop, &stream->recv_io);
+    ev_io_stop(ctx->loop, &stream->send_io);
+    ev_timer_stop(ctx->loop, &stream->watcher);
+    close(stream->fd);
+
+    ctx->crypto->ctx_release(&stream->e_ctx);
+    ctx->crypto->ctx_release(&stream->d_ctx);
+    bfree(&stream->buf);
+    bfree(&stream->pending);
+    bfree(&stream->out);
+
+    cork_dllist_remove(&stream->entries);
+    ss_free(stream);
+}
+
+void
+ss_ctx_free(ss_ctx_t *ctx)
+{
+    struct cork_dllist_item *curr, *next;
+
+    if (ctx == NULL) {
+        return;
+    }
+
+    cork_dllist_foreach_void(&ctx->streams, curr, next) {
+        stream_free(cork_container_of(curr, ss_stream_t, entries));
+    }
+
+    crypto_free(ctx->crypto);
+    ss_free(ctx);
+}
+
+/*
+ * The stream is gone for good, on_close is the last callback it gets
+ */
+static void
+stream_end(ss_stream_t *stream, int err)
+{
+    stream->in_cb  = 1;
+    stream->closed = 1;
+    if (stream->cb.on_close != NULL) {
+        stream->cb.on_close(stream, err, stream->data);
+    }
+    stream_free(stream);
+}
+
+/*
+ * Returns -1 with errno set on a broken connection
+ */
+static int
+stream_flush(ss_stream_t *stream)
+{
+    struct ev_loop *loop = stream->ctx->loop;
+    buffer_t *pending    = &stream->pending;
+
+    while (pending->idx < pending->len) {
+        ssize_t s = send(stream->fd, pending->data + pending->idx,
+                         pending->len - pending->idx, MSG_NOSIGNAL);
+        if (s == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ev_io_start(loop, &stream->send_io);
+                return 0;
+            }
+            return -1;
+        }
+        pending->idx += s;
+    }
+
+    pending->idx = 0;
+    pending->len = 0;
+    ev_io_stop(loop, &stream->send_io);
+
+    return 0;
+}
+
+static void
+stream_timeout_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    ss_stream_t *stream = cork_container_of(watcher, ss_stream_t, watcher);
+
+    stream_end(stream, ETIMEDOUT);
+}
+
+static void
+stream_send_cb(EV_P_ ev_io *w, int revents)
+{
+    ss_stream_t *stream = cork_container_of(w, ss_stream_t, send_io);
+
+    if (!stream->connected) {
+        int err       = 0;
+        socklen_t len = sizeof(err);
+
+        if (getsockopt(stream->fd, SOL_SOCKET, SO_ERROR, (void *)&err, &len) == -1) {
+            err = errno;
+        }
+        if (err != 0) {
+            stream_end(stream, err);
+            return;
+        }
+
+        stream->connected = 1;
+        ev_io_start(EV_A_ & stream->recv_io);
+        ev_timer_again(EV_A_ & stream->watcher);
+    }
+
+    if (stream_flush(stream) == -1) {
+        stream_end(stream, errno);
+        return;
+    }
+
+    if (stream->pending.len == 0 && stream->cb.on_drain != NULL) {
+        stream->in_cb = 1;
+        stream->cb.on_drain(stream, stream->data);
+        stream->in_cb = 0;
+        if (stream->closed) {
+            stream_free(stream);
+        }
+    }
+}
+
+static void
+stream_recv_cb(EV_P_ ev_io *w, int revents)
+{
+    ss_stream_t *stream = cork_container_of(w, ss_stream_t, recv_io);
+    buffer_t *buf       = &stream->buf;
+
+    ssize_t r = recv(stream->fd, buf->data, SOCKET_BUF_SIZE, 0);
+
+    if (r == 0) {
+        stream_end(stream, 0);
+        return;
+    } else if (r == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        stream_end(stream, errno);
+        return;
+    }
+
+    ev_timer_again(EV_A_ & stream->watcher);
+
+    buf->idx = 0;
+    buf->len = r;
+
+    int err = stream->ctx->crypto->decrypt(buf, &stream->d_ctx, SOCKET_BUF_SIZE);
+    if (err == CRYPTO_ERROR) {
+        LOGE("invalid password or cipher");
+        stream_end(stream, EPROTO);
+        return;
+    } else if (err == CRYPTO_NEED_MORE || buf->len == 0) {
+        return; // Wait for more
+    }
+
+    stream->in_cb = 1;
+    stream->cb.on_read(stream, buf->data, buf->len, stream->data);
+    stream->in_cb = 0;
+    if (stream->closed) {
+        stream_free(stream);
+    }
+}
+
+/*
+ * The target as the first bytes of the stream, in the SOCKS5 format
+ */
+static int
+stream_header(buffer_t *buf, const char *host, int port)
+{
+    struct in_addr v4;
+    struct in6_addr v6;
+    size_t host_len = strlen(host);
+    uint16_t nport  = htons((uint16_t)port);
+
+    buf->len = 0;
+    if (inet_pton(AF_INET, host, &v4) == 1) {
+        buf->data[buf->len++] = 1;
+        memcpy(buf->data + buf->len, &v4, sizeof(v4));
+        buf->len += sizeof(v4);
+    } else if (inet_pton(AF_INET6, host, &v6) == 1) {
+        buf->data[buf->len++] = 4;
+        memcpy(buf->data + buf->len, &v6, sizeof(v6));
+        buf->len += sizeof(v6);
+    } else if (host_len > 0 && host_len <= 255) {
+        buf->data[buf->len++] = 3;
+        buf->data[buf->len++] = host_len;
+        memcpy(buf->data + buf->len, host, host_len);
+        buf->len += host_len;
+    } else {
+        return -1;
+    }
+    memcpy(buf->data + buf->len, &nport, sizeof(nport));
+    buf->len += sizeof(nport);
+
+    return 0;
+}
+
+/*
+ * Encrypt len bytes to the end of the pending buffer, in chunks the
+ * ciphers take at once.
+ */
+static int
+stream_queue(ss_stream_t *stream, const char *data, size_t len)
+{
+    crypto_t *crypto  = stream->ctx->crypto;
+    buffer_t *pending = &stream->pending;
+    buffer_t *buf     = &stream->out;
+
+    if (pending->idx > 0) {
+        memmove(pending->data, pending->data + pending->idx,
+                pending->len - pending->idx);
+        pending->len -= pending->idx;
+        pending->idx  = 0;
+    }
+
+    while (len > 0) {
+        size_t n = len < SOCKET_BUF_SIZE ? len : SOCKET_BUF_SIZE;
+
+        memcpy(buf->data, data, n);
+        buf->idx = 0;
+        buf->len = n;
+        if (crypto->encrypt(buf, &stream->e_ctx, SOCKET_BUF_SIZE) != CRYPTO_OK) {
+            return -1;
+        }
+
+        brealloc(pending, pending->len + buf->len, SOCKET_BUF_SIZE);
+        memcpy(pending->data + pending->len, buf->data, buf->len);
+        pending->len += buf->len;
+
+        data += n;
+        len  -= n;
+    }
+
+    return 0;
+}
+
+ss_stream_t *
+ss_stream_open(ss_ctx_t *ctx, const char *host, int port,
+               const ss_stream_cb_t *cb, void *data)
+{
+    struct sockaddr *addr = (struct sockaddr *)&ctx->addr;
+    int opt               = 1;
+
+    if (host == NULL || port <= 0 || port > 65535 || cb->on_read == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fd = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (fd == -1) {
+        ERROR("socket");
+        return NULL;
+    }
+
+    setsockopt(fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+#endif
+    if (ctx->mptcp > 1) {
+        if (setsockopt(fd, SOL_TCP, ctx->mptcp, &opt, sizeof(opt)) == -1)
+            ERROR("failed to enable multipath TCP");
+    } else if (ctx->mptcp == 1) {
+        for (int i = 0; mptcp_enabled_values[i] > 0; i++)
+            if (setsockopt(fd, SOL_TCP, mptcp_enabled_values[i], &opt, sizeof(opt)) != -1)
+                break;
+    }
+    setnonblocking(fd);
+
+    ss_stream_t *stream = ss_malloc(sizeof(ss_stream_t));
+    memset(stream, 0, sizeof(ss_stream_t));
+    stream->ctx  = ctx;
+    stream->fd   = fd;
+    stream->cb   = *cb;
+    stream->data = data;
+
+    balloc(&stream->buf, SOCKET_BUF_SIZE);
+    balloc(&stream->pending, SOCKET_BUF_SIZE);
+    balloc(&stream->out, SOCKET_BUF_SIZE);
+    ctx->crypto->ctx_init(ctx->crypto->cipher, &stream->e_ctx, 1);
+    ctx->crypto->ctx_init(ctx->crypto->cipher, &stream->d_ctx, 0);
+
+    ev_io_init(&stream->recv_io, stream_recv_cb, fd, EV_READ);
+    ev_io_init(&stream->send_io, stream_send_cb, fd, EV_WRITE);
+    ev_timer_init(&stream->watcher, stream_timeout_cb,
+                  min(ctx->timeout, MAX_CONNECT_TIMEOUT), ctx->timeout);
+    cork_dllist_add(&ctx->streams, &stream->entries);
+
+    // Goes out with the first flight, ahead of anything written
+    if (stream_header(&stream->out, host, port) == -1
+        || ctx->crypto->encrypt(&stream->out, &stream->e_ctx, SOCKET_BUF_SIZE) != CRYPTO_OK) {
+        LOGE("ss_stream_open: invalid target %s", host);
+        stream_free(stream);
+        errno = EINVAL;
+        return NULL;
+    }
+    brealloc(&stream->pending, stream->out.len, SOCKET_BUF_SIZE);
+    memcpy(stream->pending.data, stream->out.data, stream->out.len);
+    stream->pending.len = stream->out.len;
+
+    if (connect(fd, addr, get_sockaddr_len(addr)) == -1
+        && errno != CONNECT_IN_PROGRESS) {
+        ERROR("connect");
+        stream_free(stream);
+        return NULL;
+    }
+
+    ev_io_start(ctx->loop, &stream->send_io);
+    ev_timer_start(ctx->loop, &stream->watcher);
+
+    return stream;
+}
+
+ssize_t
+ss_stream_write(ss_stream_t *stream, const void *buf, size_t len)
+{
+    if (stream->closed) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    if (stream_queue(stream, buf, len) == -1) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    // Until connected, and while the socket is full, the send watcher flushes
+    if (stream->connected && !ev_is_active(&stream->send_io)) {
+        if (stream_flush(stream) == -1) {
+            return -1;
+        }
+        ev_timer_again(stream->ctx->loop, &stream->watcher);
+    }
+
+    return stream->pending.len - stream->pending.idx;
+}
+
+void
+ss_stream_close(ss_stream_t *stream)
+{
+    if (stream->in_cb) {
+        stream->closed = 1;
+        return;
+    }
+    stream_free(stream);
+}
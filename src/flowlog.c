@@ -0,0 +1,210 @@
+/*
+ * flowlog.c - Anonymised flow metadata for replaying production traffic
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "crypto.h"
+#include "loopstat.h"
+#include "flowlog.h"
+
+static FILE *flow_file;
+
+static const char *proto_names[] = {
+    "tcp",
+    "udp"
+};
+
+static const char *dest_names[] = {
+    "none",
+    "ipv4",
+    "domain",
+    "ipv6"
+};
+
+static const char *service_names[] = {
+    "other",
+    "web",
+    "dns"
+};
+
+flowlog_t *
+flowlog_new(int proto)
+{
+    if (flow_file == NULL) {
+        return NULL;
+    }
+
+    flowlog_t *flow = ss_malloc(sizeof(flowlog_t));
+    memset(flow, 0, sizeof(flowlog_t));
+    flow->proto   = proto;
+    flow->wall    = ev_time();
+    flow->start   = loop_stat_clock();
+    flow->last    = flow->start;
+    flow->connect = proto == FLOWLOG_UDP ? 0 : -1;
+
+    return flow;
+}
+
+void
+flowlog_record(flowlog_t *flow, int dir, size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+
+    ev_tstamp now = loop_stat_clock();
+
+    // Long streams keep their opening shape, the tail is only summed up
+    if (flow->num >= FLOWLOG_MAX_EVENTS) {
+        flow->rest_bytes[dir] += size;
+        flow->rest_reads[dir]++;
+        flow->last = now;
+        return;
+    }
+
+    if (flow->num == flow->capacity) {
+        flow->capacity = flow->capacity ? flow->capacity * 2 : 16;
+        flow->events   = ss_realloc(flow->events,
+                                    flow->capacity * sizeof(flowlog_event_t));
+    }
+
+    double gap             = (now - flow->last) * 1e6;
+    flowlog_event_t *event = &flow->events[flow->num++];
+    event->gap             = gap < UINT32_MAX ? (uint32_t)gap : UINT32_MAX;
+    event->size            = size;
+    event->dir             = dir;
+    flow->last             = now;
+}
+
+/*
+ * Only the address type and a coarse port class are kept, never the
+ * address itself.
+ */
+void
+flowlog_set_dest(flowlog_t *flow, const char *addr_header)
+{
+    const char *port;
+
+    if (flow->dest != FLOWLOG_DEST_NONE) {
+        return;
+    }
+
+    switch (addr_header[0] & ADDRTYPE_MASK) {
+    case 1:
+        flow->dest = FLOWLOG_DEST_IPV4;
+        port       = addr_header + 1 + 4;
+        break;
+    case 3:
+        flow->dest = FLOWLOG_DEST_DOMAIN;
+        port       = addr_header + 2 + (uint8_t)addr_header[1];
+        break;
+    case 4:
+        flow->dest = FLOWLOG_DEST_IPV6;
+        port       = addr_header + 1 + 16;
+        break;
+    default:
+        return;
+    }
+
+    switch (load16_be(port)) {
+    case 80:
+    case 443:
+    case 8080:
+    case 8443:
+        flow->service = FLOWLOG_SERVICE_WEB;
+        break;
+    case 53:
+        flow->service = FLOWLOG_SERVICE_DNS;
+        break;
+    default:
+        flow->service = FLOWLOG_SERVICE_OTHER;
+    }
+}
+
+void
+flowlog_connected(flowlog_t *flow)
+{
+    if (flow->connect < 0) {
+        flow->connect = loop_stat_clock() - flow->start;
+    }
+}
+
+void
+flowlog_free(flowlog_t *flow)
+{
+    if (flow == NULL) {
+        return;
+    }
+
+    if (flow_file != NULL && flow->dest != FLOWLOG_DEST_NONE) {
+        fprintf(flow_file,
+                "{\"t\":%.3f,\"proto\":\"%s\",\"dest\":\"%s\",\"service\":\"%s\","
+                "\"connect\":%.6f,\"dur\":%.6f,\"events\":[",
+                flow->wall, proto_names[flow->proto], dest_names[flow->dest],
+                service_names[flow->service], flow->connect,
+                loop_stat_clock() - flow->start);
+        for (int i = 0; i < flow->num; i++)
+            fprintf(flow_file, "%s[%d,%" PRIu32 ",%" PRIu32 "]", i ? "," : "",
+                    flow->events[i].dir, flow->events[i].gap, flow->events[i].size);
+        fprintf(flow_file, "],\"rest\":[%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "]}\n",
+                flow->rest_bytes[FLOWLOG_UP], flow->rest_reads[FLOWLOG_UP],
+                flow->rest_bytes[FLOWLOG_DOWN], flow->rest_reads[FLOWLOG_DOWN]);
+    }
+
+    ss_free(flow->events);
+    ss_free(flow);
+}
+
+int
+flowlog_init(const char *path)
+{
+    flow_file = fopen(path, "a");
+    if (flow_file == NULL) {
+        ERROR("fopen");
+        LOGE("failed to open the flow log %s", path);
+        return -1;
+    }
+
+    // One write per finished flow, so a crash only loses open flows
+    setvbuf(flow_file, NULL, _IOLBF, 0);
+
+    LOGI("log flow metadata to %s", path);
+
+    return 0;
+}
+
+void
+flowlog_cleanup(void)
+{
+    if (flow_file != NULL) {
+        fclose(flow_file);
+        flow_file = NULL;
+    }
+}
@@ -0,0 +1,97 @@
+/*
+ * flowlog.h - Define the anonymised flow metadata log interface
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FLOWLOG_H
+#define _FLOWLOG_H
+
+#ifdef HAVE_LIBEV_EV_H
+#include <libev/ev.h>
+#else
+#include <ev.h>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLOWLOG_MAX_EVENTS 4096     // reads kept per flow, later ones are only summed
+
+enum {
+    FLOWLOG_TCP,
+    FLOWLOG_UDP
+};
+
+enum {
+    FLOWLOG_UP,                     // client to origin
+    FLOWLOG_DOWN                    // origin to client
+};
+
+enum {
+    FLOWLOG_DEST_NONE,              // no request header seen, not logged
+    FLOWLOG_DEST_IPV4,
+    FLOWLOG_DEST_DOMAIN,
+    FLOWLOG_DEST_IPV6
+};
+
+enum {
+    FLOWLOG_SERVICE_OTHER,
+    FLOWLOG_SERVICE_WEB,            // 80, 443, 8080, 8443
+    FLOWLOG_SERVICE_DNS
+};
+
+typedef struct flowlog_event {
+    uint32_t gap;                   // microseconds since the previous event
+    uint32_t size;
+    int dir;
+} flowlog_event_t;
+
+typedef struct flowlog {
+    int proto;
+    int dest;
+    int service;
+    ev_tstamp wall;                 // start, wall clock
+    ev_tstamp start;
+    ev_tstamp last;
+    ev_tstamp connect;              // connect latency, -1 until connected
+    int num;
+    int capacity;
+    flowlog_event_t *events;
+    uint64_t rest_bytes[2];
+    uint64_t rest_reads[2];
+} flowlog_t;
+
+int flowlog_init(const char *path);
+void flowlog_cleanup(void);
+
+flowlog_t *flowlog_new(int proto);
+void flowlog_free(flowlog_t *flow);
+
+void flowlog_record(flowlog_t *flow, int dir, size_t size);
+void flowlog_set_dest(flowlog_t *flow, const char *addr_header);
+void flowlog_connected(flowlog_t *flow);
+
+#define FLOWLOG(f, dir, size)                   \
+    do {                                        \
+        if (f)                                  \
+            flowlog_record(f, dir, size);       \
+    } while (0)
+
+#endif // _FLOWLOG_H
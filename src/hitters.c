@@ -0,0 +1,239 @@
+/*
+ * hitters.c - Top destinations by bytes and connections in fixed memory
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "control.h"
+#include "hitters.h"
+
+typedef struct hitter {
+    uint64_t count;
+    uint32_t h1;
+    uint32_t h2;
+    char name[HITTERS_NAME_LEN];
+} hitter_t;
+
+/*
+ * One count-min sketch per metric gives an estimate for any destination,
+ * and a min-heap keeps the K destinations with the largest estimates.
+ */
+typedef struct hitters {
+    uint64_t sketch[HITTERS_DEPTH][HITTERS_WIDTH];
+    hitter_t heap[HITTERS_TOP_K];
+    int heap_len;
+} hitters_t;
+
+int dest_stats = 0;
+
+static hitters_t *metrics;
+static ev_timer decay_watcher;
+
+static const char *metric_names[HITTERS_METRIC_NUM] = {
+    "bytes",
+    "connections"
+};
+
+hitters_key_t *
+hitters_key_new(const char *dest)
+{
+    if (metrics == NULL) {
+        return NULL;
+    }
+
+    hitters_key_t *key = ss_malloc(sizeof(hitters_key_t));
+
+    // FNV-1a, split in two halves for double hashing across the rows
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *p = dest; *p; p++) {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211ULL;
+    }
+    key->h1 = (uint32_t)h;
+    key->h2 = (uint32_t)(h >> 32) | 1;
+
+    // Hostnames come from the client, keep them safe to embed in JSON
+    snprintf(key->name, HITTERS_NAME_LEN, "%s", dest);
+    for (char *p = key->name; *p; p++)
+        if (*p < 0x20 || *p > 0x7e || *p == '"' || *p == '\\')
+            *p = '?';
+
+    return key;
+}
+
+static void
+heap_swap(hitters_t *m, int a, int b)
+{
+    hitter_t tmp = m->heap[a];
+    m->heap[a] = m->heap[b];
+    m->heap[b] = tmp;
+}
+
+static void
+heap_down(hitters_t *m, int i)
+{
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        if (l < m->heap_len && m->heap[l].count < m->heap[min].count)
+            min = l;
+        if (r < m->heap_len && m->heap[r].count < m->heap[min].count)
+            min = r;
+        if (min == i)
+            return;
+        heap_swap(m, i, min);
+        i = min;
+    }
+}
+
+static void
+heap_up(hitters_t *m, int i)
+{
+    while (i > 0 && m->heap[(i - 1) / 2].count > m->heap[i].count) {
+        heap_swap(m, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+void
+hitters_add(const hitters_key_t *key, int metric, uint64_t value)
+{
+    hitters_t *m = &metrics[metric];
+    uint64_t *counters[HITTERS_DEPTH];
+    uint64_t estimate = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < HITTERS_DEPTH; i++) {
+        uint32_t idx = (key->h1 + i * key->h2) & (HITTERS_WIDTH - 1);
+        counters[i] = &m->sketch[i][idx];
+        if (*counters[i] < estimate)
+            estimate = *counters[i];
+    }
+
+    // Conservative update, only raise the counters below the new estimate
+    estimate += value;
+    for (i = 0; i < HITTERS_DEPTH; i++)
+        if (*counters[i] < estimate)
+            *counters[i] = estimate;
+
+    for (i = 0; i < m->heap_len; i++)
+        if (m->heap[i].h1 == key->h1 && m->heap[i].h2 == key->h2) {
+            m->heap[i].count = estimate;
+            heap_down(m, i);
+            return;
+        }
+
+    if (m->heap_len < HITTERS_TOP_K) {
+        i = m->heap_len++;
+    } else if (estimate > m->heap[0].count) {
+        i = 0;
+    } else {
+        return;
+    }
+
+    m->heap[i].count = estimate;
+    m->heap[i].h1    = key->h1;
+    m->heap[i].h2    = key->h2;
+    memcpy(m->heap[i].name, key->name, HITTERS_NAME_LEN);
+
+    if (i == 0) {
+        heap_down(m, 0);
+    } else {
+        heap_up(m, i);
+    }
+}
+
+static void
+decay_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    for (int metric = 0; metric < HITTERS_METRIC_NUM; metric++) {
+        hitters_t *m = &metrics[metric];
+        for (int i = 0; i < HITTERS_DEPTH; i++)
+            for (int j = 0; j < HITTERS_WIDTH; j++)
+                m->sketch[i][j] >>= 1;
+        // Halving keeps the heap order
+        for (int i = 0; i < m->heap_len; i++)
+            m->heap[i].count >>= 1;
+    }
+}
+
+static int
+hitter_cmp(const void *a, const void *b)
+{
+    uint64_t ca = ((const hitter_t *)a)->count;
+    uint64_t cb = ((const hitter_t *)b)->count;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+static void
+top_cmd_cb(const char *data, control_reply_t *reply)
+{
+    hitter_t top[HITTERS_TOP_K];
+
+    control_reply(reply, "{");
+    for (int metric = 0; metric < HITTERS_METRIC_NUM; metric++) {
+        hitters_t *m = &metrics[metric];
+        memcpy(top, m->heap, m->heap_len * sizeof(hitter_t));
+        qsort(top, m->heap_len, sizeof(hitter_t), hitter_cmp);
+
+        control_reply(reply, "%s\n\"%s\":[", metric ? "," : "", metric_names[metric]);
+        for (int i = 0; i < m->heap_len; i++)
+            control_reply(reply, "%s\n\t{\"dest\":\"%s\",\"%s\":%" PRIu64 "}",
+                          i ? "," : "", top[i].name, metric_names[metric], top[i].count);
+        control_reply(reply, "\n]");
+    }
+    control_reply(reply, "\n}\n");
+}
+
+int
+hitters_init(struct ev_loop *loop)
+{
+    if (control_register("top", top_cmd_cb) == -1) {
+        return -1;
+    }
+
+    metrics = ss_malloc(sizeof(hitters_t) * HITTERS_METRIC_NUM);
+    memset(metrics, 0, sizeof(hitters_t) * HITTERS_METRIC_NUM);
+
+    ev_timer_init(&decay_watcher, decay_cb,
+                  HITTERS_DECAY_INTERVAL, HITTERS_DECAY_INTERVAL);
+    ev_timer_start(loop, &decay_watcher);
+
+    return 0;
+}
+
+void
+hitters_free(struct ev_loop *loop)
+{
+    if (metrics == NULL) {
+        return;
+    }
+
+    ev_timer_stop(loop, &decay_watcher);
+    ss_free(metrics);
+}
@@ -0,0 +1,70 @@
+/*
+ * hitters.h - Define the heavy-hitter destination statistics interface
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HITTERS_H
+#define _HITTERS_H
+
+#ifdef HAVE_LIBEV_EV_H
+#include <libev/ev.h>
+#else
+#include <ev.h>
+#endif
+
+#include <stdint.h>
+
+#define HITTERS_DEPTH          4        // rows of the count-min sketch
+#define HITTERS_WIDTH          4096     // counters per row, a power of two
+#define HITTERS_TOP_K          32
+#define HITTERS_NAME_LEN       64
+#define HITTERS_DECAY_INTERVAL 3600     // halve all counts every hour
+
+enum {
+    HITTERS_BYTES,
+    HITTERS_CONNS,
+    HITTERS_METRIC_NUM
+};
+
+/*
+ * A destination is hashed once per connection, the relay callbacks only
+ * pass the key around.
+ */
+typedef struct hitters_key {
+    uint32_t h1;
+    uint32_t h2;
+    char name[HITTERS_NAME_LEN];
+} hitters_key_t;
+
+extern int dest_stats;
+
+int hitters_init(struct ev_loop *loop);
+void hitters_free(struct ev_loop *loop);
+
+hitters_key_t *hitters_key_new(const char *dest);
+void hitters_add(const hitters_key_t *key, int metric, uint64_t value);
+
+#define HITTERS_ADD(key, metric, value)             \
+    do {                                            \
+        if (key)                                    \
+            hitters_add(key, metric, value);        \
+    } while (0)
+
+#endif // _HITTERS_H
@@ -0,0 +1,236 @@
+/*
+ * ipscore.c - Per-address connect RTT and failure history
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef __MINGW32__
+#include <netinet/in.h>
+#endif
+
+#include "utils.h"
+#include "cache.h"
+#include "control.h"
+#include "ipscore.h"
+
+typedef struct ipscore {
+    ev_tstamp srtt;                 // smoothed connect RTT, 0 until a connect succeeds
+    double fail;                    // smoothed failure rate, 0 to 1
+    ev_tstamp updated;
+} ipscore_t;
+
+static struct cache *scores;
+
+static uint64_t connects;
+static uint64_t failures;
+static uint64_t explores;
+
+static double costs[IPSCORE_CACHE_SIZE];
+static double median;
+static ev_tstamp median_updated;
+
+int
+ipscore_init(void)
+{
+    return cache_create(&scores, IPSCORE_CACHE_SIZE, NULL);
+}
+
+void
+ipscore_free(void)
+{
+    if (scores != NULL) {
+        cache_delete(scores, 0);
+        scores = NULL;
+    }
+    median_updated = 0;
+}
+
+void
+ipscore_key(ipscore_key_t *key, const struct sockaddr *addr)
+{
+    key->data[0] = addr->sa_family;
+
+    if (addr->sa_family == AF_INET) {
+        memcpy(key->data + 1, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+        key->len = 1 + 4;
+    } else if (addr->sa_family == AF_INET6) {
+        memcpy(key->data + 1, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+        key->len = 1 + 16;
+    } else {
+        key->len = 0;
+    }
+}
+
+static ipscore_t *
+ipscore_get(const ipscore_key_t *key, int create)
+{
+    ipscore_t *score = NULL;
+
+    if (scores == NULL || key->len == 0) {
+        return NULL;
+    }
+
+    cache_lookup(scores, (char *)key->data, key->len, &score);
+    if (score == NULL && create) {
+        score = ss_malloc(sizeof(ipscore_t));
+        memset(score, 0, sizeof(ipscore_t));
+        cache_insert(scores, (char *)key->data, key->len, score);
+    }
+
+    return score;
+}
+
+static int
+cost_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Cost of an address without history: the median of the addresses that
+ * connected within the explore interval, so an untried address is never
+ * preferred to the better half of the working ones. Recomputed at most
+ * once per IPSCORE_MEDIAN_INTERVAL.
+ */
+static double
+ipscore_unknown(void)
+{
+    struct cache_entry *entry, *tmp;
+    ev_tstamp now = ev_time();
+    int num       = 0;
+
+    if (now - median_updated < IPSCORE_MEDIAN_INTERVAL) {
+        return median;
+    }
+
+    HASH_ITER(hh, scores->entries, entry, tmp) {
+        ipscore_t *score = entry->data;
+        if (num == IPSCORE_CACHE_SIZE) {
+            break;
+        }
+        if (score->srtt > 0 && now - score->updated <= IPSCORE_EXPLORE_INTERVAL) {
+            costs[num++] = score->srtt + score->fail * IPSCORE_FAIL_PENALTY;
+        }
+    }
+
+    if (num == 0) {
+        median = IPSCORE_UNKNOWN;
+    } else {
+        qsort(costs, num, sizeof(double), cost_cmp);
+        median = costs[num / 2];
+    }
+    median_updated = now;
+
+    return median;
+}
+
+/*
+ * Expected cost of connecting to addr in seconds, lower is better. An
+ * address that failed half of the time recently costs its RTT plus half
+ * the penalty. Anything not heard from within the explore interval is
+ * back to unknown, so a demoted address gets tried again once the
+ * median has slowed down past its cost, or after its history ages out.
+ */
+double
+ipscore_rank(const struct sockaddr *addr)
+{
+    ipscore_key_t key;
+    ipscore_t *score;
+
+    ipscore_key(&key, addr);
+    score = ipscore_get(&key, 0);
+
+    if (score == NULL) {
+        return ipscore_unknown();
+    }
+
+    if (ev_time() - score->updated > IPSCORE_EXPLORE_INTERVAL) {
+        explores++;
+        return ipscore_unknown();
+    }
+
+    return (score->srtt > 0 ? score->srtt : ipscore_unknown())
+           + score->fail * IPSCORE_FAIL_PENALTY;
+}
+
+void
+ipscore_connected(const ipscore_key_t *key, ev_tstamp rtt)
+{
+    ipscore_t *score = ipscore_get(key, 1);
+
+    if (score == NULL) {
+        return;
+    }
+
+    connects++;
+
+    if (ev_time() - score->updated > IPSCORE_EXPLORE_INTERVAL) {
+        score->srtt = 0;
+        score->fail = 0;
+    }
+
+    // Same gains as the TCP RTT estimator
+    if (score->srtt == 0) {
+        score->srtt = rtt;
+    } else {
+        score->srtt += (rtt - score->srtt) / 8;
+    }
+    score->fail   -= score->fail / 4;
+    score->updated = ev_time();
+}
+
+void
+ipscore_failed(const ipscore_key_t *key)
+{
+    ipscore_t *score = ipscore_get(key, 1);
+
+    if (score == NULL) {
+        return;
+    }
+
+    failures++;
+
+    if (ev_time() - score->updated > IPSCORE_EXPLORE_INTERVAL) {
+        score->srtt = 0;
+        score->fail = 0;
+    }
+    score->fail   += (1 - score->fail) / 4;
+    score->updated = ev_time();
+}
+
+void
+ipscore_stats(const char *data, control_reply_t *reply)
+{
+    control_reply(reply, "{\"addresses\":%u,\"connects\":%" PRIu64
+                  ",\"failures\":%" PRIu64 ",\"explores\":%" PRIu64 "}\n",
+                  scores != NULL ? HASH_COUNT(scores->entries) : 0,
+                  connects, failures, explores);
+}
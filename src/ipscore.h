@@ -0,0 +1,67 @@
+/*
+ * ipscore.h - Define the per-address connect scoring interface
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _IPSCORE_H
+#define _IPSCORE_H
+
+#ifdef HAVE_LIBEV_EV_H
+#include <libev/ev.h>
+#else
+#include <ev.h>
+#endif
+
+#include <stdint.h>
+#ifndef __MINGW32__
+#include <sys/socket.h>
+#endif
+
+#define IPSCORE_CACHE_SIZE       4096   // addresses remembered, least recently used go first
+#define IPSCORE_KEY_LEN          17     // family byte and up to 16 address bytes
+#define IPSCORE_UNKNOWN          0.1    // cost of an address without usable history, seconds,
+                                        // until some address has any
+#define IPSCORE_MEDIAN_INTERVAL  1      // seconds between two median computations
+#define IPSCORE_FAIL_PENALTY     3.0    // cost of an address that always fails, seconds
+#define IPSCORE_EXPLORE_INTERVAL 60     // history older than this is ignored, seconds
+
+struct control_reply;
+
+/*
+ * A remote keeps the key of the address it connects to, so the outcome
+ * can be recorded without another sockaddr around.
+ */
+typedef struct ipscore_key {
+    uint8_t len;
+    char data[IPSCORE_KEY_LEN];
+} ipscore_key_t;
+
+int ipscore_init(void);
+void ipscore_free(void);
+
+void ipscore_key(ipscore_key_t *key, const struct sockaddr *addr);
+double ipscore_rank(const struct sockaddr *addr);
+
+void ipscore_connected(const ipscore_key_t *key, ev_tstamp rtt);
+void ipscore_failed(const ipscore_key_t *key);
+
+void ipscore_stats(const char *data, struct control_reply *reply);
+
+#endif // _IPSCORE_H
@@ -152,6 +152,70 @@ parse_dscp(char *str)
     return DSCP_DEFAULT;
 }
 
+/*
+ * Options left out of a profile stay -1 (NULL for congestion), so the
+ * socket keeps whatever the relay or the system sets.
+ */
+static void
+parse_sockprof(const json_value *value, ss_sockprof_t *profile)
+{
+    unsigned int i;
+
+    check_json_value_type(value, json_object,
+                          "invalid config file: a socket profile must be an object");
+
+    profile->congestion    = NULL;
+    profile->sndbuf        = -1;
+    profile->rcvbuf        = -1;
+    profile->notsent_lowat = -1;
+    profile->keepalive     = -1;
+    profile->tos           = -1;
+    profile->no_delay      = -1;
+
+    for (i = 0; i < value->u.object.length; i++) {
+        char *name    = value->u.object.values[i].name;
+        json_value *v = value->u.object.values[i].value;
+        if (strcmp(name, "congestion") == 0) {
+            check_json_value_type(v, json_string,
+                                  "invalid config file: profile option 'congestion' must be a string");
+            profile->congestion = to_string(v);
+        } else if (strcmp(name, "sndbuf") == 0) {
+            check_json_value_type(v, json_integer,
+                                  "invalid config file: profile option 'sndbuf' must be an integer");
+            profile->sndbuf = v->u.integer;
+        } else if (strcmp(name, "rcvbuf") == 0) {
+            check_json_value_type(v, json_integer,
+                                  "invalid config file: profile option 'rcvbuf' must be an integer");
+            profile->rcvbuf = v->u.integer;
+        } else if (strcmp(name, "notsent_lowat") == 0) {
+            check_json_value_type(v, json_integer,
+                                  "invalid config file: profile option 'notsent_lowat' must be an integer");
+            profile->notsent_lowat = v->u.integer;
+        } else if (strcmp(name, "keepalive") == 0) {
+            check_json_value_type(v, json_integer,
+                                  "invalid config file: profile option 'keepalive' must be an integer");
+            profile->keepalive = v->u.integer;
+        } else if (strcmp(name, "tos") == 0) {
+            // A TOS byte, or a DSCP name or value as in the 'dscp' option
+            if (v->type == json_string) {
+                char *dscp = to_string(v);
+                profile->tos = parse_dscp(dscp) << 2;
+                ss_free(dscp);
+            } else {
+                check_json_value_type(v, json_integer,
+                                      "invalid config file: profile option 'tos' must be an integer or a string");
+                profile->tos = v->u.integer & 0xff;
+            }
+        } else if (strcmp(name, "no_delay") == 0) {
+            check_json_value_type(v, json_boolean,
+                                  "invalid config file: profile option 'no_delay' must be a boolean");
+            profile->no_delay = v->u.boolean;
+        } else {
+            LOGE("unknown socket profile option '%s'", name);
+        }
+    }
+}
+
 jconf_t *
 read_jconf(const char *file)
 {
@@ -221,6 +285,51 @@ read_jconf(const char *file)
                     parse_addr(to_string(value), conf.remote_addr);
                     conf.remote_num = 1;
                 }
+            } else if (strcmp(name, "upstreams") == 0) {
+                check_json_value_type(value, json_object,
+                                      "invalid config file: option 'upstreams' must be an object");
+                for (j = 0; j < value->u.object.length; j++) {
+                    if (j >= MAX_UPSTREAM_NUM) {
+                        break;
+                    }
+                    json_value *v           = value->u.object.values[j].value;
+                    ss_upstream_t *upstream = conf.upstream + conf.upstream_num;
+                    if (v->type == json_array) {
+                        unsigned int k;
+                        for (k = 0; k < v->u.array.length; k++) {
+                            if (k >= MAX_REMOTE_NUM) {
+                                break;
+                            }
+                            char *addr_str = to_string(v->u.array.values[k]);
+                            parse_addr(addr_str, upstream->remote_addr + k);
+                            ss_free(addr_str);
+                            upstream->remote_num = k + 1;
+                        }
+                    } else if (v->type == json_string) {
+                        parse_addr(to_string(v), upstream->remote_addr);
+                        upstream->remote_num = 1;
+                    }
+                    if (upstream->remote_num > 0) {
+                        upstream->name = ss_strndup(value->u.object.values[j].name,
+                                                    value->u.object.values[j].name_length);
+                        conf.upstream_num++;
+                    }
+                }
+            } else if (strcmp(name, "socket_profiles") == 0) {
+                check_json_value_type(value, json_object,
+                                      "invalid config file: option 'socket_profiles' must be an object");
+                for (j = 0; j < value->u.object.length; j++) {
+                    if (j >= MAX_SOCKPROF_NUM) {
+                        LOGE("too many socket profiles, dropping \"%.*s\"",
+                             (int)value->u.object.values[j].name_length,
+                             value->u.object.values[j].name);
+                        continue;
+                    }
+                    ss_sockprof_t *profile = conf.sockprof + conf.sockprof_num++;
+                    parse_sockprof(value->u.object.values[j].value, profile);
+                    profile->name = ss_strndup(value->u.object.values[j].name,
+                                               value->u.object.values[j].name_length);
+                }
             } else if (strcmp(name, "port_password") == 0) {
                 if (value->type == json_object) {
                     for (j = 0; j < value->u.object.length; j++) {
@@ -319,6 +428,22 @@ read_jconf(const char *file)
                 check_json_value_type(value, json_integer,
                                       "invalid config file: option 'mtu' must be an integer");
                 conf.mtu = value->u.integer;
+            } else if (strcmp(name, "udp_batch") == 0) {
+                check_json_value_type(value, json_integer,
+                                      "invalid config file: option 'udp_batch' must be an integer");
+                conf.udp_batch = value->u.integer;
+            } else if (strcmp(name, "busy_poll") == 0) {
+                check_json_value_type(value, json_integer,
+                                      "invalid config file: option 'busy_poll' must be an integer");
+                conf.busy_poll = value->u.integer;
+            } else if (strcmp(name, "huge_pages") == 0) {
+                check_json_value_type(value, json_integer,
+                                      "invalid config file: option 'huge_pages' must be an integer");
+                conf.huge_pages = value->u.integer;
+            } else if (strcmp(name, "key_pool") == 0) {
+                check_json_value_type(value, json_integer,
+                                      "invalid config file: option 'key_pool' must be an integer");
+                conf.key_pool = value->u.integer;
             } else if (strcmp(name, "mptcp") == 0) {
                 check_json_value_type(value, json_boolean,
                                       "invalid config file: option 'mptcp' must be a boolean");
@@ -338,12 +463,63 @@ read_jconf(const char *file)
                     value, json_boolean,
                     "invalid config file: option 'no_delay' must be a boolean");
                 conf.no_delay = value->u.boolean;
+            } else if (strcmp(name, "edge_triggered") == 0) {
+                check_json_value_type(
+                    value, json_boolean,
+                    "invalid config file: option 'edge_triggered' must be a boolean");
+                conf.edge_triggered = value->u.boolean;
+            } else if (strcmp(name, "priority_classes") == 0) {
+                check_json_value_type(
+                    value, json_boolean,
+                    "invalid config file: option 'priority_classes' must be a boolean");
+                conf.priority_classes = value->u.boolean;
+            } else if (strcmp(name, "udp_over_tcp") == 0) {
+                check_json_value_type(
+                    value, json_boolean,
+                    "invalid config file: option 'udp_over_tcp' must be a boolean");
+                conf.udp_over_tcp = value->u.boolean;
+            } else if (strcmp(name, "mtu_discovery") == 0) {
+                check_json_value_type(
+                    value, json_boolean,
+                    "invalid config file: option 'mtu_discovery' must be a boolean");
+                conf.mtu_discovery = value->u.boolean;
+            } else if (strcmp(name, "loop_stat") == 0) {
+                check_json_value_type(
+                    value, json_boolean,
+                    "invalid config file: option 'loop_stat' must be a boolean");
+                conf.loop_stat = value->u.boolean;
             } else if (strcmp(name, "workdir") == 0) {
                 conf.workdir = to_string(value);
             } else if (strcmp(name, "acl") == 0) {
                 conf.acl = to_string(value);
             } else if (strcmp(name, "manager_address") == 0) {
                 conf.manager_address = to_string(value);
+            } else if (strcmp(name, "control_address") == 0) {
+                conf.control_address = to_string(value);
+            } else if (strcmp(name, "trace_sample") == 0) {
+                if (value->type == json_integer) {
+                    conf.trace_sample = value->u.integer;
+                } else {
+                    check_json_value_type(value, json_double,
+                                          "invalid config file: option 'trace_sample' must be a number");
+                    conf.trace_sample = value->u.dbl;
+                }
+            } else if (strcmp(name, "trace_threshold") == 0) {
+                check_json_value_type(value, json_integer,
+                                      "invalid config file: option 'trace_threshold' must be an integer");
+                conf.trace_threshold = value->u.integer;
+            } else if (strcmp(name, "dest_stats") == 0) {
+                check_json_value_type(value, json_boolean,
+                                      "invalid config file: option 'dest_stats' must be a boolean");
+                conf.dest_stats = value->u.boolean;
+            } else if (strcmp(name, "flow_log") == 0) {
+                conf.flow_log = to_string(value);
+            } else if (strcmp(name, "dns_cache") == 0) {
+                conf.dns_cache = to_string(value);
+            } else if (strcmp(name, "rank_addresses") == 0) {
+                check_json_value_type(value, json_boolean,
+                                      "invalid config file: option 'rank_addresses' must be a boolean");
+                conf.rank_addresses = value->u.boolean;
             }
         }
     } else {
@@ -24,7 +24,9 @@
 
 #define MAX_PORT_NUM 1024
 #define MAX_REMOTE_NUM 10
+#define MAX_UPSTREAM_NUM 16
 #define MAX_DSCP_NUM 64
+#define MAX_SOCKPROF_NUM 16
 #define MAX_CONF_SIZE (128 * 1024)
 #define MAX_CONNECT_TIMEOUT 10
 #define MIN_TCP_IDLE_TIMEOUT (24 * 3600)
@@ -54,8 +56,29 @@ typedef struct {
 } ss_dscp_t;
 
 typedef struct {
+    char *name;
     int remote_num;
     ss_addr_t remote_addr[MAX_REMOTE_NUM];
+} ss_upstream_t;
+
+typedef struct {
+    char *name;
+    char *congestion;
+    int sndbuf;
+    int rcvbuf;
+    int notsent_lowat;
+    int keepalive;
+    int tos;
+    int no_delay;
+} ss_sockprof_t;
+
+typedef struct {
+    int remote_num;
+    ss_addr_t remote_addr[MAX_REMOTE_NUM];
+    int upstream_num;
+    ss_upstream_t upstream[MAX_UPSTREAM_NUM];
+    int sockprof_num;
+    ss_sockprof_t sockprof[MAX_SOCKPROF_NUM];
     int port_password_num;
     ss_port_password_t port_password[MAX_PORT_NUM];
     char *remote_port;
@@ -82,9 +105,25 @@ typedef struct {
     int mptcp;
     int ipv6_first;
     int no_delay;
+    int loop_stat;
     char *workdir;
     char *acl;
     char *manager_address;
+    char *control_address;
+    double trace_sample;
+    int trace_threshold;
+    int dest_stats;
+    char *flow_log;
+    char *dns_cache;
+    int rank_addresses;
+    int edge_triggered;
+    int priority_classes;
+    int udp_batch;
+    int busy_poll;
+    int udp_over_tcp;
+    int mtu_discovery;
+    int huge_pages;
+    int key_pool;
 } jconf_t;
 
 jconf_t *read_jconf(const char *file);
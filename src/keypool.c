@@ -0,0 +1,96 @@
+/*
+ * keypool.c - Precompute session keys while the loop is idle
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "utils.h"
+#include "aead.h"
+#include "keypool.h"
+
+// Keys derived per idle callback, a few microseconds each
+#define KEY_POOL_BATCH 8
+
+int key_pool = 0;
+
+static ev_prepare prepare_watcher;
+static ev_idle fill_watcher;
+
+static void
+fill_cb(EV_P_ ev_idle *w, int revents)
+{
+    if (aead_key_pool_fill(KEY_POOL_BATCH) == 0) {
+        ev_idle_stop(EV_A_ w);
+    }
+}
+
+/*
+ * Keys are taken by the watchers of an iteration, look before the loop
+ * blocks again
+ */
+static void
+prepare_cb(EV_P_ ev_prepare *w, int revents)
+{
+    if (!ev_is_active(&fill_watcher) && aead_key_pool_fill(0) > 0) {
+        ev_idle_start(EV_A_ & fill_watcher);
+    }
+}
+
+int
+key_pool_init(struct ev_loop *loop, crypto_t *crypto)
+{
+    if (key_pool <= 0) {
+        key_pool = 0;
+        return -1;
+    }
+
+    if (crypto->encrypt != aead_encrypt) {
+        LOGE("the key pool works with AEAD ciphers only");
+        key_pool = 0;
+        return -1;
+    }
+
+    aead_key_pool_init(crypto->cipher, key_pool);
+    aead_key_pool_fill(key_pool);
+
+    ev_idle_init(&fill_watcher, fill_cb);
+    ev_set_priority(&fill_watcher, EV_MINPRI);
+    ev_prepare_init(&prepare_watcher, prepare_cb);
+    ev_prepare_start(loop, &prepare_watcher);
+
+    return 0;
+}
+
+void
+key_pool_free(struct ev_loop *loop)
+{
+    if (!ev_is_active(&prepare_watcher)) {
+        return;
+    }
+
+    ev_prepare_stop(loop, &prepare_watcher);
+    if (ev_is_active(&fill_watcher)) {
+        ev_idle_stop(loop, &fill_watcher);
+    }
+    aead_key_pool_free();
+}
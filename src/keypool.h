@@ -0,0 +1,53 @@
+/*
+ * keypool.h - Define the precomputed session key pool
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _KEYPOOL_H
+#define _KEYPOOL_H
+
+#ifdef HAVE_LIBEV_EV_H
+#include <libev/ev.h>
+#else
+#include <ev.h>
+#endif
+
+#include "crypto.h"
+
+/*
+ * With key_pool set to a number of keys, that many random salts are
+ * kept with their HKDF subkey already derived and, for AES-256-GCM with
+ * libsodium, the key schedule expanded. New encrypt contexts (the first
+ * chunk of a TCP stream, every UDP packet) take one instead of deriving
+ * it before the first byte goes out. The pool is refilled by an idle
+ * watcher at the lowest priority, that is only when the loop has nothing
+ * else to do, so a burst of new connections drains it and the quiet time
+ * after refills it.
+ *
+ * AEAD ciphers only, and the keys are of this process: the pool must be
+ * set up after any fork.
+ */
+
+extern int key_pool;
+
+int key_pool_init(struct ev_loop *loop, crypto_t *crypto);
+void key_pool_free(struct ev_loop *loop);
+
+#endif // _KEYPOOL_H
@@ -57,6 +57,16 @@
 #include "acl.h"
 #include "plugin.h"
 #include "local.h"
+#include "loopstat.h"
+#include "control.h"
+#include "trace.h"
+#include "flowlog.h"
+#include "edge.h"
+#include "prio.h"
+#include "busypoll.h"
+#include "keypool.h"
+#include "sockprof.h"
+#include "arena.h"
 #include "winsock.h"
 
 #ifndef LIB_ONLY
@@ -127,6 +137,8 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents);
 static void remote_send_cb(EV_P_ ev_io *w, int revents);
 static void accept_cb(EV_P_ ev_io *w, int revents);
 static void signal_cb(EV_P_ ev_signal *w, int revents);
+static void delayed_connect_cb(EV_P_ ev_timer *watcher, int revents);
+static void remote_timeout_cb(EV_P_ ev_timer *watcher, int revents);
 #if defined(__MINGW32__) && !defined(LIB_ONLY)
 static void plugin_watcher_cb(EV_P_ ev_io *w, int revents);
 #endif
@@ -135,7 +147,16 @@ static int create_and_bind(const char *addr, const char *port);
 #ifdef HAVE_LAUNCHD
 static int launch_or_create(const char *addr, const char *port);
 #endif
-static remote_t *create_remote(listen_ctx_t *listener, struct sockaddr *addr, int direct);
+static remote_t *create_remote(listen_ctx_t *listener, struct sockaddr *addr, int direct,
+                               int upstream, int profile);
+
+LOOP_STAT_DEFINE(server_recv_cb, ev_io)
+LOOP_STAT_DEFINE(server_send_cb, ev_io)
+LOOP_STAT_DEFINE(remote_recv_cb, ev_io)
+LOOP_STAT_DEFINE(remote_send_cb, ev_io)
+LOOP_STAT_DEFINE(accept_cb, ev_io)
+LOOP_STAT_DEFINE(delayed_connect_cb, ev_timer)
+LOOP_STAT_DEFINE(remote_timeout_cb, ev_timer)
 static void free_remote(remote_t *remote);
 static void close_and_free_remote(EV_P_ remote_t *remote);
 static void free_server(server_t *server);
@@ -146,6 +167,12 @@ static server_t *new_server(int fd);
 
 static struct cork_dllist connections;
 
+// Connection slabs, from the huge page arena with --huge-pages
+static arena_pool_t server_pool     = ARENA_POOL(server_t);
+static arena_pool_t server_ctx_pool = ARENA_POOL(server_ctx_t);
+static arena_pool_t remote_pool     = ARENA_POOL(remote_t);
+static arena_pool_t remote_ctx_pool = ARENA_POOL(remote_ctx_t);
+
 #ifndef __MINGW32__
 int
 setnonblocking(int fd)
@@ -194,6 +221,7 @@ create_and_bind(const char *addr, const char *port)
 #ifdef SO_NOSIGPIPE
         setsockopt(listen_sock, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
 #endif
+        BUSY_POLL(listen_sock);
         if (reuse_port) {
             int err = set_reuseport(listen_sock);
             if (err == 0) {
@@ -261,6 +289,64 @@ free_connections(struct ev_loop *loop)
     }
 }
 
+#ifndef LIB_ONLY
+/*
+ * Heap held by the live connections, by component. Watchers are
+ * embedded in the context structs and counted apart from them.
+ */
+static void
+mem_cmd_cb(const char *data, control_reply_t *reply)
+{
+    struct cork_dllist_item *curr, *next;
+    size_t conns = 0, remotes = 0;
+    size_t state = 0, watchers = 0, buffers = 0, ciphers = 0;
+
+    cork_dllist_foreach_void(&connections, curr, next) {
+        server_t *server = cork_container_of(curr, server_t, entries);
+        remote_t *remote = server->remote;
+
+        conns++;
+        state    += sizeof(server_t) + 2 * sizeof(server_ctx_t);
+        watchers += 2 * sizeof(ev_io) + sizeof(ev_timer);
+        buffers  += sizeof(buffer_t) + server->buf->capacity;
+        ciphers  += crypto_ctx_mem(server->e_ctx) + crypto_ctx_mem(server->d_ctx);
+
+        // The address header is dropped once it has been sent
+        if (server->abuf != NULL)
+            buffers += sizeof(buffer_t) + server->abuf->capacity;
+        if (server->trace != NULL)
+            state += sizeof(trace_t);
+        if (server->flow != NULL)
+            state += sizeof(flowlog_t) +
+                     server->flow->capacity * sizeof(flowlog_event_t);
+
+        if (remote != NULL) {
+            remotes++;
+            state    += sizeof(remote_t) + 2 * sizeof(remote_ctx_t);
+            watchers += 2 * (sizeof(ev_io) + sizeof(ev_timer));
+            buffers  += sizeof(buffer_t) + remote->buf->capacity;
+        }
+    }
+
+    control_reply(reply, "{\"connections\":%zu,\"remotes\":%zu,\"state\":%zu,"
+                  "\"watchers\":%zu,\"buffers\":%zu,\"ciphers\":%zu}\n",
+                  conns, remotes, state - watchers, watchers, buffers, ciphers);
+}
+#endif
+
+static void
+update_prio(EV_P_ server_t *server, size_t size)
+{
+    int cls = prio_update(EV_A_ & server->prio, size);
+
+    prio_watcher(EV_A_ & server->recv_ctx->io, cls);
+    prio_watcher(EV_A_ & server->send_ctx->io, cls);
+    if (server->remote != NULL) {
+        prio_watcher(EV_A_ & server->remote->recv_ctx->io, cls);
+        prio_watcher(EV_A_ & server->remote->send_ctx->io, cls);
+    }
+}
+
 static void
 delayed_connect_cb(EV_P_ ev_timer *watcher, int revents)
 {
@@ -377,7 +463,7 @@ server_handshake(EV_P_ ev_io *w, buffer_t *buf)
         memcpy(abuf->data + abuf->len, buf->data + request_len, in_addr_len + 2);
         abuf->len += in_addr_len + 2;
 
-        if (acl || verbose) {
+        if (acl || verbose || server->trace) {
             uint16_t p = load16_be(buf->data + request_len + in_addr_len);
             if (!inet_ntop(AF_INET, (const void *)(buf->data + request_len),
                            ip, INET_ADDRSTRLEN)) {
@@ -395,7 +481,7 @@ server_handshake(EV_P_ ev_io *w, buffer_t *buf)
         memcpy(abuf->data + abuf->len, buf->data + request_len + 1, name_len + 2);
         abuf->len += name_len + 2;
 
-        if (acl || verbose) {
+        if (acl || verbose || server->trace) {
             uint16_t p = load16_be(buf->data + request_len + 1 + name_len);
             memcpy(host, buf->data + request_len + 1, name_len);
             host[name_len] = '\0';
@@ -409,7 +495,7 @@ server_handshake(EV_P_ ev_io *w, buffer_t *buf)
         memcpy(abuf->data + abuf->len, buf->data + request_len, in6_addr_len + 2);
         abuf->len += in6_addr_len + 2;
 
-        if (acl || verbose) {
+        if (acl || verbose || server->trace) {
             uint16_t p = load16_be(buf->data + request_len + in6_addr_len);
             if (!inet_ntop(AF_INET6, (const void *)(buf->data + request_len),
                            ip, INET6_ADDRSTRLEN)) {
@@ -446,6 +532,17 @@ server_handshake(EV_P_ ev_io *w, buffer_t *buf)
             LOGI("connect to [%s]:%s", ip, port);
     }
 
+    if (server->trace != NULL) {
+        trace_set_dest(server->trace, atyp == SOCKS5_ATYP_DOMAIN ? host : ip, atoi(port));
+    }
+    if (server->flow != NULL) {
+        flowlog_set_dest(server->flow, abuf->data);
+    }
+    prio_set_port(&server->prio, load16_be(abuf->data + abuf->len - 2));
+
+    int upstream = -1;
+    int profile  = sockprof_match(!acl ? NULL : atyp == SOCKS5_ATYP_DOMAIN ? host : ip);
+
     if (acl
 #ifdef __ANDROID__
         && !(vpn && strcmp(port, "53") == 0)
@@ -458,10 +555,14 @@ server_handshake(EV_P_ ev_io *w, buffer_t *buf)
         int err;
 
         int host_match = 0;
-        if (atyp == SOCKS5_ATYP_DOMAIN)
+        if (atyp == SOCKS5_ATYP_DOMAIN) {
+            upstream   = acl_match_upstream(host);
             host_match = acl_match_host(host);
+        }
 
-        if (host_match > 0)
+        if (upstream >= 0)
+            bypass = 0;                             // proxy hostnames in upstream lists
+        else if (host_match > 0)
             bypass = 1;                             // bypass hostnames in black list
         else if (host_match < 0)
             bypass = 0;                             // proxy hostnames in white list
@@ -471,7 +572,10 @@ server_handshake(EV_P_ ev_io *w, buffer_t *buf)
                 && !vpn
 #endif
                 ) {           // resolve domain so we can bypass domain with geoip
-                if (get_sockaddr(host, port, &storage, 0, ipv6first))
+                TRACE(server->trace, TRACE_RESOLVE_START, 0);
+                err = get_sockaddr(host, port, &storage, 0, ipv6first);
+                TRACE(server->trace, TRACE_RESOLVE_END, 0);
+                if (err)
                     goto not_bypass;
                 resolved = 1;
                 switch (((struct sockaddr *)&storage)->sa_family) {
@@ -497,6 +601,12 @@ server_handshake(EV_P_ ev_io *w, buffer_t *buf)
             int ip_match = (resolved || atyp == SOCKS5_ATYP_IPV4
                             || atyp == SOCKS5_ATYP_IPV6) ? acl_match_host(ip) : 0;
 
+            if (resolved || atyp == SOCKS5_ATYP_IPV4 || atyp == SOCKS5_ATYP_IPV6)
+                upstream = acl_match_upstream(ip);
+
+            if (upstream >= 0)
+                ip_match = -1;                                                // proxy IPs in upstream lists
+
             switch (get_acl_mode()) {
             case BLACK_LIST:
                 if (ip_match > 0)
@@ -525,11 +635,16 @@ server_handshake(EV_P_ ev_io *w, buffer_t *buf)
                     goto not_bypass;
                 else
 #endif
-                err = get_sockaddr(host, port, &storage, 0, ipv6first);
+                {
+                    TRACE(server->trace, TRACE_RESOLVE_START, 0);
+                    err = get_sockaddr(host, port, &storage, 0, ipv6first);
+                    TRACE(server->trace, TRACE_RESOLVE_END, 0);
+                }
             else
                 err = get_sockaddr(ip, port, &storage, 0, ipv6first);
             if (err != -1) {
-                remote = create_remote(server->listener, (struct sockaddr *)&storage, 1);
+                remote = create_remote(server->listener, (struct sockaddr *)&storage, 1, -1,
+                                       profile);
             }
         }
     }
@@ -537,11 +652,12 @@ server_handshake(EV_P_ ev_io *w, buffer_t *buf)
 not_bypass:
     // Not bypass
     if (remote == NULL) {
-        remote = create_remote(server->listener, NULL, 0);
+        remote = create_remote(server->listener, NULL, 0, upstream, profile);
     }
 
     if (remote == NULL) {
         LOGE("invalid remote addr");
+        TRACE_REASON(server->trace, TRACE_CLOSE_CONNECT);
         close_and_free_server(EV_A_ server);
         return -1;
     }
@@ -550,6 +666,7 @@ not_bypass:
         int err = crypto->encrypt(abuf, server->e_ctx, SOCKET_BUF_SIZE);
         if (err) {
             LOGE("invalid password or cipher");
+            TRACE_REASON(server->trace, TRACE_CLOSE_CRYPTO);
             close_and_free_remote(EV_A_ remote);
             close_and_free_server(EV_A_ server);
             return -1;
@@ -586,6 +703,11 @@ server_stream(EV_P_ ev_io *w, buffer_t *buf)
         return;
     }
 
+    FLOWLOG(server->flow, FLOWLOG_UP, remote->buf->len);
+    if (priority_classes) {
+        update_prio(EV_A_ server, remote->buf->len);
+    }
+
     // insert shadowsocks header
     if (!remote->direct) {
 #ifdef __ANDROID__
@@ -595,6 +717,7 @@ server_stream(EV_P_ ev_io *w, buffer_t *buf)
 
         if (err) {
             LOGE("invalid password or cipher");
+            TRACE_REASON(server->trace, TRACE_CLOSE_CRYPTO);
             close_and_free_remote(EV_A_ remote);
             close_and_free_server(EV_A_ server);
             return;
@@ -630,20 +753,23 @@ server_stream(EV_P_ ev_io *w, buffer_t *buf)
 
         remote->buf->idx = 0;
 
+        TRACE(server->trace, TRACE_CONNECT_START, 0);
+
         if (!fast_open || remote->direct) {
             // connecting, wait until connected
             int r = connect(remote->fd, (struct sockaddr *)&(remote->addr), remote->addr_len);
 
             if (r == -1 && errno != CONNECT_IN_PROGRESS) {
                 ERROR("connect");
+                TRACE_REASON(server->trace, TRACE_CLOSE_CONNECT);
                 close_and_free_remote(EV_A_ remote);
                 close_and_free_server(EV_A_ server);
                 return;
             }
 
             // wait on remote connected event
-            ev_io_stop(EV_A_ & server_recv_ctx->io);
-            ev_io_start(EV_A_ & remote->send_ctx->io);
+            edge_io_stop(EV_A_ & server_recv_ctx->io);
+            edge_io_start(EV_A_ & remote->send_ctx->io);
             ev_timer_start(EV_A_ & remote->send_ctx->watcher);
         } else {
 #if defined(MSG_FASTOPEN) && !defined(TCP_FASTOPEN_CONNECT)
@@ -722,8 +848,8 @@ server_stream(EV_P_ ev_io *w, buffer_t *buf)
                 if (errno == CONNECT_IN_PROGRESS) {
                     // in progress, wait until connected
                     remote->buf->idx = 0;
-                    ev_io_stop(EV_A_ & server_recv_ctx->io);
-                    ev_io_start(EV_A_ & remote->send_ctx->io);
+                    edge_io_stop(EV_A_ & server_recv_ctx->io);
+                    edge_io_start(EV_A_ & remote->send_ctx->io);
                     return;
                 } else {
                     if (errno == EOPNOTSUPP || errno == EPROTONOSUPPORT ||
@@ -734,6 +860,7 @@ server_stream(EV_P_ ev_io *w, buffer_t *buf)
                     } else {
                         ERROR("fast_open_connect");
                     }
+                    TRACE_REASON(server->trace, TRACE_CLOSE_CONNECT);
                     close_and_free_remote(EV_A_ remote);
                     close_and_free_server(EV_A_ server);
                     return;
@@ -742,8 +869,8 @@ server_stream(EV_P_ ev_io *w, buffer_t *buf)
                 remote->buf->len -= s;
                 remote->buf->idx  = s;
 
-                ev_io_stop(EV_A_ & server_recv_ctx->io);
-                ev_io_start(EV_A_ & remote->send_ctx->io);
+                edge_io_stop(EV_A_ & server_recv_ctx->io);
+                edge_io_start(EV_A_ & remote->send_ctx->io);
                 ev_timer_start(EV_A_ & remote->send_ctx->watcher);
                 return;
             }
@@ -753,21 +880,26 @@ server_stream(EV_P_ ev_io *w, buffer_t *buf)
         if (s == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // no data, wait for send
+                TRACE(server->trace, TRACE_STALL, TRACE_TO_REMOTE);
                 remote->buf->idx = 0;
-                ev_io_stop(EV_A_ & server_recv_ctx->io);
-                ev_io_start(EV_A_ & remote->send_ctx->io);
+                edge_io_again(&remote->send_ctx->io);
+                edge_io_stop(EV_A_ & server_recv_ctx->io);
+                edge_io_start(EV_A_ & remote->send_ctx->io);
                 return;
             } else {
                 ERROR("server_recv_cb_send");
+                TRACE_REASON(server->trace, TRACE_CLOSE_ERROR);
                 close_and_free_remote(EV_A_ remote);
                 close_and_free_server(EV_A_ server);
                 return;
             }
         } else if (s < (int)(remote->buf->len)) {
+            TRACE(server->trace, TRACE_STALL, TRACE_TO_REMOTE);
             remote->buf->len -= s;
             remote->buf->idx  = s;
-            ev_io_stop(EV_A_ & server_recv_ctx->io);
-            ev_io_start(EV_A_ & remote->send_ctx->io);
+            edge_io_again(&remote->send_ctx->io);
+            edge_io_stop(EV_A_ & server_recv_ctx->io);
+            edge_io_start(EV_A_ & remote->send_ctx->io);
             return;
         } else {
             remote->buf->idx = 0;
@@ -785,6 +917,11 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
     buffer_t *buf;
     ssize_t r;
 
+    if (revents != EV_TIMER && server->stage == STAGE_STREAM
+        && PRIO_DEFER(&server->prio)) {
+        return;
+    }
+
     ev_timer_stop(EV_A_ & server->delayed_connect_watcher);
 
     if (remote == NULL) {
@@ -798,6 +935,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
 
         if (r == 0) {
             // connection closed
+            TRACE_REASON(server->trace, TRACE_CLOSE_CLIENT);
             close_and_free_remote(EV_A_ remote);
             close_and_free_server(EV_A_ server);
             return;
@@ -805,10 +943,12 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // no data
                 // continue to wait for recv
+                edge_io_again(&server_recv_ctx->io);
                 return;
             } else {
                 if (verbose)
                     ERROR("server_recv_cb_recv");
+                TRACE_REASON(server->trace, TRACE_CLOSE_ERROR);
                 close_and_free_remote(EV_A_ remote);
                 close_and_free_server(EV_A_ server);
                 return;
@@ -900,12 +1040,18 @@ server_send_cb(EV_P_ ev_io *w, int revents)
         if (s == -1) {
             if (errno != EAGAIN && errno != EWOULDBLOCK) {
                 ERROR("server_send_cb_send");
+                TRACE_REASON(server->trace, TRACE_CLOSE_ERROR);
                 close_and_free_remote(EV_A_ remote);
                 close_and_free_server(EV_A_ server);
+            } else {
+                TRACE(server->trace, TRACE_STALL, TRACE_TO_CLIENT);
+                edge_io_again(&server_send_ctx->io);
             }
             return;
         } else if (s < (ssize_t)(server->buf->len)) {
             // partly sent, move memory, wait for the next time to send
+            TRACE(server->trace, TRACE_STALL, TRACE_TO_CLIENT);
+            edge_io_again(&server_send_ctx->io);
             server->buf->len -= s;
             server->buf->idx += s;
             return;
@@ -913,8 +1059,8 @@ server_send_cb(EV_P_ ev_io *w, int revents)
             // all sent out, wait for reading
             server->buf->len = 0;
             server->buf->idx = 0;
-            ev_io_stop(EV_A_ & server_send_ctx->io);
-            ev_io_start(EV_A_ & remote->recv_ctx->io);
+            edge_io_stop(EV_A_ & server_send_ctx->io);
+            edge_io_start(EV_A_ & remote->recv_ctx->io);
             return;
         }
     }
@@ -946,6 +1092,7 @@ remote_timeout_cb(EV_P_ ev_timer *watcher, int revents)
         LOGI("TCP connection timeout");
     }
 
+    TRACE_REASON(server->trace, TRACE_CLOSE_TIMEOUT);
     close_and_free_remote(EV_A_ remote);
     close_and_free_server(EV_A_ server);
 }
@@ -957,10 +1104,15 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
     remote_t *remote              = remote_recv_ctx->remote;
     server_t *server              = remote->server;
 
+    if (PRIO_DEFER(&server->prio)) {
+        return;
+    }
+
     ssize_t r = recv(remote->fd, server->buf->data, SOCKET_BUF_SIZE, 0);
 
     if (r == 0) {
         // connection closed
+        TRACE_REASON(server->trace, TRACE_CLOSE_REMOTE);
         close_and_free_remote(EV_A_ remote);
         close_and_free_server(EV_A_ server);
         return;
@@ -968,9 +1120,11 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data
             // continue to wait for recv
+            edge_io_again(&remote_recv_ctx->io);
             return;
         } else {
             ERROR("remote_recv_cb_recv");
+            TRACE_REASON(server->trace, TRACE_CLOSE_ERROR);
             close_and_free_remote(EV_A_ remote);
             close_and_free_server(EV_A_ server);
             return;
@@ -979,6 +1133,8 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
 
     server->buf->len = r;
 
+    TRACE(server->trace, TRACE_FIRST_BYTE, 0);
+
     if (!remote->direct) {
 #ifdef __ANDROID__
         rx += server->buf->len;
@@ -987,12 +1143,19 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
         int err = crypto->decrypt(server->buf, server->d_ctx, SOCKET_BUF_SIZE);
         if (err == CRYPTO_ERROR) {
             LOGE("invalid password or cipher");
+            TRACE_REASON(server->trace, TRACE_CLOSE_CRYPTO);
             close_and_free_remote(EV_A_ remote);
             close_and_free_server(EV_A_ server);
             return;
         } else if (err == CRYPTO_NEED_MORE) {
             return; // Wait for more
         }
+        TRACE(server->trace, TRACE_DECRYPT, 0);
+    }
+
+    FLOWLOG(server->flow, FLOWLOG_DOWN, server->buf->len);
+    if (priority_classes) {
+        update_prio(EV_A_ server, server->buf->len);
     }
 
     int s = send(server->fd, server->buf->data, server->buf->len, 0);
@@ -1000,20 +1163,25 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
     if (s == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data, wait for send
+            TRACE(server->trace, TRACE_STALL, TRACE_TO_CLIENT);
             server->buf->idx = 0;
-            ev_io_stop(EV_A_ & remote_recv_ctx->io);
-            ev_io_start(EV_A_ & server->send_ctx->io);
+            edge_io_again(&server->send_ctx->io);
+            edge_io_stop(EV_A_ & remote_recv_ctx->io);
+            edge_io_start(EV_A_ & server->send_ctx->io);
         } else {
             ERROR("remote_recv_cb_send");
+            TRACE_REASON(server->trace, TRACE_CLOSE_ERROR);
             close_and_free_remote(EV_A_ remote);
             close_and_free_server(EV_A_ server);
             return;
         }
     } else if (s < (int)(server->buf->len)) {
+        TRACE(server->trace, TRACE_STALL, TRACE_TO_CLIENT);
         server->buf->len -= s;
         server->buf->idx  = s;
-        ev_io_stop(EV_A_ & remote_recv_ctx->io);
-        ev_io_start(EV_A_ & server->send_ctx->io);
+        edge_io_again(&server->send_ctx->io);
+        edge_io_stop(EV_A_ & remote_recv_ctx->io);
+        edge_io_start(EV_A_ & server->send_ctx->io);
     }
 
     // Disable TCP_NODELAY after the first response are sent
@@ -1069,18 +1237,23 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
         int r         = getpeername(remote->fd, (struct sockaddr *)&addr, &len);
         if (r == 0) {
             remote_send_ctx->connected = 1;
+            TRACE(server->trace, TRACE_CONNECT_END, 0);
+            if (server->flow != NULL) {
+                flowlog_connected(server->flow);
+            }
             ev_timer_stop(EV_A_ & remote_send_ctx->watcher);
-            ev_io_start(EV_A_ & remote->recv_ctx->io);
+            edge_io_start(EV_A_ & remote->recv_ctx->io);
 
             // no need to send any data
             if (remote->buf->len == 0) {
-                ev_io_stop(EV_A_ & remote_send_ctx->io);
-                ev_io_start(EV_A_ & server->recv_ctx->io);
+                edge_io_stop(EV_A_ & remote_send_ctx->io);
+                edge_io_start(EV_A_ & server->recv_ctx->io);
                 return;
             }
         } else {
             // not connected
             ERROR("getpeername");
+            TRACE_REASON(server->trace, TRACE_CLOSE_CONNECT);
             close_and_free_remote(EV_A_ remote);
             close_and_free_server(EV_A_ server);
             return;
@@ -1099,13 +1272,19 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
         if (s == -1) {
             if (errno != EAGAIN && errno != EWOULDBLOCK) {
                 ERROR("remote_send_cb_send");
+                TRACE_REASON(server->trace, TRACE_CLOSE_ERROR);
                 // close and free
                 close_and_free_remote(EV_A_ remote);
                 close_and_free_server(EV_A_ server);
+            } else {
+                TRACE(server->trace, TRACE_STALL, TRACE_TO_REMOTE);
+                edge_io_again(&remote_send_ctx->io);
             }
             return;
         } else if (s < (ssize_t)(remote->buf->len)) {
             // partly sent, move memory, wait for the next time to send
+            TRACE(server->trace, TRACE_STALL, TRACE_TO_REMOTE);
+            edge_io_again(&remote_send_ctx->io);
             remote->buf->len -= s;
             remote->buf->idx += s;
             return;
@@ -1113,8 +1292,8 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
             // all sent out, wait for reading
             remote->buf->len = 0;
             remote->buf->idx = 0;
-            ev_io_stop(EV_A_ & remote_send_ctx->io);
-            ev_io_start(EV_A_ & server->recv_ctx->io);
+            edge_io_stop(EV_A_ & remote_send_ctx->io);
+            edge_io_start(EV_A_ & server->recv_ctx->io);
         }
     }
 }
@@ -1123,13 +1302,13 @@ static remote_t *
 new_remote(int fd, int timeout)
 {
     remote_t *remote;
-    remote = ss_malloc(sizeof(remote_t));
+    remote = arena_get(&remote_pool);
 
     memset(remote, 0, sizeof(remote_t));
 
     remote->buf      = ss_malloc(sizeof(buffer_t));
-    remote->recv_ctx = ss_malloc(sizeof(remote_ctx_t));
-    remote->send_ctx = ss_malloc(sizeof(remote_ctx_t));
+    remote->recv_ctx = arena_get(&remote_ctx_pool);
+    remote->send_ctx = arena_get(&remote_ctx_pool);
     balloc(remote->buf, SOCKET_BUF_SIZE);
     memset(remote->recv_ctx, 0, sizeof(remote_ctx_t));
     memset(remote->send_ctx, 0, sizeof(remote_ctx_t));
@@ -1139,9 +1318,10 @@ new_remote(int fd, int timeout)
     remote->recv_ctx->remote    = remote;
     remote->send_ctx->remote    = remote;
 
-    ev_io_init(&remote->recv_ctx->io, remote_recv_cb, fd, EV_READ);
-    ev_io_init(&remote->send_ctx->io, remote_send_cb, fd, EV_WRITE);
-    ev_timer_init(&remote->send_ctx->watcher, remote_timeout_cb,
+    ev_io_init(&remote->recv_ctx->io, LOOP_STAT_CB(remote_recv_cb), fd, EV_READ);
+    ev_io_init(&remote->send_ctx->io, LOOP_STAT_CB(remote_send_cb), fd, EV_WRITE);
+    edge_add(fd, &remote->recv_ctx->io, &remote->send_ctx->io);
+    ev_timer_init(&remote->send_ctx->watcher, LOOP_STAT_CB(remote_timeout_cb),
                   min(MAX_CONNECT_TIMEOUT, timeout), 0);
 
     return remote;
@@ -1157,9 +1337,9 @@ free_remote(remote_t *remote)
         bfree(remote->buf);
         ss_free(remote->buf);
     }
-    ss_free(remote->recv_ctx);
-    ss_free(remote->send_ctx);
-    ss_free(remote);
+    arena_put(&remote_ctx_pool, remote->recv_ctx);
+    arena_put(&remote_ctx_pool, remote->send_ctx);
+    arena_put(&remote_pool, remote);
 }
 
 static void
@@ -1167,8 +1347,9 @@ close_and_free_remote(EV_P_ remote_t *remote)
 {
     if (remote != NULL) {
         ev_timer_stop(EV_A_ & remote->send_ctx->watcher);
-        ev_io_stop(EV_A_ & remote->send_ctx->io);
-        ev_io_stop(EV_A_ & remote->recv_ctx->io);
+        edge_io_stop(EV_A_ & remote->send_ctx->io);
+        edge_io_stop(EV_A_ & remote->recv_ctx->io);
+        edge_del(remote->fd);
         close(remote->fd);
         free_remote(remote);
     }
@@ -1178,12 +1359,12 @@ static server_t *
 new_server(int fd)
 {
     server_t *server;
-    server = ss_malloc(sizeof(server_t));
+    server = arena_get(&server_pool);
 
     memset(server, 0, sizeof(server_t));
 
-    server->recv_ctx = ss_malloc(sizeof(server_ctx_t));
-    server->send_ctx = ss_malloc(sizeof(server_ctx_t));
+    server->recv_ctx = arena_get(&server_ctx_pool);
+    server->send_ctx = arena_get(&server_ctx_pool);
     server->buf      = ss_malloc(sizeof(buffer_t));
     server->abuf     = ss_malloc(sizeof(buffer_t));
     balloc(server->buf, SOCKET_BUF_SIZE);
@@ -1196,17 +1377,20 @@ new_server(int fd)
     server->fd                  = fd;
     server->recv_ctx->server    = server;
     server->send_ctx->server    = server;
+    server->trace               = trace_new();
+    server->flow                = flowlog_new(FLOWLOG_TCP);
 
     server->e_ctx = ss_malloc(sizeof(cipher_ctx_t));
     server->d_ctx = ss_malloc(sizeof(cipher_ctx_t));
     crypto->ctx_init(crypto->cipher, server->e_ctx, 1);
     crypto->ctx_init(crypto->cipher, server->d_ctx, 0);
 
-    ev_io_init(&server->recv_ctx->io, server_recv_cb, fd, EV_READ);
-    ev_io_init(&server->send_ctx->io, server_send_cb, fd, EV_WRITE);
+    ev_io_init(&server->recv_ctx->io, LOOP_STAT_CB(server_recv_cb), fd, EV_READ);
+    ev_io_init(&server->send_ctx->io, LOOP_STAT_CB(server_send_cb), fd, EV_WRITE);
+    edge_add(fd, &server->recv_ctx->io, &server->send_ctx->io);
 
     ev_timer_init(&server->delayed_connect_watcher,
-                  delayed_connect_cb, 0.05, 0);
+                  LOOP_STAT_CB(delayed_connect_cb), 0.05, 0);
 
     cork_dllist_add(&connections, &server->entries);
 
@@ -1237,18 +1421,21 @@ free_server(server_t *server)
         bfree(server->abuf);
         ss_free(server->abuf);
     }
-    ss_free(server->recv_ctx);
-    ss_free(server->send_ctx);
-    ss_free(server);
+    trace_free(server->trace);
+    flowlog_free(server->flow);
+    arena_put(&server_ctx_pool, server->recv_ctx);
+    arena_put(&server_ctx_pool, server->send_ctx);
+    arena_put(&server_pool, server);
 }
 
 static void
 close_and_free_server(EV_P_ server_t *server)
 {
     if (server != NULL) {
-        ev_io_stop(EV_A_ & server->send_ctx->io);
-        ev_io_stop(EV_A_ & server->recv_ctx->io);
+        edge_io_stop(EV_A_ & server->send_ctx->io);
+        edge_io_stop(EV_A_ & server->recv_ctx->io);
         ev_timer_stop(EV_A_ & server->delayed_connect_watcher);
+        edge_del(server->fd);
         close(server->fd);
         free_server(server);
     }
@@ -1257,15 +1444,22 @@ close_and_free_server(EV_P_ server_t *server)
 static remote_t *
 create_remote(listen_ctx_t *listener,
               struct sockaddr *addr,
-              int direct)
+              int direct,
+              int upstream,
+              int profile)
 {
     struct sockaddr *remote_addr;
 
-    int index = rand() % listener->remote_num;
-    if (addr == NULL) {
-        remote_addr = listener->remote_addr[index];
-    } else {
+    if (addr != NULL) {
         remote_addr = addr;
+    } else if (upstream >= 0 && upstream < listener->upstream_num
+               && listener->upstream[upstream].remote_num > 0) {
+        upstream_t *group = &listener->upstream[upstream];
+        remote_addr = group->remote_addr[rand() % group->remote_num];
+        if (group->profile != SOCKPROF_NONE)
+            profile = group->profile;
+    } else {
+        remote_addr = listener->remote_addr[rand() % listener->remote_num];
     }
 
     int remotefd = socket(remote_addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
@@ -1280,6 +1474,7 @@ create_remote(listen_ctx_t *listener,
 #ifdef SO_NOSIGPIPE
     setsockopt(remotefd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
 #endif
+    BUSY_POLL(remotefd);
 
     if (listener->mptcp > 1) {
         int err = setsockopt(remotefd, SOL_TCP, listener->mptcp, &opt, sizeof(opt));
@@ -1300,6 +1495,8 @@ create_remote(listen_ctx_t *listener,
         }
     }
 
+    sockprof_apply(remotefd, profile);
+
     // Setup
     setnonblocking(remotefd);
 #ifdef SET_INTERFACE
@@ -1389,14 +1586,74 @@ accept_cb(EV_P_ ev_io *w, int revents)
 #ifdef SO_NOSIGPIPE
     setsockopt(serverfd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
 #endif
+    BUSY_POLL(serverfd);
 
     server_t *server = new_server(serverfd);
     server->listener = listener;
 
-    ev_io_start(EV_A_ & server->recv_ctx->io);
+    edge_io_start(EV_A_ & server->recv_ctx->io);
 }
 
 #ifndef LIB_ONLY
+static void
+init_upstreams(listen_ctx_t *listener, ss_upstream_t *upstreams, int upstream_num,
+               char *remote_port)
+{
+    int i, j, k;
+    int num = get_upstream_num();
+
+    listener->upstream     = ss_malloc(sizeof(upstream_t) * num);
+    listener->upstream_num = num;
+    memset(listener->upstream, 0, sizeof(upstream_t) * num);
+
+    for (i = 0; i < num; i++) {
+        const char *name    = get_upstream_name(i);
+        ss_upstream_t *conf = NULL;
+        listener->upstream[i].profile = sockprof_find(name);
+        for (j = 0; j < upstream_num; j++)
+            if (strcmp(upstreams[j].name, name) == 0) {
+                conf = &upstreams[j];
+                break;
+            }
+        if (conf == NULL) {
+            LOGE("no servers for upstream %s, falling back to the default servers", name);
+            continue;
+        }
+
+        upstream_t *group = &listener->upstream[i];
+        group->remote_addr = ss_malloc(sizeof(struct sockaddr *) * conf->remote_num);
+        for (k = 0; k < conf->remote_num; k++) {
+            char *host = conf->remote_addr[k].host;
+            char *port = conf->remote_addr[k].port == NULL ? remote_port :
+                         conf->remote_addr[k].port;
+            struct sockaddr_storage *storage = ss_malloc(sizeof(struct sockaddr_storage));
+            memset(storage, 0, sizeof(struct sockaddr_storage));
+            if (get_sockaddr(host, port, storage, 1, ipv6first) == -1) {
+                FATAL("failed to resolve the provided hostname");
+            }
+            group->remote_addr[group->remote_num++] = (struct sockaddr *)storage;
+        }
+
+        if (verbose) {
+            LOGI("upstream %s: %d server(s)", name, group->remote_num);
+        }
+    }
+}
+
+static void
+free_upstreams(listen_ctx_t *listener)
+{
+    int i, j;
+    for (i = 0; i < listener->upstream_num; i++) {
+        upstream_t *group = &listener->upstream[i];
+        for (j = 0; j < group->remote_num; j++)
+            ss_free(group->remote_addr[j]);
+        ss_free(group->remote_addr);
+    }
+    ss_free(listener->upstream);
+    listener->upstream_num = 0;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -1415,6 +1672,10 @@ main(int argc, char **argv)
     char *conf_path  = NULL;
     char *iface      = NULL;
 
+    char *control_addr     = NULL;
+    char *flow_log         = NULL;
+    int trace_threshold_ms = 0;
+
     char *plugin      = NULL;
     char *plugin_opts = NULL;
     char *plugin_host = NULL;
@@ -1423,7 +1684,11 @@ main(int argc, char **argv)
 
     int remote_num = 0;
     ss_addr_t remote_addr[MAX_REMOTE_NUM];
-    char *remote_port = NULL;
+    int upstream_num         = 0;
+    ss_upstream_t *upstreams = NULL;
+    int sockprof_num         = 0;
+    ss_sockprof_t *sockprofs = NULL;
+    char *remote_port        = NULL;
 
     memset(remote_addr, 0, sizeof(ss_addr_t) * MAX_REMOTE_NUM);
     srand(time(NULL));
@@ -1432,9 +1697,25 @@ main(int argc, char **argv)
         { "reuse-port",  no_argument,       NULL, GETOPT_VAL_REUSE_PORT  },
         { "fast-open",   no_argument,       NULL, GETOPT_VAL_FAST_OPEN   },
         { "no-delay",    no_argument,       NULL, GETOPT_VAL_NODELAY     },
+        { "edge-triggered", no_argument,    NULL, GETOPT_VAL_EDGE_TRIGGERED },
+        { "priority-classes", no_argument,  NULL,
+          GETOPT_VAL_PRIORITY_CLASSES },
+        { "busy-poll",   required_argument, NULL, GETOPT_VAL_BUSY_POLL   },
+        { "huge-pages",  required_argument, NULL, GETOPT_VAL_HUGE_PAGES  },
+        { "key-pool",    required_argument, NULL, GETOPT_VAL_KEY_POOL    },
+        { "udp-over-tcp", no_argument,      NULL, GETOPT_VAL_UDP_OVER_TCP },
+        { "mtu-discovery", no_argument,     NULL, GETOPT_VAL_MTU_DISCOVERY },
         { "acl",         required_argument, NULL, GETOPT_VAL_ACL         },
         { "mtu",         required_argument, NULL, GETOPT_VAL_MTU         },
         { "mptcp",       no_argument,       NULL, GETOPT_VAL_MPTCP       },
+        { "loop-stat",   no_argument,       NULL, GETOPT_VAL_LOOP_STAT   },
+        { "control-address", required_argument, NULL,
+          GETOPT_VAL_CONTROL_ADDRESS },
+        { "trace-sample", required_argument, NULL,
+          GETOPT_VAL_TRACE_SAMPLE },
+        { "trace-threshold", required_argument, NULL,
+          GETOPT_VAL_TRACE_THRESHOLD },
+        { "flow-log",    required_argument, NULL, GETOPT_VAL_FLOW_LOG    },
         { "plugin",      required_argument, NULL, GETOPT_VAL_PLUGIN      },
         { "plugin-opts", required_argument, NULL, GETOPT_VAL_PLUGIN_OPTS },
         { "password",    required_argument, NULL, GETOPT_VAL_PASSWORD    },
@@ -1474,6 +1755,21 @@ main(int argc, char **argv)
             no_delay = 1;
             LOGI("enable TCP no-delay");
             break;
+        case GETOPT_VAL_LOOP_STAT:
+            loop_stat = 1;
+            break;
+        case GETOPT_VAL_CONTROL_ADDRESS:
+            control_addr = optarg;
+            break;
+        case GETOPT_VAL_TRACE_SAMPLE:
+            trace_sample = atof(optarg);
+            break;
+        case GETOPT_VAL_TRACE_THRESHOLD:
+            trace_threshold_ms = atoi(optarg);
+            break;
+        case GETOPT_VAL_FLOW_LOG:
+            flow_log = optarg;
+            break;
         case GETOPT_VAL_PLUGIN:
             plugin = optarg;
             break;
@@ -1486,6 +1782,27 @@ main(int argc, char **argv)
         case GETOPT_VAL_REUSE_PORT:
             reuse_port = 1;
             break;
+        case GETOPT_VAL_EDGE_TRIGGERED:
+            edge_triggered = 1;
+            break;
+        case GETOPT_VAL_PRIORITY_CLASSES:
+            priority_classes = 1;
+            break;
+        case GETOPT_VAL_BUSY_POLL:
+            busy_poll = atoi(optarg);
+            break;
+        case GETOPT_VAL_HUGE_PAGES:
+            huge_pages = atoi(optarg);
+            break;
+        case GETOPT_VAL_KEY_POOL:
+            key_pool = atoi(optarg);
+            break;
+        case GETOPT_VAL_UDP_OVER_TCP:
+            udp_over_tcp = 1;
+            break;
+        case GETOPT_VAL_MTU_DISCOVERY:
+            mtu_discovery = 1;
+            break;
         case 's':
             if (remote_num < MAX_REMOTE_NUM) {
                 parse_addr(optarg, &remote_addr[remote_num++]);
@@ -1580,6 +1897,10 @@ main(int argc, char **argv)
             for (i = 0; i < remote_num; i++)
                 remote_addr[i] = conf->remote_addr[i];
         }
+        upstream_num = conf->upstream_num;
+        upstreams    = conf->upstream;
+        sockprof_num = conf->sockprof_num;
+        sockprofs    = conf->sockprof;
         if (remote_port == NULL) {
             remote_port = conf->remote_port;
         }
@@ -1628,6 +1949,42 @@ main(int argc, char **argv)
         if (no_delay == 0) {
             no_delay = conf->no_delay;
         }
+        if (loop_stat == 0) {
+            loop_stat = conf->loop_stat;
+        }
+        if (edge_triggered == 0) {
+            edge_triggered = conf->edge_triggered;
+        }
+        if (priority_classes == 0) {
+            priority_classes = conf->priority_classes;
+        }
+        if (busy_poll == 0) {
+            busy_poll = conf->busy_poll;
+        }
+        if (huge_pages == 0) {
+            huge_pages = conf->huge_pages;
+        }
+        if (key_pool == 0) {
+            key_pool = conf->key_pool;
+        }
+        if (udp_over_tcp == 0) {
+            udp_over_tcp = conf->udp_over_tcp;
+        }
+        if (mtu_discovery == 0) {
+            mtu_discovery = conf->mtu_discovery;
+        }
+        if (control_addr == NULL) {
+            control_addr = conf->control_address;
+        }
+        if (trace_sample == 0) {
+            trace_sample = conf->trace_sample;
+        }
+        if (trace_threshold_ms == 0) {
+            trace_threshold_ms = conf->trace_threshold;
+        }
+        if (flow_log == NULL) {
+            flow_log = conf->flow_log;
+        }
 #ifdef HAVE_SETRLIMIT
         if (nofile == 0) {
             nofile = conf->nofile;
@@ -1690,7 +2047,7 @@ main(int argc, char **argv)
     }
 
     if (method == NULL) {
-        method = "chacha20-ietf-poly1305";
+        method = DEFAULT_METHOD;
     }
 
     if (timeout == NULL) {
@@ -1803,6 +2160,11 @@ main(int argc, char **argv)
     signal(SIGABRT, SIG_IGN);
 #endif
 
+    // Before the ciphers, which set up the replay filter
+    if (huge_pages) {
+        arena_init();
+    }
+
     // Setup keys
     LOGI("initializing ciphers... %s", method);
     crypto = crypto_init(password, key, method);
@@ -1833,9 +2195,24 @@ main(int argc, char **argv)
         if (plugin != NULL)
             break;
     }
-    listen_ctx.timeout = atoi(timeout);
-    listen_ctx.iface   = iface;
-    listen_ctx.mptcp   = mptcp;
+    listen_ctx.timeout      = atoi(timeout);
+    listen_ctx.iface        = iface;
+    listen_ctx.mptcp        = mptcp;
+    listen_ctx.upstream_num = 0;
+    listen_ctx.upstream     = NULL;
+
+    // Before the upstream groups, which look up their profiles
+    if (sockprof_num > 0 && sockprof_init(sockprofs, sockprof_num) == 0) {
+        LOGI("using %d socket profiles", sockprof_num);
+    }
+
+    if (acl && get_upstream_num() > 0) {
+        if (plugin != NULL) {
+            LOGE("upstream lists are not supported with plugins, ignoring");
+        } else {
+            init_upstreams(&listen_ctx, upstreams, upstream_num, remote_port);
+        }
+    }
 
     // Setup signal handler
     ev_signal_init(&sigint_watcher, signal_cb, SIGINT);
@@ -1854,6 +2231,40 @@ main(int argc, char **argv)
 
     struct ev_loop *loop = EV_DEFAULT;
 
+    if (loop_stat) {
+        LOGI("enable event loop instrumentation");
+    }
+    loop_stat_init(loop);
+
+    if (edge_triggered && edge_init(loop) == 0) {
+        LOGI("enable edge-triggered readiness");
+    }
+
+    if (priority_classes) {
+        LOGI("enable interactive and bulk priority classes");
+        prio_init(loop);
+    }
+
+    if (busy_poll && busy_poll_init(loop) == 0) {
+        LOGI("enable busy polling for %d us", busy_poll);
+    }
+
+    if (key_pool && key_pool_init(loop, crypto) == 0) {
+        LOGI("keeping %d session keys ahead", key_pool);
+    }
+
+    trace_threshold = trace_threshold_ms / 1000.0;
+    if (control_addr != NULL && control_init(loop, control_addr) == 0) {
+        control_register("mem", mem_cmd_cb);
+        trace_init();
+    } else if (trace_sample > 0 || trace_threshold > 0) {
+        LOGE("connection tracing needs a working control address");
+    }
+
+    if (flow_log != NULL) {
+        flowlog_init(flow_log);
+    }
+
     if (mode != UDP_ONLY) {
         // Setup socket
         int listenfd;
@@ -1872,7 +2283,7 @@ main(int argc, char **argv)
 
         listen_ctx.fd = listenfd;
 
-        ev_io_init(&listen_ctx.io, accept_cb, listenfd, EV_READ);
+        ev_io_init(&listen_ctx.io, LOOP_STAT_CB(accept_cb), listenfd, EV_READ);
         ev_io_start(loop, &listen_ctx.io);
     }
 
@@ -1889,6 +2300,9 @@ main(int argc, char **argv)
         struct sockaddr *addr = (struct sockaddr *)storage;
         udp_fd = init_udprelay(local_addr, local_port, addr,
                                get_sockaddr_len(addr), mtu, crypto, listen_ctx.timeout, iface);
+        if (udp_over_tcp) {
+            LOGI("relay udp over tcp");
+        }
     }
 
 #ifdef HAVE_LAUNCHD
@@ -1919,6 +2333,9 @@ main(int argc, char **argv)
     }
 
     // Clean up
+    control_free(loop);
+    loop_stat_free(loop);
+
     if (plugin != NULL) {
         stop_plugin();
     }
@@ -1926,16 +2343,26 @@ main(int argc, char **argv)
     if (mode != UDP_ONLY) {
         ev_io_stop(loop, &listen_ctx.io);
         free_connections(loop);
+        edge_free(loop);
+        prio_free(loop);
+        busy_poll_free(loop);
+        key_pool_free(loop);
+        sockprof_free();
 
         for (i = 0; i < listen_ctx.remote_num; i++)
             ss_free(listen_ctx.remote_addr[i]);
         ss_free(listen_ctx.remote_addr);
+        free_upstreams(&listen_ctx);
     }
 
     if (mode != TCP_ONLY) {
         free_udprelay();
     }
 
+    trace_cleanup();
+    flowlog_cleanup();
+    arena_free();
+
 #ifdef __MINGW32__
     if (plugin_watcher.valid) {
         closesocket(plugin_watcher.fd);
@@ -2029,6 +2456,8 @@ _start_ss_local_server(profile_t profile, ss_local_callback callback, void *udat
     listen_ctx.timeout        = timeout;
     listen_ctx.iface          = NULL;
     listen_ctx.mptcp          = mptcp;
+    listen_ctx.upstream_num   = 0;
+    listen_ctx.upstream       = NULL;
 
     if (ss_is_ipv6addr(local_addr))
         LOGI("listening at [%s]:%s", local_addr, local_port_str);
@@ -2051,7 +2480,7 @@ _start_ss_local_server(profile_t profile, ss_local_callback callback, void *udat
 
         listen_ctx.fd = listenfd;
 
-        ev_io_init(&listen_ctx.io, accept_cb, listenfd, EV_READ);
+        ev_io_init(&listen_ctx.io, LOOP_STAT_CB(accept_cb), listenfd, EV_READ);
         ev_io_start(loop, &listen_ctx.io);
     }
 
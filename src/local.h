@@ -37,9 +37,16 @@
 
 #include "crypto.h"
 #include "jconf.h"
+#include "prio.h"
 
 #include "common.h"
 
+typedef struct upstream {
+    int remote_num;
+    struct sockaddr **remote_addr;
+    int profile; // the socket profile named like the group, if any
+} upstream_t;
+
 typedef struct listen_ctx {
     ev_io io;
     char *iface;
@@ -48,6 +55,8 @@ typedef struct listen_ctx {
     int fd;
     int mptcp;
     struct sockaddr **remote_addr;
+    int upstream_num;
+    upstream_t *upstream; // indexed by the ACL [upstream:<name>] lists
 } listen_ctx_t;
 
 typedef struct server_ctx {
@@ -56,6 +65,9 @@ typedef struct server_ctx {
     struct server *server;
 } server_ctx_t;
 
+struct trace;
+struct flowlog;
+
 typedef struct server {
     int fd;
     int stage;
@@ -71,6 +83,9 @@ typedef struct server {
     buffer_t *abuf;
 
     ev_timer delayed_connect_watcher;
+    struct trace *trace;
+    struct flowlog *flow;
+    prio_t prio;
 
     struct cork_dllist_item entries;
 } server_t;
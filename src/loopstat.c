@@ -0,0 +1,194 @@
+/*
+ * loopstat.c - Event loop lag and callback duration instrumentation
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "utils.h"
+#include "loopstat.h"
+
+#define MAX_CALLBACK_NUM 32
+
+typedef struct callback_stat {
+    const char *name;
+    uint64_t calls;
+    ev_tstamp total;
+    ev_tstamp max;
+} callback_stat_t;
+
+int loop_stat = 0;
+
+static ev_prepare prepare_watcher;
+static ev_check check_watcher;
+static ev_timer report_watcher;
+
+static ev_tstamp check_ts;      // when the last poll returned
+static ev_tstamp report_ts;
+static uint64_t iterations;
+static ev_tstamp busy_total;    // time spent running callbacks
+static ev_tstamp iteration_max;
+
+static ev_tstamp stall_max;
+static const char *stall_name;
+
+static int callback_num;
+static callback_stat_t callbacks[MAX_CALLBACK_NUM];
+
+ev_tstamp
+loop_stat_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+    return ev_time();
+}
+
+int
+loop_stat_register(const char *name)
+{
+    int i;
+    for (i = 0; i < callback_num; i++)
+        if (strcmp(callbacks[i].name, name) == 0)
+            return i;
+
+    if (callback_num >= MAX_CALLBACK_NUM)
+        return MAX_CALLBACK_NUM - 1;
+
+    callbacks[callback_num].name = name;
+    return callback_num++;
+}
+
+void
+loop_stat_record(int id, ev_tstamp start)
+{
+    ev_tstamp elapsed     = loop_stat_clock() - start;
+    callback_stat_t *stat = &callbacks[id];
+
+    stat->calls++;
+    stat->total += elapsed;
+    if (elapsed > stat->max)
+        stat->max = elapsed;
+
+    if (elapsed > stall_max) {
+        stall_max  = elapsed;
+        stall_name = stat->name;
+        // Only log when the worst stall of this period gets worse,
+        // so a storm of slow callbacks can't flood the log.
+        if (elapsed > LOOP_STAT_STALL) {
+            LOGE("loop stalled for %.1f ms in %s", elapsed * 1e3, stat->name);
+        }
+    }
+}
+
+/*
+ * From the return of one poll to the start of the next: the callbacks of
+ * one iteration, without the time spent waiting in poll.
+ */
+static void
+prepare_cb(EV_P_ ev_prepare *w, int revents)
+{
+    if (check_ts > 0) {
+        ev_tstamp iteration = loop_stat_clock() - check_ts;
+        busy_total += iteration;
+        if (iteration > iteration_max)
+            iteration_max = iteration;
+        check_ts = 0;
+    }
+}
+
+static void
+check_cb(EV_P_ ev_check *w, int revents)
+{
+    check_ts = loop_stat_clock();
+    iterations++;
+}
+
+static void
+report_cb(EV_P_ ev_timer *w, int revents)
+{
+    int i;
+    ev_tstamp now     = loop_stat_clock();
+    ev_tstamp elapsed = now - report_ts;
+
+    LOGI("loop: %" PRIu64 " iterations, busy %.1f%%, max iteration %.1f ms",
+         iterations, elapsed > 0 ? busy_total * 100 / elapsed : 0,
+         iteration_max * 1e3);
+    if (stall_name != NULL) {
+        LOGI("loop: longest stall %.1f ms in %s", stall_max * 1e3, stall_name);
+    }
+    for (i = 0; i < callback_num; i++) {
+        callback_stat_t *stat = &callbacks[i];
+        if (stat->calls == 0)
+            continue;
+        LOGI("loop: %s: %" PRIu64 " calls, total %.1f ms, avg %.1f us, max %.1f us",
+             stat->name, stat->calls, stat->total * 1e3,
+             stat->total * 1e6 / stat->calls, stat->max * 1e6);
+        stat->calls = 0;
+        stat->total = 0;
+        stat->max   = 0;
+    }
+
+    report_ts     = now;
+    iterations    = 0;
+    busy_total    = 0;
+    iteration_max = 0;
+    stall_max     = 0;
+    stall_name    = NULL;
+}
+
+void
+loop_stat_init(struct ev_loop *loop)
+{
+    if (!loop_stat)
+        return;
+
+    report_ts = loop_stat_clock();
+
+    ev_prepare_init(&prepare_watcher, prepare_cb);
+    ev_check_init(&check_watcher, check_cb);
+    // Take the timestamp before any other pending callback runs
+    ev_set_priority(&check_watcher, EV_MAXPRI);
+    ev_timer_init(&report_watcher, report_cb, LOOP_STAT_INTERVAL, LOOP_STAT_INTERVAL);
+
+    ev_prepare_start(loop, &prepare_watcher);
+    ev_check_start(loop, &check_watcher);
+    ev_timer_start(loop, &report_watcher);
+}
+
+void
+loop_stat_free(struct ev_loop *loop)
+{
+    if (!loop_stat)
+        return;
+
+    ev_prepare_stop(loop, &prepare_watcher);
+    ev_check_stop(loop, &check_watcher);
+    ev_timer_stop(loop, &report_watcher);
+}
@@ -0,0 +1,62 @@
+/*
+ * loopstat.h - Define the event loop instrumentation interface
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOOPSTAT_H
+#define _LOOPSTAT_H
+
+#ifdef HAVE_LIBEV_EV_H
+#include <libev/ev.h>
+#else
+#include <ev.h>
+#endif
+
+#define LOOP_STAT_INTERVAL 60    // seconds between two reports
+#define LOOP_STAT_STALL    0.1   // log callbacks blocking the loop longer than this
+
+extern int loop_stat;
+
+void loop_stat_init(struct ev_loop *loop);
+void loop_stat_free(struct ev_loop *loop);
+
+int loop_stat_register(const char *name);
+ev_tstamp loop_stat_clock(void);
+void loop_stat_record(int id, ev_tstamp start);
+
+/*
+ * Define a timed trampoline for a watcher callback. Register it with
+ * LOOP_STAT_CB(cb) in place of cb; it's only used if loop_stat is on.
+ */
+#define LOOP_STAT_DEFINE(cb, watcher_type)                  \
+    static void                                             \
+    cb ## _timed(EV_P_ watcher_type *w, int revents)        \
+    {                                                       \
+        static int id = -1;                                 \
+        if (id < 0)                                         \
+            id = loop_stat_register(#cb);                   \
+        ev_tstamp start = loop_stat_clock();                \
+        cb(EV_A_ w, revents);                               \
+        loop_stat_record(id, start);                        \
+    }
+
+#define LOOP_STAT_CB(cb) (loop_stat ? cb ## _timed : cb)
+
+#endif // _LOOPSTAT_H
@@ -48,6 +48,8 @@
 #include <sys/un.h>
 #include <sys/socket.h>
 #include <pwd.h>
+#include <spawn.h>
+#include <stdarg.h>
 #include <libcork/core.h>
 
 #if defined(HAVE_SYS_IOCTL_H) && defined(HAVE_NET_IF_H) && defined(__linux__)
@@ -60,11 +62,20 @@
 #include "utils.h"
 #include "netutils.h"
 #include "manager.h"
+#include "dnscache.h"
 
 #ifndef BUF_SIZE
 #define BUF_SIZE 65535
 #endif
 
+// Arguments of an ss-server, with a -s and two --listen-fd per host
+#define MAX_ARGS (40 + MAX_REMOTE_NUM * 6)
+
+// Sockets bound for one server, TCP and UDP on each host
+#define MAX_LISTEN_FDS (MAX_REMOTE_NUM * 2)
+
+extern char **environ;
+
 int verbose          = 0;
 char *executable     = "ss-server";
 char *working_dir    = NULL;
@@ -140,10 +151,40 @@ build_config(char *prefix, struct manager_ctx *manager, struct server *server)
     ss_free(path);
 }
 
-static char *
-construct_command_line(struct manager_ctx *manager, struct server *server)
+static void
+add_arg(char **args, int *argc, const char *fmt, ...)
 {
-    static char cmd[BUF_SIZE];
+    char arg[BUF_SIZE];
+    va_list ap;
+
+    if (*argc >= MAX_ARGS - 1) {
+        LOGE("too many arguments for %s", executable);
+        return;
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(arg, sizeof(arg), fmt, ap);
+    va_end(ap);
+
+    args[(*argc)++] = strdup(arg);
+    args[*argc]     = NULL;
+}
+
+static void
+free_args(char **args, int argc)
+{
+    for (int i = 0; i < argc; i++)
+        ss_free(args[i]);
+}
+
+/*
+ * Arguments of the server, exec'ed without a shell, so nothing is quoted.
+ */
+static int
+construct_argv(struct manager_ctx *manager, struct server *server,
+               char **args, int *fds, int fd_num)
+{
+    int argc = 0;
     int i;
     int port;
 
@@ -151,79 +192,88 @@ construct_command_line(struct manager_ctx *manager, struct server *server)
 
     build_config(working_dir, manager, server);
 
-    memset(cmd, 0, BUF_SIZE);
-    snprintf(cmd, BUF_SIZE,
-             "%s --manager-address %s -f %s/.shadowsocks_%d.pid -c %s/.shadowsocks_%d.conf",
-             executable, manager->manager_address, working_dir, port, working_dir, port);
+    add_arg(args, &argc, "%s", executable);
+    add_arg(args, &argc, "--manager-address");
+    add_arg(args, &argc, "%s", manager->manager_address);
+    add_arg(args, &argc, "-f");
+    add_arg(args, &argc, "%s/.shadowsocks_%d.pid", working_dir, port);
+    add_arg(args, &argc, "-c");
+    add_arg(args, &argc, "%s/.shadowsocks_%d.conf", working_dir, port);
 
     if (manager->acl != NULL) {
-        int len = strlen(cmd);
-        snprintf(cmd + len, BUF_SIZE - len, " --acl %s", manager->acl);
+        add_arg(args, &argc, "--acl");
+        add_arg(args, &argc, "%s", manager->acl);
     }
     if (manager->timeout != NULL) {
-        int len = strlen(cmd);
-        snprintf(cmd + len, BUF_SIZE - len, " -t %s", manager->timeout);
+        add_arg(args, &argc, "-t");
+        add_arg(args, &argc, "%s", manager->timeout);
     }
 #ifdef HAVE_SETRLIMIT
     if (manager->nofile) {
-        int len = strlen(cmd);
-        snprintf(cmd + len, BUF_SIZE - len, " -n %d", manager->nofile);
+        add_arg(args, &argc, "-n");
+        add_arg(args, &argc, "%d", manager->nofile);
     }
 #endif
     if (manager->user != NULL) {
-        int len = strlen(cmd);
-        snprintf(cmd + len, BUF_SIZE - len, " -a %s", manager->user);
+        add_arg(args, &argc, "-a");
+        add_arg(args, &argc, "%s", manager->user);
     }
     if (manager->verbose) {
-        int len = strlen(cmd);
-        snprintf(cmd + len, BUF_SIZE - len, " -v");
+        add_arg(args, &argc, "-v");
     }
     if (server->mode == NULL && manager->mode == UDP_ONLY) {
-        int len = strlen(cmd);
-        snprintf(cmd + len, BUF_SIZE - len, " -U");
+        add_arg(args, &argc, "-U");
     }
     if (server->mode == NULL && manager->mode == TCP_AND_UDP) {
-        int len = strlen(cmd);
-        snprintf(cmd + len, BUF_SIZE - len, " -u");
+        add_arg(args, &argc, "-u");
     }
     if (server->fast_open[0] == 0 && manager->fast_open) {
-        int len = strlen(cmd);
-        snprintf(cmd + len, BUF_SIZE - len, " --fast-open");
+        add_arg(args, &argc, "--fast-open");
     }
     if (server->no_delay[0] == 0 && manager->no_delay) {
-        int len = strlen(cmd);
-        snprintf(cmd + len, BUF_SIZE - len, " --no-delay");
+        add_arg(args, &argc, "--no-delay");
     }
     if (manager->ipv6first) {
-        int len = strlen(cmd);
-        snprintf(cmd + len, BUF_SIZE - len, " -6");
+        add_arg(args, &argc, "-6");
     }
     if (manager->mtu) {
-        int len = strlen(cmd);
-        snprintf(cmd + len, BUF_SIZE - len, " --mtu %d", manager->mtu);
+        add_arg(args, &argc, "--mtu");
+        add_arg(args, &argc, "%d", manager->mtu);
     }
     if (server->plugin == NULL && manager->plugin) {
-        int len = strlen(cmd);
-        snprintf(cmd + len, BUF_SIZE - len, " --plugin \"%s\"", manager->plugin);
+        add_arg(args, &argc, "--plugin");
+        add_arg(args, &argc, "%s", manager->plugin);
     }
     if (server->plugin_opts == NULL && manager->plugin_opts) {
-        int len = strlen(cmd);
-        snprintf(cmd + len, BUF_SIZE - len, " --plugin-opts \"%s\"", manager->plugin_opts);
+        add_arg(args, &argc, "--plugin-opts");
+        add_arg(args, &argc, "%s", manager->plugin_opts);
     }
     if (manager->nameservers) {
-        int len = strlen(cmd);
-        snprintf(cmd + len, BUF_SIZE - len, " -d \"%s\"", manager->nameservers);
+        add_arg(args, &argc, "-d");
+        add_arg(args, &argc, "%s", manager->nameservers);
+    }
+    if (manager->dns_cache) {
+        add_arg(args, &argc, "--dns-cache");
+        add_arg(args, &argc, "%s", manager->dns_cache);
     }
     for (i = 0; i < manager->host_num; i++) {
-        int len = strlen(cmd);
-        snprintf(cmd + len, BUF_SIZE - len, " -s %s", manager->hosts[i]);
+        add_arg(args, &argc, "-s");
+        add_arg(args, &argc, "%s", manager->hosts[i]);
+    }
+    for (i = 0; i < fd_num; i++) {
+        add_arg(args, &argc, "--listen-fd");
+        add_arg(args, &argc, "%d", fds[i]);
     }
 
     if (verbose) {
+        char cmd[BUF_SIZE];
+        int len = 0;
+        for (i = 0; i < argc && len < BUF_SIZE; i++)
+            len += snprintf(cmd + len, BUF_SIZE - len, i ? " %s" : "%s", args[i]);
         LOGI("cmd: %s", cmd);
     }
 
-    return cmd;
+    return argc;
 }
 
 static char *
@@ -367,8 +417,11 @@ parse_traffic(char *buf, int len, char *port, uint64_t *traffic)
     return 0;
 }
 
+/*
+ * The socket stays open, listening for TCP, to be handed to the server.
+ */
 static int
-create_and_bind(const char *host, const char *port, int protocol)
+create_and_bind(const char *host, const char *port, int protocol, int reuse_port)
 {
     struct addrinfo hints;
     struct addrinfo *result, *rp, *ipv4v6bindall;
@@ -425,23 +478,23 @@ create_and_bind(const char *host, const char *port, int protocol)
 #ifdef SO_NOSIGPIPE
         setsockopt(listen_sock, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
 #endif
+        if (reuse_port) {
+            set_reuseport(listen_sock);
+        }
 
         s = bind(listen_sock, rp->ai_addr, rp->ai_addrlen);
-        if (s == 0) {
+        if (s == 0 && (protocol != IPPROTO_TCP || listen(listen_sock, SOMAXCONN) == 0)) {
             /* We managed to bind successfully! */
-
-            close(listen_sock);
-
             break;
         } else {
             ERROR("bind");
         }
-    }
 
-    if (!result) {
-        freeaddrinfo(result);
+        close(listen_sock);
     }
 
+    freeaddrinfo(result);
+
     if (rp == NULL) {
         LOGE("Could not bind");
         return -1;
@@ -451,62 +504,94 @@ create_and_bind(const char *host, const char *port, int protocol)
 }
 
 static int
-check_port(struct manager_ctx *manager, struct server *server)
+server_mode(struct manager_ctx *manager, struct server *server)
 {
-    bool both_tcp_udp = manager->mode == TCP_AND_UDP;
-    int fd_count      = manager->host_num * (both_tcp_udp ? 2 : 1);
-    int bind_err      = 0;
-
-    int *sock_fds = (int *)ss_malloc(fd_count * sizeof(int));
-    memset(sock_fds, 0, fd_count * sizeof(int));
+    if (server->mode == NULL) {
+        return manager->mode;
+    } else if (strcmp(server->mode, "tcp_and_udp") == 0) {
+        return TCP_AND_UDP;
+    } else if (strcmp(server->mode, "udp_only") == 0) {
+        return UDP_ONLY;
+    }
+    return TCP_ONLY;
+}
 
-    /* try to bind each interface */
-    for (int i = 0; i < manager->host_num; i++) {
-        LOGI("try to bind interface: %s, port: %s", manager->hosts[i], server->port);
+/*
+ * Bind the ports of the server on each host. The sockets are what the
+ * server gets, so the ports cannot be taken in between.
+ */
+static int
+bind_server(struct manager_ctx *manager, struct server *server, int *fds)
+{
+    int mode   = server_mode(manager, server);
+    int fd_num = 0;
 
-        if (manager->mode == UDP_ONLY) {
-            sock_fds[i] = create_and_bind(manager->hosts[i], server->port, IPPROTO_UDP);
-        } else {
-            sock_fds[i] = create_and_bind(manager->hosts[i], server->port, IPPROTO_TCP);
+    for (int i = 0; i < manager->host_num && fd_num < MAX_LISTEN_FDS - 1; i++) {
+        if (verbose) {
+            LOGI("bind interface: %s, port: %s", manager->hosts[i], server->port);
         }
 
-        if (both_tcp_udp) {
-            sock_fds[i + manager->host_num] = create_and_bind(manager->hosts[i], server->port, IPPROTO_UDP);
+        if (mode != UDP_ONLY) {
+            fds[fd_num] = create_and_bind(manager->hosts[i], server->port,
+                                          IPPROTO_TCP, manager->reuse_port);
+            if (fds[fd_num] == -1) {
+                goto fail;
+            }
+            fd_num++;
         }
 
-        if (sock_fds[i] == -1 || (both_tcp_udp && sock_fds[i + manager->host_num] == -1)) {
-            bind_err = -1;
-            break;
+        if (mode != TCP_ONLY) {
+            fds[fd_num] = create_and_bind(manager->hosts[i], server->port,
+                                          IPPROTO_UDP, manager->reuse_port);
+            if (fds[fd_num] == -1) {
+                goto fail;
+            }
+            fd_num++;
         }
     }
 
-    /* clean socks */
-    for (int i = 0; i < fd_count; i++)
-        if (sock_fds[i] > 0) {
-            close(sock_fds[i]);
-        }
+    return fd_num;
 
-    ss_free(sock_fds);
-
-    return bind_err == -1 ? -1 : 0;
+fail:
+    while (fd_num > 0)
+        close(fds[--fd_num]);
+    return -1;
 }
 
 static int
 add_server(struct manager_ctx *manager, struct server *server)
 {
-    int ret = check_port(manager, server);
+    int fds[MAX_LISTEN_FDS];
+    char *args[MAX_ARGS];
+    int fd_num = bind_server(manager, server, fds);
 
-    if (ret == -1) {
+    if (fd_num == -1) {
         LOGE("port is not available, please check.");
         return -1;
     }
 
+    // A plugin listens on the port in place of the server, let it bind again
+    if (server->plugin != NULL || manager->plugin != NULL) {
+        while (fd_num > 0)
+            close(fds[--fd_num]);
+    }
+
     bool new = false;
     cork_hash_table_put(server_table, (void *)server->port, (void *)server, &new, NULL, NULL);
 
-    char *cmd = construct_command_line(manager, server);
-    if (system(cmd) == -1) {
-        ERROR("add_server_system");
+    int argc = construct_argv(manager, server, args, fds, fd_num);
+
+    // No waiting here, the server reports over the manager socket when ready
+    pid_t pid;
+    int err = posix_spawnp(&pid, executable, NULL, NULL, args, environ);
+
+    free_args(args, argc);
+    for (int i = 0; i < fd_num; i++)
+        close(fds[i]);
+
+    if (err != 0) {
+        errno = err;
+        ERROR("add_server_spawn");
         return -1;
     }
 
@@ -574,6 +659,20 @@ remove_server(char *prefix, char *port)
     stop_server(prefix, port);
 }
 
+static void
+update_ready(char *port, uint64_t pid)
+{
+    struct server *server = cork_hash_table_get(server_table, (void *)port);
+
+    if (server != NULL) {
+        server->ready = 1;
+        server->pid   = pid;
+        if (verbose) {
+            LOGI("server on port %s is ready, pid %d", port, server->pid);
+        }
+    }
+}
+
 static void
 update_stat(char *port, uint64_t traffic)
 {
@@ -657,7 +756,7 @@ manager_recv_cb(EV_P_ ev_io *w, int revents)
             char *method          = server->method ? server->method : manager->method;
             size_t pos            = strlen(buf);
             size_t entry_len      = strlen(server->port) + strlen(server->password) + strlen(method);
-            if (pos > BUF_SIZE - entry_len - 50) {
+            if (pos > BUF_SIZE - entry_len - 70) {
                 if (sendto(manager->fd, buf, pos, 0, (struct sockaddr *)&claddr, len)
                     != pos) {
                     ERROR("list_sendto");
@@ -665,8 +764,9 @@ manager_recv_cb(EV_P_ ev_io *w, int revents)
                 memset(buf, 0, BUF_SIZE);
                 pos = 0;
             }
-            sprintf(buf + pos, "\n\t{\"server_port\":\"%s\",\"password\":\"%s\",\"method\":\"%s\"},",
-                    server->port, server->password, method);
+            sprintf(buf + pos, "\n\t{\"server_port\":\"%s\",\"password\":\"%s\",\"method\":\"%s\","
+                    "\"ready\":%s},",
+                    server->port, server->password, method, server->ready ? "true" : "false");
         }
 
         size_t pos = strlen(buf);
@@ -707,6 +807,17 @@ manager_recv_cb(EV_P_ ev_io *w, int revents)
 
         update_stat(port, traffic);
 
+    } else if (strcmp(action, "ready") == 0) {
+        char port[8];
+        uint64_t pid = 0;
+
+        if (parse_traffic(buf, r, port, &pid) == -1) {
+            LOGE("invalid command: %s:%s", buf, get_data(buf, r));
+            return;
+        }
+
+        update_ready(port, pid);
+
     } else if (strcmp(action, "ping") == 0) {
         struct cork_hash_table_entry *entry;
         struct cork_hash_table_iterator server_iter;
@@ -1142,6 +1253,17 @@ main(int argc, char **argv)
         LOGI("using the default manager address: %s", manager_address);
     }
 
+    // One DNS cache for all the servers, anything left from the last run is stale
+    size_t dns_cache_size = strlen(working_dir) + 24;
+    char *dns_cache       = ss_malloc(dns_cache_size);
+    snprintf(dns_cache, dns_cache_size, "%s/.shadowsocks_dns.cache", working_dir);
+    if (dnscache_init(dns_cache, 1) == 0) {
+        // ss-manager itself never resolves, the servers map it on their own
+        dnscache_free();
+    } else {
+        ss_free(dns_cache);
+    }
+
     // ignore SIGPIPE
     signal(SIGPIPE, SIG_IGN);
     signal(SIGCHLD, SIG_IGN);
@@ -1177,6 +1299,7 @@ main(int argc, char **argv)
     manager.plugin_opts     = plugin_opts;
     manager.ipv6first       = ipv6first;
     manager.workdir         = workdir;
+    manager.dns_cache       = dns_cache;
 #ifdef HAVE_SETRLIMIT
     manager.nofile = nofile;
 #endif
@@ -1205,16 +1328,6 @@ main(int argc, char **argv)
 
     server_table = cork_string_hash_table_new(MAX_PORT_NUM, 0);
 
-    if (conf != NULL) {
-        for (i = 0; i < conf->port_password_num; i++) {
-            struct server *server = ss_malloc(sizeof(struct server));
-            memset(server, 0, sizeof(struct server));
-            strncpy(server->port, conf->port_password[i].port, 7);
-            strncpy(server->password, conf->port_password[i].password, 127);
-            add_server(&manager, server);
-        }
-    }
-
     int sfd;
     ss_addr_t ip_addr = { .host = NULL, .port = NULL };
     parse_addr(manager_address, &ip_addr);
@@ -1252,10 +1365,27 @@ main(int argc, char **argv)
         }
     }
 
+    // Not for the servers spawned from here
+    fcntl(sfd, F_SETFD, FD_CLOEXEC);
+
     manager.fd = sfd;
     ev_io_init(&manager.io, manager_recv_cb, manager.fd, EV_READ);
     ev_io_start(loop, &manager.io);
 
+    // Once the servers can report to us, they start side by side
+    if (conf != NULL) {
+        for (i = 0; i < conf->port_password_num; i++) {
+            struct server *server = ss_malloc(sizeof(struct server));
+            memset(server, 0, sizeof(struct server));
+            strncpy(server->port, conf->port_password[i].port, 7);
+            strncpy(server->password, conf->port_password[i].password, 127);
+            add_server(&manager, server);
+        }
+        if (conf->port_password_num > 0) {
+            LOGI("started %d servers", conf->port_password_num);
+        }
+    }
+
     // start ev loop
     ev_run(loop, 0);
 
@@ -1276,6 +1406,10 @@ main(int argc, char **argv)
 
     ev_signal_stop(EV_DEFAULT, &sigint_watcher);
     ev_signal_stop(EV_DEFAULT, &sigterm_watcher);
+    if (dns_cache != NULL) {
+        unlink(dns_cache);
+        ss_free(dns_cache);
+    }
     ss_free(working_dir);
 
     return 0;
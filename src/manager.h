@@ -60,6 +60,7 @@ struct manager_ctx {
     int mtu;
     int ipv6first;
     char *workdir;
+    char *dns_cache;
 #ifdef HAVE_SETRLIMIT
     int nofile;
 #endif
@@ -75,6 +76,8 @@ struct server {
     char *plugin;
     char *plugin_opts;
     uint64_t traffic;
+    int ready;  // reported by the server once it listens
+    int pid;
 };
 
 #endif // _MANAGER_H
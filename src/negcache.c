@@ -0,0 +1,173 @@
+/*
+ * negcache.c - Fail fast on destinations that recently refused or timed out
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef __MINGW32__
+#include <netinet/in.h>
+#endif
+
+#include "utils.h"
+#include "cache.h"
+#include "control.h"
+#include "negcache.h"
+
+#define NEGCACHE_KEY_LEN (IPSCORE_KEY_LEN + 2)
+
+typedef struct negcache {
+    int fails;                      // consecutive failures
+    ev_tstamp until;                // end of the backoff window
+} negcache_t;
+
+static struct cache *entries;
+
+static uint64_t failures;
+static uint64_t avoided;
+
+static size_t
+negcache_key(char *key, const ipscore_key_t *addr, uint16_t port)
+{
+    memcpy(key, addr->data, addr->len);
+    memcpy(key + addr->len, &port, 2);
+    return addr->len + 2;
+}
+
+int
+negcache_init(void)
+{
+    return cache_create(&entries, NEGCACHE_SIZE, NULL);
+}
+
+void
+negcache_free(void)
+{
+    if (entries != NULL) {
+        cache_delete(entries, 0);
+        entries = NULL;
+    }
+}
+
+int
+negcache_blocked(const struct sockaddr *addr)
+{
+    char key[NEGCACHE_KEY_LEN];
+    ipscore_key_t ip;
+    uint16_t port;
+    negcache_t *entry = NULL;
+
+    if (entries == NULL) {
+        return 0;
+    }
+
+    ipscore_key(&ip, addr);
+    if (ip.len == 0) {
+        return 0;
+    }
+
+    // Already in network byte order, as in the key
+    port = addr->sa_family == AF_INET6
+           ? ((const struct sockaddr_in6 *)addr)->sin6_port
+           : ((const struct sockaddr_in *)addr)->sin_port;
+
+    cache_lookup(entries, key, negcache_key(key, &ip, port), &entry);
+    if (entry == NULL || ev_time() >= entry->until) {
+        return 0;
+    }
+
+    avoided++;
+    return 1;
+}
+
+/*
+ * Only outcomes that say the destination itself is unreachable count, a
+ * local resource shortage must not block anyone.
+ */
+void
+negcache_failed(const ipscore_key_t *addr, uint16_t port, int err)
+{
+    char key[NEGCACHE_KEY_LEN];
+    size_t key_len;
+    negcache_t *entry = NULL;
+    ev_tstamp now     = ev_time();
+
+    if (entries == NULL || addr->len == 0) {
+        return;
+    }
+
+    if (err != ECONNREFUSED && err != ENETUNREACH && err != EHOSTUNREACH
+        && err != ETIMEDOUT) {
+        return;
+    }
+
+    failures++;
+
+    key_len = negcache_key(key, addr, port);
+    cache_lookup(entries, key, key_len, &entry);
+
+    if (entry == NULL) {
+        entry = ss_malloc(sizeof(negcache_t));
+        memset(entry, 0, sizeof(negcache_t));
+        cache_insert(entries, key, key_len, entry);
+    } else if (now - entry->until > NEGCACHE_BACKOFF_MAX) {
+        // Quiet for a while, start over from the shortest backoff
+        entry->fails = 0;
+    }
+
+    ev_tstamp backoff = NEGCACHE_BACKOFF_MIN;
+    for (int i = 0; i < entry->fails && backoff < NEGCACHE_BACKOFF_MAX; i++)
+        backoff *= 2;
+    if (backoff > NEGCACHE_BACKOFF_MAX) {
+        backoff = NEGCACHE_BACKOFF_MAX;
+    }
+
+    entry->fails++;
+    entry->until = now + backoff;
+}
+
+void
+negcache_connected(const ipscore_key_t *addr, uint16_t port)
+{
+    char key[NEGCACHE_KEY_LEN];
+
+    if (entries == NULL || addr->len == 0) {
+        return;
+    }
+
+    cache_remove(entries, key, negcache_key(key, addr, port));
+}
+
+void
+negcache_stats(const char *data, control_reply_t *reply)
+{
+    control_reply(reply, "{\"destinations\":%u,\"failures\":%" PRIu64
+                  ",\"avoided\":%" PRIu64 "}\n",
+                  entries != NULL ? HASH_COUNT(entries->entries) : 0,
+                  failures, avoided);
+}
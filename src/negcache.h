@@ -0,0 +1,50 @@
+/*
+ * negcache.h - Define the negative connect cache interface
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NEGCACHE_H
+#define _NEGCACHE_H
+
+#include <stdint.h>
+
+#include "ipscore.h"
+
+#define NEGCACHE_SIZE        4096       // destinations remembered, least recently used go first
+#define NEGCACHE_BACKOFF_MIN 1.0        // first backoff after a failure, seconds
+#define NEGCACHE_BACKOFF_MAX 32.0       // backoff doubles per failure up to this, seconds
+
+struct control_reply;
+
+int negcache_init(void);
+void negcache_free(void);
+
+/*
+ * Returns 1 while the destination is backing off. The first connect
+ * after the backoff expires goes through as a probe.
+ */
+int negcache_blocked(const struct sockaddr *addr);
+
+void negcache_failed(const ipscore_key_t *addr, uint16_t port, int err);
+void negcache_connected(const ipscore_key_t *addr, uint16_t port);
+
+void negcache_stats(const char *data, struct control_reply *reply);
+
+#endif // _NEGCACHE_H
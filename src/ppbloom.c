@@ -24,79 +24,137 @@
 #include <stdlib.h>
 
 #include "bloom.h"
+#include "arena.h"
 #include "ppbloom.h"
 #include "utils.h"
 
 #define PING 0
 #define PONG 1
 
+#ifdef LIB_ONLY
+#include <pthread.h>
+
+// Contexts of the library may each run on a thread of their own
+static pthread_mutex_t ppbloom_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PPBLOOM_LOCK()   pthread_mutex_lock(&ppbloom_lock)
+#define PPBLOOM_UNLOCK() pthread_mutex_unlock(&ppbloom_lock)
+#else
+#define PPBLOOM_LOCK()
+#define PPBLOOM_UNLOCK()
+#endif
+
 static struct bloom ppbloom[2];
 static int bloom_count[2];
 static int current;
 static int entries;
 static double error;
 
-int
-ppbloom_init(int n, double e)
+/*
+ * Move the bit array libbloom calloc'ed into the huge page arena, it is
+ * hit at random on every salt checked.
+ */
+static void
+ppbloom_arena(struct bloom *bloom)
+{
+    void *bf = arena_alloc(bloom->bytes);
+
+    if (bf != NULL) {
+        free(bloom->bf);
+        bloom->bf = bf;
+    }
+}
+
+static int
+ppbloom_setup(int n, double e)
 {
     int err;
-    entries = n / 2;
-    error   = e;
 
-    err = bloom_init(ppbloom + PING, entries, error);
+    // Set up by an earlier crypto_init, the filter is one per process
+    if (entries != 0) {
+        return 0;
+    }
+
+    err = bloom_init(ppbloom + PING, n / 2, e);
     if (err)
         return err;
 
-    err = bloom_init(ppbloom + PONG, entries, error);
+    err = bloom_init(ppbloom + PONG, n / 2, e);
     if (err)
         return err;
 
+    if (huge_pages) {
+        ppbloom_arena(ppbloom + PING);
+        ppbloom_arena(ppbloom + PONG);
+    }
+
     bloom_count[PING] = 0;
     bloom_count[PONG] = 0;
 
     current = PING;
+    error   = e;
+    entries = n / 2;
 
     return 0;
 }
 
+int
+ppbloom_init(int n, double e)
+{
+    int err;
+
+    PPBLOOM_LOCK();
+    err = ppbloom_setup(n, e);
+    PPBLOOM_UNLOCK();
+
+    return err;
+}
+
 int
 ppbloom_check(const void *buffer, int len)
 {
     int ret;
 
+    PPBLOOM_LOCK();
     ret = bloom_check(ppbloom + PING, buffer, len);
-    if (ret)
-        return ret;
+    if (!ret)
+        ret = bloom_check(ppbloom + PONG, buffer, len);
+    PPBLOOM_UNLOCK();
 
-    ret = bloom_check(ppbloom + PONG, buffer, len);
-    if (ret)
-        return ret;
-
-    return 0;
+    return ret;
 }
 
 int
 ppbloom_add(const void *buffer, int len)
 {
     int err;
-    err = bloom_add(ppbloom + current, buffer, len);
-    if (err == -1)
-        return err;
 
-    bloom_count[current]++;
-
-    if (bloom_count[current] >= entries) {
-        bloom_count[current] = 0;
-        current              = current == PING ? PONG : PING;
-        bloom_reset(ppbloom + current);
+    PPBLOOM_LOCK();
+    err = bloom_add(ppbloom + current, buffer, len);
+    if (err != -1) {
+        bloom_count[current]++;
+
+        if (bloom_count[current] >= entries) {
+            bloom_count[current] = 0;
+            current              = current == PING ? PONG : PING;
+            bloom_reset(ppbloom + current);
+        }
+        err = 0;
     }
+    PPBLOOM_UNLOCK();
 
-    return 0;
+    return err;
 }
 
 void
 ppbloom_free()
 {
+    PPBLOOM_LOCK();
+    for (int i = PING; i <= PONG; i++)
+        if (arena_owns(ppbloom[i].bf))
+            ppbloom[i].bf = NULL;
+
     bloom_free(ppbloom + PING);
     bloom_free(ppbloom + PONG);
+    entries = 0;
+    PPBLOOM_UNLOCK();
 }
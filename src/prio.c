@@ -0,0 +1,132 @@
+/*
+ * prio.c - Interactive and bulk flow classes for the relay
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "utils.h"
+#include "prio.h"
+
+int priority_classes = 0;
+
+static ev_prepare budget_watcher;
+static long budget;
+
+// Ports whose flows are latency-bound however much they carry
+static const uint16_t interactive_ports[] = {
+    22,     // ssh
+    53      // dns over tcp
+};
+
+static void
+budget_cb(EV_P_ ev_prepare *w, int revents)
+{
+    budget = PRIO_BULK_BUDGET;
+}
+
+void
+prio_set_port(prio_t *prio, uint16_t port)
+{
+    for (int i = 0; i < sizeof(interactive_ports) / sizeof(interactive_ports[0]); i++)
+        if (interactive_ports[i] == port) {
+            prio->pinned = 1;
+            prio->cls    = PRIO_INTERACTIVE;
+            return;
+        }
+}
+
+/*
+ * Account a relayed read, in either direction. Returns the class of the
+ * flow, which changed if it differs from what its watchers were set to.
+ */
+int
+prio_update(EV_P_ prio_t *prio, size_t size)
+{
+    ev_tstamp now = ev_now(EV_A);
+    ev_tstamp dt  = now - prio->last;
+
+    // Close to exp(-dt) for the short gaps of a busy flow, and an idle
+    // flow starts over
+    prio->rate  = prio->rate / (1.0 + dt) + size;
+    prio->size += ((float)size - prio->size) / 8;
+    prio->last  = now;
+
+    if (prio->cls == PRIO_BULK) {
+        budget -= size;
+        if (prio->rate < PRIO_IDLE_RATE) {
+            prio->cls = PRIO_INTERACTIVE;
+        }
+    } else if (!prio->pinned && prio->rate > PRIO_BULK_RATE
+               && prio->size > PRIO_BULK_SIZE) {
+        prio->cls = PRIO_BULK;
+    }
+
+    return prio->cls;
+}
+
+int
+prio_defer(prio_t *prio)
+{
+    return prio->cls == PRIO_BULK && budget <= 0;
+}
+
+/*
+ * Move a watcher to the priority of a class. libev only allows that while
+ * it's neither pending nor started, a pending one is left for the next
+ * read to retry.
+ */
+void
+prio_watcher(EV_P_ ev_io *w, int cls)
+{
+    int pri = cls == PRIO_BULK ? EV_MINPRI : 0;
+
+    if (ev_priority(w) == pri || ev_is_pending(w)) {
+        return;
+    }
+
+    int active = ev_is_active(w);
+    if (active) {
+        ev_io_stop(EV_A_ w);
+    }
+    ev_set_priority(w, pri);
+    if (active) {
+        ev_io_start(EV_A_ w);
+    }
+}
+
+void
+prio_init(struct ev_loop *loop)
+{
+    budget = PRIO_BULK_BUDGET;
+    ev_prepare_init(&budget_watcher, budget_cb);
+    ev_prepare_start(loop, &budget_watcher);
+}
+
+void
+prio_free(struct ev_loop *loop)
+{
+    if (ev_is_active(&budget_watcher)) {
+        ev_prepare_stop(loop, &budget_watcher);
+    }
+}
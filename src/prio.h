@@ -0,0 +1,75 @@
+/*
+ * prio.h - Define the interactive and bulk flow classes
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _PRIO_H
+#define _PRIO_H
+
+#ifdef HAVE_LIBEV_EV_H
+#include <libev/ev.h>
+#else
+#include <ev.h>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PRIO_BULK_RATE   131072     // bytes/s above which a flow may turn bulk
+#define PRIO_BULK_SIZE   4096       // average read size above which it does
+#define PRIO_IDLE_RATE   32768      // bytes/s under which it's interactive again
+#define PRIO_BULK_BUDGET 262144     // bulk bytes relayed per loop iteration
+
+/*
+ * Flows start interactive and keep the default watcher priority. Once a
+ * flow moves more than PRIO_BULK_RATE in full-sized reads it turns bulk:
+ * its watchers drop to EV_MINPRI, so libev invokes them after everything
+ * else that became ready in the same iteration, and it stops reading once
+ * the bulk budget of the iteration is spent. A deferred socket is still
+ * readable and comes back on the next iteration, after a fresh poll.
+ */
+
+enum {
+    PRIO_INTERACTIVE,
+    PRIO_BULK
+};
+
+typedef struct prio {
+    ev_tstamp last;                 // time of the last read
+    float rate;                     // bytes/s, decayed over about a second
+    float size;                     // average read size
+    uint8_t cls;
+    uint8_t pinned;                 // interactive by port, never turns bulk
+} prio_t;
+
+extern int priority_classes;
+
+void prio_init(struct ev_loop *loop);
+void prio_free(struct ev_loop *loop);
+
+void prio_set_port(prio_t *prio, uint16_t port);
+int prio_update(EV_P_ prio_t *prio, size_t size);
+int prio_defer(prio_t *prio);
+void prio_watcher(EV_P_ ev_io *w, int cls);
+
+#define PRIO_DEFER(p) (priority_classes && prio_defer(p))
+
+#endif // _PRIO_H
@@ -50,6 +50,7 @@
 #include "plugin.h"
 #include "netutils.h"
 #include "utils.h"
+#include "edge.h"
 #include "common.h"
 #include "redir.h"
 
@@ -203,6 +204,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data
             // continue to wait for recv
+            edge_io_again(&server_recv_ctx->io);
             return;
         } else {
             ERROR("server recv");
@@ -233,8 +235,8 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
     }
 
     if (!remote->send_ctx->connected) {
-        ev_io_stop(EV_A_ & server_recv_ctx->io);
-        ev_io_start(EV_A_ & remote->send_ctx->io);
+        edge_io_stop(EV_A_ & server_recv_ctx->io);
+        edge_io_start(EV_A_ & remote->send_ctx->io);
         return;
     }
 
@@ -253,8 +255,9 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data, wait for send
             remote->buf->idx = 0;
-            ev_io_stop(EV_A_ & server_recv_ctx->io);
-            ev_io_start(EV_A_ & remote->send_ctx->io);
+            edge_io_again(&remote->send_ctx->io);
+            edge_io_stop(EV_A_ & server_recv_ctx->io);
+            edge_io_start(EV_A_ & remote->send_ctx->io);
             return;
         } else {
             ERROR("send");
@@ -265,8 +268,9 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
     } else if (s < remote->buf->len) {
         remote->buf->len -= s;
         remote->buf->idx  = s;
-        ev_io_stop(EV_A_ & server_recv_ctx->io);
-        ev_io_start(EV_A_ & remote->send_ctx->io);
+        edge_io_again(&remote->send_ctx->io);
+        edge_io_stop(EV_A_ & server_recv_ctx->io);
+        edge_io_start(EV_A_ & remote->send_ctx->io);
         return;
     } else {
         remote->buf->idx = 0;
@@ -294,10 +298,13 @@ server_send_cb(EV_P_ ev_io *w, int revents)
                 ERROR("send");
                 close_and_free_remote(EV_A_ remote);
                 close_and_free_server(EV_A_ server);
+            } else {
+                edge_io_again(&server_send_ctx->io);
             }
             return;
         } else if (s < server->buf->len) {
             // partly sent, move memory, wait for the next time to send
+            edge_io_again(&server_send_ctx->io);
             server->buf->len -= s;
             server->buf->idx += s;
             return;
@@ -305,8 +312,8 @@ server_send_cb(EV_P_ ev_io *w, int revents)
             // all sent out, wait for reading
             server->buf->len = 0;
             server->buf->idx = 0;
-            ev_io_stop(EV_A_ & server_send_ctx->io);
-            ev_io_start(EV_A_ & remote->recv_ctx->io);
+            edge_io_stop(EV_A_ & server_send_ctx->io);
+            edge_io_start(EV_A_ & remote->recv_ctx->io);
         }
     }
 }
@@ -330,7 +337,7 @@ delayed_connect_cb(EV_P_ ev_timer *watcher, int revents)
         return;
     } else {
         // listen to remote connected event
-        ev_io_start(EV_A_ & remote->send_ctx->io);
+        edge_io_start(EV_A_ & remote->send_ctx->io);
         ev_timer_start(EV_A_ & remote->send_ctx->watcher);
     }
 }
@@ -368,6 +375,7 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data
             // continue to wait for recv
+            edge_io_again(&remote_recv_ctx->io);
             return;
         } else {
             ERROR("remote recv");
@@ -395,8 +403,9 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data, wait for send
             server->buf->idx = 0;
-            ev_io_stop(EV_A_ & remote_recv_ctx->io);
-            ev_io_start(EV_A_ & server->send_ctx->io);
+            edge_io_again(&server->send_ctx->io);
+            edge_io_stop(EV_A_ & remote_recv_ctx->io);
+            edge_io_start(EV_A_ & server->send_ctx->io);
         } else {
             ERROR("send");
             close_and_free_remote(EV_A_ remote);
@@ -406,8 +415,9 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
     } else if (s < server->buf->len) {
         server->buf->len -= s;
         server->buf->idx  = s;
-        ev_io_stop(EV_A_ & remote_recv_ctx->io);
-        ev_io_start(EV_A_ & server->send_ctx->io);
+        edge_io_again(&server->send_ctx->io);
+        edge_io_stop(EV_A_ & remote_recv_ctx->io);
+        edge_io_start(EV_A_ & server->send_ctx->io);
     }
 
     // Disable TCP_NODELAY after the first response are sent
@@ -439,9 +449,9 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
         if (r == 0) {
             remote_send_ctx->connected = 1;
 
-            ev_io_stop(EV_A_ & remote_send_ctx->io);
-            ev_io_stop(EV_A_ & server->recv_ctx->io);
-            ev_io_start(EV_A_ & remote->recv_ctx->io);
+            edge_io_stop(EV_A_ & remote_send_ctx->io);
+            edge_io_stop(EV_A_ & server->recv_ctx->io);
+            edge_io_start(EV_A_ & remote->recv_ctx->io);
 
             // send destaddr
             buffer_t ss_addr_to_send;
@@ -531,7 +541,7 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
 
             if (s == -1) {
                 if (errno == CONNECT_IN_PROGRESS) {
-                    ev_io_start(EV_A_ & remote_send_ctx->io);
+                    edge_io_start(EV_A_ & remote_send_ctx->io);
                     ev_timer_start(EV_A_ & remote_send_ctx->watcher);
                 } else {
                     if (errno == EOPNOTSUPP || errno == EPROTONOSUPPORT ||
@@ -557,20 +567,23 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
                 // close and free
                 close_and_free_remote(EV_A_ remote);
                 close_and_free_server(EV_A_ server);
+            } else {
+                edge_io_again(&remote_send_ctx->io);
             }
             return;
         } else if (s < remote->buf->len) {
             // partly sent, move memory, wait for the next time to send
+            edge_io_again(&remote_send_ctx->io);
             remote->buf->len -= s;
             remote->buf->idx += s;
-            ev_io_start(EV_A_ & remote_send_ctx->io);
+            edge_io_start(EV_A_ & remote_send_ctx->io);
             return;
         } else {
             // all sent out, wait for reading
             remote->buf->len = 0;
             remote->buf->idx = 0;
-            ev_io_stop(EV_A_ & remote_send_ctx->io);
-            ev_io_start(EV_A_ & server->recv_ctx->io);
+            edge_io_stop(EV_A_ & remote_send_ctx->io);
+            edge_io_start(EV_A_ & server->recv_ctx->io);
         }
     }
 }
@@ -595,6 +608,7 @@ new_remote(int fd, int timeout)
 
     ev_io_init(&remote->recv_ctx->io, remote_recv_cb, fd, EV_READ);
     ev_io_init(&remote->send_ctx->io, remote_send_cb, fd, EV_WRITE);
+    edge_add(fd, &remote->recv_ctx->io, &remote->send_ctx->io);
     ev_timer_init(&remote->send_ctx->watcher, remote_timeout_cb,
                   min(MAX_CONNECT_TIMEOUT, timeout), 0);
 
@@ -621,8 +635,9 @@ close_and_free_remote(EV_P_ remote_t *remote)
 {
     if (remote != NULL) {
         ev_timer_stop(EV_A_ & remote->send_ctx->watcher);
-        ev_io_stop(EV_A_ & remote->send_ctx->io);
-        ev_io_stop(EV_A_ & remote->recv_ctx->io);
+        edge_io_stop(EV_A_ & remote->send_ctx->io);
+        edge_io_stop(EV_A_ & remote->recv_ctx->io);
+        edge_del(remote->fd);
         close(remote->fd);
         free_remote(remote);
     }
@@ -653,6 +668,7 @@ new_server(int fd)
 
     ev_io_init(&server->recv_ctx->io, server_recv_cb, fd, EV_READ);
     ev_io_init(&server->send_ctx->io, server_send_cb, fd, EV_WRITE);
+    edge_add(fd, &server->recv_ctx->io, &server->send_ctx->io);
 
     ev_timer_init(&server->delayed_connect_watcher, delayed_connect_cb, 0.05,
                   0);
@@ -687,9 +703,10 @@ static void
 close_and_free_server(EV_P_ server_t *server)
 {
     if (server != NULL) {
-        ev_io_stop(EV_A_ & server->send_ctx->io);
-        ev_io_stop(EV_A_ & server->recv_ctx->io);
+        edge_io_stop(EV_A_ & server->send_ctx->io);
+        edge_io_stop(EV_A_ & server->recv_ctx->io);
         ev_timer_stop(EV_A_ & server->delayed_connect_watcher);
+        edge_del(server->fd);
         close(server->fd);
         free_server(server);
     }
@@ -802,10 +819,10 @@ accept_cb(EV_P_ ev_io *w, int revents)
             return;
         }
         // listen to remote connected event
-        ev_io_start(EV_A_ & remote->send_ctx->io);
+        edge_io_start(EV_A_ & remote->send_ctx->io);
         ev_timer_start(EV_A_ & remote->send_ctx->watcher);
     }
-    ev_io_start(EV_A_ & server->recv_ctx->io);
+    edge_io_start(EV_A_ & server->recv_ctx->io);
 }
 
 static void
@@ -872,6 +889,7 @@ main(int argc, char **argv)
         { "plugin-opts", required_argument, NULL, GETOPT_VAL_PLUGIN_OPTS },
         { "reuse-port",  no_argument,       NULL, GETOPT_VAL_REUSE_PORT  },
         { "no-delay",    no_argument,       NULL, GETOPT_VAL_NODELAY     },
+        { "edge-triggered", no_argument,    NULL, GETOPT_VAL_EDGE_TRIGGERED },
         { "password",    required_argument, NULL, GETOPT_VAL_PASSWORD    },
         { "key",         required_argument, NULL, GETOPT_VAL_KEY         },
         { "help",        no_argument,       NULL, GETOPT_VAL_HELP        },
@@ -912,6 +930,9 @@ main(int argc, char **argv)
         case GETOPT_VAL_REUSE_PORT:
             reuse_port = 1;
             break;
+        case GETOPT_VAL_EDGE_TRIGGERED:
+            edge_triggered = 1;
+            break;
         case 's':
             if (remote_num < MAX_REMOTE_NUM) {
                 parse_addr(optarg, &remote_addr[remote_num++]);
@@ -1041,6 +1062,9 @@ main(int argc, char **argv)
         if (reuse_port == 0) {
             reuse_port = conf->reuse_port;
         }
+        if (edge_triggered == 0) {
+            edge_triggered = conf->edge_triggered;
+        }
         if (fast_open == 0) {
             fast_open = conf->fast_open;
         }
@@ -1079,7 +1103,7 @@ main(int argc, char **argv)
     }
 
     if (method == NULL) {
-        method = "chacha20-ietf-poly1305";
+        method = DEFAULT_METHOD;
     }
 
     if (timeout == NULL) {
@@ -1192,6 +1216,10 @@ main(int argc, char **argv)
 
     struct ev_loop *loop = EV_DEFAULT;
 
+    if (edge_triggered && edge_init(loop) == 0) {
+        LOGI("enable edge-triggered readiness");
+    }
+
     listen_ctx_t *listen_ctx_current = &listen_ctx;
     do {
         if (listen_ctx_current->tos) {
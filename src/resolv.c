@@ -28,11 +28,13 @@
 #include "config.h"
 #endif
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #ifndef __MINGW32__
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -54,6 +56,9 @@
 #include "resolv.h"
 #include "utils.h"
 #include "netutils.h"
+#include "loopstat.h"
+#include "control.h"
+#include "dnscache.h"
 
 #ifdef __MINGW32__
 #define CONV_STATE_CB (ares_sock_state_cb)
@@ -61,25 +66,75 @@
 #define CONV_STATE_CB
 #endif
 
+#if ARES_VERSION_MAJOR >= 1 && ARES_VERSION_MINOR >= 11
+#define RESOLV_SPLIT_SERVERS
+#endif
+
 /*
  * Implement DNS resolution interface using libc-ares
+ *
+ * Every nameserver gets its own c-ares channel, so that the resolver,
+ * not c-ares, decides where a query goes. A query is sent to the
+ * nameserver with the lowest expected latency, and hedged to the next
+ * best one if no answer came within the primary's p95 RTT. The first
+ * valid answer wins, a failure moves on to the next nameserver at once.
  */
 
 #define SS_NUM_IOS 6
 #define SS_INVALID_FD -1
 #define SS_TIMER_AFTER 1.0
 
+#define RESOLV_MAX_SERVERS 8
+#define RESOLV_TIMEOUT     3000     // ms per try
+#define RESOLV_TRIES       2
+#define RESOLV_RTT_SAMPLES 64       // recent RTTs kept per nameserver for the p95
+#define RESOLV_RTT_INITIAL 0.05     // assumed until the first answer, so every server gets tried
+#define RESOLV_RTT_WEIGHT  0.125
+#define RESOLV_LOSS_WEIGHT 0.05
+#define RESOLV_HEDGE_MIN   0.01
+#define RESOLV_HEDGE_MAX   1.0
+
 struct resolv_ctx {
     struct ev_io ios[SS_NUM_IOS];
-    struct ev_timer timer;
-    ev_tstamp last_tick;
 
     ares_channel channel;
-    struct ares_options options;
+    char name[64];
+
+    ev_tstamp srtt;
+    ev_tstamp p95;
+    double loss;                    // moving average over tries
+    float rtts[RESOLV_RTT_SAMPLES];
+    int rtt_num;
+
+    uint64_t sent;
+    uint64_t answered;
+    uint64_t failed;
+    uint64_t timeouts;
+    uint64_t hedged;
+    uint64_t wins;
+};
+
+/*
+ * One address family of a query, possibly asked of several nameservers
+ */
+struct resolv_request {
+    struct resolv_query *query;
+    int family;
+    int done;
+    int pending;                    // attempts in flight
+    uint32_t tried;                 // bitmask of nameservers asked
+    ev_timer hedge;
+};
+
+struct resolv_attempt {
+    struct resolv_request *request;
+    struct resolv_ctx *ctx;
+    ev_tstamp sent;
+    int cached;                     // answered from the c-ares cache
 };
 
 struct resolv_query {
-    int requests[2];
+    struct resolv_request requests[2];
     size_t response_count;
     struct sockaddr **responses;
 
@@ -87,16 +142,23 @@ struct resolv_query {
     void (*free_cb)(void *);
 
     uint16_t port;
+    char *hostname;
 
     void *data;
 
+    int refs;                       // attempts in flight, plus resolv_start itself
     int is_closed;
+    int shared;                     // answered from the shared cache
 };
 
 extern int verbose;
 
-static struct resolv_ctx default_ctx;
+static struct resolv_ctx servers[RESOLV_MAX_SERVERS];
+static int server_num;
+static struct ev_timer default_timer;
+static ev_tstamp last_tick;
 static struct ev_loop *default_loop;
+static int in_send;
 
 enum {
     MODE_IPV4_FIRST = 0,
@@ -105,15 +167,25 @@ enum {
 
 static int resolv_mode = MODE_IPV4_FIRST;
 
+static double (*rank_cb)(const struct sockaddr *);
+
 static void resolv_sock_cb(struct ev_loop *, struct ev_io *, int);
 static void resolv_timer_cb(struct ev_loop *, struct ev_timer *, int);
+static void resolv_hedge_cb(struct ev_loop *, struct ev_timer *, int);
 static void resolv_sock_state_cb(void *, int, int, int);
 
-static void dns_query_v4_cb(void *, int, int, struct hostent *);
-static void dns_query_v6_cb(void *, int, int, struct hostent *);
+LOOP_STAT_DEFINE(resolv_sock_cb, ev_io)
+
+static void dns_query_cb(void *, int, int, struct hostent *);
 
+static void request_send(struct resolv_request *, struct resolv_ctx *);
+static int request_hedge(struct resolv_request *);
+static void request_done(struct resolv_request *, struct hostent *);
+static void add_response(struct resolv_query *, int, const void *, int);
+static int shared_lookup(struct resolv_query *);
+static void shared_store(struct resolv_query *);
 static void process_client_callback(struct resolv_query *);
-static inline int all_requests_are_null(struct resolv_query *);
+static void release_query(struct resolv_query *);
 static struct sockaddr *choose_ipv4_first(struct resolv_query *);
 static struct sockaddr *choose_ipv6_first(struct resolv_query *);
 static struct sockaddr *choose_any(struct resolv_query *);
@@ -124,17 +196,109 @@ static struct sockaddr *choose_any(struct resolv_query *);
 static void
 resolv_sock_cb(EV_P_ ev_io *w, int revents)
 {
-    ares_socket_t rfd = ARES_SOCKET_BAD, wfd = ARES_SOCKET_BAD;
+    struct resolv_ctx *ctx = (struct resolv_ctx *)w->data;
+    ares_socket_t rfd      = ARES_SOCKET_BAD, wfd = ARES_SOCKET_BAD;
 
     if (revents & EV_READ)
         rfd = w->fd;
     if (revents & EV_WRITE)
         wfd = w->fd;
 
-    default_ctx.last_tick = ev_now(default_loop);
+    last_tick = ev_now(default_loop);
+
+    ares_process_fd(ctx->channel, rfd, wfd);
+}
+
+static int
+server_init(struct resolv_ctx *ctx)
+{
+    struct ares_options options;
+    int status;
+
+    memset(&options, 0, sizeof(struct ares_options));
+    options.sock_state_cb_data = ctx;
+    options.sock_state_cb      = CONV_STATE_CB resolv_sock_state_cb;
+    options.timeout            = RESOLV_TIMEOUT;
+    options.tries              = RESOLV_TRIES;
+
+    status = ares_init_options(&ctx->channel, &options,
+#if ARES_VERSION_MAJOR >= 1 && ARES_VERSION_MINOR >= 12
+                               ARES_OPT_NOROTATE |
+#endif
+                               ARES_OPT_TIMEOUTMS | ARES_OPT_TRIES | ARES_OPT_SOCK_STATE_CB);
+
+    if (status != ARES_SUCCESS) {
+        LOGE("c-ares error: %s", ares_strerror(status));
+        return -1;
+    }
+
+    for (int i = 0; i < SS_NUM_IOS; i++) {
+        ev_io_init(&ctx->ios[i], LOOP_STAT_CB(resolv_sock_cb), SS_INVALID_FD, 0);
+        ctx->ios[i].data = ctx;
+    }
+
+    ctx->srtt = RESOLV_RTT_INITIAL;
+    ctx->p95  = RESOLV_RTT_INITIAL;
+
+    return 0;
+}
+
+#ifdef RESOLV_SPLIT_SERVERS
+static void
+split_servers(char *nameservers)
+{
+    char *saveptr = NULL;
+
+    for (char *entry = strtok_r(nameservers, ",", &saveptr);
+         entry != NULL && server_num < RESOLV_MAX_SERVERS;
+         entry = strtok_r(NULL, ",", &saveptr)) {
+        struct resolv_ctx *ctx = &servers[server_num];
+        if (server_init(ctx) == -1) {
+            FATAL("failed to initialize c-ares");
+        }
+        if (ares_set_servers_ports_csv(ctx->channel, entry) != ARES_SUCCESS) {
+            FATAL("failed to set nameservers");
+        }
+        snprintf(ctx->name, sizeof(ctx->name), "%s", entry);
+        server_num++;
+    }
+}
+
+static void
+split_system_servers(struct resolv_ctx *probe)
+{
+    struct ares_addr_port_node *list = NULL;
+    char ip[INET6_ADDRSTRLEN];
+
+    if (ares_get_servers_ports(probe->channel, &list) != ARES_SUCCESS || list == NULL) {
+        return;
+    }
+
+    int i = 0;
+    for (struct ares_addr_port_node *node = list;
+         node != NULL && i < RESOLV_MAX_SERVERS; node = node->next, i++) {
+        struct ares_addr_port_node single = *node;
+        single.next = NULL;
+
+        struct resolv_ctx *ctx = &servers[i];
+        if (i > 0 && server_init(ctx) == -1) {
+            break;
+        }
+        if (ares_set_servers_ports(ctx->channel, &single) != ARES_SUCCESS) {
+            if (i > 0) {
+                ares_destroy(ctx->channel);
+            }
+            break;
+        }
+        inet_ntop(node->family, &node->addr, ip, sizeof(ip));
+        snprintf(ctx->name, sizeof(ctx->name), node->family == AF_INET6 ? "[%s]:%d" : "%s:%d",
+                 ip, node->udp_port ? node->udp_port : 53);
+        server_num = i + 1;
+    }
 
-    ares_process_fd(default_ctx.channel, rfd, wfd);
+    ares_free_data(list);
 }
+#endif
 
 int
 resolv_init(struct ev_loop *loop, char *nameservers, int ipv6first)
@@ -153,41 +317,43 @@ resolv_init(struct ev_loop *loop, char *nameservers, int ipv6first)
         FATAL("failed to initialize c-ares");
     }
 
-    memset(&default_ctx, 0, sizeof(struct resolv_ctx));
-
-    default_ctx.options.sock_state_cb_data = &default_ctx;
-    default_ctx.options.sock_state_cb      = CONV_STATE_CB resolv_sock_state_cb;
-    default_ctx.options.timeout            = 3000;
-    default_ctx.options.tries              = 2;
-
-    status = ares_init_options(&default_ctx.channel, &default_ctx.options,
-#if ARES_VERSION_MAJOR >= 1 && ARES_VERSION_MINOR >= 12
-                               ARES_OPT_NOROTATE |
-#endif
-                               ARES_OPT_TIMEOUTMS | ARES_OPT_TRIES | ARES_OPT_SOCK_STATE_CB);
-
-    if (status != ARES_SUCCESS) {
-        FATAL("failed to initialize c-ares");
-    }
+    memset(servers, 0, sizeof(servers));
+    server_num = 0;
 
     if (nameservers != NULL) {
-#if ARES_VERSION_MAJOR >= 1 && ARES_VERSION_MINOR >= 11
-        status = ares_set_servers_ports_csv(default_ctx.channel, nameservers);
+#ifdef RESOLV_SPLIT_SERVERS
+        char *list = strdup(nameservers);
+        split_servers(list);
+        ss_free(list);
 #else
-        status = ares_set_servers_csv(default_ctx.channel, nameservers);
+        if (server_init(&servers[0]) == -1) {
+            FATAL("failed to initialize c-ares");
+        }
+        if (ares_set_servers_csv(servers[0].channel, nameservers) != ARES_SUCCESS) {
+            FATAL("failed to set nameservers");
+        }
+        snprintf(servers[0].name, sizeof(servers[0].name), "%s", nameservers);
+        server_num = 1;
+#endif
+    } else {
+        // The system configuration, from /etc/resolv.conf
+        if (server_init(&servers[0]) == -1) {
+            FATAL("failed to initialize c-ares");
+        }
+        snprintf(servers[0].name, sizeof(servers[0].name), "system");
+        server_num = 1;
+#ifdef RESOLV_SPLIT_SERVERS
+        split_system_servers(&servers[0]);
 #endif
     }
 
-    if (status != ARES_SUCCESS) {
+    if (server_num == 0) {
         FATAL("failed to set nameservers");
     }
 
-    for (int i = 0; i < SS_NUM_IOS; i++)
-        ev_io_init(&default_ctx.ios[i], resolv_sock_cb, SS_INVALID_FD, 0);
-
-    default_ctx.last_tick = ev_now(default_loop);
-    ev_init(&default_ctx.timer, resolv_timer_cb);
-    resolv_timer_cb(default_loop, &default_ctx.timer, 0);
+    last_tick = ev_now(default_loop);
+    ev_init(&default_timer, resolv_timer_cb);
+    resolv_timer_cb(default_loop, &default_timer, 0);
 
     return 0;
 }
@@ -195,16 +361,98 @@ resolv_init(struct ev_loop *loop, char *nameservers, int ipv6first)
 void
 resolv_shutdown(struct ev_loop *loop)
 {
-    ev_timer_stop(default_loop, &default_ctx.timer);
-    for (int i = 0; i < SS_NUM_IOS; i++)
-        ev_io_stop(default_loop, &default_ctx.ios[i]);
+    ev_timer_stop(default_loop, &default_timer);
 
-    ares_cancel(default_ctx.channel);
-    ares_destroy(default_ctx.channel);
+    for (int i = 0; i < server_num; i++) {
+        for (int j = 0; j < SS_NUM_IOS; j++)
+            ev_io_stop(default_loop, &servers[i].ios[j]);
+
+        ares_cancel(servers[i].channel);
+        ares_destroy(servers[i].channel);
+    }
+    server_num = 0;
 
     ares_library_cleanup();
 }
 
+/*
+ * Expected latency of a query, a lost try costs a full c-ares timeout
+ */
+static ev_tstamp
+server_cost(struct resolv_ctx *ctx)
+{
+    return ctx->srtt + ctx->loss * RESOLV_TIMEOUT / 1000.0;
+}
+
+static struct resolv_ctx *
+best_server(uint32_t tried)
+{
+    struct resolv_ctx *best = NULL;
+
+    for (int i = 0; i < server_num; i++) {
+        if (tried & (1u << i))
+            continue;
+        if (best == NULL || server_cost(&servers[i]) < server_cost(best))
+            best = &servers[i];
+    }
+
+    return best;
+}
+
+static ev_tstamp
+hedge_delay(struct resolv_ctx *ctx)
+{
+    ev_tstamp delay = ctx->p95;
+
+    if (delay < RESOLV_HEDGE_MIN)
+        delay = RESOLV_HEDGE_MIN;
+    if (delay > RESOLV_HEDGE_MAX)
+        delay = RESOLV_HEDGE_MAX;
+
+    return delay;
+}
+
+static int
+float_cmp(const void *a, const void *b)
+{
+    float fa = *(const float *)a, fb = *(const float *)b;
+    return fa < fb ? -1 : fa > fb ? 1 : 0;
+}
+
+static void
+server_update(struct resolv_ctx *ctx, int answered, int timeouts, ev_tstamp rtt)
+{
+    for (int i = 0; i < timeouts; i++)
+        ctx->loss += RESOLV_LOSS_WEIGHT * (1.0 - ctx->loss);
+    ctx->timeouts += timeouts;
+
+    if (!answered) {
+        ctx->failed++;
+        return;
+    }
+
+    ctx->answered++;
+    ctx->loss -= RESOLV_LOSS_WEIGHT * ctx->loss;
+
+    // Retried answers say more about loss than about RTT
+    if (timeouts > 0) {
+        return;
+    }
+
+    if (ctx->rtt_num == 0) {
+        ctx->srtt = rtt;
+    } else {
+        ctx->srtt += RESOLV_RTT_WEIGHT * (rtt - ctx->srtt);
+    }
+
+    float sorted[RESOLV_RTT_SAMPLES];
+    ctx->rtts[ctx->rtt_num++ % RESOLV_RTT_SAMPLES] = rtt;
+    int n = ctx->rtt_num < RESOLV_RTT_SAMPLES ? ctx->rtt_num : RESOLV_RTT_SAMPLES;
+    memcpy(sorted, ctx->rtts, n * sizeof(float));
+    qsort(sorted, n, sizeof(float), float_cmp);
+    ctx->p95 = sorted[n * 95 / 100];
+}
+
 void
 resolv_start(const char *hostname, uint16_t port,
              void (*client_cb)(struct sockaddr *, void *),
@@ -223,139 +471,259 @@ resolv_start(const char *hostname, uint16_t port,
     query->responses      = NULL;
     query->data           = data;
     query->free_cb        = free_cb;
+    query->hostname       = strdup(hostname);
+    query->refs           = 1;
+
+    query->requests[0].family = AF_INET;
+    query->requests[1].family = AF_INET6;
+
+    for (int i = 0; i < 2; i++) {
+        struct resolv_request *request = &query->requests[i];
+        request->query = query;
+        ev_timer_init(&request->hedge, resolv_hedge_cb, 0, 0);
+    }
+
+    if (shared_lookup(query)) {
+        query->shared           = 1;
+        query->requests[0].done = 1;
+        query->requests[1].done = 1;
+        process_client_callback(query);
+        release_query(query);
+        return;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        struct resolv_request *request = &query->requests[i];
+        struct resolv_ctx *ctx         = best_server(0);
 
-    query->requests[0] = AF_INET;
-    query->requests[1] = AF_INET6;
+        request_send(request, ctx);
+        if (!request->done && server_num > 1) {
+            ev_timer_set(&request->hedge, hedge_delay(ctx), 0);
+            ev_timer_start(default_loop, &request->hedge);
+        }
+    }
 
-    ares_gethostbyname(default_ctx.channel, hostname, AF_INET, dns_query_v4_cb, query);
-    ares_gethostbyname(default_ctx.channel, hostname, AF_INET6, dns_query_v6_cb, query);
+    release_query(query);
+}
+
+static void
+request_send(struct resolv_request *request, struct resolv_ctx *ctx)
+{
+    struct resolv_attempt *attempt = ss_malloc(sizeof(struct resolv_attempt));
+    int saved                      = in_send;
+
+    attempt->request = request;
+    attempt->ctx     = ctx;
+    attempt->sent    = ev_time();
+    attempt->cached  = 0;
+
+    request->tried |= 1u << (ctx - servers);
+    request->pending++;
+    request->query->refs++;
+    ctx->sent++;
+
+    // c-ares calls back before returning when the answer is cached
+    in_send = 1;
+    ares_gethostbyname(ctx->channel, request->query->hostname, request->family,
+                       dns_query_cb, attempt);
+    in_send = saved;
+}
+
+/*
+ * Ask the best nameserver not asked yet, returns 0 if there is none
+ */
+static int
+request_hedge(struct resolv_request *request)
+{
+    struct resolv_ctx *ctx = best_server(request->tried);
+
+    ev_timer_stop(default_loop, &request->hedge);
+
+    if (ctx == NULL) {
+        return 0;
+    }
+
+    if (verbose) {
+        LOGI("hedging %s to %s", request->query->hostname, ctx->name);
+    }
+
+    ctx->hedged++;
+    request_send(request, ctx);
+
+    if (!request->done && best_server(request->tried) != NULL) {
+        ev_timer_set(&request->hedge, hedge_delay(ctx), 0);
+        ev_timer_start(default_loop, &request->hedge);
+    }
+
+    return 1;
+}
+
+static void
+resolv_hedge_cb(EV_P_ ev_timer *w, int revents)
+{
+    struct resolv_request *request = cork_container_of(w, struct resolv_request, hedge);
+    struct resolv_query *query     = request->query;
+
+    query->refs++;
+    request_hedge(request);
+    release_query(query);
 }
 
 /*
  * Wrapper for client callback we provide to c-ares
  */
 static void
-dns_query_v4_cb(void *arg, int status, int timeouts, struct hostent *he)
+dns_query_cb(void *arg, int status, int timeouts, struct hostent *he)
 {
-    int i, n;
-    struct resolv_query *query = (struct resolv_query *)arg;
+    struct resolv_attempt *attempt = (struct resolv_attempt *)arg;
+    struct resolv_request *request = attempt->request;
+    struct resolv_ctx *ctx         = attempt->ctx;
+    struct resolv_query *query     = request->query;
 
     if (status == ARES_EDESTRUCTION) {
+        ss_free(attempt);
         return;
     }
 
-    if (!he || status != ARES_SUCCESS) {
-        if (verbose) {
-            LOGI("failed to lookup v4 address %s", ares_strerror(status));
-        }
-        goto CLEANUP;
-    }
+    attempt->cached = in_send;
+    request->pending--;
 
-    if (verbose) {
-        LOGI("found address name v4 address %s", he->h_name);
-    }
-
-    n = 0;
-    while (he->h_addr_list[n])
-        n++;
+    // An NXDOMAIN or an empty answer is as good as an address
+    int valid = status == ARES_SUCCESS || status == ARES_ENOTFOUND
+                || status == ARES_ENODATA;
 
-    if (n > 0) {
-        struct sockaddr **new_responses = ss_realloc(query->responses,
-                                                     (query->response_count + n)
-                                                     * sizeof(struct sockaddr *));
+    if (!attempt->cached && status != ARES_ECANCELLED) {
+        server_update(ctx, valid, timeouts, ev_time() - attempt->sent);
+    }
 
-        if (new_responses == NULL) {
-            LOGE("failed to allocate memory for additional DNS responses");
+    if (!request->done) {
+        if (valid) {
+            if (!attempt->cached) {
+                ctx->wins++;
+            }
+            if (status != ARES_SUCCESS && verbose) {
+                LOGI("failed to lookup v%d address %s", request->family == AF_INET ? 4 : 6,
+                     ares_strerror(status));
+            }
+            request_done(request, status == ARES_SUCCESS ? he : NULL);
         } else {
-            query->responses = new_responses;
-
-            for (i = 0; i < n; i++) {
-                struct sockaddr_in *sa = ss_malloc(sizeof(struct sockaddr_in));
-                memset(sa, 0, sizeof(struct sockaddr_in));
-                sa->sin_family = AF_INET;
-                sa->sin_port   = query->port;
-                memcpy(&sa->sin_addr, he->h_addr_list[i], he->h_length);
-
-                query->responses[query->response_count] = (struct sockaddr *)sa;
-                if (query->responses[query->response_count] == NULL) {
-                    LOGE("failed to allocate memory for DNS query result address");
-                } else {
-                    query->response_count++;
-                }
+            if (verbose) {
+                LOGI("%s failed to lookup %s: %s", ctx->name, query->hostname,
+                     ares_strerror(status));
+            }
+            // The request is given up once every nameserver failed
+            if (status == ARES_ECANCELLED
+                || (!request_hedge(request) && request->pending == 0)) {
+                request_done(request, NULL);
             }
         }
     }
 
-CLEANUP:
+    ss_free(attempt);
+    release_query(query);
+}
+
+static void
+request_done(struct resolv_request *request, struct hostent *he)
+{
+    struct resolv_query *query = request->query;
 
-    query->requests[0] = 0; /* mark A query as being completed */
+    request->done = 1;
+    ev_timer_stop(default_loop, &request->hedge);
+
+    if (he != NULL) {
+        if (verbose) {
+            LOGI("found address name v%d address %s",
+                 request->family == AF_INET ? 4 : 6, he->h_name);
+        }
+        for (int i = 0; he->h_addr_list[i] != NULL; i++)
+            add_response(query, request->family, he->h_addr_list[i], he->h_length);
+    }
 
     /* Once all requests have completed, call client callback */
-    if (all_requests_are_null(query)) {
-        return process_client_callback(query);
+    if (query->requests[0].done && query->requests[1].done) {
+        process_client_callback(query);
     }
 }
 
 static void
-dns_query_v6_cb(void *arg, int status, int timeouts, struct hostent *he)
+add_response(struct resolv_query *query, int family, const void *addr, int addr_len)
 {
-    int i, n;
-    struct resolv_query *query = (struct resolv_query *)arg;
+    struct sockaddr **new_responses = ss_realloc(query->responses,
+                                                 (query->response_count + 1)
+                                                 * sizeof(struct sockaddr *));
+    struct sockaddr *sa;
 
-    if (status == ARES_EDESTRUCTION) {
+    if (new_responses == NULL) {
+        LOGE("failed to allocate memory for additional DNS responses");
         return;
     }
+    query->responses = new_responses;
+
+    if (family == AF_INET) {
+        struct sockaddr_in *sin = ss_malloc(sizeof(struct sockaddr_in));
+        memset(sin, 0, sizeof(struct sockaddr_in));
+        sin->sin_family = AF_INET;
+        sin->sin_port   = query->port;
+        memcpy(&sin->sin_addr, addr, addr_len);
+        sa = (struct sockaddr *)sin;
+    } else {
+        struct sockaddr_in6 *sin6 = ss_malloc(sizeof(struct sockaddr_in6));
+        memset(sin6, 0, sizeof(struct sockaddr_in6));
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port   = query->port;
+        memcpy(&sin6->sin6_addr, addr, addr_len);
+        sa = (struct sockaddr *)sin6;
+    }
 
-    if (!he || status != ARES_SUCCESS) {
-        if (verbose) {
-            LOGI("failed to lookup v6 address %s", ares_strerror(status));
-        }
-        goto CLEANUP;
+    query->responses[query->response_count++] = sa;
+}
+
+/*
+ * Answers another process of ss-manager's already looked up
+ */
+static int
+shared_lookup(struct resolv_query *query)
+{
+    dnscache_answer_t answer;
+
+    if (!dnscache_lookup(query->hostname, &answer)) {
+        return 0;
     }
 
     if (verbose) {
-        LOGI("found address name v6 address %s", he->h_name);
+        LOGI("found %s in the shared cache", query->hostname);
     }
 
-    n = 0;
-    while (he->h_addr_list[n])
-        n++;
+    for (int i = 0; i < answer.v4_num; i++)
+        add_response(query, AF_INET, &answer.v4[i], sizeof(struct in_addr));
+    for (int i = 0; i < answer.v6_num; i++)
+        add_response(query, AF_INET6, &answer.v6[i], sizeof(struct in6_addr));
 
-    if (n > 0) {
-        struct sockaddr **new_responses = ss_realloc(query->responses,
-                                                     (query->response_count + n)
-                                                     * sizeof(struct sockaddr *));
-
-        if (new_responses == NULL) {
-            LOGE("failed to allocate memory for additional DNS responses");
-        } else {
-            query->responses = new_responses;
-
-            for (i = 0; i < n; i++) {
-                struct sockaddr_in6 *sa = ss_malloc(sizeof(struct sockaddr_in6));
-                memset(sa, 0, sizeof(struct sockaddr_in6));
-                sa->sin6_family = AF_INET6;
-                sa->sin6_port   = query->port;
-                memcpy(&sa->sin6_addr, he->h_addr_list[i], he->h_length);
-
-                query->responses[query->response_count] = (struct sockaddr *)sa;
-                if (query->responses[query->response_count] == NULL) {
-                    LOGE("failed to allocate memory for DNS query result address");
-                } else {
-                    query->response_count++;
-                }
-            }
-        }
-    }
+    return 1;
+}
 
-CLEANUP:
+static void
+shared_store(struct resolv_query *query)
+{
+    dnscache_answer_t answer;
 
-    query->requests[1] = 0; /* mark A query as being completed */
+    // Failures may be local, only addresses are worth sharing
+    if (query->shared || query->response_count == 0) {
+        return;
+    }
 
-    /* Once all requests have completed, call client callback */
-    if (all_requests_are_null(query)) {
-        return process_client_callback(query);
+    memset(&answer, 0, sizeof(dnscache_answer_t));
+    for (int i = 0; i < query->response_count; i++) {
+        struct sockaddr *sa = query->responses[i];
+        if (sa->sa_family == AF_INET && answer.v4_num < DNSCACHE_ADDRS) {
+            answer.v4[answer.v4_num++] = ((struct sockaddr_in *)sa)->sin_addr;
+        } else if (sa->sa_family == AF_INET6 && answer.v6_num < DNSCACHE_ADDRS) {
+            answer.v6[answer.v6_num++] = ((struct sockaddr_in6 *)sa)->sin6_addr;
+        }
     }
+
+    dnscache_store(query->hostname, &answer);
 }
 
 /*
@@ -366,6 +734,8 @@ process_client_callback(struct resolv_query *query)
 {
     struct sockaddr *best_address = NULL;
 
+    shared_store(query);
+
     if (resolv_mode == MODE_IPV4_FIRST) {
         best_address = choose_ipv4_first(query);
     } else if (resolv_mode == MODE_IPV6_FIRST) {
@@ -386,51 +756,93 @@ process_client_callback(struct resolv_query *query)
     else
         ss_free(query->data);
 
+    // Hedged attempts still in flight keep the query until they return
+    query->is_closed = 1;
+}
+
+static void
+release_query(struct resolv_query *query)
+{
+    if (--query->refs > 0 || !query->is_closed) {
+        return;
+    }
+
+    ss_free(query->hostname);
     ss_free(query);
 }
 
+/*
+ * Lowest ranked answer of the family, or the first one without a rank
+ * hook. Ties keep the nameserver's order.
+ */
 static struct sockaddr *
-choose_ipv4_first(struct resolv_query *query)
+choose_ranked(struct resolv_query *query, int family)
 {
-    for (int i = 0; i < query->response_count; i++)
-        if (query->responses[i]->sa_family == AF_INET) {
-            return query->responses[i];
+    struct sockaddr *best = NULL;
+    double best_rank      = 0;
+
+    for (int i = 0; i < query->response_count; i++) {
+        struct sockaddr *sa = query->responses[i];
+        if (family != AF_UNSPEC && sa->sa_family != family) {
+            continue;
         }
+        if (rank_cb == NULL) {
+            return sa;
+        }
+        double rank = rank_cb(sa);
+        if (best == NULL || rank < best_rank) {
+            best      = sa;
+            best_rank = rank;
+        }
+    }
 
-    return choose_any(query);
+    return best;
 }
 
 static struct sockaddr *
-choose_ipv6_first(struct resolv_query *query)
+choose_ipv4_first(struct resolv_query *query)
 {
-    for (int i = 0; i < query->response_count; i++)
-        if (query->responses[i]->sa_family == AF_INET6) {
-            return query->responses[i];
-        }
+    struct sockaddr *sa = choose_ranked(query, AF_INET);
 
-    return choose_any(query);
+    return sa != NULL ? sa : choose_any(query);
 }
 
 static struct sockaddr *
-choose_any(struct resolv_query *query)
+choose_ipv6_first(struct resolv_query *query)
 {
-    if (query->response_count >= 1) {
-        return query->responses[0];
-    }
+    struct sockaddr *sa = choose_ranked(query, AF_INET6);
 
-    return NULL;
+    return sa != NULL ? sa : choose_any(query);
 }
 
-static inline int
-all_requests_are_null(struct resolv_query *query)
+static struct sockaddr *
+choose_any(struct resolv_query *query)
 {
-    int result = 1;
+    return choose_ranked(query, AF_UNSPEC);
+}
 
-    for (int i = 0; i < sizeof(query->requests) / sizeof(query->requests[0]);
-         i++)
-        result = result && query->requests[i] == 0;
+void
+resolv_set_rank(double (*rank)(const struct sockaddr *))
+{
+    rank_cb = rank;
+}
 
-    return result;
+void
+resolv_stats(const char *data, control_reply_t *reply)
+{
+    control_reply(reply, "[");
+    for (int i = 0; i < server_num; i++) {
+        struct resolv_ctx *ctx = &servers[i];
+        control_reply(reply,
+                      "%s\n\t{\"server\":\"%s\",\"srtt_ms\":%.1f,\"p95_ms\":%.1f,"
+                      "\"loss\":%.3f,\"sent\":%" PRIu64 ",\"answered\":%" PRIu64
+                      ",\"failed\":%" PRIu64 ",\"timeouts\":%" PRIu64
+                      ",\"hedged\":%" PRIu64 ",\"wins\":%" PRIu64 "}",
+                      i ? "," : "", ctx->name, ctx->srtt * 1e3, ctx->p95 * 1e3,
+                      ctx->loss, ctx->sent, ctx->answered, ctx->failed,
+                      ctx->timeouts, ctx->hedged, ctx->wins);
+    }
+    control_reply(reply, "\n]\n");
 }
 
 /*
@@ -439,14 +851,13 @@ all_requests_are_null(struct resolv_query *query)
 static void
 resolv_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
 {
-    struct resolv_ctx *ctx = cork_container_of(w, struct resolv_ctx, timer);
-
     ev_tstamp now   = ev_now(default_loop);
-    ev_tstamp after = ctx->last_tick - now + SS_TIMER_AFTER;
+    ev_tstamp after = last_tick - now + SS_TIMER_AFTER;
 
     if (after < 0.0) {
-        ctx->last_tick = now;
-        ares_process_fd(ctx->channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+        last_tick = now;
+        for (int i = 0; i < server_num; i++)
+            ares_process_fd(servers[i].channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
 
         ev_timer_set(w, SS_TIMER_AFTER, 0.0);
     } else {
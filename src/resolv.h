@@ -36,6 +36,7 @@
 #endif
 
 struct resolv_query;
+struct control_reply;
 
 int resolv_init(struct ev_loop *, char *, int);
 void resolv_start(const char *hostname, uint16_t port,
@@ -43,4 +44,15 @@ void resolv_start(const char *hostname, uint16_t port,
                   void (*free_cb)(void *), void *data);
 void resolv_shutdown(struct ev_loop *);
 
+/*
+ * Order the answers of a lookup by rank, lowest first, within the
+ * preferred address family
+ */
+void resolv_set_rank(double (*rank)(const struct sockaddr *));
+
+/*
+ * Control command reporting RTT, loss and hedging per nameserver
+ */
+void resolv_stats(const char *data, struct control_reply *reply);
+
 #endif
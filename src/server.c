@@ -58,6 +58,20 @@
 #include "server.h"
 #include "winsock.h"
 #include "resolv.h"
+#include "loopstat.h"
+#include "control.h"
+#include "trace.h"
+#include "hitters.h"
+#include "flowlog.h"
+#include "ipscore.h"
+#include "negcache.h"
+#include "dnscache.h"
+#include "edge.h"
+#include "prio.h"
+#include "busypoll.h"
+#include "keypool.h"
+#include "sockprof.h"
+#include "arena.h"
 
 #ifndef EAGAIN
 #define EAGAIN EWOULDBLOCK
@@ -95,6 +109,13 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents);
 static void remote_send_cb(EV_P_ ev_io *w, int revents);
 static void server_timeout_cb(EV_P_ ev_timer *watcher, int revents);
 
+LOOP_STAT_DEFINE(accept_cb, ev_io)
+LOOP_STAT_DEFINE(server_send_cb, ev_io)
+LOOP_STAT_DEFINE(server_recv_cb, ev_io)
+LOOP_STAT_DEFINE(remote_recv_cb, ev_io)
+LOOP_STAT_DEFINE(remote_send_cb, ev_io)
+LOOP_STAT_DEFINE(server_timeout_cb, ev_timer)
+
 static remote_t *new_remote(int fd);
 static server_t *new_server(int fd, listen_ctx_t *listener);
 static remote_t *connect_to_remote(EV_P_ struct addrinfo *res,
@@ -154,20 +175,20 @@ static struct plugin_watcher_t {
 
 static struct cork_dllist connections;
 
+// Connection slabs, from the huge page arena with --huge-pages
+static arena_pool_t server_pool     = ARENA_POOL(server_t);
+static arena_pool_t server_ctx_pool = ARENA_POOL(server_ctx_t);
+static arena_pool_t remote_pool     = ARENA_POOL(remote_t);
+static arena_pool_t remote_ctx_pool = ARENA_POOL(remote_ctx_t);
+
 #ifndef __MINGW32__
 static void
-stat_update_cb(EV_P_ ev_timer *watcher, int revents)
+send_to_manager(const char *resp)
 {
     struct sockaddr_un svaddr, claddr;
     int sfd = -1;
     size_t msgLen;
-    char resp[SOCKET_BUF_SIZE];
-
-    if (verbose) {
-        LOGI("update traffic stat: tx: %" PRIu64 " rx: %" PRIu64 "", tx, rx);
-    }
 
-    snprintf(resp, SOCKET_BUF_SIZE, "stat: {\"%s\":%" PRIu64 "}", remote_port, tx + rx);
     msgLen = strlen(resp) + 1;
 
     ss_addr_t ip_addr = { .host = NULL, .port = NULL };
@@ -231,6 +252,19 @@ stat_update_cb(EV_P_ ev_timer *watcher, int revents)
     close(sfd);
 }
 
+static void
+stat_update_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    char resp[SOCKET_BUF_SIZE];
+
+    if (verbose) {
+        LOGI("update traffic stat: tx: %" PRIu64 " rx: %" PRIu64 "", tx, rx);
+    }
+
+    snprintf(resp, SOCKET_BUF_SIZE, "stat: {\"%s\":%" PRIu64 "}", remote_port, tx + rx);
+    send_to_manager(resp);
+}
+
 #endif
 
 static void
@@ -245,6 +279,50 @@ free_connections(struct ev_loop *loop)
     }
 }
 
+/*
+ * Heap held by the live connections, by component. Watchers are
+ * embedded in the context structs and counted apart from them.
+ */
+static void
+mem_cmd_cb(const char *data, control_reply_t *reply)
+{
+    struct cork_dllist_item *curr, *next;
+    size_t conns = 0, remotes = 0;
+    size_t state = 0, watchers = 0, buffers = 0, ciphers = 0;
+
+    cork_dllist_foreach_void(&connections, curr, next) {
+        server_t *server = cork_container_of(curr, server_t, entries);
+        remote_t *remote = server->remote;
+
+        conns++;
+        state    += sizeof(server_t) + 2 * sizeof(server_ctx_t);
+        watchers += 2 * (sizeof(ev_io) + sizeof(ev_timer));
+        buffers  += sizeof(buffer_t) + server->buf->capacity;
+        ciphers  += crypto_ctx_mem(server->e_ctx) + crypto_ctx_mem(server->d_ctx);
+
+        if (server->query != NULL)
+            state += sizeof(query_t);
+        if (server->trace != NULL)
+            state += sizeof(trace_t);
+        if (server->dest != NULL)
+            state += sizeof(hitters_key_t);
+        if (server->flow != NULL)
+            state += sizeof(flowlog_t) +
+                     server->flow->capacity * sizeof(flowlog_event_t);
+
+        if (remote != NULL) {
+            remotes++;
+            state    += sizeof(remote_t) + 2 * sizeof(remote_ctx_t);
+            watchers += 2 * sizeof(ev_io);
+            buffers  += sizeof(buffer_t) + remote->buf->capacity;
+        }
+    }
+
+    control_reply(reply, "{\"connections\":%zu,\"remotes\":%zu,\"state\":%zu,"
+                  "\"watchers\":%zu,\"buffers\":%zu,\"ciphers\":%zu}\n",
+                  conns, remotes, state - watchers, watchers, buffers, ciphers);
+}
+
 static char *
 get_peer_name(int fd)
 {
@@ -274,6 +352,19 @@ stop_server(EV_P_ server_t *server)
     server->stage = STAGE_STOP;
 }
 
+static void
+update_prio(EV_P_ server_t *server, size_t size)
+{
+    int cls = prio_update(EV_A_ & server->prio, size);
+
+    prio_watcher(EV_A_ & server->recv_ctx->io, cls);
+    prio_watcher(EV_A_ & server->send_ctx->io, cls);
+    if (server->remote != NULL) {
+        prio_watcher(EV_A_ & server->remote->recv_ctx->io, cls);
+        prio_watcher(EV_A_ & server->remote->send_ctx->io, cls);
+    }
+}
+
 static void
 report_addr(int fd, const char *info)
 {
@@ -323,6 +414,18 @@ setnonblocking(int fd)
 
 #endif
 
+static void
+setmptcp(int fd)
+{
+    int opt = 1;
+
+    for (int i = 0; mptcp_enabled_values[i] > 0; i++)
+        if (setsockopt(fd, IPPROTO_TCP, mptcp_enabled_values[i], &opt, sizeof(opt)) != -1)
+            return;
+
+    ERROR("failed to enable multipath TCP");
+}
+
 int
 create_and_bind(const char *host, const char *port, int mptcp)
 {
@@ -387,6 +490,7 @@ create_and_bind(const char *host, const char *port, int mptcp)
 #ifdef SO_NOSIGPIPE
         setsockopt(listen_sock, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
 #endif
+        BUSY_POLL(listen_sock);
         if (reuse_port) {
             int err = set_reuseport(listen_sock);
             if (err == 0) {
@@ -395,17 +499,7 @@ create_and_bind(const char *host, const char *port, int mptcp)
         }
 
         if (mptcp == 1) {
-            int i = 0;
-            while ((mptcp = mptcp_enabled_values[i]) > 0) {
-                int err = setsockopt(listen_sock, IPPROTO_TCP, mptcp, &opt, sizeof(opt));
-                if (err != -1) {
-                    break;
-                }
-                i++;
-            }
-            if (mptcp == 0) {
-                ERROR("failed to enable multipath TCP");
-            }
+            setmptcp(listen_sock);
         }
 
         s = bind(listen_sock, rp->ai_addr, rp->ai_addrlen);
@@ -456,6 +550,12 @@ connect_to_remote(EV_P_ struct addrinfo *res,
         }
     }
 
+    if (negcache_blocked(res->ai_addr)) {
+        if (verbose)
+            LOGI("destination recently unreachable, connect avoided");
+        return NULL;
+    }
+
     // initialize remote socks
     sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
     if (sockfd == -1) {
@@ -470,6 +570,8 @@ connect_to_remote(EV_P_ struct addrinfo *res,
     setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
 #endif
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    BUSY_POLL(sockfd);
+    sockprof_apply(sockfd, server->profile);
 
     // setup remote socks
 
@@ -499,6 +601,12 @@ connect_to_remote(EV_P_ struct addrinfo *res,
 #endif
 
     remote_t *remote = new_remote(sockfd);
+    remote->connect_start = loop_stat_clock();
+    ipscore_key(&remote->addr, res->ai_addr);
+    remote->port = res->ai_family == AF_INET6
+                   ? ((struct sockaddr_in6 *)res->ai_addr)->sin6_port
+                   : ((struct sockaddr_in *)res->ai_addr)->sin_port;
+    prio_set_port(&server->prio, ntohs(remote->port));
 
     if (fast_open) {
 #if defined(MSG_FASTOPEN) && !defined(TCP_FASTOPEN_CONNECT)
@@ -596,11 +704,15 @@ connect_to_remote(EV_P_ struct addrinfo *res,
 
         if (r == -1 && errno != CONNECT_IN_PROGRESS) {
             ERROR("connect");
+            ipscore_failed(&remote->addr);
+            negcache_failed(&remote->addr, remote->port, errno);
             close_and_free_remote(EV_A_ remote);
             return NULL;
         }
     }
 
+    HITTERS_ADD(server->dest, HITTERS_CONNS, 1);
+
     return remote;
 }
 
@@ -695,6 +807,34 @@ setTosFromConnmark(remote_t *remote, server_t *server)
 
 #endif
 
+/*
+ * Hand a stream of datagrams over to the UDP relay, which owns the socket
+ * and the cipher contexts from then on.
+ */
+static void
+accept_udp_stream(EV_P_ server_t *server)
+{
+    edge_io_stop(EV_A_ & server->send_ctx->io);
+    edge_io_stop(EV_A_ & server->recv_ctx->io);
+    ev_timer_stop(EV_A_ & server->recv_ctx->watcher);
+    edge_del(server->fd);
+
+    if (uot_accept(EV_A_ server->fd, server->e_ctx, server->d_ctx,
+                   server->buf->data + server->buf->idx, server->buf->len) == 0) {
+        server->e_ctx = NULL;
+        server->d_ctx = NULL;
+    } else {
+        report_addr(server->fd, "udp over tcp without udp relay");
+        close(server->fd);
+    }
+
+    free_server(server);
+    if (verbose) {
+        server_conn--;
+        LOGI("close a connection from client, %d opened client connections", server_conn);
+    }
+}
+
 static void
 server_recv_cb(EV_P_ ev_io *w, int revents)
 {
@@ -705,6 +845,10 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
     buffer_t *buf = server->buf;
 
     if (server->stage == STAGE_STREAM) {
+        if (PRIO_DEFER(&server->prio)) {
+            return;
+        }
+
         remote = server->remote;
         buf    = remote->buf;
 
@@ -716,6 +860,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
 
     if (r == 0) {
         // connection closed
+        TRACE_REASON(server->trace, TRACE_CLOSE_CLIENT);
         close_and_free_remote(EV_A_ remote);
         close_and_free_server(EV_A_ server);
         return;
@@ -723,9 +868,11 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data
             // continue to wait for recv
+            edge_io_again(&server_recv_ctx->io);
             return;
         } else {
             ERROR("server recv");
+            TRACE_REASON(server->trace, TRACE_CLOSE_ERROR);
             close_and_free_remote(EV_A_ remote);
             close_and_free_server(EV_A_ server);
             return;
@@ -744,12 +891,14 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
 
     if (err == CRYPTO_ERROR) {
         report_addr(server->fd, "authentication error");
+        TRACE_REASON(server->trace, TRACE_CLOSE_CRYPTO);
         stop_server(EV_A_ server);
         return;
     } else if (err == CRYPTO_NEED_MORE) {
         if (server->stage != STAGE_STREAM) {
             if (server->frag > MAX_FRAG) {
                 report_addr(server->fd, "malicious fragmentation");
+                TRACE_REASON(server->trace, TRACE_CLOSE_CRYPTO);
                 stop_server(EV_A_ server);
                 return;
             }
@@ -758,25 +907,37 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
         return;
     }
 
+    TRACE(server->trace, TRACE_DECRYPT, 0);
+
     // handshake and transmit data
     if (server->stage == STAGE_STREAM) {
+        HITTERS_ADD(server->dest, HITTERS_BYTES, remote->buf->len);
+        FLOWLOG(server->flow, FLOWLOG_UP, remote->buf->len);
+        if (priority_classes) {
+            update_prio(EV_A_ server, r);
+        }
         int s = send(remote->fd, remote->buf->data, remote->buf->len, 0);
         if (s == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // no data, wait for send
+                TRACE(server->trace, TRACE_STALL, TRACE_TO_REMOTE);
                 remote->buf->idx = 0;
-                ev_io_stop(EV_A_ & server_recv_ctx->io);
-                ev_io_start(EV_A_ & remote->send_ctx->io);
+                edge_io_again(&remote->send_ctx->io);
+                edge_io_stop(EV_A_ & server_recv_ctx->io);
+                edge_io_start(EV_A_ & remote->send_ctx->io);
             } else {
                 ERROR("server_recv_send");
+                TRACE_REASON(server->trace, TRACE_CLOSE_ERROR);
                 close_and_free_remote(EV_A_ remote);
                 close_and_free_server(EV_A_ server);
             }
         } else if (s < remote->buf->len) {
+            TRACE(server->trace, TRACE_STALL, TRACE_TO_REMOTE);
             remote->buf->len -= s;
             remote->buf->idx  = s;
-            ev_io_stop(EV_A_ & server_recv_ctx->io);
-            ev_io_start(EV_A_ & remote->send_ctx->io);
+            edge_io_again(&remote->send_ctx->io);
+            edge_io_stop(EV_A_ & server_recv_ctx->io);
+            edge_io_start(EV_A_ & remote->send_ctx->io);
         }
         return;
     } else if (server->stage == STAGE_INIT) {
@@ -837,6 +998,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
             if (acl && outbound_block_match_host(host) == 1) {
                 if (verbose)
                     LOGI("outbound blocked %s", host);
+                TRACE_REASON(server->trace, TRACE_CLOSE_BLOCKED);
                 close_and_free_server(EV_A_ server);
                 return;
             }
@@ -912,6 +1074,11 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
             server->buf->idx = offset;
         }
 
+        if ((atyp & ADDRTYPE_MASK) == 3 && strcmp(host, UOT_HOST) == 0) {
+            accept_udp_stream(EV_A_ server);
+            return;
+        }
+
         if (verbose) {
             if ((atyp & ADDRTYPE_MASK) == 4)
                 LOGI("[%s] connect to [%s]:%d", remote_port, host, ntohs(port));
@@ -919,11 +1086,24 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
                 LOGI("[%s] connect to %s:%d", remote_port, host, ntohs(port));
         }
 
+        if (server->trace != NULL) {
+            trace_set_dest(server->trace, host, ntohs(port));
+        }
+        server->dest    = hitters_key_new(host);
+        server->profile = sockprof_match(acl ? host : NULL);
+
+        if (server->flow != NULL) {
+            flowlog_set_dest(server->flow, server->buf->data);
+            flowlog_record(server->flow, FLOWLOG_UP, server->buf->len);
+        }
+
         if (!need_query) {
+            TRACE(server->trace, TRACE_CONNECT_START, 0);
             remote_t *remote = connect_to_remote(EV_A_ & info, server);
 
             if (remote == NULL) {
                 LOGE("connect error");
+                TRACE_REASON(server->trace, TRACE_CLOSE_CONNECT);
                 close_and_free_server(EV_A_ server);
                 return;
             } else {
@@ -942,11 +1122,11 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
                 }
 
                 // waiting on remote connected event
-                ev_io_stop(EV_A_ & server_recv_ctx->io);
-                ev_io_start(EV_A_ & remote->send_ctx->io);
+                edge_io_stop(EV_A_ & server_recv_ctx->io);
+                edge_io_start(EV_A_ & remote->send_ctx->io);
             }
         } else {
-            ev_io_stop(EV_A_ & server_recv_ctx->io);
+            edge_io_stop(EV_A_ & server_recv_ctx->io);
 
             query_t *query = ss_malloc(sizeof(query_t));
             memset(query, 0, sizeof(query_t));
@@ -955,6 +1135,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
             snprintf(query->hostname, MAX_HOSTNAME_LEN, "%s", host);
 
             server->stage = STAGE_RESOLVE;
+            TRACE(server->trace, TRACE_RESOLVE_START, 0);
             resolv_start(host, port, resolv_cb, resolv_free_cb, query);
         }
 
@@ -989,12 +1170,18 @@ server_send_cb(EV_P_ ev_io *w, int revents)
         if (s == -1) {
             if (errno != EAGAIN && errno != EWOULDBLOCK) {
                 ERROR("server_send_send");
+                TRACE_REASON(server->trace, TRACE_CLOSE_ERROR);
                 close_and_free_remote(EV_A_ remote);
                 close_and_free_server(EV_A_ server);
+            } else {
+                TRACE(server->trace, TRACE_STALL, TRACE_TO_CLIENT);
+                edge_io_again(&server_send_ctx->io);
             }
             return;
         } else if (s < server->buf->len) {
             // partly sent, move memory, wait for the next time to send
+            TRACE(server->trace, TRACE_STALL, TRACE_TO_CLIENT);
+            edge_io_again(&server_send_ctx->io);
             server->buf->len -= s;
             server->buf->idx += s;
             return;
@@ -1002,9 +1189,9 @@ server_send_cb(EV_P_ ev_io *w, int revents)
             // all sent out, wait for reading
             server->buf->len = 0;
             server->buf->idx = 0;
-            ev_io_stop(EV_A_ & server_send_ctx->io);
+            edge_io_stop(EV_A_ & server_send_ctx->io);
             if (remote != NULL) {
-                ev_io_start(EV_A_ & remote->recv_ctx->io);
+                edge_io_start(EV_A_ & remote->recv_ctx->io);
                 return;
             } else {
                 LOGE("invalid remote");
@@ -1028,6 +1215,12 @@ server_timeout_cb(EV_P_ ev_timer *watcher, int revents)
         LOGI("TCP connection timeout");
     }
 
+    if (remote != NULL && !remote->send_ctx->connected) {
+        ipscore_failed(&remote->addr);
+        negcache_failed(&remote->addr, remote->port, ETIMEDOUT);
+    }
+
+    TRACE_REASON(server->trace, TRACE_CLOSE_TIMEOUT);
     close_and_free_remote(EV_A_ remote);
     close_and_free_server(EV_A_ server);
 }
@@ -1055,8 +1248,11 @@ resolv_cb(struct sockaddr *addr, void *data)
 
     struct ev_loop *loop = server->listen_ctx->loop;
 
+    TRACE(server->trace, TRACE_RESOLVE_END, 0);
+
     if (addr == NULL) {
         LOGE("unable to resolve %s", query->hostname);
+        TRACE_REASON(server->trace, TRACE_CLOSE_RESOLVE);
         close_and_free_server(EV_A_ server);
     } else {
         if (verbose) {
@@ -1077,9 +1273,11 @@ resolv_cb(struct sockaddr *addr, void *data)
             info.ai_addrlen = sizeof(struct sockaddr_in6);
         }
 
+        TRACE(server->trace, TRACE_CONNECT_START, 0);
         remote_t *remote = connect_to_remote(EV_A_ & info, server);
 
         if (remote == NULL) {
+            TRACE_REASON(server->trace, TRACE_CLOSE_CONNECT);
             close_and_free_server(EV_A_ server);
         } else {
             server->remote = remote;
@@ -1097,7 +1295,7 @@ resolv_cb(struct sockaddr *addr, void *data)
             }
 
             // listen to remote connected event
-            ev_io_start(EV_A_ & remote->send_ctx->io);
+            edge_io_start(EV_A_ & remote->send_ctx->io);
         }
     }
 }
@@ -1115,12 +1313,17 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
         return;
     }
 
+    if (PRIO_DEFER(&server->prio)) {
+        return;
+    }
+
     ev_timer_again(EV_A_ & server->recv_ctx->watcher);
 
     ssize_t r = recv(remote->fd, server->buf->data, SOCKET_BUF_SIZE, 0);
 
     if (r == 0) {
         // connection closed
+        TRACE_REASON(server->trace, TRACE_CLOSE_REMOTE);
         close_and_free_remote(EV_A_ remote);
         close_and_free_server(EV_A_ server);
         return;
@@ -1128,9 +1331,11 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data
             // continue to wait for recv
+            edge_io_again(&remote_recv_ctx->io);
             return;
         } else {
             ERROR("remote recv");
+            TRACE_REASON(server->trace, TRACE_CLOSE_ERROR);
             close_and_free_remote(EV_A_ remote);
             close_and_free_server(EV_A_ server);
             return;
@@ -1139,6 +1344,13 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
 
     rx += r;
 
+    TRACE(server->trace, TRACE_FIRST_BYTE, 0);
+    HITTERS_ADD(server->dest, HITTERS_BYTES, r);
+    FLOWLOG(server->flow, FLOWLOG_DOWN, r);
+    if (priority_classes) {
+        update_prio(EV_A_ server, r);
+    }
+
     // Ignore any new packet if the server is stopped
     if (server->stage == STAGE_STOP) {
         return;
@@ -1149,6 +1361,7 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
 
     if (err) {
         LOGE("invalid password or cipher");
+        TRACE_REASON(server->trace, TRACE_CLOSE_CRYPTO);
         close_and_free_remote(EV_A_ remote);
         close_and_free_server(EV_A_ server);
         return;
@@ -1162,20 +1375,25 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
     if (s == -1) {
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data, wait for send
+            TRACE(server->trace, TRACE_STALL, TRACE_TO_CLIENT);
             server->buf->idx = 0;
-            ev_io_stop(EV_A_ & remote_recv_ctx->io);
-            ev_io_start(EV_A_ & server->send_ctx->io);
+            edge_io_again(&server->send_ctx->io);
+            edge_io_stop(EV_A_ & remote_recv_ctx->io);
+            edge_io_start(EV_A_ & server->send_ctx->io);
         } else {
             ERROR("remote_recv_send");
+            TRACE_REASON(server->trace, TRACE_CLOSE_ERROR);
             close_and_free_remote(EV_A_ remote);
             close_and_free_server(EV_A_ server);
             return;
         }
     } else if (s < server->buf->len) {
+        TRACE(server->trace, TRACE_STALL, TRACE_TO_CLIENT);
         server->buf->len -= s;
         server->buf->idx  = s;
-        ev_io_stop(EV_A_ & remote_recv_ctx->io);
-        ev_io_start(EV_A_ & server->send_ctx->io);
+        edge_io_again(&server->send_ctx->io);
+        edge_io_stop(EV_A_ & remote_recv_ctx->io);
+        edge_io_start(EV_A_ & server->send_ctx->io);
     }
 
     // Disable TCP_NODELAY after the first response are sent
@@ -1240,16 +1458,31 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
 
         if (r == 0) {
             remote_send_ctx->connected = 1;
+            TRACE(server->trace, TRACE_CONNECT_END, 0);
+            ipscore_connected(&remote->addr, loop_stat_clock() - remote->connect_start);
+            negcache_connected(&remote->addr, remote->port);
+            if (server->flow != NULL) {
+                flowlog_connected(server->flow);
+            }
 
             if (remote->buf->len == 0) {
                 server->stage = STAGE_STREAM;
-                ev_io_stop(EV_A_ & remote_send_ctx->io);
-                ev_io_start(EV_A_ & server->recv_ctx->io);
-                ev_io_start(EV_A_ & remote->recv_ctx->io);
+                edge_io_stop(EV_A_ & remote_send_ctx->io);
+                edge_io_start(EV_A_ & server->recv_ctx->io);
+                edge_io_start(EV_A_ & remote->recv_ctx->io);
                 return;
             }
         } else {
             ERROR("getpeername");
+            ipscore_failed(&remote->addr);
+
+            // getpeername only says ENOTCONN, the reason is pending on the socket
+            int err       = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(remote->fd, SOL_SOCKET, SO_ERROR, (void *)&err, &len) == 0) {
+                negcache_failed(&remote->addr, remote->port, err);
+            }
+            TRACE_REASON(server->trace, TRACE_CLOSE_CONNECT);
             // not connected
             close_and_free_remote(EV_A_ remote);
             close_and_free_server(EV_A_ server);
@@ -1269,13 +1502,19 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
         if (s == -1) {
             if (errno != EAGAIN && errno != EWOULDBLOCK) {
                 ERROR("remote_send_send");
+                TRACE_REASON(server->trace, TRACE_CLOSE_ERROR);
                 // close and free
                 close_and_free_remote(EV_A_ remote);
                 close_and_free_server(EV_A_ server);
+            } else {
+                TRACE(server->trace, TRACE_STALL, TRACE_TO_REMOTE);
+                edge_io_again(&remote_send_ctx->io);
             }
             return;
         } else if (s < remote->buf->len) {
             // partly sent, move memory, wait for the next time to send
+            TRACE(server->trace, TRACE_STALL, TRACE_TO_REMOTE);
+            edge_io_again(&remote_send_ctx->io);
             remote->buf->len -= s;
             remote->buf->idx += s;
             return;
@@ -1283,12 +1522,12 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
             // all sent out, wait for reading
             remote->buf->len = 0;
             remote->buf->idx = 0;
-            ev_io_stop(EV_A_ & remote_send_ctx->io);
+            edge_io_stop(EV_A_ & remote_send_ctx->io);
             if (server != NULL) {
-                ev_io_start(EV_A_ & server->recv_ctx->io);
+                edge_io_start(EV_A_ & server->recv_ctx->io);
                 if (server->stage != STAGE_STREAM) {
                     server->stage = STAGE_STREAM;
-                    ev_io_start(EV_A_ & remote->recv_ctx->io);
+                    edge_io_start(EV_A_ & remote->recv_ctx->io);
                 }
             } else {
                 LOGE("invalid server");
@@ -1308,11 +1547,11 @@ new_remote(int fd)
         LOGI("new connection to remote, %d opened remote connections", remote_conn);
     }
 
-    remote_t *remote = ss_malloc(sizeof(remote_t));
+    remote_t *remote = arena_get(&remote_pool);
     memset(remote, 0, sizeof(remote_t));
 
-    remote->recv_ctx = ss_malloc(sizeof(remote_ctx_t));
-    remote->send_ctx = ss_malloc(sizeof(remote_ctx_t));
+    remote->recv_ctx = arena_get(&remote_ctx_pool);
+    remote->send_ctx = arena_get(&remote_ctx_pool);
     remote->buf      = ss_malloc(sizeof(buffer_t));
     balloc(remote->buf, SOCKET_BUF_SIZE);
     memset(remote->recv_ctx, 0, sizeof(remote_ctx_t));
@@ -1324,8 +1563,9 @@ new_remote(int fd)
     remote->send_ctx->connected = 0;
     remote->server              = NULL;
 
-    ev_io_init(&remote->recv_ctx->io, remote_recv_cb, fd, EV_READ);
-    ev_io_init(&remote->send_ctx->io, remote_send_cb, fd, EV_WRITE);
+    ev_io_init(&remote->recv_ctx->io, LOOP_STAT_CB(remote_recv_cb), fd, EV_READ);
+    ev_io_init(&remote->send_ctx->io, LOOP_STAT_CB(remote_send_cb), fd, EV_WRITE);
+    edge_add(fd, &remote->recv_ctx->io, &remote->send_ctx->io);
 
     return remote;
 }
@@ -1340,17 +1580,18 @@ free_remote(remote_t *remote)
         bfree(remote->buf);
         ss_free(remote->buf);
     }
-    ss_free(remote->recv_ctx);
-    ss_free(remote->send_ctx);
-    ss_free(remote);
+    arena_put(&remote_ctx_pool, remote->recv_ctx);
+    arena_put(&remote_ctx_pool, remote->send_ctx);
+    arena_put(&remote_pool, remote);
 }
 
 static void
 close_and_free_remote(EV_P_ remote_t *remote)
 {
     if (remote != NULL) {
-        ev_io_stop(EV_A_ & remote->send_ctx->io);
-        ev_io_stop(EV_A_ & remote->recv_ctx->io);
+        edge_io_stop(EV_A_ & remote->send_ctx->io);
+        edge_io_stop(EV_A_ & remote->recv_ctx->io);
+        edge_del(remote->fd);
         close(remote->fd);
         free_remote(remote);
         if (verbose) {
@@ -1369,12 +1610,12 @@ new_server(int fd, listen_ctx_t *listener)
     }
 
     server_t *server;
-    server = ss_malloc(sizeof(server_t));
+    server = arena_get(&server_pool);
 
     memset(server, 0, sizeof(server_t));
 
-    server->recv_ctx = ss_malloc(sizeof(server_ctx_t));
-    server->send_ctx = ss_malloc(sizeof(server_ctx_t));
+    server->recv_ctx = arena_get(&server_ctx_pool);
+    server->send_ctx = arena_get(&server_ctx_pool);
     server->buf      = ss_malloc(sizeof(buffer_t));
     memset(server->recv_ctx, 0, sizeof(server_ctx_t));
     memset(server->send_ctx, 0, sizeof(server_ctx_t));
@@ -1389,6 +1630,9 @@ new_server(int fd, listen_ctx_t *listener)
     server->query               = NULL;
     server->listen_ctx          = listener;
     server->remote              = NULL;
+    server->trace               = trace_new();
+    server->flow                = flowlog_new(FLOWLOG_TCP);
+    server->profile             = SOCKPROF_NONE;
 
     server->e_ctx = ss_malloc(sizeof(cipher_ctx_t));
     server->d_ctx = ss_malloc(sizeof(cipher_ctx_t));
@@ -1396,9 +1640,10 @@ new_server(int fd, listen_ctx_t *listener)
     crypto->ctx_init(crypto->cipher, server->d_ctx, 0);
 
     int timeout = max(MIN_TCP_IDLE_TIMEOUT, server->listen_ctx->timeout);
-    ev_io_init(&server->recv_ctx->io, server_recv_cb, fd, EV_READ);
-    ev_io_init(&server->send_ctx->io, server_send_cb, fd, EV_WRITE);
-    ev_timer_init(&server->recv_ctx->watcher, server_timeout_cb,
+    ev_io_init(&server->recv_ctx->io, LOOP_STAT_CB(server_recv_cb), fd, EV_READ);
+    ev_io_init(&server->send_ctx->io, LOOP_STAT_CB(server_send_cb), fd, EV_WRITE);
+    edge_add(fd, &server->recv_ctx->io, &server->send_ctx->io);
+    ev_timer_init(&server->recv_ctx->watcher, LOOP_STAT_CB(server_timeout_cb),
                   timeout, timeout);
 
     cork_dllist_add(&connections, &server->entries);
@@ -1438,9 +1683,13 @@ free_server(server_t *server)
         ss_free(server->buf);
     }
 
-    ss_free(server->recv_ctx);
-    ss_free(server->send_ctx);
-    ss_free(server);
+    trace_free(server->trace);
+    ss_free(server->dest);
+    flowlog_free(server->flow);
+
+    arena_put(&server_ctx_pool, server->recv_ctx);
+    arena_put(&server_ctx_pool, server->send_ctx);
+    arena_put(&server_pool, server);
 }
 
 static void
@@ -1451,9 +1700,10 @@ close_and_free_server(EV_P_ server_t *server)
             server->query->server = NULL;
             server->query         = NULL;
         }
-        ev_io_stop(EV_A_ & server->send_ctx->io);
-        ev_io_stop(EV_A_ & server->recv_ctx->io);
+        edge_io_stop(EV_A_ & server->send_ctx->io);
+        edge_io_stop(EV_A_ & server->recv_ctx->io);
         ev_timer_stop(EV_A_ & server->recv_ctx->watcher);
+        edge_del(server->fd);
         close(server->fd);
         free_server(server);
         if (verbose) {
@@ -1538,10 +1788,11 @@ accept_cb(EV_P_ ev_io *w, int revents)
 #ifdef SO_NOSIGPIPE
     setsockopt(serverfd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
 #endif
+    BUSY_POLL(serverfd);
     setnonblocking(serverfd);
 
     server_t *server = new_server(serverfd, listener);
-    ev_io_start(EV_A_ & server->recv_ctx->io);
+    edge_io_start(EV_A_ & server->recv_ctx->io);
     ev_timer_start(EV_A_ & server->recv_ctx->watcher);
 }
 
@@ -1552,6 +1803,7 @@ main(int argc, char **argv)
     int pid_flags   = 0;
     int mptcp       = 0;
     int mtu         = 0;
+    int batch       = 0;
     char *user      = NULL;
     char *password  = NULL;
     char *key       = NULL;
@@ -1561,6 +1813,14 @@ main(int argc, char **argv)
     char *conf_path = NULL;
     char *iface     = NULL;
 
+    char *control_addr     = NULL;
+    int trace_threshold_ms = 0;
+    char *flow_log         = NULL;
+    char *dns_cache        = NULL;
+    int rank_addresses     = 0;
+    int sockprof_num         = 0;
+    ss_sockprof_t *sockprofs = NULL;
+
     char *server_port = NULL;
     char *plugin_opts = NULL;
     char *plugin_host = NULL;
@@ -1571,6 +1831,9 @@ main(int argc, char **argv)
     int server_num = 0;
     ss_addr_t server_addr[MAX_REMOTE_NUM];
     memset(server_addr, 0, sizeof(ss_addr_t) * MAX_REMOTE_NUM);
+
+    int listen_fd_num = 0;
+    int listen_fds[MAX_REMOTE_NUM * 2];
     memset(&local_addr_v4, 0, sizeof(struct sockaddr_storage));
     memset(&local_addr_v6, 0, sizeof(struct sockaddr_storage));
 
@@ -1578,10 +1841,30 @@ main(int argc, char **argv)
         { "fast-open",       no_argument,       NULL, GETOPT_VAL_FAST_OPEN   },
         { "reuse-port",      no_argument,       NULL, GETOPT_VAL_REUSE_PORT  },
         { "no-delay",        no_argument,       NULL, GETOPT_VAL_NODELAY     },
+        { "edge-triggered",  no_argument,       NULL, GETOPT_VAL_EDGE_TRIGGERED },
+        { "priority-classes", no_argument,      NULL,
+          GETOPT_VAL_PRIORITY_CLASSES },
+        { "busy-poll",       required_argument, NULL, GETOPT_VAL_BUSY_POLL   },
+        { "huge-pages",      required_argument, NULL, GETOPT_VAL_HUGE_PAGES  },
+        { "key-pool",        required_argument, NULL, GETOPT_VAL_KEY_POOL    },
         { "acl",             required_argument, NULL, GETOPT_VAL_ACL         },
         { "manager-address", required_argument, NULL,
           GETOPT_VAL_MANAGER_ADDRESS },
         { "mtu",             required_argument, NULL, GETOPT_VAL_MTU         },
+        { "udp-batch",       required_argument, NULL, GETOPT_VAL_UDP_BATCH   },
+        { "loop-stat",       no_argument,       NULL, GETOPT_VAL_LOOP_STAT   },
+        { "control-address", required_argument, NULL,
+          GETOPT_VAL_CONTROL_ADDRESS },
+        { "trace-sample",    required_argument, NULL,
+          GETOPT_VAL_TRACE_SAMPLE },
+        { "trace-threshold", required_argument, NULL,
+          GETOPT_VAL_TRACE_THRESHOLD },
+        { "dest-stats",      no_argument,       NULL, GETOPT_VAL_DEST_STATS  },
+        { "flow-log",        required_argument, NULL, GETOPT_VAL_FLOW_LOG    },
+        { "dns-cache",       required_argument, NULL, GETOPT_VAL_DNS_CACHE   },
+        { "listen-fd",       required_argument, NULL, GETOPT_VAL_LISTEN_FD   },
+        { "rank-addresses",  no_argument,       NULL,
+          GETOPT_VAL_RANK_ADDRESSES },
         { "help",            no_argument,       NULL, GETOPT_VAL_HELP        },
         { "plugin",          required_argument, NULL, GETOPT_VAL_PLUGIN      },
         { "plugin-opts",     required_argument, NULL, GETOPT_VAL_PLUGIN_OPTS },
@@ -1614,10 +1897,37 @@ main(int argc, char **argv)
         case GETOPT_VAL_MANAGER_ADDRESS:
             manager_addr = optarg;
             break;
+        case GETOPT_VAL_LOOP_STAT:
+            loop_stat = 1;
+            break;
+        case GETOPT_VAL_CONTROL_ADDRESS:
+            control_addr = optarg;
+            break;
+        case GETOPT_VAL_TRACE_SAMPLE:
+            trace_sample = atof(optarg);
+            break;
+        case GETOPT_VAL_TRACE_THRESHOLD:
+            trace_threshold_ms = atoi(optarg);
+            break;
+        case GETOPT_VAL_DEST_STATS:
+            dest_stats = 1;
+            break;
+        case GETOPT_VAL_FLOW_LOG:
+            flow_log = optarg;
+            break;
+        case GETOPT_VAL_DNS_CACHE:
+            dns_cache = optarg;
+            break;
+        case GETOPT_VAL_RANK_ADDRESSES:
+            rank_addresses = 1;
+            break;
         case GETOPT_VAL_MTU:
             mtu = atoi(optarg);
             LOGI("set MTU to %d", mtu);
             break;
+        case GETOPT_VAL_UDP_BATCH:
+            batch = atoi(optarg);
+            break;
         case GETOPT_VAL_PLUGIN:
             plugin = optarg;
             break;
@@ -1634,6 +1944,26 @@ main(int argc, char **argv)
         case GETOPT_VAL_REUSE_PORT:
             reuse_port = 1;
             break;
+        case GETOPT_VAL_EDGE_TRIGGERED:
+            edge_triggered = 1;
+            break;
+        case GETOPT_VAL_PRIORITY_CLASSES:
+            priority_classes = 1;
+            break;
+        case GETOPT_VAL_BUSY_POLL:
+            busy_poll = atoi(optarg);
+            break;
+        case GETOPT_VAL_HUGE_PAGES:
+            huge_pages = atoi(optarg);
+            break;
+        case GETOPT_VAL_KEY_POOL:
+            key_pool = atoi(optarg);
+            break;
+        case GETOPT_VAL_LISTEN_FD:
+            if (listen_fd_num < MAX_REMOTE_NUM * 2) {
+                listen_fds[listen_fd_num++] = atoi(optarg);
+            }
+            break;
         case 's':
             if (server_num < MAX_REMOTE_NUM) {
                 parse_addr(optarg, &server_addr[server_num++]);
@@ -1751,12 +2081,56 @@ main(int argc, char **argv)
         if (mtu == 0) {
             mtu = conf->mtu;
         }
+        if (batch == 0) {
+            batch = conf->udp_batch;
+        }
         if (mptcp == 0) {
             mptcp = conf->mptcp;
         }
         if (no_delay == 0) {
             no_delay = conf->no_delay;
         }
+        if (loop_stat == 0) {
+            loop_stat = conf->loop_stat;
+        }
+        if (edge_triggered == 0) {
+            edge_triggered = conf->edge_triggered;
+        }
+        if (priority_classes == 0) {
+            priority_classes = conf->priority_classes;
+        }
+        if (busy_poll == 0) {
+            busy_poll = conf->busy_poll;
+        }
+        if (huge_pages == 0) {
+            huge_pages = conf->huge_pages;
+        }
+        if (key_pool == 0) {
+            key_pool = conf->key_pool;
+        }
+        if (control_addr == NULL) {
+            control_addr = conf->control_address;
+        }
+        if (trace_sample == 0) {
+            trace_sample = conf->trace_sample;
+        }
+        if (trace_threshold_ms == 0) {
+            trace_threshold_ms = conf->trace_threshold;
+        }
+        if (dest_stats == 0) {
+            dest_stats = conf->dest_stats;
+        }
+        if (flow_log == NULL) {
+            flow_log = conf->flow_log;
+        }
+        if (dns_cache == NULL) {
+            dns_cache = conf->dns_cache;
+        }
+        if (rank_addresses == 0) {
+            rank_addresses = conf->rank_addresses;
+        }
+        sockprof_num = conf->sockprof_num;
+        sockprofs    = conf->sockprof;
         if (reuse_port == 0) {
             reuse_port = conf->reuse_port;
         }
@@ -1828,7 +2202,7 @@ main(int argc, char **argv)
     }
 
     if (method == NULL) {
-        method = "chacha20-ietf-poly1305";
+        method = DEFAULT_METHOD;
     }
 
     if (timeout == NULL) {
@@ -1872,6 +2246,9 @@ main(int argc, char **argv)
 
     if (mode != TCP_ONLY) {
         LOGI("UDP relay enabled");
+        if (batch != 0) {
+            udp_batch = batch;
+        }
     }
 
     if (mode == UDP_ONLY) {
@@ -1897,6 +2274,11 @@ main(int argc, char **argv)
     ev_signal_start(EV_DEFAULT, &sigchld_watcher);
 #endif
 
+    // Before the ciphers, which set up the replay filter
+    if (huge_pages) {
+        arena_init();
+    }
+
     // setup keys
     LOGI("initializing ciphers... %s", method);
     crypto = crypto_init(password, key, method);
@@ -1906,9 +2288,65 @@ main(int argc, char **argv)
     // initialize ev loop
     struct ev_loop *loop = EV_DEFAULT;
 
+    if (loop_stat) {
+        LOGI("enable event loop instrumentation");
+    }
+    loop_stat_init(loop);
+
+    if (edge_triggered && edge_init(loop) == 0) {
+        LOGI("enable edge-triggered readiness");
+    }
+
+    if (priority_classes) {
+        LOGI("enable interactive and bulk priority classes");
+        prio_init(loop);
+    }
+
+    if (busy_poll && busy_poll_init(loop) == 0) {
+        LOGI("enable busy polling for %d us", busy_poll);
+    }
+
+    if (key_pool && key_pool_init(loop, crypto) == 0) {
+        LOGI("keeping %d session keys ahead", key_pool);
+    }
+
+    if (sockprof_num > 0 && sockprof_init(sockprofs, sockprof_num) == 0) {
+        LOGI("using %d socket profiles", sockprof_num);
+    }
+
+    trace_threshold = trace_threshold_ms / 1000.0;
+    if (control_addr != NULL && control_init(loop, control_addr) == 0) {
+        control_register("mem", mem_cmd_cb);
+        control_register("dns", resolv_stats);
+        control_register("ipscore", ipscore_stats);
+        control_register("negcache", negcache_stats);
+        control_register("dnscache", dnscache_stats);
+        trace_init();
+        if (dest_stats && hitters_init(loop) == 0) {
+            LOGI("enable destination statistics");
+        }
+    } else if (trace_sample > 0 || trace_threshold > 0 || dest_stats) {
+        LOGE("connection tracing and destination statistics need a working control address");
+    }
+
+    if (flow_log != NULL) {
+        flowlog_init(flow_log);
+    }
+
     // setup dns
     resolv_init(loop, nameservers, ipv6first);
 
+    if (rank_addresses && ipscore_init() == 0) {
+        LOGI("ranking destination addresses by connect history");
+        resolv_set_rank(ipscore_rank);
+    }
+    negcache_init();
+
+    // Before dropping privileges, ss-manager may have created it as root
+    if (dns_cache != NULL && dnscache_init(dns_cache, 0) == 0) {
+        LOGI("sharing DNS answers through %s", dns_cache);
+    }
+
     if (nameservers != NULL)
         LOGI("using nameserver: %s", nameservers);
 
@@ -1971,11 +2409,74 @@ main(int argc, char **argv)
         }
     }
 
+    if (listen_fd_num > 0 && plugin != NULL) {
+        LOGE("listening sockets cannot be handed to a plugin, binding again");
+        for (i = 0; i < listen_fd_num; i++)
+            close(listen_fds[i]);
+        listen_fd_num = 0;
+    }
+
     // initialize listen context
-    listen_ctx_t listen_ctx_list[server_num];
+    listen_ctx_t listen_ctx_list[server_num + listen_fd_num];
+
+    // Sockets bound by ss-manager, which held the port all along
+    if (listen_fd_num > 0) {
+        int num_listen_ctx = 0;
+        int num_tcp        = 0;
+        for (i = 0; i < listen_fd_num; i++) {
+            int fd             = listen_fds[i];
+            int type           = 0;
+            socklen_t type_len = sizeof(type);
+
+            if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_len) == -1) {
+                ERROR("listen_fd");
+                continue;
+            }
+
+            if (type == SOCK_STREAM && mode != UDP_ONLY) {
+                // What create_and_bind sets before bind
+                if (mptcp == 1) {
+                    setmptcp(fd);
+                }
+                if (listen(fd, SSMAXCONN) == -1) {
+                    ERROR("listen()");
+                    close(fd);
+                    continue;
+                }
+                setfastopen(fd);
+                setnonblocking(fd);
+                BUSY_POLL(fd);
+                listen_ctx_t *listen_ctx = &listen_ctx_list[num_tcp++];
+
+                listen_ctx->timeout = atoi(timeout);
+                listen_ctx->fd      = fd;
+                listen_ctx->iface   = iface;
+                listen_ctx->loop    = loop;
+
+                ev_io_init(&listen_ctx->io, LOOP_STAT_CB(accept_cb), fd, EV_READ);
+                ev_io_start(loop, &listen_ctx->io);
+            } else if (type == SOCK_DGRAM && mode != TCP_ONLY) {
+                if (init_udprelay_fd(fd, server_port, mtu, crypto, atoi(timeout), iface) == -1) {
+                    continue;
+                }
+            } else {
+                close(fd);
+                continue;
+            }
+            num_listen_ctx++;
+        }
+
+        if (num_listen_ctx == 0) {
+            FATAL("failed to listen on any address");
+        }
+        LOGI("serving on %d sockets from the manager", num_listen_ctx);
+
+        // The TCP listeners are what is cleaned up by interface below
+        server_num = num_tcp;
+    }
 
     // bind to each interface
-    if (mode != UDP_ONLY) {
+    if (mode != UDP_ONLY && listen_fd_num == 0) {
         int num_listen_ctx = 0;
         for (int i = 0; i < server_num; i++) {
             const char *host = server_addr[i].host;
@@ -2010,7 +2511,7 @@ main(int argc, char **argv)
             listen_ctx->iface   = iface;
             listen_ctx->loop    = loop;
 
-            ev_io_init(&listen_ctx->io, accept_cb, listenfd, EV_READ);
+            ev_io_init(&listen_ctx->io, LOOP_STAT_CB(accept_cb), listenfd, EV_READ);
             ev_io_start(loop, &listen_ctx->io);
 
             num_listen_ctx++;
@@ -2024,7 +2525,7 @@ main(int argc, char **argv)
         }
     }
 
-    if (mode != TCP_ONLY) {
+    if (mode != TCP_ONLY && listen_fd_num == 0) {
         int num_listen_ctx = 0;
         for (int i = 0; i < server_num; i++) {
             const char *host = server_addr[i].host;
@@ -2069,6 +2570,14 @@ main(int argc, char **argv)
     // Init connections
     cork_dllist_init(&connections);
 
+#ifndef __MINGW32__
+    if (manager_addr != NULL) {
+        char ready[64];
+        snprintf(ready, sizeof(ready), "ready: {\"%s\":%d}", remote_port, (int)getpid());
+        send_to_manager(ready);
+    }
+#endif
+
     // start ev loop
     ev_run(loop, 0);
 
@@ -2088,6 +2597,8 @@ main(int argc, char **argv)
 
     // Clean up
 
+    control_free(loop);
+    loop_stat_free(loop);
     resolv_shutdown(loop);
 
     for (int i = 0; i < server_num; i++) {
@@ -2104,10 +2615,24 @@ main(int argc, char **argv)
         free_connections(loop);
     }
 
+    edge_free(loop);
+    prio_free(loop);
+    busy_poll_free(loop);
+    key_pool_free(loop);
+    sockprof_free();
+
     if (mode != TCP_ONLY) {
         free_udprelay();
     }
 
+    trace_cleanup();
+    hitters_free(loop);
+    flowlog_cleanup();
+    ipscore_free();
+    negcache_free();
+    dnscache_free();
+    arena_free();
+
 #ifdef __MINGW32__
     if (plugin_watcher.valid) {
         closesocket(plugin_watcher.fd);
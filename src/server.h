@@ -39,6 +39,8 @@
 #include "crypto.h"
 #include "jconf.h"
 #include "netutils.h"
+#include "ipscore.h"
+#include "prio.h"
 
 #include "common.h"
 
@@ -72,6 +74,9 @@ struct dscptracker {
 #endif
 
 struct query;
+struct trace;
+struct hitters_key;
+struct flowlog;
 
 typedef struct server {
     int fd;
@@ -88,6 +93,11 @@ typedef struct server {
     struct remote *remote;
 
     struct query *query;
+    struct trace *trace;
+    struct hitters_key *dest;
+    int profile; // socket profile of the connection to dest
+    struct flowlog *flow;
+    prio_t prio;
 
     struct cork_dllist_item entries;
 #ifdef USE_NFCONNTRACK_TOS
@@ -116,6 +126,9 @@ typedef struct remote {
     struct remote_ctx *recv_ctx;
     struct remote_ctx *send_ctx;
     struct server *server;
+    ev_tstamp connect_start;
+    ipscore_key_t addr;
+    uint16_t port;                  // network byte order
 } remote_t;
 
 #endif // _SERVER_H
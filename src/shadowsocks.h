@@ -22,6 +22,9 @@
 #ifndef _SHADOWSOCKS_H
 #define _SHADOWSOCKS_H
 
+#include <stddef.h>
+#include <sys/types.h>
+
 typedef struct {
     /*  Required  */
     char *remote_host;    // hostname or ip of remote server
@@ -89,6 +92,77 @@ int start_ss_local_server(profile_t profile);
  */
 int start_ss_local_server_with_callback(profile_t profile, ss_local_callback callback, void *udata);
 
+/*
+ * Streams opened by the application itself, without a SOCKS5 server in
+ * between: the bytes written to a stream are encrypted and sent to the
+ * shadowsocks server, the ones it returns are handed to on_read.
+ *
+ * A context holds what start_ss_local_server keeps in globals, the
+ * cipher and the server address of one profile. Any number of contexts
+ * may run in one process, each driven by the libev loop it was created
+ * for, on one thread or a thread per loop. A context and its streams must
+ * only be used from the thread running that loop. The filter of replayed
+ * salts is the only state they share, it is locked.
+ *
+ * Of the profile, remote_host, remote_port, method, password, timeout and
+ * mptcp are used. The host name is resolved once, by ss_ctx_new.
+ */
+struct ev_loop;
+
+typedef struct ss_ctx ss_ctx_t;
+typedef struct ss_stream ss_stream_t;
+
+typedef struct {
+    /* Data from the target, only valid during the call. Required. */
+    void (*on_read)(ss_stream_t *stream, const char *buf, size_t len, void *data);
+
+    /* Connected, or everything written so far has been sent */
+    void (*on_drain)(ss_stream_t *stream, void *data);
+
+    /*
+     * The stream is over: err is 0 when the server closed it, an errno
+     * value otherwise. The stream is freed once this returns.
+     */
+    void (*on_close)(ss_stream_t *stream, int err, void *data);
+} ss_stream_cb_t;
+
+/*
+ * Returns NULL on failure. With a NULL loop, the default loop is used.
+ *
+ * Blocks while remote_host is resolved, create contexts before entering
+ * the loop or from a thread of their own when it is a host name.
+ */
+ss_ctx_t *ss_ctx_new(struct ev_loop *loop, const profile_t *profile);
+
+/*
+ * Closes the streams still open, without calling their on_close.
+ * Not from within a callback.
+ */
+void ss_ctx_free(ss_ctx_t *ctx);
+
+/*
+ * Start a connection to host and port through the server, host is an IP
+ * address or a domain name resolved by the server. Data may be written
+ * right away, it goes out once connected. Returns NULL with errno set on
+ * failure.
+ */
+ss_stream_t *ss_stream_open(ss_ctx_t *ctx, const char *host, int port,
+                            const ss_stream_cb_t *cb, void *data);
+
+/*
+ * Queue len bytes, all of them are taken. Returns the bytes waiting to
+ * be sent, a caller may stop writing until on_drain when that grows
+ * large. Returns -1 with errno set when the stream is broken, the caller
+ * should close it.
+ */
+ssize_t ss_stream_write(ss_stream_t *stream, const void *buf, size_t len);
+
+/*
+ * Close and free the stream, on_close is not called. Allowed from within
+ * the callbacks of the stream.
+ */
+void ss_stream_close(ss_stream_t *stream);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,211 @@
+/*
+ * sockprof.c - Per-route socket profiles
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef __MINGW32__
+#include <netinet/in.h>
+#endif
+
+#include "netutils.h"
+#include "utils.h"
+#include "acl.h"
+#include "sockprof.h"
+
+static ss_sockprof_t profiles[MAX_SOCKPROF_NUM];
+static int profile_num;
+static int default_profile = SOCKPROF_NONE;
+
+// Profile of each ACL [profile:<name>] list
+static int acl_profiles[MAX_SOCKPROF_NUM];
+static int acl_profile_num;
+
+static int
+set_int(int fd, int level, int name, int value)
+{
+    return setsockopt(fd, level, name, (void *)&value, sizeof(value));
+}
+
+/*
+ * With probe set, an option the kernel refuses is logged and taken out
+ * of the profile, so connections do not keep paying for it.
+ */
+static void
+apply_profile(int fd, ss_sockprof_t *p, int probe)
+{
+#ifdef TCP_CONGESTION
+    if (p->congestion != NULL
+        && setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, p->congestion,
+                      strlen(p->congestion)) == -1 && probe) {
+        LOGE("profile %s: congestion control %s unavailable", p->name, p->congestion);
+        p->congestion = NULL;
+    }
+#endif
+    if (p->sndbuf > 0
+        && set_int(fd, SOL_SOCKET, SO_SNDBUF, p->sndbuf) == -1 && probe) {
+        ERROR("profile sndbuf");
+        p->sndbuf = -1;
+    }
+    if (p->rcvbuf > 0
+        && set_int(fd, SOL_SOCKET, SO_RCVBUF, p->rcvbuf) == -1 && probe) {
+        ERROR("profile rcvbuf");
+        p->rcvbuf = -1;
+    }
+#ifdef TCP_NOTSENT_LOWAT
+    if (p->notsent_lowat > 0
+        && set_int(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, p->notsent_lowat) == -1 && probe) {
+        ERROR("profile notsent_lowat");
+        p->notsent_lowat = -1;
+    }
+#endif
+    if (p->keepalive > 0) {
+        // Same proportions as the fixed keepalive of ss-redir
+        int err = set_int(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+#if defined(TCP_KEEPIDLE)
+        err = err || set_int(fd, IPPROTO_TCP, TCP_KEEPIDLE, p->keepalive);
+#elif defined(TCP_KEEPALIVE)
+        err = err || set_int(fd, IPPROTO_TCP, TCP_KEEPALIVE, p->keepalive);
+#endif
+#ifdef TCP_KEEPINTVL
+        err = err || set_int(fd, IPPROTO_TCP, TCP_KEEPINTVL,
+                             p->keepalive > 1 ? p->keepalive / 2 : 1);
+#endif
+#ifdef TCP_KEEPCNT
+        err = err || set_int(fd, IPPROTO_TCP, TCP_KEEPCNT, 5);
+#endif
+        if (err && probe) {
+            ERROR("profile keepalive");
+            p->keepalive = -1;
+        }
+    }
+    if (p->tos >= 0) {
+        // Only one of them applies to the socket, as in ss-redir
+        int rc = set_int(fd, IPPROTO_IP, IP_TOS, p->tos);
+        if (rc == -1 && errno != ENOPROTOOPT && probe) {
+            ERROR("profile tos");
+        }
+#ifdef IPV6_TCLASS
+        set_int(fd, IPPROTO_IPV6, IPV6_TCLASS, p->tos);
+#endif
+    }
+    if (p->no_delay >= 0) {
+        set_int(fd, IPPROTO_TCP, TCP_NODELAY, p->no_delay);
+    }
+}
+
+int
+sockprof_init(const ss_sockprof_t *conf, int num)
+{
+    int i, fd;
+
+    profile_num     = 0;
+    default_profile = SOCKPROF_NONE;
+    acl_profile_num = 0;
+
+    if (num <= 0) {
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd == -1) {
+        ERROR("sockprof_socket");
+    }
+
+    for (i = 0; i < num && i < MAX_SOCKPROF_NUM; i++) {
+        profiles[i] = conf[i];
+        if (fd != -1) {
+            apply_profile(fd, &profiles[i], 1);
+        }
+        if (strcmp(profiles[i].name, "default") == 0) {
+            default_profile = i;
+        }
+    }
+    profile_num = i;
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    acl_profile_num = get_profile_num();
+    for (i = 0; i < acl_profile_num; i++) {
+        const char *name = get_profile_name(i);
+        acl_profiles[i] = sockprof_find(name);
+        if (acl_profiles[i] == SOCKPROF_NONE) {
+            LOGE("no socket profile %s, using the default for its ACL list", name);
+            acl_profiles[i] = default_profile;
+        }
+    }
+
+    return 0;
+}
+
+void
+sockprof_free(void)
+{
+    profile_num     = 0;
+    default_profile = SOCKPROF_NONE;
+    acl_profile_num = 0;
+}
+
+int
+sockprof_find(const char *name)
+{
+    int i;
+
+    if (name == NULL) {
+        return SOCKPROF_NONE;
+    }
+
+    for (i = 0; i < profile_num; i++)
+        if (strcmp(profiles[i].name, name) == 0)
+            return i;
+
+    return SOCKPROF_NONE;
+}
+
+int
+sockprof_match(const char *host)
+{
+    if (profile_num == 0) {
+        return SOCKPROF_NONE;
+    }
+
+    int i = host != NULL && acl_profile_num > 0 ? acl_match_profile(host) : -1;
+
+    return i >= 0 ? acl_profiles[i] : default_profile;
+}
+
+void
+sockprof_apply(int fd, int profile)
+{
+    if (profile < 0 || profile >= profile_num) {
+        return;
+    }
+
+    apply_profile(fd, &profiles[profile], 0);
+}
@@ -0,0 +1,52 @@
+/*
+ * sockprof.h - Define the per-route socket profiles
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SOCKPROF_H
+#define _SOCKPROF_H
+
+#include "jconf.h"
+
+/*
+ * Named sets of socket options from the "socket_profiles" config object,
+ * applied to outbound TCP sockets before they connect. A connection gets
+ * the profile of the first ACL [profile:<name>] list matching its
+ * destination, else the profile named "default" if there is one. On
+ * ss-local, a connection relayed through an upstream group takes the
+ * profile named like the group first.
+ *
+ * Every option is tried once at startup on a scratch socket; those the
+ * kernel refuses (a congestion control module not loaded, say) are
+ * dropped from the profile there rather than failing on each connect.
+ */
+
+#define SOCKPROF_NONE -1
+
+int sockprof_init(const ss_sockprof_t *profiles, int num);
+void sockprof_free(void);
+
+int sockprof_find(const char *name);
+// host may be NULL when there is no ACL to match it against
+int sockprof_match(const char *host);
+
+void sockprof_apply(int fd, int profile);
+
+#endif // _SOCKPROF_H
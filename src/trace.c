@@ -0,0 +1,273 @@
+/*
+ * trace.c - Sampled per-connection timelines for tail latency debugging
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "loopstat.h"
+#include "control.h"
+#include "trace.h"
+
+#define TRACE_ONCE_MASK ((1u << TRACE_STALL) - 1)
+
+double trace_sample    = 0;
+double trace_threshold = 0;
+
+static int trace_enabled;
+static uint64_t trace_seq;
+
+static trace_t *ring[TRACE_RING_SIZE];
+static uint64_t ring_next;
+
+static const char *event_names[TRACE_EVENT_NUM] = {
+    "accept",
+    "first decrypt",
+    "resolve",
+    "resolve end",
+    "connect",
+    "connect end",
+    "first byte",
+    "stall",
+    "close"
+};
+
+static const char *close_reasons[TRACE_CLOSE_NUM] = {
+    "unknown",
+    "client closed",
+    "remote closed",
+    "timeout",
+    "error",
+    "crypto error",
+    "resolve failed",
+    "connect failed",
+    "blocked"
+};
+
+trace_t *
+trace_new(void)
+{
+    if (!trace_enabled) {
+        return NULL;
+    }
+
+    int sampled = trace_sample > 0 && (double)rand() / RAND_MAX < trace_sample;
+    if (!sampled && trace_threshold <= 0) {
+        return NULL;
+    }
+
+    trace_t *trace = ss_malloc(sizeof(trace_t));
+    memset(trace, 0, sizeof(trace_t));
+    trace->id      = ++trace_seq;
+    trace->sampled = sampled;
+
+    trace_record(trace, TRACE_ACCEPT, 0);
+
+    return trace;
+}
+
+void
+trace_record(trace_t *trace, int type, int arg)
+{
+    unsigned int bit = 1u << type;
+
+    if (bit & TRACE_ONCE_MASK) {
+        if (trace->seen & bit) {
+            return;
+        }
+        trace->seen |= bit;
+    }
+
+    // The last slot is reserved for the close event
+    if (trace->num >= TRACE_MAX_EVENTS - 1 && type != TRACE_CLOSE) {
+        return;
+    }
+
+    trace_event_t *event = &trace->events[trace->num++];
+    event->ts   = loop_stat_clock();
+    event->type = type;
+    event->arg  = arg;
+}
+
+void
+trace_set_dest(trace_t *trace, const char *host, uint16_t port)
+{
+    // Hostnames come from the client, keep them safe to embed in JSON
+    snprintf(trace->dest, TRACE_DEST_LEN, "%s:%d", host, port);
+    for (char *p = trace->dest; *p; p++)
+        if (*p < 0x20 || *p > 0x7e || *p == '"' || *p == '\\')
+            *p = '?';
+}
+
+void
+trace_set_reason(trace_t *trace, int reason)
+{
+    if (trace->reason == TRACE_CLOSE_UNKNOWN) {
+        trace->reason = reason;
+    }
+}
+
+static ev_tstamp
+trace_find(trace_t *trace, int type)
+{
+    for (int i = 0; i < trace->num; i++)
+        if (trace->events[i].type == type)
+            return trace->events[i].ts;
+    return 0;
+}
+
+void
+trace_free(trace_t *trace)
+{
+    if (trace == NULL) {
+        return;
+    }
+
+    trace_record(trace, TRACE_CLOSE, trace->reason);
+
+    // Latency is time to first byte, or the whole life if none arrived
+    ev_tstamp start = trace->events[0].ts;
+    ev_tstamp end   = trace_find(trace, TRACE_FIRST_BYTE);
+    if (end == 0) {
+        end = trace->events[trace->num - 1].ts;
+    }
+
+    if (!trace_enabled || (!trace->sampled
+                           && (trace_threshold <= 0 || end - start < trace_threshold))) {
+        ss_free(trace);
+        return;
+    }
+
+    trace_t **slot = &ring[ring_next++ % TRACE_RING_SIZE];
+    ss_free(*slot);
+    *slot = trace;
+}
+
+static void
+dump_span(control_reply_t *reply, trace_t *trace, const char *name,
+          ev_tstamp start, ev_tstamp end)
+{
+    control_reply(reply,
+                  ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%" PRIu64
+                  ",\"ts\":%.0f,\"dur\":%.0f}",
+                  name, (int)getpid(), trace->id, start * 1e6, (end - start) * 1e6);
+}
+
+static void
+dump_trace(control_reply_t *reply, trace_t *trace)
+{
+    int pid         = (int)getpid();
+    ev_tstamp start = trace->events[0].ts;
+    ev_tstamp end   = trace->events[trace->num - 1].ts;
+
+    control_reply(reply,
+                  ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%" PRIu64
+                  ",\"ts\":%.0f,\"dur\":%.0f,\"args\":{\"close\":\"%s\",\"sampled\":%s}}",
+                  trace->dest[0] ? trace->dest : "connection", pid, trace->id,
+                  start * 1e6, (end - start) * 1e6,
+                  close_reasons[trace->reason], trace->sampled ? "true" : "false");
+
+    for (int i = 0; i < trace->num; i++) {
+        trace_event_t *event = &trace->events[i];
+        switch (event->type) {
+        case TRACE_RESOLVE_START:
+        case TRACE_CONNECT_START:
+        {
+            // Pair with the matching end, or run up to the close
+            ev_tstamp stop = trace_find(trace, event->type + 1);
+            dump_span(reply, trace, event_names[event->type],
+                      event->ts, stop != 0 ? stop : end);
+            break;
+        }
+        case TRACE_RESOLVE_END:
+        case TRACE_CONNECT_END:
+        case TRACE_ACCEPT:
+            break;
+        default:
+            control_reply(reply,
+                          ",\n{\"name\":\"%s%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,"
+                          "\"tid\":%" PRIu64 ",\"ts\":%.0f}",
+                          event_names[event->type],
+                          event->type != TRACE_STALL ? "" :
+                          event->arg == TRACE_TO_CLIENT ? " to client" : " to remote",
+                          pid, trace->id, event->ts * 1e6);
+        }
+    }
+}
+
+static void
+trace_cmd_cb(const char *data, control_reply_t *reply)
+{
+    int clear = strcmp(data, "clear") == 0;
+
+    control_reply(reply, "{\"traceEvents\":[\n"
+                  "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                  "\"args\":{\"name\":\"shadowsocks\"}}", (int)getpid());
+
+    // Oldest first
+    for (uint64_t i = 0; i < TRACE_RING_SIZE; i++) {
+        trace_t **slot = &ring[(ring_next + i) % TRACE_RING_SIZE];
+        if (*slot == NULL) {
+            continue;
+        }
+        dump_trace(reply, *slot);
+        if (clear) {
+            ss_free(*slot);
+        }
+    }
+
+    control_reply(reply, "\n]}\n");
+}
+
+int
+trace_init(void)
+{
+    if (trace_sample <= 0 && trace_threshold <= 0) {
+        return 0;
+    }
+
+    if (control_register("trace", trace_cmd_cb) == -1) {
+        return -1;
+    }
+
+    trace_enabled = 1;
+
+    LOGI("trace connections with sample rate %g, latency threshold %g ms",
+         trace_sample, trace_threshold * 1000);
+
+    return 0;
+}
+
+void
+trace_cleanup(void)
+{
+    trace_enabled = 0;
+    for (int i = 0; i < TRACE_RING_SIZE; i++)
+        ss_free(ring[i]);
+}
@@ -0,0 +1,114 @@
+/*
+ * trace.h - Define the per-connection timeline tracing interface
+ *
+ * Copyright (C) 2013 - 2019, Max Lv <max.c.lv@gmail.com>
+ *
+ * This file is part of the shadowsocks-libev.
+ *
+ * shadowsocks-libev is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shadowsocks-libev is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shadowsocks-libev; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#ifdef HAVE_LIBEV_EV_H
+#include <libev/ev.h>
+#else
+#include <ev.h>
+#endif
+
+#include <stdint.h>
+
+#define TRACE_MAX_EVENTS 32     // events kept per connection
+#define TRACE_RING_SIZE  128    // finished timelines kept for the control socket
+#define TRACE_DEST_LEN   64
+
+enum {
+    TRACE_ACCEPT,
+    TRACE_DECRYPT,              // first payload decrypted
+    TRACE_RESOLVE_START,
+    TRACE_RESOLVE_END,
+    TRACE_CONNECT_START,
+    TRACE_CONNECT_END,
+    TRACE_FIRST_BYTE,           // first byte from the origin
+    TRACE_STALL,                // send hit EAGAIN, arg is a TRACE_TO_* direction
+    TRACE_CLOSE,
+    TRACE_EVENT_NUM
+};
+
+enum {
+    TRACE_TO_CLIENT,
+    TRACE_TO_REMOTE
+};
+
+enum {
+    TRACE_CLOSE_UNKNOWN,
+    TRACE_CLOSE_CLIENT,         // client closed the connection
+    TRACE_CLOSE_REMOTE,         // origin closed the connection
+    TRACE_CLOSE_TIMEOUT,
+    TRACE_CLOSE_ERROR,
+    TRACE_CLOSE_CRYPTO,
+    TRACE_CLOSE_RESOLVE,
+    TRACE_CLOSE_CONNECT,
+    TRACE_CLOSE_BLOCKED,
+    TRACE_CLOSE_NUM
+};
+
+typedef struct trace_event {
+    ev_tstamp ts;
+    int type;
+    int arg;
+} trace_event_t;
+
+typedef struct trace {
+    uint64_t id;
+    int sampled;
+    int reason;
+    int num;
+    unsigned int seen;          // bitmask of one-shot events already recorded
+    char dest[TRACE_DEST_LEN];
+    trace_event_t events[TRACE_MAX_EVENTS];
+} trace_t;
+
+extern double trace_sample;     // fraction of connections always kept
+extern double trace_threshold;  // keep any connection slower than this (seconds)
+
+int trace_init(void);
+void trace_cleanup(void);
+
+trace_t *trace_new(void);
+void trace_free(trace_t *trace);
+
+void trace_record(trace_t *trace, int type, int arg);
+void trace_set_dest(trace_t *trace, const char *host, uint16_t port);
+void trace_set_reason(trace_t *trace, int reason);
+
+/*
+ * Hooks are no-ops for connections without a timeline, so the relay
+ * paths only pay a NULL check when tracing is off.
+ */
+#define TRACE(t, type, arg)                 \
+    do {                                    \
+        if (t)                              \
+            trace_record(t, type, arg);     \
+    } while (0)
+
+#define TRACE_REASON(t, reason)             \
+    do {                                    \
+        if (t)                              \
+            trace_set_reason(t, reason);    \
+    } while (0)
+
+#endif // _TRACE_H
@@ -50,6 +50,7 @@
 
 #include "netutils.h"
 #include "utils.h"
+#include "edge.h"
 #include "plugin.h"
 #include "tunnel.h"
 #include "winsock.h"
@@ -202,6 +203,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data
             // continue to wait for recv
+            edge_io_again(&server_recv_ctx->io);
             return;
         } else {
             ERROR("server recv");
@@ -228,8 +230,9 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data, wait for send
             remote->buf->idx = 0;
-            ev_io_stop(EV_A_ & server_recv_ctx->io);
-            ev_io_start(EV_A_ & remote->send_ctx->io);
+            edge_io_again(&remote->send_ctx->io);
+            edge_io_stop(EV_A_ & server_recv_ctx->io);
+            edge_io_start(EV_A_ & remote->send_ctx->io);
             return;
         } else {
             ERROR("send");
@@ -240,8 +243,9 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
     } else if (s < remote->buf->len) {
         remote->buf->len -= s;
         remote->buf->idx  = s;
-        ev_io_stop(EV_A_ & server_recv_ctx->io);
-        ev_io_start(EV_A_ & remote->send_ctx->io);
+        edge_io_again(&remote->send_ctx->io);
+        edge_io_stop(EV_A_ & server_recv_ctx->io);
+        edge_io_start(EV_A_ & remote->send_ctx->io);
         return;
     }
 }
@@ -266,10 +270,13 @@ server_send_cb(EV_P_ ev_io *w, int revents)
                 ERROR("send");
                 close_and_free_remote(EV_A_ remote);
                 close_and_free_server(EV_A_ server);
+            } else {
+                edge_io_again(&server_send_ctx->io);
             }
             return;
         } else if (s < server->buf->len) {
             // partly sent, move memory, wait for the next time to send
+            edge_io_again(&server_send_ctx->io);
             server->buf->len -= s;
             server->buf->idx += s;
             return;
@@ -277,9 +284,9 @@ server_send_cb(EV_P_ ev_io *w, int revents)
             // all sent out, wait for reading
             server->buf->len = 0;
             server->buf->idx = 0;
-            ev_io_stop(EV_A_ & server_send_ctx->io);
+            edge_io_stop(EV_A_ & server_send_ctx->io);
             if (remote != NULL) {
-                ev_io_start(EV_A_ & remote->recv_ctx->io);
+                edge_io_start(EV_A_ & remote->recv_ctx->io);
             } else {
                 close_and_free_remote(EV_A_ remote);
                 close_and_free_server(EV_A_ server);
@@ -326,6 +333,7 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data
             // continue to wait for recv
+            edge_io_again(&remote_recv_ctx->io);
             return;
         } else {
             ERROR("remote recv");
@@ -353,8 +361,9 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
             // no data, wait for send
             server->buf->idx = 0;
-            ev_io_stop(EV_A_ & remote_recv_ctx->io);
-            ev_io_start(EV_A_ & server->send_ctx->io);
+            edge_io_again(&server->send_ctx->io);
+            edge_io_stop(EV_A_ & remote_recv_ctx->io);
+            edge_io_start(EV_A_ & server->send_ctx->io);
         } else {
             ERROR("send");
             close_and_free_remote(EV_A_ remote);
@@ -364,8 +373,9 @@ remote_recv_cb(EV_P_ ev_io *w, int revents)
     } else if (s < server->buf->len) {
         server->buf->len -= s;
         server->buf->idx  = s;
-        ev_io_stop(EV_A_ & remote_recv_ctx->io);
-        ev_io_start(EV_A_ & server->send_ctx->io);
+        edge_io_again(&server->send_ctx->io);
+        edge_io_stop(EV_A_ & remote_recv_ctx->io);
+        edge_io_start(EV_A_ & server->send_ctx->io);
     }
 
     // Disable TCP_NODELAY after the first response are sent
@@ -454,7 +464,7 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
                 return;
             }
 
-            ev_io_start(EV_A_ & remote->recv_ctx->io);
+            edge_io_start(EV_A_ & remote->recv_ctx->io);
         } else {
             ERROR("getpeername");
             // not connected
@@ -546,7 +556,7 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
 
             if (s == -1) {
                 if (errno == CONNECT_IN_PROGRESS) {
-                    ev_io_start(EV_A_ & remote_send_ctx->io);
+                    edge_io_start(EV_A_ & remote_send_ctx->io);
                     ev_timer_start(EV_A_ & remote_send_ctx->watcher);
                 } else {
                     fast_open = 0;
@@ -572,10 +582,13 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
                 // close and free
                 close_and_free_remote(EV_A_ remote);
                 close_and_free_server(EV_A_ server);
+            } else {
+                edge_io_again(&remote_send_ctx->io);
             }
             return;
         } else if (s < remote->buf->len) {
             // partly sent, move memory, wait for the next time to send
+            edge_io_again(&remote_send_ctx->io);
             remote->buf->len -= s;
             remote->buf->idx += s;
             return;
@@ -583,8 +596,8 @@ remote_send_cb(EV_P_ ev_io *w, int revents)
             // all sent out, wait for reading
             remote->buf->len = 0;
             remote->buf->idx = 0;
-            ev_io_stop(EV_A_ & remote_send_ctx->io);
-            ev_io_start(EV_A_ & server->recv_ctx->io);
+            edge_io_stop(EV_A_ & remote_send_ctx->io);
+            edge_io_start(EV_A_ & server->recv_ctx->io);
         }
     }
 }
@@ -609,6 +622,7 @@ new_remote(int fd, int timeout)
 
     ev_io_init(&remote->recv_ctx->io, remote_recv_cb, fd, EV_READ);
     ev_io_init(&remote->send_ctx->io, remote_send_cb, fd, EV_WRITE);
+    edge_add(fd, &remote->recv_ctx->io, &remote->send_ctx->io);
     ev_timer_init(&remote->send_ctx->watcher, remote_timeout_cb,
                   min(MAX_CONNECT_TIMEOUT, timeout), 0);
 
@@ -635,8 +649,9 @@ close_and_free_remote(EV_P_ remote_t *remote)
 {
     if (remote != NULL) {
         ev_timer_stop(EV_A_ & remote->send_ctx->watcher);
-        ev_io_stop(EV_A_ & remote->send_ctx->io);
-        ev_io_stop(EV_A_ & remote->recv_ctx->io);
+        edge_io_stop(EV_A_ & remote->send_ctx->io);
+        edge_io_stop(EV_A_ & remote->recv_ctx->io);
+        edge_del(remote->fd);
         close(remote->fd);
         free_remote(remote);
     }
@@ -667,6 +682,7 @@ new_server(int fd)
 
     ev_io_init(&server->recv_ctx->io, server_recv_cb, fd, EV_READ);
     ev_io_init(&server->send_ctx->io, server_send_cb, fd, EV_WRITE);
+    edge_add(fd, &server->recv_ctx->io, &server->send_ctx->io);
 
     return server;
 }
@@ -698,8 +714,9 @@ static void
 close_and_free_server(EV_P_ server_t *server)
 {
     if (server != NULL) {
-        ev_io_stop(EV_A_ & server->send_ctx->io);
-        ev_io_stop(EV_A_ & server->recv_ctx->io);
+        edge_io_stop(EV_A_ & server->send_ctx->io);
+        edge_io_stop(EV_A_ & server->recv_ctx->io);
+        edge_del(server->fd);
         close(server->fd);
         free_server(server);
     }
@@ -803,7 +820,7 @@ accept_cb(EV_P_ ev_io *w, int revents)
     }
 
     // listen to remote connected event
-    ev_io_start(EV_A_ & remote->send_ctx->io);
+    edge_io_start(EV_A_ & remote->send_ctx->io);
     ev_timer_start(EV_A_ & remote->send_ctx->watcher);
 }
 
@@ -894,6 +911,7 @@ main(int argc, char **argv)
         { "fast-open",   no_argument,       NULL, GETOPT_VAL_FAST_OPEN   },
         { "mtu",         required_argument, NULL, GETOPT_VAL_MTU         },
         { "no-delay",    no_argument,       NULL, GETOPT_VAL_NODELAY     },
+        { "edge-triggered", no_argument,    NULL, GETOPT_VAL_EDGE_TRIGGERED },
         { "mptcp",       no_argument,       NULL, GETOPT_VAL_MPTCP       },
         { "plugin",      required_argument, NULL, GETOPT_VAL_PLUGIN      },
         { "plugin-opts", required_argument, NULL, GETOPT_VAL_PLUGIN_OPTS },
@@ -943,6 +961,9 @@ main(int argc, char **argv)
         case GETOPT_VAL_REUSE_PORT:
             reuse_port = 1;
             break;
+        case GETOPT_VAL_EDGE_TRIGGERED:
+            edge_triggered = 1;
+            break;
         case 's':
             if (remote_num < MAX_REMOTE_NUM) {
                 parse_addr(optarg, &remote_addr[remote_num++]);
@@ -1086,6 +1107,9 @@ main(int argc, char **argv)
         if (reuse_port == 0) {
             reuse_port = conf->reuse_port;
         }
+        if (edge_triggered == 0) {
+            edge_triggered = conf->edge_triggered;
+        }
         if (fast_open == 0) {
             fast_open = conf->fast_open;
         }
@@ -1131,7 +1155,7 @@ main(int argc, char **argv)
     }
 
     if (method == NULL) {
-        method = "chacha20-ietf-poly1305";
+        method = DEFAULT_METHOD;
     }
 
     if (timeout == NULL) {
@@ -1293,6 +1317,10 @@ main(int argc, char **argv)
 
     struct ev_loop *loop = EV_DEFAULT;
 
+    if (edge_triggered && edge_init(loop) == 0) {
+        LOGI("enable edge-triggered readiness");
+    }
+
     if (mode != UDP_ONLY) {
         // Setup socket
         int listenfd;
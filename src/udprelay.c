@@ -54,12 +54,25 @@
 #include "udprelay.h"
 #include "winsock.h"
 
+#if !defined(MODULE_TUNNEL) && !defined(MODULE_REDIR)
+#include "flowlog.h"
+#endif
+
 #ifdef MODULE_REMOTE
 #define MAX_UDP_CONN_NUM 512
 #else
 #define MAX_UDP_CONN_NUM 256
 #endif
 
+#ifdef MODULE_REMOTE
+#define UDP_RESOLVE_TTL 60 // seconds a session reuses a resolved hostname
+#endif
+
+#if defined(MODULE_LOCAL) && defined(IP_MTU_DISCOVER) && defined(IP_MTU)
+#define PMTU_DISCOVERY
+#define PMTU_UPDATE_INTERVAL 10 // seconds between path MTU queries
+#endif
+
 #ifdef MODULE_REMOTE
 #ifdef MODULE_
 #error "MODULE_REMOTE and MODULE_LOCAL should not be both defined"
@@ -85,6 +98,15 @@ static void resolv_cb(struct sockaddr *addr, void *data);
 #endif
 static void close_and_free_remote(EV_P_ remote_ctx_t *ctx);
 static remote_ctx_t *new_remote(int fd, server_ctx_t *server_ctx);
+#ifdef UDP_OVER_TCP
+static void uot_recv_cb(EV_P_ ev_io *w, int revents);
+static void uot_send_cb(EV_P_ ev_io *w, int revents);
+static void uot_timeout_cb(EV_P_ ev_timer *watcher, int revents);
+#endif
+#ifdef MODULE_REMOTE
+static void server_recv_packet(EV_P_ server_ctx_t *server_ctx, buffer_t *buf,
+                               const struct sockaddr_storage *from);
+#endif
 
 #ifdef __ANDROID__
 extern uint64_t tx;
@@ -104,6 +126,24 @@ extern struct sockaddr_storage local_addr_v4;
 extern struct sockaddr_storage local_addr_v6;
 #endif
 
+#ifdef MODULE_REMOTE
+int udp_batch = UDP_BATCH_MAX;
+#endif
+#ifdef UDP_OVER_TCP
+#ifdef MODULE_REMOTE
+static uot_t *uot_streams;          // stream id -> uot, owns them
+static uint32_t uot_last_id;
+#else
+int udp_over_tcp = 0;
+#endif
+#endif
+#ifdef MODULE_LOCAL
+int mtu_discovery = 0;
+#endif
+#ifdef USE_MMSG
+static ev_prepare flush_watcher;
+#endif
+
 static int packet_size                               = DEFAULT_PACKET_SIZE;
 static int buf_size                                  = DEFAULT_PACKET_SIZE * 2;
 static int server_num                                = 0;
@@ -349,6 +389,13 @@ get_addr_str(const struct sockaddr *sa)
         sprintf(port, "%d", p);
         break;
 
+#ifdef UDP_OVER_TCP
+    case AF_UNSPEC:
+        sprintf(addr, "stream %u", ((const uot_addr_t *)sa)->stream);
+        sprintf(port, "%u", ((const uot_addr_t *)sa)->session);
+        break;
+#endif
+
     default:
         strncpy(s, "Unknown AF", SS_ADDRSTRLEN);
     }
@@ -362,6 +409,93 @@ get_addr_str(const struct sockaddr *sa)
     return s;
 }
 
+#ifdef PMTU_DISCOVERY
+static void
+set_pmtu_probe(int fd, int ipv6)
+{
+    // Set DF but don't let the cached path MTU block the send, so
+    // oversized datagrams are dropped on the path instead of fragmented
+    // and the kernel learns the real path MTU from ICMP.
+    int opt, rc;
+    if (ipv6) {
+        opt = IPV6_PMTUDISC_PROBE;
+        rc  = setsockopt(fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &opt, sizeof(opt));
+    } else {
+        opt = IP_PMTUDISC_PROBE;
+        rc  = setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &opt, sizeof(opt));
+    }
+    if (rc < 0 && verbose) {
+        ERROR("[udp] setsockopt IP_MTU_DISCOVER");
+    }
+}
+
+static int
+create_mtu_socket(const struct sockaddr *remote_addr, int remote_addr_len,
+                  const char *iface)
+{
+    int fd = socket(remote_addr->sa_family, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        ERROR("[udp] cannot create mtu socket");
+        return -1;
+    }
+    set_pmtu_probe(fd, remote_addr->sa_family == AF_INET6);
+#ifdef SET_INTERFACE
+    if (iface) {
+        if (setinterface(fd, iface) == -1)
+            ERROR("setinterface");
+    }
+#endif
+    // IP_MTU is only available on connected sockets, nothing is sent here
+    if (connect(fd, remote_addr, remote_addr_len) != 0) {
+        ERROR("[udp] mtu socket connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void
+update_path_mtu(EV_P_ server_ctx_t *server_ctx)
+{
+    if (server_ctx->mtu_fd < 0)
+        return;
+
+    ev_tstamp now = ev_now(EV_A);
+    if (now - server_ctx->mtu_ts < PMTU_UPDATE_INTERVAL)
+        return;
+    server_ctx->mtu_ts = now;
+
+    int mtu       = 0;
+    socklen_t len = sizeof(mtu);
+    int rc;
+    if (server_ctx->remote_addr->sa_family == AF_INET6)
+        rc = getsockopt(server_ctx->mtu_fd, IPPROTO_IPV6, IPV6_MTU, &mtu, &len);
+    else
+        rc = getsockopt(server_ctx->mtu_fd, IPPROTO_IP, IP_MTU, &mtu, &len);
+    if (rc < 0 || mtu <= 0)
+        return;
+
+    if (mtu != server_ctx->path_mtu && verbose) {
+        LOGI("[udp] path MTU to %s: %d",
+             get_addr_str((struct sockaddr *)server_ctx->remote_addr), mtu);
+    }
+    server_ctx->path_mtu = mtu;
+}
+
+/*
+ * Largest encrypted datagram that fits the discovered path MTU,
+ * or 0 if it's not known yet.
+ */
+static size_t
+path_payload_size(const server_ctx_t *server_ctx)
+{
+    int ip_header = server_ctx->remote_addr->sa_family == AF_INET6 ? 40 : 20;
+    int size      = server_ctx->path_mtu - ip_header - 8;
+    return size > 0 ? size : 0;
+}
+
+#endif
+
 int
 create_remote_socket(int ipv6)
 {
@@ -431,6 +565,25 @@ create_remote_socket(int ipv6)
     return remote_sock;
 }
 
+/*
+ * Mark the datagrams of the relay expedited forwarding
+ */
+static void
+setdscp(int fd)
+{
+#ifdef IP_TOS
+    int tos = 46 << 2;
+    int rc  = setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+    if (rc < 0 && errno != ENOPROTOOPT) {
+        LOGE("setting ipv4 dscp failed: %d", errno);
+    }
+    rc = setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
+    if (rc < 0 && errno != ENOPROTOOPT) {
+        LOGE("setting ipv6 dscp failed: %d", errno);
+    }
+#endif
+}
+
 int
 create_server_socket(const char *host, const char *port)
 {
@@ -498,18 +651,7 @@ create_server_socket(const char *host, const char *port)
                 LOGI("udp port reuse enabled");
             }
         }
-#ifdef IP_TOS
-        // Set QoS flag
-        int tos   = 46 << 2;
-        int rc = setsockopt(server_sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
-        if (rc < 0 && errno != ENOPROTOOPT) {
-            LOGE("setting ipv4 dscp failed: %d", errno);
-        }
-        rc = setsockopt(server_sock, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
-        if (rc < 0 && errno != ENOPROTOOPT) {
-            LOGE("setting ipv6 dscp failed: %d", errno);
-        }
-#endif
+        setdscp(server_sock);
 
 #ifdef MODULE_REDIR
         int sol    = rp->ai_family == AF_INET ? SOL_IP : SOL_IPV6;
@@ -552,6 +694,9 @@ new_remote(int fd, server_ctx_t *server_ctx)
     ctx->fd         = fd;
     ctx->server_ctx = server_ctx;
     ctx->af         = AF_UNSPEC;
+#if !defined(MODULE_TUNNEL) && !defined(MODULE_REDIR)
+    ctx->flow = flowlog_new(FLOWLOG_UDP);
+#endif
 
     ev_io_init(&ctx->io, remote_recv_cb, fd, EV_READ);
     ev_timer_init(&ctx->watcher, remote_timeout_cb, server_ctx->timeout,
@@ -594,6 +739,7 @@ close_and_free_query(EV_P_ struct query_ctx *ctx)
             bfree(ctx->buf);
             ss_free(ctx->buf);
         }
+        ss_free(ctx->hostname);
         ss_free(ctx);
     }
 }
@@ -604,9 +750,26 @@ void
 close_and_free_remote(EV_P_ remote_ctx_t *ctx)
 {
     if (ctx != NULL) {
+        if (verbose && (ctx->fragmented || ctx->oversized)) {
+            LOGI("[udp] session closed, fragmented: %u, oversized: %u",
+                 ctx->fragmented, ctx->oversized);
+        }
         ev_timer_stop(EV_A_ & ctx->watcher);
         ev_io_stop(EV_A_ & ctx->io);
-        close(ctx->fd);
+#if defined(UDP_OVER_TCP) && defined(MODULE_LOCAL)
+        if (ctx->session != 0) {
+            cache_remove(ctx->server_ctx->sessions, (char *)&ctx->session, sizeof(uint32_t));
+        }
+#endif
+        if (ctx->fd != -1) {
+            close(ctx->fd);
+        }
+#ifdef MODULE_REMOTE
+        ss_free(ctx->dst_host);
+#endif
+#if !defined(MODULE_TUNNEL) && !defined(MODULE_REDIR)
+        flowlog_free(ctx->flow);
+#endif
         ss_free(ctx);
     }
 }
@@ -634,9 +797,38 @@ resolv_free_cb(void *data)
         bfree(ctx->buf);
         ss_free(ctx->buf);
     }
+    ss_free(ctx->hostname);
     ss_free(ctx);
 }
 
+/*
+ * Domain-addressed datagrams of a session usually go to the same name,
+ * so reuse the address it was last resolved to until the TTL expires.
+ */
+static int
+lookup_dst_memo(EV_P_ remote_ctx_t *remote_ctx, const char *host, const char *port,
+                struct sockaddr_storage *dst_addr)
+{
+    if (remote_ctx->dst_host == NULL || ev_now(EV_A) >= remote_ctx->dst_expire
+        || strcmp(remote_ctx->dst_host, host) != 0) {
+        return 0;
+    }
+
+    uint16_t dst_port = htons(atoi(port));
+    if (remote_ctx->dst_addr.ss_family == AF_INET) {
+        if (((struct sockaddr_in *)&remote_ctx->dst_addr)->sin_port != dst_port)
+            return 0;
+    } else if (remote_ctx->dst_addr.ss_family == AF_INET6) {
+        if (((struct sockaddr_in6 *)&remote_ctx->dst_addr)->sin6_port != dst_port)
+            return 0;
+    } else {
+        return 0;
+    }
+
+    memcpy(dst_addr, &remote_ctx->dst_addr, sizeof(struct sockaddr_storage));
+    return 1;
+}
+
 static void
 resolv_cb(struct sockaddr *addr, void *data)
 {
@@ -699,16 +891,26 @@ resolv_cb(struct sockaddr *addr, void *data)
             else
                 memcpy(&remote_ctx->dst_addr, addr, sizeof(struct sockaddr_in6));
 
+            ss_free(remote_ctx->dst_host);
+            remote_ctx->dst_host   = strdup(query_ctx->hostname);
+            remote_ctx->dst_expire = ev_now(EV_A) + UDP_RESOLVE_TTL;
+
             size_t addr_len = get_sockaddr_len(addr);
             int s           = sendto(remote_ctx->fd, query_ctx->buf->data, query_ctx->buf->len,
                                      0, addr, addr_len);
 
             if (s == -1) {
+                if (errno == EMSGSIZE)
+                    remote_ctx->oversized++;
                 ERROR("[udp] sendto_remote");
                 if (!cache_hit) {
                     close_and_free_remote(EV_A_ remote_ctx);
                 }
             } else {
+                if (remote_ctx->flow != NULL) {
+                    flowlog_set_dest(remote_ctx->flow, query_ctx->addr_header);
+                    flowlog_record(remote_ctx->flow, FLOWLOG_UP, query_ctx->buf->len);
+                }
                 if (!cache_hit) {
                     // Add to conn cache
                     char *key = hash_key(AF_UNSPEC, &remote_ctx->src_addr);
@@ -723,271 +925,755 @@ resolv_cb(struct sockaddr *addr, void *data)
 
 #endif
 
+#ifdef USE_MMSG
 static void
-remote_recv_cb(EV_P_ ev_io *w, int revents)
+flush_replies(server_ctx_t *server_ctx)
 {
-    ssize_t r;
-    remote_ctx_t *remote_ctx = (remote_ctx_t *)w;
-    server_ctx_t *server_ctx = remote_ctx->server_ctx;
-
-    // server has been closed
-    if (server_ctx == NULL) {
-        LOGE("[udp] invalid server");
-        close_and_free_remote(EV_A_ remote_ctx);
-        return;
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct iovec iovs[UDP_BATCH_MAX];
+    int num = server_ctx->tx_num;
+
+    memset(msgs, 0, num * sizeof(struct mmsghdr));
+    for (int i = 0; i < num; i++) {
+        iovs[i].iov_base            = server_ctx->tx_bufs[i].data;
+        iovs[i].iov_len             = server_ctx->tx_bufs[i].len;
+        msgs[i].msg_hdr.msg_name    = &server_ctx->tx_addrs[i];
+        msgs[i].msg_hdr.msg_namelen =
+            get_sockaddr_len((struct sockaddr *)&server_ctx->tx_addrs[i]);
+        msgs[i].msg_hdr.msg_iov    = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
     }
 
-    if (verbose) {
-        LOGI("[udp] remote receive a packet");
+    int i = 0;
+    while (i < num) {
+        int s = sendmmsg(server_ctx->fd, msgs + i, num - i, 0);
+        if (s == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // the socket buffer is full, drop the rest
+                break;
+            } else if (errno == ENOSYS) {
+                LOGE("[udp] sendmmsg not supported, relay datagrams one by one");
+                udp_batch = 1;
+                for (; i < num; i++)
+                    sendto(server_ctx->fd, iovs[i].iov_base, iovs[i].iov_len, 0,
+                           msgs[i].msg_hdr.msg_name, msgs[i].msg_hdr.msg_namelen);
+                break;
+            }
+            // only the first datagram failed, skip it
+            ERROR("[udp] remote_recv_sendmmsg");
+            i++;
+            continue;
+        }
+        i += s;
     }
 
-    struct sockaddr_storage src_addr;
-    socklen_t src_addr_len = sizeof(struct sockaddr_storage);
-    memset(&src_addr, 0, src_addr_len);
+    for (i = 0; i < num; i++)
+        bfree(&server_ctx->tx_bufs[i]);
+    server_ctx->tx_num = 0;
+}
 
-    buffer_t *buf = ss_malloc(sizeof(buffer_t));
-    balloc(buf, buf_size);
+/*
+ * Queue a reply on the listener, it's sent with the others of the same
+ * loop iteration. The data of buf is swapped into the queue, buf still
+ * has to be freed by the caller.
+ */
+static void
+queue_reply(server_ctx_t *server_ctx, buffer_t *buf,
+            const struct sockaddr_storage *addr)
+{
+    buffer_t tmp = server_ctx->tx_bufs[server_ctx->tx_num];
 
-    // recv
-    r = recvfrom(remote_ctx->fd, buf->data, buf_size, 0, (struct sockaddr *)&src_addr, &src_addr_len);
+    server_ctx->tx_bufs[server_ctx->tx_num]  = *buf;
+    server_ctx->tx_addrs[server_ctx->tx_num] = *addr;
+    *buf = tmp;
 
-    if (r == -1) {
-        // error on recv
-        // simply drop that packet
-        ERROR("[udp] remote_recv_recvfrom");
-        goto CLEAN_UP;
-    } else if (r > packet_size) {
-        if (verbose) {
-            LOGI("[udp] remote_recv_recvfrom fragmentation, MTU at least be: " SSIZE_FMT, r + PACKET_HEADER_SIZE);
-        }
+    if (++server_ctx->tx_num == udp_batch) {
+        flush_replies(server_ctx);
     }
+}
 
-    buf->len = r;
+static void
+flush_cb(EV_P_ ev_prepare *w, int revents)
+{
+    for (int i = 0; i < server_num; i++)
+        if (server_ctx_list[i]->tx_num > 0) {
+            flush_replies(server_ctx_list[i]);
+        }
+}
 
-#ifdef MODULE_LOCAL
-    int err = server_ctx->crypto->decrypt_all(buf, server_ctx->crypto->cipher, buf_size);
-    if (err) {
-        // drop the packet silently
-        goto CLEAN_UP;
-    }
+#endif
 
-#ifdef MODULE_REDIR
-    struct sockaddr_storage dst_addr;
-    memset(&dst_addr, 0, sizeof(struct sockaddr_storage));
-    int len = parse_udprelay_header(buf->data, buf->len, NULL, NULL, &dst_addr);
+#ifdef UDP_OVER_TCP
+static uot_t *
+new_uot(int fd, server_ctx_t *server_ctx, cipher_ctx_t *e_ctx, cipher_ctx_t *d_ctx)
+{
+    crypto_t *crypto = server_ctx->crypto;
+    uot_t *uot       = ss_malloc(sizeof(uot_t));
+    memset(uot, 0, sizeof(uot_t));
 
-    if (dst_addr.ss_family != AF_INET && dst_addr.ss_family != AF_INET6) {
-        LOGI("[udp] ss-redir does not support domain name");
-        goto CLEAN_UP;
+    if (e_ctx == NULL) {
+        e_ctx = ss_malloc(sizeof(cipher_ctx_t));
+        crypto->ctx_init(crypto->cipher, e_ctx, 1);
     }
-#else
-    int len = parse_udprelay_header(buf->data, buf->len, NULL, NULL, NULL);
+    if (d_ctx == NULL) {
+        d_ctx = ss_malloc(sizeof(cipher_ctx_t));
+        crypto->ctx_init(crypto->cipher, d_ctx, 0);
+    }
+
+    uot->fd         = fd;
+    uot->e_ctx      = e_ctx;
+    uot->d_ctx      = d_ctx;
+    uot->server_ctx = server_ctx;
+    uot->buf        = ss_malloc(sizeof(buffer_t));
+    uot->recv_buf   = ss_malloc(sizeof(buffer_t));
+    uot->send_buf   = ss_malloc(sizeof(buffer_t));
+    balloc(uot->buf, SOCKET_BUF_SIZE);
+    balloc(uot->recv_buf, SOCKET_BUF_SIZE);
+    balloc(uot->send_buf, SOCKET_BUF_SIZE);
+
+    ev_io_init(&uot->recv_io, uot_recv_cb, fd, EV_READ);
+    ev_io_init(&uot->send_io, uot_send_cb, fd, EV_WRITE);
+    ev_timer_init(&uot->watcher, uot_timeout_cb, server_ctx->timeout,
+                  server_ctx->timeout);
+
+    return uot;
+}
+
+static void
+free_uot(EV_P_ uot_t *uot)
+{
+    crypto_t *crypto = uot->server_ctx->crypto;
+
+    ev_io_stop(EV_A_ & uot->recv_io);
+    ev_io_stop(EV_A_ & uot->send_io);
+    ev_timer_stop(EV_A_ & uot->watcher);
+    close(uot->fd);
+
+    crypto->ctx_release(uot->e_ctx);
+    crypto->ctx_release(uot->d_ctx);
+    ss_free(uot->e_ctx);
+    ss_free(uot->d_ctx);
+    bfree(uot->buf);
+    bfree(uot->recv_buf);
+    bfree(uot->send_buf);
+    ss_free(uot->buf);
+    ss_free(uot->recv_buf);
+    ss_free(uot->send_buf);
+    ss_free(uot);
+}
+
+#ifndef MODULE_REMOTE
+static void
+session_free_cb(void *key, void *element)
+{
+    // Sessions are owned by the conn cache
+}
+
 #endif
 
-    if (len == 0) {
-        // error when parsing header
-        LOGE("[udp] error in parse header");
-        goto CLEAN_UP;
+static void
+close_and_free_uot(EV_P_ uot_t *uot)
+{
+    if (verbose) {
+        LOGI("[udp] stream closed");
     }
 
-#if defined(MODULE_TUNNEL) || defined(MODULE_REDIR)
-    // Construct packet
-    buf->len -= len;
-    memmove(buf->data, buf->data + len, buf->len);
+#ifdef MODULE_REMOTE
+    // Its sessions time out in the conn cache
+    HASH_DEL(uot_streams, uot);
 #else
-#ifdef __ANDROID__
-    rx += buf->len;
-    stat_update_cb();
-#endif
-    // Construct packet
-    brealloc(buf, buf->len + 3, buf_size);
-    memmove(buf->data + 3, buf->data, buf->len);
-    memset(buf->data, 0, 3);
-    buf->len += 3;
+    uot->server_ctx->uot = NULL;
 #endif
+    free_uot(EV_A_ uot);
+}
 
-#endif
+static int
+uot_flush(EV_P_ uot_t *uot)
+{
+    buffer_t *queue = uot->send_buf;
 
-#ifdef MODULE_REMOTE
+    while (queue->len > 0) {
+        ssize_t s = send(uot->fd, queue->data + queue->idx, queue->len, 0);
+        if (s == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            ERROR("[udp] uot_send");
+            close_and_free_uot(EV_A_ uot);
+            return -1;
+        }
+        queue->idx += s;
+        queue->len -= s;
+    }
 
-    rx += buf->len;
+    if (queue->len == 0) {
+        queue->idx = 0;
+        ev_io_stop(EV_A_ & uot->send_io);
+    } else {
+        ev_io_start(EV_A_ & uot->send_io);
+    }
 
-    // Reconstruct UDP response header
-    char addr_header[MAX_ADDR_HEADER_SIZE];
-    int addr_header_len = construct_udprelay_header(&src_addr, addr_header);
+    return 0;
+}
 
-    // Construct packet
-    brealloc(buf, buf->len + addr_header_len, buf_size);
-    memmove(buf->data + addr_header_len, buf->data, buf->len);
-    memcpy(buf->data, addr_header, addr_header_len);
-    buf->len += addr_header_len;
+/*
+ * Send buf, a datagram from its ATYP on, as a frame of the session.
+ * While the stream is backed up datagrams are dropped, the way a full
+ * socket buffer drops them. Returns -1 if the stream got closed.
+ */
+static int
+uot_write(EV_P_ uot_t *uot, uint32_t session, buffer_t *buf)
+{
+    crypto_t *crypto = uot->server_ctx->crypto;
+    buffer_t *queue  = uot->send_buf;
+    size_t frame_len = buf->len + sizeof(uint32_t);
 
-    int err = server_ctx->crypto->encrypt_all(buf, server_ctx->crypto->cipher, buf_size);
-    if (err) {
-        // drop the packet silently
-        goto CLEAN_UP;
+    if (frame_len > UINT16_MAX || queue->len > UOT_MAX_QUEUE) {
+        return 0;
     }
 
-#endif
+    uint16_t len_net     = htons(frame_len);
+    uint32_t session_net = htonl(session);
+    brealloc(buf, buf->len + 6, buf_size);
+    memmove(buf->data + 6, buf->data, buf->len);
+    memcpy(buf->data, &len_net, 2);
+    memcpy(buf->data + 2, &session_net, 4);
+    buf->len += 6;
+
+    if (crypto->encrypt(buf, uot->e_ctx, SOCKET_BUF_SIZE)) {
+        LOGE("[udp] failed to encrypt the stream");
+        close_and_free_uot(EV_A_ uot);
+        return -1;
+    }
 
-    if (buf->len > packet_size) {
-        if (verbose) {
-            LOGI("[udp] remote_recv_sendto fragmentation, MTU at least be: " SSIZE_FMT, buf->len + PACKET_HEADER_SIZE);
-        }
+    if (queue->idx > 0) {
+        memmove(queue->data, queue->data + queue->idx, queue->len);
+        queue->idx = 0;
     }
+    brealloc(queue, queue->len + buf->len, SOCKET_BUF_SIZE);
+    memcpy(queue->data + queue->len, buf->data, buf->len);
+    queue->len += buf->len;
 
-    size_t remote_src_addr_len = get_sockaddr_len((struct sockaddr *)&remote_ctx->src_addr);
+    ev_timer_again(EV_A_ & uot->watcher);
 
-#ifdef MODULE_REDIR
+    // Not connected yet, or waiting to be writable
+    if (ev_is_active(&uot->send_io)) {
+        return 0;
+    }
 
-    size_t remote_dst_addr_len = get_sockaddr_len((struct sockaddr *)&dst_addr);
+    return uot_flush(EV_A_ uot);
+}
 
-    int src_fd = socket(remote_ctx->src_addr.ss_family, SOCK_DGRAM, 0);
-    if (src_fd < 0) {
-        ERROR("[udp] remote_recv_socket");
-        goto CLEAN_UP;
+/*
+ * Relay a datagram that came over the stream, data starts at its ATYP.
+ */
+static void
+uot_packet(EV_P_ uot_t *uot, uint32_t session, const char *data, size_t len)
+{
+#ifdef MODULE_REMOTE
+    struct sockaddr_storage src_addr;
+    uot_addr_t *addr = (uot_addr_t *)&src_addr;
+    memset(&src_addr, 0, sizeof(struct sockaddr_storage));
+    addr->family  = AF_UNSPEC;
+    addr->stream  = uot->id;
+    addr->session = session;
+
+    buffer_t *buf = ss_malloc(sizeof(buffer_t));
+    balloc(buf, max(len, buf_size));
+    memcpy(buf->data, data, len);
+    buf->len = len;
+    tx      += len;
+
+    server_recv_packet(EV_A_ uot->server_ctx, buf, &src_addr);
+#else
+    server_ctx_t *server_ctx = uot->server_ctx;
+    remote_ctx_t *remote_ctx = NULL;
+
+    cache_lookup(server_ctx->sessions, (char *)&session, sizeof(uint32_t),
+                 (void *)&remote_ctx);
+    if (remote_ctx == NULL) {
+        // The session timed out meanwhile
+        return;
     }
-    int opt  = 1;
-    int sol  = remote_ctx->src_addr.ss_family == AF_INET6 ? SOL_IPV6 : SOL_IP;
-    int flag = remote_ctx->src_addr.ss_family == AF_INET6 ? IPV6_TRANSPARENT : IP_TRANSPARENT;
-    if (setsockopt(src_fd, sol, flag, &opt, sizeof(opt))) {
-        ERROR("[udp] remote_recv_setsockopt");
-        close(src_fd);
-        goto CLEAN_UP;
+
+    int addr_header_len = parse_udprelay_header(data, len, NULL, NULL, NULL);
+    if (addr_header_len == 0) {
+        LOGE("[udp] error in parse header");
+        return;
     }
-    if (setsockopt(src_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        ERROR("[udp] remote_recv_setsockopt");
-        close(src_fd);
-        goto CLEAN_UP;
+
+    FLOWLOG(remote_ctx->flow, FLOWLOG_DOWN, len - addr_header_len);
+#ifdef __ANDROID__
+    rx += len;
+    stat_update_cb();
+#endif
+
+    // SOCKS5 UDP response, RSV and FRAG in front of the datagram
+    char rsv_frag[3] = { 0 };
+    struct iovec iov[2];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    iov[0].iov_base = rsv_frag;
+    iov[0].iov_len  = sizeof(rsv_frag);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len  = len;
+    msg.msg_name    = &remote_ctx->src_addr;
+    msg.msg_namelen = get_sockaddr_len((struct sockaddr *)&remote_ctx->src_addr);
+    msg.msg_iov     = iov;
+    msg.msg_iovlen  = 2;
+
+    int s = sendmsg(server_ctx->fd, &msg, 0);
+    if (s == -1 && !(errno == EAGAIN || errno == EWOULDBLOCK)) {
+        ERROR("[udp] uot_recv_sendmsg");
+        return;
     }
-#ifdef IP_TOS
-    // Set QoS flag
-    int tos   = 46 << 2;
-    int rc = setsockopt(src_fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
-    if (rc < 0 && errno != ENOPROTOOPT) {
-        LOGE("setting ipv4 dscp failed: %d", errno);
+
+    ev_timer_again(EV_A_ & remote_ctx->watcher);
+#endif
+}
+
+/*
+ * Relay the whole frames decrypted so far, a partial one is kept for the
+ * next read.
+ */
+static void
+uot_frames(EV_P_ uot_t *uot)
+{
+    buffer_t *buf = uot->recv_buf;
+    size_t idx    = 0;
+
+    while (buf->len - idx >= 2) {
+        uint16_t frame_len;
+        uint32_t session;
+
+        memcpy(&frame_len, buf->data + idx, 2);
+        frame_len = ntohs(frame_len);
+        if (frame_len <= sizeof(uint32_t)) {
+            LOGE("[udp] invalid frame on the stream");
+            close_and_free_uot(EV_A_ uot);
+            return;
+        }
+        if (buf->len - idx < 2 + frame_len) {
+            break;
+        }
+
+        memcpy(&session, buf->data + idx + 2, 4);
+        uot_packet(EV_A_ uot, ntohl(session), buf->data + idx + 6, frame_len - 4);
+        idx += 2 + frame_len;
     }
-    rc = setsockopt(src_fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
-    if (rc < 0 && errno != ENOPROTOOPT) {
-        LOGE("setting ipv6 dscp failed: %d", errno);
+
+    buf->len -= idx;
+    memmove(buf->data, buf->data + idx, buf->len);
+}
+
+static void
+uot_recv_cb(EV_P_ ev_io *w, int revents)
+{
+    uot_t *uot       = cork_container_of(w, uot_t, recv_io);
+    crypto_t *crypto = uot->server_ctx->crypto;
+    buffer_t *buf    = uot->buf;
+
+    ssize_t r = recv(uot->fd, buf->data, SOCKET_BUF_SIZE, 0);
+
+    if (r == 0) {
+        close_and_free_uot(EV_A_ uot);
+        return;
+    } else if (r == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        ERROR("[udp] uot_recv");
+        close_and_free_uot(EV_A_ uot);
+        return;
     }
-#endif
-    if (bind(src_fd, (struct sockaddr *)&dst_addr, remote_dst_addr_len) != 0) {
-        ERROR("[udp] remote_recv_bind");
-        close(src_fd);
-        goto CLEAN_UP;
+
+    buf->len = r;
+
+    int err = crypto->decrypt(buf, uot->d_ctx, SOCKET_BUF_SIZE);
+    if (err == CRYPTO_ERROR) {
+        LOGE("[udp] invalid password or cipher on the stream");
+        close_and_free_uot(EV_A_ uot);
+        return;
+    } else if (err == CRYPTO_NEED_MORE) {
+        return;
     }
 
-    int s = sendto(src_fd, buf->data, buf->len, 0,
-                   (struct sockaddr *)&remote_ctx->src_addr, remote_src_addr_len);
-    if (s == -1 && !(errno == EAGAIN || errno == EWOULDBLOCK)) {
-        ERROR("[udp] remote_recv_sendto");
-        close(src_fd);
-        goto CLEAN_UP;
+    ev_timer_again(EV_A_ & uot->watcher);
+
+    buffer_t *pending = uot->recv_buf;
+    brealloc(pending, pending->len + buf->len, SOCKET_BUF_SIZE);
+    memcpy(pending->data + pending->len, buf->data, buf->len);
+    pending->len += buf->len;
+
+    uot_frames(EV_A_ uot);
+}
+
+static void
+uot_send_cb(EV_P_ ev_io *w, int revents)
+{
+    uot_t *uot = cork_container_of(w, uot_t, send_io);
+
+    // A pending connect has finished, the send tells how
+    uot->connected = 1;
+
+    uot_flush(EV_A_ uot);
+}
+
+static void
+uot_timeout_cb(EV_P_ ev_timer *watcher, int revents)
+{
+    uot_t *uot = cork_container_of(watcher, uot_t, watcher);
+
+    if (verbose) {
+        LOGI("[udp] stream timeout");
+    }
+
+    close_and_free_uot(EV_A_ uot);
+}
+
+#ifdef MODULE_REMOTE
+/*
+ * Take over a client stream that carries datagrams, with the cipher
+ * contexts it was set up with and what was decrypted after the request
+ * header. Fails when no UDP relay is running.
+ */
+int
+uot_accept(EV_P_ int fd, cipher_ctx_t *e_ctx, cipher_ctx_t *d_ctx,
+           const char *data, size_t len)
+{
+    if (server_num == 0) {
+        return -1;
+    }
+
+    // Streams are never evicted, skip ids still taken after a wrap
+    uot_t *uot = NULL;
+    do {
+        if (++uot_last_id == 0) {
+            ++uot_last_id;
+        }
+        HASH_FIND(hh, uot_streams, &uot_last_id, sizeof(uint32_t), uot);
+    } while (uot != NULL);
+
+    uot = new_uot(fd, server_ctx_list[0], e_ctx, d_ctx);
+    uot->id        = uot_last_id;
+    uot->connected = 1;
+    HASH_ADD(hh, uot_streams, id, sizeof(uint32_t), uot);
+
+    ev_io_start(EV_A_ & uot->recv_io);
+    ev_timer_start(EV_A_ & uot->watcher);
+
+    if (verbose) {
+        LOGI("[udp] stream accepted");
     }
-    close(src_fd);
+
+    if (len > 0) {
+        brealloc(uot->recv_buf, len, SOCKET_BUF_SIZE);
+        memcpy(uot->recv_buf->data, data, len);
+        uot->recv_buf->len = len;
+        uot_frames(EV_A_ uot);
+    }
+
+    return 0;
+}
 
 #else
+static uot_t *
+uot_connect(EV_P_ server_ctx_t *server_ctx)
+{
+    const struct sockaddr *remote_addr = server_ctx->remote_addr;
 
-    int s = sendto(server_ctx->fd, buf->data, buf->len, 0,
-                   (struct sockaddr *)&remote_ctx->src_addr, remote_src_addr_len);
-    if (s == -1 && !(errno == EAGAIN || errno == EWOULDBLOCK)) {
-        ERROR("[udp] remote_recv_sendto");
-        goto CLEAN_UP;
+    int fd = socket(remote_addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (fd == -1) {
+        ERROR("[udp] uot_socket");
+        return NULL;
     }
 
+    setnonblocking(fd);
+    int opt = 1;
+    setsockopt(fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+#ifdef SO_NOSIGPIPE
+    set_nosigpipe(fd);
+#endif
+#ifdef SET_INTERFACE
+    if (server_ctx->iface) {
+        if (setinterface(fd, server_ctx->iface) == -1)
+            ERROR("setinterface");
+    }
+#endif
+#ifdef __ANDROID__
+    if (vpn) {
+        if (protect_socket(fd) == -1) {
+            ERROR("protect_socket");
+            close(fd);
+            return NULL;
+        }
+    }
 #endif
 
-    // handle the UDP packet successfully,
-    // triger the timer
-    ev_timer_again(EV_A_ & remote_ctx->watcher);
+    if (connect(fd, remote_addr, server_ctx->remote_addr_len) == -1
+        && errno != EINPROGRESS) {
+        ERROR("[udp] uot_connect");
+        close(fd);
+        return NULL;
+    }
 
-CLEAN_UP:
+    uot_t *uot = new_uot(fd, server_ctx, NULL, NULL);
 
-    bfree(buf);
-    ss_free(buf);
+    // The request header names UOT_HOST, the port is unused
+    buffer_t *queue = uot->send_buf;
+    size_t host_len = strlen(UOT_HOST);
+    queue->data[0]  = 3;
+    queue->data[1]  = host_len;
+    memcpy(queue->data + 2, UOT_HOST, host_len);
+    memset(queue->data + 2 + host_len, 0, 2);
+    queue->len = host_len + 4;
+    server_ctx->crypto->encrypt(queue, uot->e_ctx, SOCKET_BUF_SIZE);
+
+    // Writable once connected
+    ev_io_start(EV_A_ & uot->send_io);
+    ev_io_start(EV_A_ & uot->recv_io);
+    ev_timer_start(EV_A_ & uot->watcher);
+
+    if (verbose) {
+        LOGI("[udp] connect a stream to the server");
+    }
+
+    return uot;
 }
 
+#endif
+#endif
+
 static void
-server_recv_cb(EV_P_ ev_io *w, int revents)
+remote_recv_cb(EV_P_ ev_io *w, int revents)
 {
-    server_ctx_t *server_ctx = (server_ctx_t *)w;
+    ssize_t r;
+    remote_ctx_t *remote_ctx = (remote_ctx_t *)w;
+    server_ctx_t *server_ctx = remote_ctx->server_ctx;
+
+    // server has been closed
+    if (server_ctx == NULL) {
+        LOGE("[udp] invalid server");
+        close_and_free_remote(EV_A_ remote_ctx);
+        return;
+    }
+
+    if (verbose) {
+        LOGI("[udp] remote receive a packet");
+    }
+
     struct sockaddr_storage src_addr;
-    memset(&src_addr, 0, sizeof(struct sockaddr_storage));
+    socklen_t src_addr_len = sizeof(struct sockaddr_storage);
+    memset(&src_addr, 0, src_addr_len);
 
     buffer_t *buf = ss_malloc(sizeof(buffer_t));
     balloc(buf, buf_size);
 
-    socklen_t src_addr_len = sizeof(struct sockaddr_storage);
-    unsigned int offset    = 0;
+    // recv
+    r = recvfrom(remote_ctx->fd, buf->data, buf_size, 0, (struct sockaddr *)&src_addr, &src_addr_len);
+
+    if (r == -1) {
+        // error on recv
+        // simply drop that packet
+        ERROR("[udp] remote_recv_recvfrom");
+        goto CLEAN_UP;
+    } else if (r > packet_size) {
+        if (verbose) {
+            LOGI("[udp] remote_recv_recvfrom fragmentation, MTU at least be: " SSIZE_FMT, r + PACKET_HEADER_SIZE);
+        }
+    }
+
+    buf->len = r;
+
+#ifdef MODULE_LOCAL
+    int err = server_ctx->crypto->decrypt_all(buf, server_ctx->crypto->cipher, buf_size);
+    if (err) {
+        // drop the packet silently
+        goto CLEAN_UP;
+    }
 
 #ifdef MODULE_REDIR
-    char control_buffer[64] = { 0 };
-    struct msghdr msg;
-    memset(&msg, 0, sizeof(struct msghdr));
-    struct iovec iov[1];
     struct sockaddr_storage dst_addr;
     memset(&dst_addr, 0, sizeof(struct sockaddr_storage));
+    int len = parse_udprelay_header(buf->data, buf->len, NULL, NULL, &dst_addr);
 
-    msg.msg_name       = &src_addr;
-    msg.msg_namelen    = src_addr_len;
-    msg.msg_control    = control_buffer;
-    msg.msg_controllen = sizeof(control_buffer);
+    if (dst_addr.ss_family != AF_INET && dst_addr.ss_family != AF_INET6) {
+        LOGI("[udp] ss-redir does not support domain name");
+        goto CLEAN_UP;
+    }
+#else
+    int len = parse_udprelay_header(buf->data, buf->len, NULL, NULL, NULL);
+#endif
 
-    iov[0].iov_base = buf->data;
-    iov[0].iov_len  = buf_size;
-    msg.msg_iov     = iov;
-    msg.msg_iovlen  = 1;
+    if (len == 0) {
+        // error when parsing header
+        LOGE("[udp] error in parse header");
+        goto CLEAN_UP;
+    }
 
-    buf->len = recvmsg(server_ctx->fd, &msg, 0);
-    if (buf->len == -1) {
-        ERROR("[udp] server_recvmsg");
+#if defined(MODULE_TUNNEL) || defined(MODULE_REDIR)
+    // Construct packet
+    buf->len -= len;
+    memmove(buf->data, buf->data + len, buf->len);
+#else
+    FLOWLOG(remote_ctx->flow, FLOWLOG_DOWN, buf->len - len);
+#ifdef __ANDROID__
+    rx += buf->len;
+    stat_update_cb();
+#endif
+    // Construct packet
+    brealloc(buf, buf->len + 3, buf_size);
+    memmove(buf->data + 3, buf->data, buf->len);
+    memset(buf->data, 0, 3);
+    buf->len += 3;
+#endif
+
+#endif
+
+#ifdef MODULE_REMOTE
+
+    rx += buf->len;
+    FLOWLOG(remote_ctx->flow, FLOWLOG_DOWN, buf->len);
+
+    // Reconstruct UDP response header
+    char addr_header[MAX_ADDR_HEADER_SIZE];
+    int addr_header_len = construct_udprelay_header(&src_addr, addr_header);
+
+    // Construct packet
+    brealloc(buf, buf->len + addr_header_len, buf_size);
+    memmove(buf->data + addr_header_len, buf->data, buf->len);
+    memcpy(buf->data, addr_header, addr_header_len);
+    buf->len += addr_header_len;
+
+    if (remote_ctx->src_addr.ss_family == AF_UNSPEC) {
+        // A session over a stream, which may be gone by now
+        uot_addr_t *addr = (uot_addr_t *)&remote_ctx->src_addr;
+        uot_t *uot       = NULL;
+        HASH_FIND(hh, uot_streams, &addr->stream, sizeof(uint32_t), uot);
+        if (uot != NULL) {
+            uot_write(EV_A_ uot, addr->session, buf);
+        }
+        ev_timer_again(EV_A_ & remote_ctx->watcher);
         goto CLEAN_UP;
-    } else if (buf->len > packet_size) {
+    }
+
+    int err = server_ctx->crypto->encrypt_all(buf, server_ctx->crypto->cipher, buf_size);
+    if (err) {
+        // drop the packet silently
+        goto CLEAN_UP;
+    }
+
+#endif
+
+    if (buf->len > packet_size) {
+        remote_ctx->fragmented++;
         if (verbose) {
-            LOGI("[udp] UDP server_recv_recvmsg fragmentation, MTU at least be: " SSIZE_FMT,
-                 buf->len + PACKET_HEADER_SIZE);
+            LOGI("[udp] remote_recv_sendto fragmentation, MTU at least be: " SSIZE_FMT, buf->len + PACKET_HEADER_SIZE);
         }
     }
 
-    if (get_dstaddr(&msg, &dst_addr)) {
-        LOGE("[udp] unable to get dest addr");
+    size_t remote_src_addr_len = get_sockaddr_len((struct sockaddr *)&remote_ctx->src_addr);
+
+#ifdef MODULE_REDIR
+
+    size_t remote_dst_addr_len = get_sockaddr_len((struct sockaddr *)&dst_addr);
+
+    int src_fd = socket(remote_ctx->src_addr.ss_family, SOCK_DGRAM, 0);
+    if (src_fd < 0) {
+        ERROR("[udp] remote_recv_socket");
+        goto CLEAN_UP;
+    }
+    int opt  = 1;
+    int sol  = remote_ctx->src_addr.ss_family == AF_INET6 ? SOL_IPV6 : SOL_IP;
+    int flag = remote_ctx->src_addr.ss_family == AF_INET6 ? IPV6_TRANSPARENT : IP_TRANSPARENT;
+    if (setsockopt(src_fd, sol, flag, &opt, sizeof(opt))) {
+        ERROR("[udp] remote_recv_setsockopt");
+        close(src_fd);
+        goto CLEAN_UP;
+    }
+    if (setsockopt(src_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+        ERROR("[udp] remote_recv_setsockopt");
+        close(src_fd);
+        goto CLEAN_UP;
+    }
+#ifdef IP_TOS
+    // Set QoS flag
+    int tos   = 46 << 2;
+    int rc = setsockopt(src_fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+    if (rc < 0 && errno != ENOPROTOOPT) {
+        LOGE("setting ipv4 dscp failed: %d", errno);
+    }
+    rc = setsockopt(src_fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
+    if (rc < 0 && errno != ENOPROTOOPT) {
+        LOGE("setting ipv6 dscp failed: %d", errno);
+    }
+#endif
+    if (bind(src_fd, (struct sockaddr *)&dst_addr, remote_dst_addr_len) != 0) {
+        ERROR("[udp] remote_recv_bind");
+        close(src_fd);
+        goto CLEAN_UP;
+    }
+
+    int s = sendto(src_fd, buf->data, buf->len, 0,
+                   (struct sockaddr *)&remote_ctx->src_addr, remote_src_addr_len);
+    if (s == -1 && !(errno == EAGAIN || errno == EWOULDBLOCK)) {
+        ERROR("[udp] remote_recv_sendto");
+        close(src_fd);
         goto CLEAN_UP;
     }
+    close(src_fd);
 
-    src_addr_len = msg.msg_namelen;
 #else
-    ssize_t r;
-    r = recvfrom(server_ctx->fd, buf->data, buf_size,
-                 0, (struct sockaddr *)&src_addr, &src_addr_len);
 
-    if (r == -1) {
-        // error on recv
-        // simply drop that packet
-        ERROR("[udp] server_recv_recvfrom");
+#ifdef USE_MMSG
+    if (udp_batch > 1) {
+        queue_reply(server_ctx, buf, &remote_ctx->src_addr);
+        ev_timer_again(EV_A_ & remote_ctx->watcher);
         goto CLEAN_UP;
-    } else if (r > packet_size) {
-        if (verbose) {
-            LOGI("[udp] server_recv_recvfrom fragmentation, MTU at least be: " SSIZE_FMT, r + PACKET_HEADER_SIZE);
-        }
     }
-
-    buf->len = r;
 #endif
 
-    if (verbose) {
-        LOGI("[udp] server receive a packet");
+    int s = sendto(server_ctx->fd, buf->data, buf->len, 0,
+                   (struct sockaddr *)&remote_ctx->src_addr, remote_src_addr_len);
+    if (s == -1 && !(errno == EAGAIN || errno == EWOULDBLOCK)) {
+        ERROR("[udp] remote_recv_sendto");
+        goto CLEAN_UP;
     }
 
-#ifdef MODULE_REMOTE
-    tx += buf->len;
+#endif
 
-    int err = server_ctx->crypto->decrypt_all(buf, server_ctx->crypto->cipher, buf_size);
-    if (err) {
-        // drop the packet silently
-        goto CLEAN_UP;
-    }
+    // handle the UDP packet successfully,
+    // triger the timer
+    ev_timer_again(EV_A_ & remote_ctx->watcher);
+
+CLEAN_UP:
+
+    bfree(buf);
+    ss_free(buf);
+}
+
+/*
+ * Relay one datagram read from the listener, or on ss-server one that came
+ * over a stream, buf is freed when done. On ss-server it's decrypted
+ * already.
+ */
+static void
+server_recv_packet(EV_P_ server_ctx_t *server_ctx, buffer_t *buf,
+                   const struct sockaddr_storage *from
+#ifdef MODULE_REDIR
+                   , const struct sockaddr_storage *to
+#endif
+                   )
+{
+    struct sockaddr_storage src_addr = *from;
+#ifdef MODULE_REDIR
+    struct sockaddr_storage dst_addr = *to;
 #endif
+    unsigned int offset = 0;
+
+    if (verbose) {
+        LOGI("[udp] server receive a packet");
+    }
 
 #ifdef MODULE_LOCAL
 #if !defined(MODULE_TUNNEL) && !defined(MODULE_REDIR)
@@ -1187,6 +1873,24 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
     const struct sockaddr *remote_addr = server_ctx->remote_addr;
     const int remote_addr_len          = server_ctx->remote_addr_len;
 
+#ifdef UDP_OVER_TCP
+    if (remote_ctx == NULL && udp_over_tcp) {
+        // No socket of its own, the datagrams go over the stream
+        remote_ctx           = new_remote(-1, server_ctx);
+        remote_ctx->src_addr = src_addr;
+        remote_ctx->af       = remote_addr->sa_family;
+        if (++server_ctx->last_session == 0) {
+            ++server_ctx->last_session;
+        }
+        remote_ctx->session = server_ctx->last_session;
+
+        cache_insert(server_ctx->sessions, (char *)&remote_ctx->session,
+                     sizeof(uint32_t), (void *)remote_ctx);
+        cache_insert(conn_cache, key, HASH_KEY_LEN, (void *)remote_ctx);
+        ev_timer_start(EV_A_ & remote_ctx->watcher);
+    }
+#endif
+
     if (remote_ctx == NULL) {
         // Bind to any port
         int remotefd = create_remote_socket(remote_addr->sa_family == AF_INET6);
@@ -1218,6 +1922,12 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
         }
 #endif
 
+#ifdef PMTU_DISCOVERY
+        if (mtu_discovery) {
+            set_pmtu_probe(remotefd, remote_addr->sa_family == AF_INET6);
+        }
+#endif
+
 #ifdef __ANDROID__
         if (vpn) {
             if (protect_socket(remotefd) == -1) {
@@ -1241,11 +1951,30 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
         ev_timer_start(EV_A_ & remote_ctx->watcher);
     }
 
+#if !defined(MODULE_TUNNEL) && !defined(MODULE_REDIR)
+    if (remote_ctx->flow != NULL) {
+        flowlog_set_dest(remote_ctx->flow, buf->data + offset);
+        flowlog_record(remote_ctx->flow, FLOWLOG_UP, buf->len - offset - addr_header_len);
+    }
+#endif
+
     if (offset > 0) {
         buf->len -= offset;
         memmove(buf->data, buf->data + offset, buf->len);
     }
 
+#ifdef UDP_OVER_TCP
+    if (remote_ctx->session != 0) {
+        if (server_ctx->uot == NULL) {
+            server_ctx->uot = uot_connect(EV_A_ server_ctx);
+        }
+        if (server_ctx->uot != NULL) {
+            uot_write(EV_A_ server_ctx->uot, remote_ctx->session, buf);
+        }
+        goto CLEAN_UP;
+    }
+#endif
+
     int err = server_ctx->crypto->encrypt_all(buf, server_ctx->crypto->cipher, buf_size);
 
     if (err) {
@@ -1254,14 +1983,31 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
     }
 
     if (buf->len > packet_size) {
+        remote_ctx->fragmented++;
         if (verbose) {
             LOGI("[udp] server_recv_sendto fragmentation, MTU at least be: " SSIZE_FMT, buf->len + PACKET_HEADER_SIZE);
         }
     }
 
+#ifdef PMTU_DISCOVERY
+    update_path_mtu(EV_A_ server_ctx);
+    size_t path_size = path_payload_size(server_ctx);
+    if (mtu_discovery && path_size > 0 && buf->len > path_size) {
+        // DF is set, so it would be dropped on the path anyway
+        remote_ctx->oversized++;
+        if (verbose) {
+            LOGI("[udp] drop an oversized packet: " SSIZE_FMT " bytes, path MTU: %d",
+                 buf->len, server_ctx->path_mtu);
+        }
+        goto CLEAN_UP;
+    }
+#endif
+
     int s = sendto(remote_ctx->fd, buf->data, buf->len, 0, remote_addr, remote_addr_len);
 
     if (s == -1) {
+        if (errno == EMSGSIZE)
+            remote_ctx->oversized++;
         ERROR("[udp] server_recv_sendto");
     }
 
@@ -1282,7 +2028,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
     if (remote_ctx != NULL) {
         cache_hit = 1;
         if (dst_addr.ss_family != AF_INET && dst_addr.ss_family != AF_INET6) {
-            need_query = 1;
+            need_query = !lookup_dst_memo(EV_A_ remote_ctx, host, port, &dst_addr);
         }
     } else {
         if (dst_addr.ss_family == AF_INET || dst_addr.ss_family == AF_INET6) {
@@ -1324,6 +2070,10 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
         }
     }
 
+    if (remote_ctx != NULL && buf->len - addr_header_len > packet_size) {
+        remote_ctx->fragmented++;
+    }
+
     if (remote_ctx != NULL && !need_query) {
         size_t addr_len = get_sockaddr_len((struct sockaddr *)&dst_addr);
         int s           = sendto(remote_ctx->fd, buf->data + addr_header_len,
@@ -1331,11 +2081,17 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
                                  (struct sockaddr *)&dst_addr, addr_len);
 
         if (s == -1) {
+            if (errno == EMSGSIZE)
+                remote_ctx->oversized++;
             ERROR("[udp] sendto_remote");
             if (!cache_hit) {
                 close_and_free_remote(EV_A_ remote_ctx);
             }
         } else {
+            if (remote_ctx->flow != NULL) {
+                flowlog_set_dest(remote_ctx->flow, addr_header);
+                flowlog_record(remote_ctx->flow, FLOWLOG_UP, buf->len - addr_header_len);
+            }
             if (!cache_hit) {
                 // Add to conn cache
                 remote_ctx->af = dst_addr.ss_family;
@@ -1352,6 +2108,7 @@ server_recv_cb(EV_P_ ev_io *w, int revents)
         query_ctx->server_ctx      = server_ctx;
         query_ctx->addr_header_len = addr_header_len;
         query_ctx->src_addr        = src_addr;
+        query_ctx->hostname        = strdup(host);
         memcpy(query_ctx->addr_header, addr_header, addr_header_len);
 
         if (need_query) {
@@ -1367,6 +2124,159 @@ CLEAN_UP:
     ss_free(buf);
 }
 
+#ifdef USE_MMSG
+static void
+server_recv_batch(EV_P_ server_ctx_t *server_ctx)
+{
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct iovec iovs[UDP_BATCH_MAX];
+    struct sockaddr_storage addrs[UDP_BATCH_MAX];
+
+    memset(msgs, 0, udp_batch * sizeof(struct mmsghdr));
+    memset(addrs, 0, udp_batch * sizeof(struct sockaddr_storage));
+    for (int i = 0; i < udp_batch; i++) {
+        if (server_ctx->rx_bufs[i] == NULL) {
+            server_ctx->rx_bufs[i] = ss_malloc(sizeof(buffer_t));
+            balloc(server_ctx->rx_bufs[i], buf_size);
+        }
+        iovs[i].iov_base            = server_ctx->rx_bufs[i]->data;
+        iovs[i].iov_len             = buf_size;
+        msgs[i].msg_hdr.msg_name    = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        msgs[i].msg_hdr.msg_iov     = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    int n = recvmmsg(server_ctx->fd, msgs, udp_batch, 0, NULL);
+    if (n == -1) {
+        if (errno == ENOSYS) {
+            LOGE("[udp] recvmmsg not supported, relay datagrams one by one");
+            udp_batch = 1;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            ERROR("[udp] server_recv_recvmmsg");
+        }
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        buffer_t *buf = server_ctx->rx_bufs[i];
+        server_ctx->rx_bufs[i] = NULL;
+        buf->len = msgs[i].msg_len;
+
+        if (buf->len > packet_size && verbose) {
+            LOGI("[udp] server_recv_recvmmsg fragmentation, MTU at least be: " SSIZE_FMT,
+                 buf->len + PACKET_HEADER_SIZE);
+        }
+
+        tx += buf->len;
+        if (server_ctx->crypto->decrypt_all(buf, server_ctx->crypto->cipher, buf_size)) {
+            // drop the packet silently
+            bfree(buf);
+            ss_free(buf);
+            continue;
+        }
+
+        server_recv_packet(EV_A_ server_ctx, buf, &addrs[i]);
+    }
+}
+
+#endif
+
+static void
+server_recv_cb(EV_P_ ev_io *w, int revents)
+{
+    server_ctx_t *server_ctx = (server_ctx_t *)w;
+    struct sockaddr_storage src_addr;
+    memset(&src_addr, 0, sizeof(struct sockaddr_storage));
+
+#ifdef USE_MMSG
+    if (udp_batch > 1) {
+        server_recv_batch(EV_A_ server_ctx);
+        return;
+    }
+#endif
+
+    buffer_t *buf = ss_malloc(sizeof(buffer_t));
+    balloc(buf, buf_size);
+
+    socklen_t src_addr_len = sizeof(struct sockaddr_storage);
+
+#ifdef MODULE_REDIR
+    char control_buffer[64] = { 0 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    struct iovec iov[1];
+    struct sockaddr_storage dst_addr;
+    memset(&dst_addr, 0, sizeof(struct sockaddr_storage));
+
+    msg.msg_name       = &src_addr;
+    msg.msg_namelen    = src_addr_len;
+    msg.msg_control    = control_buffer;
+    msg.msg_controllen = sizeof(control_buffer);
+
+    iov[0].iov_base = buf->data;
+    iov[0].iov_len  = buf_size;
+    msg.msg_iov     = iov;
+    msg.msg_iovlen  = 1;
+
+    buf->len = recvmsg(server_ctx->fd, &msg, 0);
+    if (buf->len == -1) {
+        ERROR("[udp] server_recvmsg");
+        goto CLEAN_UP;
+    } else if (buf->len > packet_size) {
+        if (verbose) {
+            LOGI("[udp] UDP server_recv_recvmsg fragmentation, MTU at least be: " SSIZE_FMT,
+                 buf->len + PACKET_HEADER_SIZE);
+        }
+    }
+
+    if (get_dstaddr(&msg, &dst_addr)) {
+        LOGE("[udp] unable to get dest addr");
+        goto CLEAN_UP;
+    }
+
+    src_addr_len = msg.msg_namelen;
+#else
+    ssize_t r;
+    r = recvfrom(server_ctx->fd, buf->data, buf_size,
+                 0, (struct sockaddr *)&src_addr, &src_addr_len);
+
+    if (r == -1) {
+        // error on recv
+        // simply drop that packet
+        ERROR("[udp] server_recv_recvfrom");
+        goto CLEAN_UP;
+    } else if (r > packet_size) {
+        if (verbose) {
+            LOGI("[udp] server_recv_recvfrom fragmentation, MTU at least be: " SSIZE_FMT, r + PACKET_HEADER_SIZE);
+        }
+    }
+
+    buf->len = r;
+#endif
+
+#ifdef MODULE_REMOTE
+    tx += buf->len;
+
+    int err = server_ctx->crypto->decrypt_all(buf, server_ctx->crypto->cipher, buf_size);
+    if (err) {
+        // drop the packet silently
+        goto CLEAN_UP;
+    }
+#endif
+
+    server_recv_packet(EV_A_ server_ctx, buf, &src_addr
+#ifdef MODULE_REDIR
+                       , &dst_addr
+#endif
+                       );
+    return;
+
+CLEAN_UP:
+    bfree(buf);
+    ss_free(buf);
+}
+
 void
 free_cb(void *key, void *element)
 {
@@ -1379,15 +2289,15 @@ free_cb(void *key, void *element)
     close_and_free_remote(EV_DEFAULT, remote_ctx);
 }
 
-int
-init_udprelay(const char *server_host, const char *server_port,
+static int
+start_udprelay(int serverfd, const char *server_port,
 #ifdef MODULE_LOCAL
-              const struct sockaddr *remote_addr, const int remote_addr_len,
+               const struct sockaddr *remote_addr, const int remote_addr_len,
 #ifdef MODULE_TUNNEL
-              const ss_addr_t tunnel_addr,
+               const ss_addr_t tunnel_addr,
 #endif
 #endif
-              int mtu, crypto_t *crypto, int timeout, const char *iface)
+               int mtu, crypto_t *crypto, int timeout, const char *iface)
 {
     s_port = server_port;
     // Initialize ev loop
@@ -1402,11 +2312,6 @@ init_udprelay(const char *server_host, const char *server_port,
     // ////////////////////////////////////////////////
     // Setup server context
 
-    // Bind to port
-    int serverfd = create_server_socket(server_host, server_port);
-    if (serverfd < 0) {
-        return -1;
-    }
     setnonblocking(serverfd);
 
     // Initialize cache
@@ -1421,9 +2326,19 @@ init_udprelay(const char *server_host, const char *server_port,
     server_ctx->crypto     = crypto;
     server_ctx->iface      = iface;
     server_ctx->conn_cache = conn_cache;
+#ifdef UDP_OVER_TCP
+#ifndef MODULE_REMOTE
+    cache_create(&server_ctx->sessions, MAX_UDP_CONN_NUM, session_free_cb);
+#endif
+#endif
 #ifdef MODULE_LOCAL
     server_ctx->remote_addr     = remote_addr;
     server_ctx->remote_addr_len = remote_addr_len;
+#ifdef PMTU_DISCOVERY
+    server_ctx->mtu_fd = create_mtu_socket(remote_addr, remote_addr_len, iface);
+#else
+    server_ctx->mtu_fd = -1;
+#endif
 #ifdef MODULE_TUNNEL
     server_ctx->tunnel_addr = tunnel_addr;
 #endif
@@ -1431,21 +2346,102 @@ init_udprelay(const char *server_host, const char *server_port,
 
     ev_io_start(loop, &server_ctx->io);
 
+#ifdef USE_MMSG
+    udp_batch = max(1, min(udp_batch, UDP_BATCH_MAX));
+    if (udp_batch > 1 && !ev_is_active(&flush_watcher)) {
+        ev_prepare_init(&flush_watcher, flush_cb);
+        ev_prepare_start(loop, &flush_watcher);
+    }
+#endif
+
     server_ctx_list[server_num++] = server_ctx;
 
     return serverfd;
 }
 
+int
+init_udprelay(const char *server_host, const char *server_port,
+#ifdef MODULE_LOCAL
+              const struct sockaddr *remote_addr, const int remote_addr_len,
+#ifdef MODULE_TUNNEL
+              const ss_addr_t tunnel_addr,
+#endif
+#endif
+              int mtu, crypto_t *crypto, int timeout, const char *iface)
+{
+    // Bind to port
+    int serverfd = create_server_socket(server_host, server_port);
+    if (serverfd < 0) {
+        return -1;
+    }
+
+    return start_udprelay(serverfd, server_port,
+#ifdef MODULE_LOCAL
+                          remote_addr, remote_addr_len,
+#ifdef MODULE_TUNNEL
+                          tunnel_addr,
+#endif
+#endif
+                          mtu, crypto, timeout, iface);
+}
+
+#ifdef MODULE_REMOTE
+/*
+ * Relay on a socket bound by someone else, ss-manager that is
+ */
+int
+init_udprelay_fd(int serverfd, const char *server_port,
+                 int mtu, crypto_t *crypto, int timeout, const char *iface)
+{
+    // Bound by ss-manager, without the options of create_server_socket
+    setdscp(serverfd);
+    return start_udprelay(serverfd, server_port, mtu, crypto, timeout, iface);
+}
+
+#endif
+
 void
 free_udprelay()
 {
     struct ev_loop *loop = EV_DEFAULT;
+#if defined(UDP_OVER_TCP) && defined(MODULE_REMOTE)
+    uot_t *uot, *tmp;
+    HASH_ITER(hh, uot_streams, uot, tmp) {
+        HASH_DEL(uot_streams, uot);
+        free_uot(loop, uot);
+    }
+#endif
     while (server_num > 0) {
         server_ctx_t *server_ctx = server_ctx_list[--server_num];
         ev_io_stop(loop, &server_ctx->io);
+#if defined(UDP_OVER_TCP) && defined(MODULE_LOCAL)
+        if (server_ctx->uot != NULL) {
+            free_uot(loop, server_ctx->uot);
+        }
+#endif
+#ifdef USE_MMSG
+        flush_replies(server_ctx);
+        for (int i = 0; i < UDP_BATCH_MAX; i++)
+            if (server_ctx->rx_bufs[i] != NULL) {
+                bfree(server_ctx->rx_bufs[i]);
+                ss_free(server_ctx->rx_bufs[i]);
+            }
+#endif
         close(server_ctx->fd);
+#ifdef MODULE_LOCAL
+        if (server_ctx->mtu_fd >= 0)
+            close(server_ctx->mtu_fd);
+#endif
         cache_delete(server_ctx->conn_cache, 0);
+#if defined(UDP_OVER_TCP) && defined(MODULE_LOCAL)
+        cache_delete(server_ctx->sessions, 0);
+#endif
         ss_free(server_ctx);
         server_ctx_list[server_num] = NULL;
     }
+#ifdef USE_MMSG
+    if (ev_is_active(&flush_watcher)) {
+        ev_prepare_stop(loop, &flush_watcher);
+    }
+#endif
 }
@@ -48,6 +48,19 @@
 #define DEFAULT_PACKET_SIZE 1397 // 1492 - PACKET_HEADER_SIZE = 1397, the default MTU for UDP relay
 #define MAX_ADDR_HEADER_SIZE (1 + 256 + 2) // 1-byte atyp + 256-byte hostname + 2-byte port
 
+#define UDP_BATCH_MAX 32 // datagrams per recvmmsg(2) or sendmmsg(2) on the listener
+
+#if defined(MODULE_REMOTE) && defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define USE_MMSG
+#endif
+
+#if defined(MODULE_REMOTE) \
+    || (defined(MODULE_LOCAL) && !defined(MODULE_TUNNEL) && !defined(MODULE_REDIR))
+#define UDP_OVER_TCP
+#endif
+
+#define UOT_MAX_QUEUE (256 * 1024) // encrypted bytes waiting on a stream before datagrams are dropped
+
 typedef struct server_ctx {
     ev_io io;
     int fd;
@@ -58,6 +71,9 @@ typedef struct server_ctx {
 #ifdef MODULE_LOCAL
     const struct sockaddr *remote_addr;
     int remote_addr_len;
+    int mtu_fd;
+    int path_mtu;
+    ev_tstamp mtu_ts;
 #ifdef MODULE_TUNNEL
     ss_addr_t tunnel_addr;
 #endif
@@ -65,8 +81,59 @@ typedef struct server_ctx {
 #ifdef MODULE_REMOTE
     struct ev_loop *loop;
 #endif
+#ifdef USE_MMSG
+    buffer_t *rx_bufs[UDP_BATCH_MAX];   // read into, handed over one by one
+    buffer_t tx_bufs[UDP_BATCH_MAX];    // replies waiting for the next flush
+    struct sockaddr_storage tx_addrs[UDP_BATCH_MAX];
+    int tx_num;
+#endif
+#if defined(UDP_OVER_TCP) && defined(MODULE_LOCAL)
+    struct uot *uot;                    // stream to the server, opened on demand
+    struct cache *sessions;             // session id -> remote_ctx
+    uint32_t last_session;
+#endif
 } server_ctx_t;
 
+#ifdef UDP_OVER_TCP
+/*
+ * UDP over TCP: ss-local carries the datagrams of all its sessions in a
+ * single long-lived shadowsocks TCP stream whose request header names
+ * UOT_HOST. Each datagram is a frame of the decrypted stream, both ways:
+ *
+ *    +--------+---------+------+----------+----------+----------+
+ *    | LENGTH | SESSION | ATYP | DST.ADDR | DST.PORT |   DATA   |
+ *    +--------+---------+------+----------+----------+----------+
+ *    |   2    |    4    |  1   | Variable |    2     | Variable |
+ *    +--------+---------+------+----------+----------+----------+
+ *
+ * LENGTH counts the bytes following it, replies carry the source address
+ * instead of the destination. ss-server relays every session of a stream
+ * like a client of its own, in the conn cache of the listener, with a
+ * uot_addr_t standing in for the client address.
+ */
+typedef struct uot {
+    ev_io recv_io;
+    ev_io send_io;
+    ev_timer watcher;
+    int fd;
+    uint32_t id;
+    int connected;
+    cipher_ctx_t *e_ctx;
+    cipher_ctx_t *d_ctx;
+    buffer_t *buf;                      // read into and decrypted in place
+    buffer_t *recv_buf;                 // decrypted, not a whole frame yet
+    buffer_t *send_buf;                 // encrypted, not written yet
+    struct server_ctx *server_ctx;
+    UT_hash_handle hh;                  // in the stream table of ss-server
+} uot_t;
+
+typedef struct uot_addr {
+    sa_family_t family;                 // AF_UNSPEC
+    uint32_t stream;
+    uint32_t session;
+} uot_addr_t;
+#endif
+
 #ifdef MODULE_REMOTE
 typedef struct query_ctx {
     struct sockaddr_storage src_addr;
@@ -75,6 +142,7 @@ typedef struct query_ctx {
     char addr_header[MAX_ADDR_HEADER_SIZE];
     struct server_ctx *server_ctx;
     struct remote_ctx *remote_ctx;
+    char *hostname;
 } query_ctx_t;
 #endif
 
@@ -86,7 +154,15 @@ typedef struct remote_ctx {
     struct sockaddr_storage src_addr;
 #ifdef MODULE_REMOTE
     struct sockaddr_storage dst_addr;
+    char *dst_host;             // hostname dst_addr was resolved from
+    ev_tstamp dst_expire;
+#endif
+    uint32_t fragmented;
+    uint32_t oversized;
+#if defined(UDP_OVER_TCP) && defined(MODULE_LOCAL)
+    uint32_t session;           // over the stream when not 0
 #endif
+    struct flowlog *flow;
     struct server_ctx *server_ctx;
 } remote_ctx_t;
 
@@ -310,6 +310,12 @@ usage()
         "       -l <local_port>            Port number of your local server.\n");
     printf(
         "       -k <password>              Password of your remote server.\n");
+#ifdef FIXED_CIPHER_NAME
+    printf(
+        "       -m <encrypt_method>        Encrypt method: " FIXED_CIPHER_NAME ",\n");
+    printf(
+        "                                  the only one this build supports.\n");
+#else
     printf(
         "       -m <encrypt_method>        Encrypt method: rc4-md5, \n");
     printf(
@@ -332,6 +338,7 @@ usage()
         "                                  salsa20, chacha20 and chacha20-ietf.\n");
     printf(
         "                                  The default cipher is chacha20-ietf-poly1305.\n");
+#endif
     printf("\n");
     printf(
         "       [-a <user>]                Run as another user.\n");
@@ -374,6 +381,15 @@ usage()
 #ifdef MODULE_REMOTE
     printf(
         "       [-d <addr>]                Name servers for internal DNS resolver.\n");
+    printf(
+        "       [--dns-cache <file>]       Share DNS answers with other servers\n"
+        "                                  through this file, set by ss-manager.\n");
+    printf(
+        "       [--rank-addresses]         Prefer the destination addresses that\n"
+        "                                  connected fastest and failed least.\n");
+    printf(
+        "       [--listen-fd <fd>]         Serve on this inherited socket instead\n"
+        "                                  of binding, set by ss-manager.\n");
 #endif
     printf(
         "       [--reuse-port]             Enable port reuse.\n");
@@ -399,6 +415,11 @@ usage()
 #endif
     printf(
         "       [--mtu <MTU>]              MTU of your network interface.\n");
+#ifdef MODULE_REMOTE
+    printf(
+        "       [--udp-batch <num>]        Datagrams per syscall on the UDP listener,\n"
+        "                                  1 to 32, default 32.\n");
+#endif
 #ifdef __linux__
     printf(
         "       [--mptcp]                  Enable Multipath TCP on MPTCP Kernel.\n");
@@ -406,6 +427,47 @@ usage()
 #ifndef MODULE_MANAGER
     printf(
         "       [--no-delay]               Enable TCP_NODELAY.\n");
+#ifdef __linux__
+    printf(
+        "       [--edge-triggered]         Register relayed sockets once, edge-triggered.\n");
+#endif
+#if defined(MODULE_REMOTE) || defined(MODULE_LOCAL)
+    printf(
+        "       [--loop-stat]              Report event loop and callback timings.\n");
+    printf(
+        "       [--priority-classes]       Serve interactive flows before bulk ones.\n");
+    printf(
+        "       [--busy-poll <usec>]       Busy-poll sockets and the event loop for\n"
+        "                                  this long before blocking.\n");
+    printf(
+        "       [--huge-pages <mb>]        Keep relay buffers and connections in an\n"
+        "                                  arena of this many MB of huge pages.\n");
+    printf(
+        "       [--key-pool <num>]         Derive this many session keys ahead\n"
+        "                                  while the event loop is idle.\n");
+#endif
+#if defined(MODULE_LOCAL) && !defined(MODULE_TUNNEL) && !defined(MODULE_REDIR)
+    printf(
+        "       [--udp-over-tcp]           Relay UDP to the server over one TCP stream.\n");
+    printf(
+        "       [--mtu-discovery]          Set DF on UDP relay sockets and drop\n"
+        "                                  datagrams over the path MTU.\n");
+#endif
+#if defined(MODULE_REMOTE) || defined(MODULE_LOCAL)
+    printf(
+        "       [--control-address <addr>] UNIX domain socket or host:port for\n"
+        "                                  runtime queries such as \"trace\".\n");
+    printf(
+        "       [--trace-sample <rate>]    Fraction of connections to trace.\n");
+    printf(
+        "       [--trace-threshold <ms>]   Also trace connections slower than this.\n");
+#ifdef MODULE_REMOTE
+    printf(
+        "       [--dest-stats]             Track top destinations by bytes and connections.\n");
+#endif
+    printf(
+        "       [--flow-log <file>]        Append anonymised flow timings to a file.\n");
+#endif
     printf(
         "       [--key <key_in_base64>]    Key of your remote server.\n");
 #endif
@@ -40,5 +40,9 @@ run_test python tests/test.py $BIN -c tests/salsa20.json
 run_test python tests/test.py $BIN -c tests/chacha20.json
 run_test python tests/test.py $BIN -c tests/chacha20-ietf.json
 run_test python tests/test.py $BIN -c tests/chacha20-ietf-poly1305.json
+run_test python tests/test.py $BIN -c tests/aes-gcm.json -a "--edge-triggered" -b "--edge-triggered"
+run_test python tests/test.py $BIN -c tests/aes-gcm.json -a "--priority-classes" -b "--priority-classes"
+run_test python tests/test.py $BIN -c tests/aes-gcm.json -a "--huge-pages 8" -b "--huge-pages 8"
+run_test python tests/test.py $BIN -c tests/aes-gcm.json -a "--key-pool 16" -b "--key-pool 16"
 
 exit $result